@@ -1,3 +1,5 @@
+#include "absl/algorithm/container.h"
+#include "absl/container/flat_hash_map.h"
 #include "absl/container/flat_hash_set.h"
 #include "perfetto/perfetto.h"
 
@@ -8,6 +10,7 @@
 #include "clang/Sema/Sema.h"
 
 #include "indexer/AstConsumer.h"
+#include "indexer/HeaderDocumentCache.h"
 #include "indexer/IdPathMappings.h"
 #include "indexer/Indexer.h"
 #include "indexer/LlvmAdapter.h"
@@ -201,6 +204,20 @@ void IndexerAstConsumer::HandleTranslationUnit(clang::ASTContext &astContext) {
 
   toBeIndexed.insert({astContext.getSourceManager().getMainFileID()});
 
+  if (this->options.recordEmittedFiles) {
+    this->recordEmittedFiles(sourceManager, emitIndexDetails,
+                             clangIdLookupMap, fileMetadataMap);
+  }
+
+  std::vector<scip::CachedDocument> cachedHeaders{};
+  std::vector<std::pair<uint64_t, clang::FileID>> headersToBeCached{};
+  auto *headerCache = this->options.headerDocumentCache;
+  if (headerCache) {
+    this->useCachedHeaders(*headerCache, sourceManager, emitIndexDetails,
+                           clangIdLookupMap, fileMetadataMap, toBeIndexed,
+                           cachedHeaders, headersToBeCached);
+  }
+
   SymbolFormatter symbolFormatter{sourceManager, fileMetadataMap};
   TuIndexer tuIndexer{
       sourceManager, this->sema->getLangOpts(), this->sema->getASTContext(),
@@ -215,6 +232,43 @@ void IndexerAstConsumer::HandleTranslationUnit(clang::ASTContext &astContext) {
 
   visitor.writeIndex(std::move(symbolFormatter), std::move(macroIndexer),
                      this->tuIndexingOutput);
+
+  if (!headerCache) {
+    return;
+  }
+  // See NOTE(ref: header-document-cache)
+  auto &output = this->tuIndexingOutput;
+  absl::flat_hash_map<std::string_view, uint64_t> keysByPath{};
+  for (auto [key, fileId] : headersToBeCached) {
+    auto optStableFileId = fileMetadataMap.getStableFileId(fileId);
+    ENFORCE(optStableFileId.has_value());
+    keysByPath.emplace(optStableFileId->path.asStringView(), key);
+  }
+  std::vector<std::pair<uint64_t, const scip::Document *>> toBeStored{};
+  for (auto &document : output.docsAndExternals.documents()) {
+    auto it = keysByPath.find(document.relative_path());
+    if (it != keysByPath.end()) {
+      toBeStored.emplace_back(it->second, &document);
+    }
+  }
+  headerCache->store(toBeStored, output.forwardDecls);
+  if (cachedHeaders.empty()) {
+    return;
+  }
+  for (auto &entry : cachedHeaders) {
+    *output.docsAndExternals.add_documents() =
+        std::move(*entry.mutable_document());
+    for (auto &forwardDecl : *entry.mutable_forward_decls()) {
+      *output.forwardDecls.add_forward_decls() = std::move(forwardDecl);
+    }
+  }
+  if (this->options.deterministic) {
+    // Match the order used by IndexerAstVisitor::writeIndex.
+    absl::c_sort(*output.docsAndExternals.mutable_documents(),
+                 [](const auto &d1, const auto &d2) -> bool {
+                   return d1.relative_path() < d2.relative_path();
+                 });
+  }
 }
 
 // virtual override
@@ -261,6 +315,74 @@ void IndexerAstConsumer::computeFileIdsToBeIndexed(
   }
 }
 
+void IndexerAstConsumer::recordEmittedFiles(
+    const clang::SourceManager &sourceManager,
+    const EmitIndexJobDetails &emitIndexDetails,
+    const ClangIdLookupMap &clangIdLookupMap,
+    const FileMetadataMap &fileMetadataMap) {
+  auto mainFileId = sourceManager.getMainFileID();
+  for (auto &fileInfo : emitIndexDetails.filesToBeIndexed) {
+    auto optFileId =
+        clangIdLookupMap.lookup(fileInfo.path.asRef(), fileInfo.hashValue);
+    if (!optFileId.has_value() || *optFileId == mainFileId) {
+      continue;
+    }
+    // Only in-project files have documents.
+    auto optStableFileId = fileMetadataMap.getStableFileId(*optFileId);
+    if (!optStableFileId.has_value() || !optStableFileId->isInProject) {
+      continue;
+    }
+    this->tuIndexingOutput.emittedFiles.emplace_back(
+        fileInfo, std::string(optStableFileId->path.asStringView()));
+  }
+}
+
+void IndexerAstConsumer::useCachedHeaders(
+    HeaderDocumentCache &headerCache, const clang::SourceManager &sourceManager,
+    const EmitIndexJobDetails &emitIndexDetails,
+    const ClangIdLookupMap &clangIdLookupMap,
+    const FileMetadataMap &fileMetadataMap, FileIdsToBeIndexedSet &toBeIndexed,
+    std::vector<scip::CachedDocument> &cached,
+    std::vector<std::pair<uint64_t, clang::FileID>> &toBeCached) {
+  // Documents are per-path, so skip paths with several variants in this TU.
+  absl::flat_hash_map<std::string_view, size_t> variantCounts{};
+  for (auto &fileInfo : emitIndexDetails.filesToBeIndexed) {
+    variantCounts[fileInfo.path.asStringRef()]++;
+  }
+  auto mainFileId = sourceManager.getMainFileID();
+  for (auto &fileInfo : emitIndexDetails.filesToBeIndexed) {
+    if (variantCounts[fileInfo.path.asStringRef()] != 1) {
+      continue;
+    }
+    auto optFileId =
+        clangIdLookupMap.lookup(fileInfo.path.asRef(), fileInfo.hashValue);
+    if (!optFileId.has_value() || *optFileId == mainFileId
+        || !toBeIndexed.contains(
+            llvm_ext::AbslHashAdapter<clang::FileID>{*optFileId})) {
+      continue;
+    }
+    // Only in-project files have documents.
+    auto optStableFileId = fileMetadataMap.getStableFileId(*optFileId);
+    if (!optStableFileId.has_value() || !optStableFileId->isInProject
+        || optStableFileId->isSynthetic) {
+      continue;
+    }
+    auto optContents = sourceManager.getBufferDataOrNone(*optFileId);
+    if (!optContents.has_value()) {
+      continue;
+    }
+    auto key = HeaderDocumentCache::key(
+        fileInfo.path.asRef(), optStableFileId->path.asStringView(),
+        fileInfo.hashValue, llvm_ext::toStringView(*optContents));
+    if (auto optEntry = headerCache.load(key)) {
+      toBeIndexed.erase(llvm_ext::AbslHashAdapter<clang::FileID>{*optFileId});
+      cached.emplace_back(std::move(*optEntry));
+    } else {
+      toBeCached.emplace_back(key, *optFileId);
+    }
+  }
+}
+
 void IndexerAstConsumer::saveIncludeReferences(
     const FileIdsToBeIndexedSet &toBeIndexed, const MacroIndexer &macroIndexer,
     const ClangIdLookupMap &clangIdLookupMap,
@@ -1,6 +1,11 @@
 #ifndef SCIP_CLANG_AST_CONSUMER_H
 #define SCIP_CLANG_AST_CONSUMER_H
 
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
 #include "absl/container/flat_hash_set.h"
 #include "absl/functional/function_ref.h"
 
@@ -8,6 +13,7 @@
 #include "clang/Sema/SemaConsumer.h"
 #include "llvm/ADT/StringRef.h"
 
+#include "proto/document_cache.pb.h"
 #include "proto/fwd_decls.pb.h"
 #include "scip/scip.pb.h"
 
@@ -17,12 +23,14 @@
 
 namespace clang {
 class CompilerInstance;
+class SourceManager;
 }
 
 namespace scip_clang {
 class ClangIdLookupMap;
 class PackageMap;
 class FileMetadataMap;
+class HeaderDocumentCache;
 class IndexerPreprocessorWrapper;
 class MacroIndexer;
 class TuIndexer;
@@ -43,6 +51,10 @@ struct IndexerAstConsumerOptions {
   WorkerCallback getEmitIndexDetails;
   bool deterministic;
   PackageMap &packageMap;
+  /// Nullable; see NOTE(ref: header-document-cache).
+  HeaderDocumentCache *headerDocumentCache;
+  /// See NOTE(ref: speculative-emission).
+  bool recordEmittedFiles;
 };
 
 struct TuIndexingOutput {
@@ -52,6 +64,10 @@ struct TuIndexingOutput {
   /// Index storing information about forward declarations.
   /// Only the external_symbols list is populated.
   scip::ForwardDeclIndex forwardDecls;
+  /// Files emitted other than the main file, along with the relative path
+  /// of the corresponding document. Only populated if
+  /// IndexerAstConsumerOptions::recordEmittedFiles is set.
+  std::vector<std::pair<PreprocessedFileInfo, std::string>> emittedFiles;
 
   TuIndexingOutput() = default;
   TuIndexingOutput(const TuIndexingOutput &) = delete;
@@ -86,6 +102,24 @@ private:
                                  FileMetadataMap &fileMetadataMap,
                                  FileIdsToBeIndexedSet &toBeIndexed);
 
+  /// Removes headers which are present in the header document cache
+  /// from \p toBeIndexed, and loads their documents into \p cached.
+  /// The remaining cacheable headers are added to \p toBeCached.
+  void useCachedHeaders(
+      HeaderDocumentCache &, const clang::SourceManager &sourceManager,
+      const EmitIndexJobDetails &emitIndexDetails,
+      const ClangIdLookupMap &clangIdLookupMap,
+      const FileMetadataMap &fileMetadataMap,
+      FileIdsToBeIndexedSet &toBeIndexed,
+      std::vector<scip::CachedDocument> &cached,
+      std::vector<std::pair<uint64_t, clang::FileID>> &toBeCached);
+
+  /// See NOTE(ref: speculative-emission).
+  void recordEmittedFiles(const clang::SourceManager &sourceManager,
+                          const EmitIndexJobDetails &emitIndexDetails,
+                          const ClangIdLookupMap &clangIdLookupMap,
+                          const FileMetadataMap &fileMetadataMap);
+
   void saveIncludeReferences(const FileIdsToBeIndexedSet &toBeIndexed,
                              const MacroIndexer &macroIndexer,
                              const ClangIdLookupMap &clangIdLookupMap,
@@ -38,6 +38,22 @@ struct CliOptions {
   std::chrono::seconds receiveTimeout;
   uint32_t numWorkers;
 
+  bool useShardLog;
+  uint64_t mergeMemoryBudgetMiB;
+  uint32_t workerPremergeCount;
+  bool splitIndexByPackage;
+  uint64_t indexOutputMaxSizeMiB;
+  bool compressIndexOutput;
+  std::string incrementalCacheDir;
+  std::string shardCacheLocation;
+  std::string headerCacheDir;
+  std::string toolchainCachePath;
+  std::string includeGraphPath;
+  std::string changedFilesPath;
+  bool reusePreviousPlan;
+  bool speculativeEmission;
+  std::string serveSocketPath;
+
   spdlog::level::level_enum logLevel;
 
   bool deterministic;
@@ -57,6 +73,8 @@ struct CliOptions {
   std::string workerMode;
 
   bool measureStatistics;
+  bool persistentWorker;
+  bool selfContainedShards;
 
   std::string preprocessorHistoryLogPath;
 
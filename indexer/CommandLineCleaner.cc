@@ -54,6 +54,25 @@ constexpr const char *clangGccSkipOptionsWithArgs[] = {
 // way to determine which ones do/do not.
 constexpr const char *clangGccSkipOptionsNoArgsPattern = "-m(no-)?fix-.*";
 
+// Options which only affect where outputs are written, so that entries
+// which only differ in output paths are considered identical. Options
+// like -fPIC are kept, as they define macros like __PIC__ which code
+// may check, so PIC and non-PIC entries may need separate indexing.
+constexpr const char *outputOptionsWithArgs[] = {
+    "-o",  "-MF", "-MT", "-MQ", "-MJ", "-dependency-file",
+    "--serialize-diagnostics",
+};
+
+constexpr const char *outputOptionsNoArgs[] = {
+    "-MD",
+    "-MMD",
+    "-MP",
+};
+
+// Dependency file options passed through to the preprocessor,
+// e.g. -Wp,-MMD,path/to/.file.o.d as used by Linux kernel builds.
+constexpr const char *outputOptionsNoArgsPattern = "^-Wp,-MM?D,";
+
 } // namespace
 
 namespace scip_clang::compdb {
@@ -99,4 +118,18 @@ std::unique_ptr<CommandLineCleaner> CommandLineCleaner::forClangOrGcc() {
   return std::make_unique<CommandLineCleaner>(std::move(cleaner));
 }
 
+std::unique_ptr<CommandLineCleaner> CommandLineCleaner::forDeduplication() {
+  CommandLineCleaner::MapType toZap;
+  for (auto s : outputOptionsWithArgs) {
+    toZap.emplace(std::string_view(s), CliOptionKind::OneArgument);
+  }
+  for (auto s : outputOptionsNoArgs) {
+    toZap.emplace(std::string_view(s), CliOptionKind::NoArgument);
+  }
+  CommandLineCleaner cleaner{
+      .toZap = std::move(toZap),
+      .noArgumentMatcher = {llvm::Regex(outputOptionsNoArgsPattern)}};
+  return std::make_unique<CommandLineCleaner>(std::move(cleaner));
+}
+
 } // namespace scip_clang::compdb
\ No newline at end of file
@@ -30,6 +30,10 @@ struct CommandLineCleaner {
   void clean(std::vector<std::string> &commandLine) const;
 
   static std::unique_ptr<CommandLineCleaner> forClangOrGcc();
+
+  /// Zaps options which only affect where outputs are written, for
+  /// comparing commands. See NOTE(ref: compdb-dedup).
+  static std::unique_ptr<CommandLineCleaner> forDeduplication();
 };
 
 } // namespace scip_clang::compdb
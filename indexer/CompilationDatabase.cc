@@ -1,8 +1,19 @@
+#include <algorithm>
+#include <bit>
+#include <chrono>
 #include <cstdint>
+#include <cstring>
 #include <filesystem>
+#include <fstream>
+#include <future>
+#include <ios>
+#include <iterator>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
+#include <system_error>
+#include <utility>
 #include <vector>
 
 #include "indexer/Enforce.h" // Defines ENFORCE used by rapidjson headers
@@ -17,14 +28,22 @@
 #include "boost/process/io.hpp"
 #include "boost/process/search_path.hpp"
 #include "rapidjson/error/en.h"
+#include "rapidjson/memorystream.h"
 #include "rapidjson/rapidjson.h"
 #include "rapidjson/reader.h"
 #include "spdlog/fmt/fmt.h"
 #include "spdlog/fmt/ranges.h"
 
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+
 #include "indexer/CommandLineCleaner.h"
 #include "indexer/CompilationDatabase.h"
 #include "indexer/FileSystem.h"
+#include "indexer/Hash.h"
+#include "indexer/LlvmAdapter.h"
 #include "indexer/LlvmCommandLineParsing.h"
 
 namespace {
@@ -128,6 +147,31 @@ struct ClangToolchainInfo : public ToolchainInfo {
     commandLine.push_back(this->resourceDir);
   }
 
+  virtual llvm::json::Object toJSON() const override {
+    return llvm::json::Object{
+        {"kind", "clang"},
+        {"compilerPath", this->findResourceDirInvocation.front()},
+        {"resourceDir", this->resourceDir},
+        {"compilerDriverPath", this->compilerDriverPath},
+    };
+  }
+
+  static std::unique_ptr<ClangToolchainInfo>
+  fromJSON(const llvm::json::Object &object) {
+    auto compilerPath = object.getString("compilerPath");
+    auto resourceDir = object.getString("resourceDir");
+    auto compilerDriverPath = object.getString("compilerDriverPath");
+    if (!compilerPath || !resourceDir || !compilerDriverPath) {
+      return nullptr;
+    }
+    return std::make_unique<ClangToolchainInfo>(
+        resourceDir->str(),
+        std::vector<std::string>{compilerPath->str(), "-print-resource-dir"},
+        compilerDriverPath->str(),
+        std::vector<std::string>{compilerPath->str(), "-###"},
+        CommandLineCleaner::forClangOrGcc());
+  }
+
   static std::unique_ptr<ClangToolchainInfo>
   tryInfer(const AbsolutePath &compilerPath) {
     std::vector<std::string> findResourceDirInvocation = {
@@ -212,6 +256,27 @@ struct GccToolchainInfo : public ToolchainInfo {
     commandLine.push_back(fmt::format("-I{}/include-fixed", this->installDir));
   }
 
+  virtual llvm::json::Object toJSON() const override {
+    return llvm::json::Object{
+        {"kind", "gcc"},
+        {"compilerPath", this->findInstallDirInvocation.front()},
+        {"installDir", this->installDir},
+    };
+  }
+
+  static std::unique_ptr<GccToolchainInfo>
+  fromJSON(const llvm::json::Object &object) {
+    auto compilerPath = object.getString("compilerPath");
+    auto installDir = object.getString("installDir");
+    if (!compilerPath || !installDir) {
+      return nullptr;
+    }
+    return std::make_unique<GccToolchainInfo>(
+        installDir->str(),
+        std::vector<std::string>{compilerPath->str(), "-print-search-dirs"},
+        CommandLineCleaner::forClangOrGcc());
+  }
+
   static std::unique_ptr<GccToolchainInfo>
   tryInfer(const AbsolutePath &compilerPath) {
     std::vector<std::string> findSearchDirsInvocation = {
@@ -371,8 +436,9 @@ struct NvccToolchainInfo : public ToolchainInfo {
 
   CommandLineCleaner cleaner;
 
-  NvccToolchainInfo(AbsolutePath cudaDir)
-      : ToolchainInfo(), cudaDir(cudaDir), clangInfo(nullptr) {
+  NvccToolchainInfo(AbsolutePath cudaDir,
+                    std::unique_ptr<ClangToolchainInfo> clangInfo)
+      : ToolchainInfo(), cudaDir(cudaDir), clangInfo(std::move(clangInfo)) {
     CommandLineCleaner::MapType toZap;
     for (auto s : nvccSkipOptionsNoArgs) {
       toZap.emplace(std::string_view(s), CliOptionKind::NoArgument);
@@ -382,7 +448,9 @@ struct NvccToolchainInfo : public ToolchainInfo {
     }
     this->cleaner =
         CommandLineCleaner{.toZap = toZap, .noArgumentMatcher = std::nullopt};
+  }
 
+  static std::unique_ptr<ClangToolchainInfo> inferClangFromPath() {
     // TODO: In principle, we could pick up Clang from -ccbin but that
     // requires more plumbing; it would require using the -ccbin arg
     // as part of the hash map key for toolchainInfoMap. So instead,
@@ -391,16 +459,16 @@ struct NvccToolchainInfo : public ToolchainInfo {
     if (!clangPath.empty()) {
       auto clangAbsPath =
           AbsolutePath(std::string(clangPath.data(), clangPath.size()));
-      this->clangInfo = ClangToolchainInfo::tryInfer(clangAbsPath);
-    }
-    if (clangInfo) {
-      return;
+      if (auto clangInfo = ClangToolchainInfo::tryInfer(clangAbsPath)) {
+        return clangInfo;
+      }
     }
     spdlog::error("clang not found on PATH; may be unable to locate headers "
                   "like __clang_cuda_runtime_wrapper.h");
     spdlog::warn("code navigation for kernel call expressions may not work in "
                  "the absence of Clang CUDA headers");
     ToolchainInfo::logStdlibWarning();
+    return nullptr;
   }
 
   virtual CompilerKind kind() const override {
@@ -432,6 +500,35 @@ struct NvccToolchainInfo : public ToolchainInfo {
                     std::filesystem::path::preferred_separator));
   }
 
+  virtual llvm::json::Object toJSON() const override {
+    llvm::json::Value clang = nullptr;
+    if (this->clangInfo) {
+      clang = this->clangInfo->toJSON();
+    }
+    return llvm::json::Object{
+        {"kind", "nvcc"},
+        {"cudaDir", this->cudaDir.asStringRef()},
+        {"clang", std::move(clang)},
+    };
+  }
+
+  static std::unique_ptr<NvccToolchainInfo>
+  fromJSON(const llvm::json::Object &object) {
+    auto cudaDir = object.getString("cudaDir");
+    if (!cudaDir || !llvm::sys::path::is_absolute(*cudaDir)) {
+      return nullptr;
+    }
+    std::unique_ptr<ClangToolchainInfo> clangInfo = nullptr;
+    if (auto *clang = object.getObject("clang")) {
+      clangInfo = ClangToolchainInfo::fromJSON(*clang);
+      if (!clangInfo) {
+        return nullptr;
+      }
+    }
+    return std::make_unique<NvccToolchainInfo>(AbsolutePath(cudaDir->str()),
+                                               std::move(clangInfo));
+  }
+
   static std::unique_ptr<NvccToolchainInfo>
   tryInfer(const AbsolutePath &compilerPath) {
     std::vector<std::string> argv = {compilerPath.asStringRef(), "--version"};
@@ -441,7 +538,8 @@ struct NvccToolchainInfo : public ToolchainInfo {
         && absl::StrContains(compilerVersionResult.stdoutLines[0], "NVIDIA")) {
       if (auto binDir = compilerPath.asRef().prefix()) {
         if (auto cudaDir = binDir->prefix()) {
-          return std::make_unique<NvccToolchainInfo>(AbsolutePath(*cudaDir));
+          return std::make_unique<NvccToolchainInfo>(
+              AbsolutePath(*cudaDir), NvccToolchainInfo::inferClangFromPath());
         }
       }
     }
@@ -481,6 +579,21 @@ ToolchainInfo::infer(const AbsolutePath &compilerPath) {
   return nullptr;
 }
 
+/*static*/ std::unique_ptr<ToolchainInfo>
+ToolchainInfo::fromJSON(const llvm::json::Object &object) {
+  auto kind = object.getString("kind");
+  if (kind == "clang") {
+    return ClangToolchainInfo::fromJSON(object);
+  }
+  if (kind == "gcc") {
+    return GccToolchainInfo::fromJSON(object);
+  }
+  if (kind == "nvcc") {
+    return NvccToolchainInfo::fromJSON(object);
+  }
+  return nullptr;
+}
+
 namespace scip_clang {
 namespace compdb {
 
@@ -534,7 +647,8 @@ public:
   absl::flat_hash_set<std::string> warnings;
 
   ValidateHandler(H &inner, ValidationOptions options)
-      : inner(inner), context(Context::Outermost), lastKey(Key::Unset),
+      : inner(inner), context(Context::Outermost), presentKeys(0),
+        lastKey(Key::Unset),
         options(options), errorMessage(), warnings() {}
 
 private:
@@ -748,49 +862,247 @@ public:
   }
 };
 
-} // namespace
+constexpr uint64_t lowBits = 0x0101010101010101;
+constexpr uint64_t highBits = 0x8080808080808080;
 
-// Validates a compilation database, counting the number of jobs along the
-// way to allow for better planning.
-//
-// Uses the global logger and exits if the compilation database is invalid.
-//
-// Returns the number of jobs in the database.
-static size_t validateAndCountJobs(size_t fileSize, FILE *compDbFile,
-                                   ValidationOptions validationOptions) {
-  struct ArrayCountHandler
-      : public rapidjson::BaseReaderHandler<rapidjson::UTF8<>,
-                                            ArrayCountHandler> {
-    // A single count is sufficient instead of a stack because this field is
-    // only read if the database is valid, which means we'll end up with the
-    // count for the outermost array (which contains command objects).
+/// Returns a value with the high bit set for the first byte in \p word
+/// which is equal to \p c (higher bytes may have false positives),
+/// or zero if there is no such byte. See
+/// https://graphics.stanford.edu/~seander/bithacks.html#ValueInWord
+constexpr uint64_t findByte(uint64_t word, uint8_t c) {
+  auto v = word ^ (lowBits * c);
+  return (v - lowBits) & ~v & highBits;
+}
+
+/// Returns the offset one past the '}' matching the '{' at \p start,
+/// or std::nullopt if the object is unterminated.
+std::optional<size_t> findObjectEnd(std::string_view json, size_t start) {
+  size_t depth = 0;
+  bool inString = false;
+  size_t i = start;
+  while (i < json.size()) {
+    if (i + sizeof(uint64_t) <= json.size()) {
+      uint64_t word;
+      std::memcpy(&word, json.data() + i, sizeof(word));
+      auto candidates = findByte(word, '"') | findByte(word, '\\');
+      if (!inString) {
+        candidates |= findByte(word, '{') | findByte(word, '}')
+                      | findByte(word, '[') | findByte(word, ']');
+      }
+      if (candidates == 0) {
+        i += sizeof(uint64_t);
+        continue;
+      }
+      if constexpr (std::endian::native == std::endian::little) {
+        // The lowest set bit is never a false positive.
+        i += std::countr_zero(candidates) / 8;
+      }
+    }
+    char c = json[i];
+    if (inString) {
+      if (c == '\\') {
+        i += 2;
+        continue;
+      }
+      inString = c != '"';
+    } else if (c == '"') {
+      inString = true;
+    } else if (c == '{' || c == '[') {
+      depth++;
+    } else if (c == '}' || c == ']') {
+      depth--;
+      if (depth == 0) {
+        return i + 1;
+      }
+    }
+    i++;
+  }
+  return {};
+}
+
+/// Incremental version of \c scanCommandObjects, so that the spans found
+/// so far can be handed out while the rest of the file is scanned.
+class CommandObjectScanner {
+  std::string_view json;
+  size_t offset;
+  enum class Expect {
+    ArrayStart,
+    ObjectOrArrayEnd,
+    CommaOrArrayEnd,
+    Object,
+    Nothing,
+  } expect;
+
+public:
+  explicit CommandObjectScanner(std::string_view json)
+      : json(json), offset(0), expect(Expect::ArrayStart) {}
+
+  size_t scannedBytes() const {
+    return this->offset;
+  }
+
+  /// Appends up to \p maxCount spans to \p out.
+  ///
+  /// Returns false once there is nothing left to scan, setting \p error
+  /// if the input turned out to be malformed.
+  bool scanSome(std::vector<ObjectSpan> &out, size_t maxCount,
+                std::optional<std::string> &error) {
+    auto &i = this->offset;
     size_t count = 0;
-    bool EndArray(rapidjson::SizeType count) {
-      this->count = count;
+    while (i < this->json.size() && count < maxCount) {
+      char c = this->json[i];
+      if (c == ' ' || c == '\n' || c == '\t' || c == '\r') {
+        i++;
+        continue;
+      }
+      auto unexpected = [&]() -> bool {
+        error = fmt::format("unexpected '{}' at offset {}", c, i);
+        return false;
+      };
+      switch (this->expect) {
+      case Expect::ArrayStart:
+        if (c != '[') {
+          return unexpected();
+        }
+        this->expect = Expect::ObjectOrArrayEnd;
+        i++;
+        continue;
+      case Expect::ObjectOrArrayEnd:
+      case Expect::CommaOrArrayEnd:
+        if (c == ']') {
+          this->expect = Expect::Nothing;
+          i++;
+          continue;
+        }
+        if (this->expect == Expect::ObjectOrArrayEnd) {
+          break;
+        }
+        if (c != ',') {
+          return unexpected();
+        }
+        this->expect = Expect::Object;
+        i++;
+        continue;
+      case Expect::Object:
+        break;
+      case Expect::Nothing:
+        return unexpected();
+      }
+      if (c != '{') {
+        return unexpected();
+      }
+      auto end = findObjectEnd(this->json, i);
+      if (!end) {
+        error = fmt::format("unterminated command object at offset {}", i);
+        return false;
+      }
+      out.push_back(ObjectSpan{i, *end - i});
+      count++;
+      i = *end;
+      this->expect = Expect::CommaOrArrayEnd;
+    }
+    if (i < this->json.size()) {
       return true;
-    };
-  };
-  rapidjson::Reader reader;
-  ArrayCountHandler countHandler;
-  ValidateHandler<ArrayCountHandler> validator(countHandler, validationOptions);
-  std::string buffer(std::min(size_t(1024 * 1024), fileSize), 0);
-  auto stream =
-      rapidjson::FileReadStream(compDbFile, buffer.data(), buffer.size());
-  auto parseResult = reader.Parse(stream, validator);
-  if (parseResult.IsError()) {
-    spdlog::error("failed to parse compile_commands.json: {}",
-                  validator.errorMessage);
-    std::exit(EXIT_FAILURE);
+    }
+    if (this->expect != Expect::Nothing) {
+      error = "unexpected end of input";
+    }
+    return false;
+  }
+};
+
+/// Number of spans published by the background scan at a time.
+constexpr size_t scanBatchSize = 4096;
+
+} // namespace
+
+std::optional<std::string> scanCommandObjects(std::string_view json,
+                                              std::vector<ObjectSpan> &out) {
+  CommandObjectScanner scanner(json);
+  std::optional<std::string> error{};
+  while (scanner.scanSome(out, scanBatchSize, error)) {
   }
-  if (!validator.warnings.empty()) {
-    std::vector<std::string> warnings(validator.warnings.begin(),
-                                      validator.warnings.end());
-    absl::c_sort(warnings);
-    for (auto &warning : warnings) {
-      spdlog::warn("in compile_commands.json: {}", warning);
+  return error;
+}
+
+CommandObjectIndex::CommandObjectIndex(
+    std::shared_ptr<const llvm::MemoryBuffer> contents)
+    : contents(std::move(contents)), mutex(), changed(), spans(),
+      scannedBytes(0), done(false), error(), cancelled(false),
+      scanThread([this]() { this->scan(); }) {}
+
+CommandObjectIndex::~CommandObjectIndex() {
+  this->cancelled.store(true, std::memory_order_relaxed);
+  if (this->scanThread.joinable()) {
+    this->scanThread.join();
+  }
+}
+
+void CommandObjectIndex::scan() {
+  CommandObjectScanner scanner(this->contents->getBuffer());
+  std::vector<ObjectSpan> batch{};
+  std::optional<std::string> scanError{};
+  bool more = true;
+  while (more && !this->cancelled.load(std::memory_order_relaxed)) {
+    batch.clear();
+    more = scanner.scanSome(batch, scanBatchSize, scanError);
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->spans.insert(this->spans.end(), batch.begin(), batch.end());
+      this->scannedBytes = scanner.scannedBytes();
+      this->done = !more;
+      this->error = scanError;
     }
+    this->changed.notify_all();
+  }
+}
+
+std::optional<std::vector<ObjectSpan>>
+CommandObjectIndex::getSpans(size_t begin, size_t maxCount, bool wait) {
+  std::unique_lock<std::mutex> lock(this->mutex);
+  auto isAvailable = [&]() -> bool {
+    // maxCount may be SIZE_MAX, so avoid computing begin + maxCount.
+    return this->done
+           || (this->spans.size() > begin
+               && this->spans.size() - begin >= maxCount);
+  };
+  if (wait) {
+    this->changed.wait(lock, isAvailable);
+  } else if (!isAvailable()) {
+    return {};
+  }
+  if (begin >= this->spans.size()) {
+    return std::vector<ObjectSpan>{};
+  }
+  auto first = this->spans.begin() + begin;
+  return std::vector<ObjectSpan>(
+      first, first + std::min(this->spans.size() - begin, maxCount));
+}
+
+size_t CommandObjectIndex::waitForCount(size_t limit) {
+  std::unique_lock<std::mutex> lock(this->mutex);
+  this->changed.wait(lock, [&]() -> bool {
+    return this->done || this->spans.size() >= limit;
+  });
+  return std::min(this->spans.size(), limit);
+}
+
+CommandCount CommandObjectIndex::count() {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  size_t known = this->spans.size();
+  if (this->done || this->scannedBytes == 0) {
+    return CommandCount{known, this->done};
   }
-  return countHandler.count;
+  // Assume that the rest of the file has similarly sized objects.
+  auto estimate = size_t(double(known) * double(this->contents->getBufferSize())
+                         / double(this->scannedBytes));
+  return CommandCount{std::max(known, estimate), false};
+}
+
+std::optional<std::string> CommandObjectIndex::waitUntilDone() {
+  std::unique_lock<std::mutex> lock(this->mutex);
+  this->changed.wait(lock, [this]() -> bool { return this->done; });
+  return this->error;
 }
 
 bool CommandObjectHandler::String(const char *str, rapidjson::SizeType length,
@@ -845,13 +1157,10 @@ bool CommandObjectHandler::EndObject(rapidjson::SizeType /*memberCount*/) {
   return true;
 }
 
-bool CommandObjectHandler::reachedLimit() const {
-  return this->commands.size() == this->parseLimit;
-}
-
 compdb::File compdb::File::open(const StdPath &path,
                                 ValidationOptions validationOptions,
-                                std::error_code &fileSizeError) {
+                                std::error_code &fileSizeError,
+                                std::error_code &readError) {
   compdb::File compdbFile{};
   compdbFile.file = std::fopen(path.c_str(), "rb");
   if (!compdbFile.file) {
@@ -884,32 +1193,209 @@ compdb::File compdb::File::open(const StdPath &path,
     }
   }
   compdbFile._sizeInBytes = size;
-  compdbFile._commandCount = validateAndCountJobs(
-      compdbFile._sizeInBytes, compdbFile.file, validationOptions);
+  compdbFile._validationOptions = validationOptions;
+  // See NOTE(ref: compdb-scan)
+  auto bufferOrErr = llvm::MemoryBuffer::getOpenFile(
+      llvm::sys::fs::convertFDToNativeFile(::fileno(compdbFile.file)),
+      path.string(), size, /*RequiresNullTerminator*/ false);
+  if (!bufferOrErr) {
+    readError = bufferOrErr.getError();
+    return compdbFile;
+  }
+  compdbFile._contents = std::move(bufferOrErr.get());
+  compdbFile._commandObjects =
+      std::make_shared<CommandObjectIndex>(compdbFile._contents);
   return compdbFile;
 }
 
 compdb::File
 compdb::File::openAndExitOnErrors(const StdPath &path,
                                   ValidationOptions validationOptions) {
-  std::error_code fileSizeError;
-  auto compdbFile = compdb::File::open(path, validationOptions, fileSizeError);
-  if (!compdbFile.file) {
-    spdlog::error("failed to open '{}': {}", path.string(),
-                  std::strerror(errno));
+  compdb::File compdbFile{};
+  auto error = compdb::File::tryOpen(path, validationOptions, compdbFile);
+  if (error) {
+    spdlog::error("{}", *error);
     std::exit(EXIT_FAILURE);
   }
+  return compdbFile;
+}
+
+std::optional<std::string>
+compdb::File::tryOpen(const StdPath &path, ValidationOptions validationOptions,
+                      compdb::File &compdbFile) {
+  std::error_code fileSizeError, readError;
+  compdbFile = compdb::File::open(path, validationOptions, fileSizeError,
+                                  readError);
+  if (!compdbFile.file) {
+    return fmt::format("failed to open '{}': {}", path.string(),
+                       std::strerror(errno));
+  }
+  std::optional<std::string> error{};
   if (fileSizeError) {
-    spdlog::error("failed to read file size for '{}': {}", path.string(),
-                  fileSizeError.message());
-    std::exit(EXIT_FAILURE);
+    error = fmt::format("failed to read file size for '{}': {}",
+                        path.string(), fileSizeError.message());
+  } else if (readError) {
+    error = fmt::format("failed to read compile_commands.json: {}",
+                        readError.message());
+  } else {
+    // Only wait for the first object; the rest of the file is scanned
+    // in the background. See NOTE(ref: compdb-scan).
+    auto &commandObjects = *compdbFile.commandObjects();
+    if (commandObjects.waitForCount(1) == 0) {
+      auto scanError = commandObjects.waitUntilDone();
+      if (scanError) {
+        error = fmt::format("failed to parse compile_commands.json: {}",
+                            *scanError);
+      } else {
+        error = "compile_commands.json has 0 objects in outermost array; "
+                "nothing to index";
+      }
+    }
   }
-  if (compdbFile.commandCount() == 0) {
-    spdlog::error("compile_commands.json has 0 objects in outermost array; "
-                  "nothing to index");
-    std::exit(EXIT_FAILURE);
+  if (error) {
+    std::fclose(compdbFile.file);
+    compdbFile = compdb::File{};
   }
-  return compdbFile;
+  return error;
+}
+
+namespace {
+
+/// Bumped whenever the serialized form of a ToolchainInfo changes.
+constexpr int64_t toolchainCacheVersion = 1;
+
+struct FileStamp {
+  int64_t modificationTime;
+  int64_t sizeInBytes;
+
+  static std::optional<FileStamp> of(const AbsolutePath &path) {
+    std::error_code error;
+    auto mtime = std::filesystem::last_write_time(path.asStringRef(), error);
+    if (error) {
+      return {};
+    }
+    auto size = std::filesystem::file_size(path.asStringRef(), error);
+    if (error) {
+      return {};
+    }
+    return FileStamp{int64_t(mtime.time_since_epoch().count()),
+                     int64_t(size)};
+  }
+};
+
+} // namespace
+
+ToolchainCache::ToolchainCache(std::string path)
+    : path(std::move(path)), entries(), modified(false) {
+  std::ifstream input(this->path, std::ios_base::in | std::ios_base::binary);
+  if (input.fail()) {
+    spdlog::debug("no toolchain cache at '{}'", this->path);
+    return;
+  }
+  std::string contents{std::istreambuf_iterator<char>(input),
+                       std::istreambuf_iterator<char>()};
+  auto valueOrErr = llvm::json::parse(contents);
+  if (!valueOrErr) {
+    spdlog::warn("ignoring malformed toolchain cache at '{}' ({})", this->path,
+                 llvm::toString(valueOrErr.takeError()));
+    return;
+  }
+  auto *root = valueOrErr->getAsObject();
+  auto *entries = root ? root->getArray("entries") : nullptr;
+  if (!entries || root->getInteger("version") != toolchainCacheVersion) {
+    spdlog::warn("ignoring toolchain cache at '{}' written by a different "
+                 "version of scip-clang",
+                 this->path);
+    return;
+  }
+  for (auto &value : *entries) {
+    auto *entry = value.getAsObject();
+    if (!entry) {
+      continue;
+    }
+    auto compilerPath = entry->getString("compilerPath");
+    auto modificationTime = entry->getInteger("modificationTime");
+    auto sizeInBytes = entry->getInteger("sizeInBytes");
+    auto *toolchain = entry->getObject("toolchain");
+    if (!compilerPath || !modificationTime || !sizeInBytes || !toolchain) {
+      continue;
+    }
+    this->entries.insert_or_assign(
+        compilerPath->str(),
+        Entry{*modificationTime, *sizeInBytes, llvm::json::Object(*toolchain)});
+  }
+  spdlog::debug("read {} entries from toolchain cache at '{}'",
+                this->entries.size(), this->path);
+}
+
+std::unique_ptr<ToolchainInfo>
+ToolchainCache::lookup(const AbsolutePath &compilerPath) {
+  auto it = this->entries.find(compilerPath.asStringRef());
+  if (it == this->entries.end()) {
+    return nullptr;
+  }
+  auto stamp = FileStamp::of(compilerPath);
+  std::unique_ptr<ToolchainInfo> toolchain = nullptr;
+  if (stamp && stamp->modificationTime == it->second.modificationTime
+      && stamp->sizeInBytes == it->second.sizeInBytes) {
+    toolchain = ToolchainInfo::fromJSON(it->second.toolchain);
+  }
+  if (!toolchain) {
+    spdlog::debug("discarding stale toolchain cache entry for '{}'",
+                  compilerPath.asStringRef());
+    this->entries.erase(it);
+    this->modified = true;
+  }
+  return toolchain;
+}
+
+void ToolchainCache::store(const AbsolutePath &compilerPath,
+                           const ToolchainInfo &toolchain) {
+  auto stamp = FileStamp::of(compilerPath);
+  if (!stamp) {
+    return;
+  }
+  this->entries.insert_or_assign(
+      compilerPath.asStringRef(),
+      Entry{stamp->modificationTime, stamp->sizeInBytes, toolchain.toJSON()});
+  this->modified = true;
+}
+
+void ToolchainCache::save() {
+  if (!this->modified) {
+    return;
+  }
+  llvm::json::Array entries{};
+  for (auto &[compilerPath, entry] : this->entries) {
+    entries.push_back(llvm::json::Object{
+        {"compilerPath", compilerPath},
+        {"modificationTime", entry.modificationTime},
+        {"sizeInBytes", entry.sizeInBytes},
+        {"toolchain", llvm::json::Object(entry.toolchain)},
+    });
+  }
+  llvm::json::Value root = llvm::json::Object{
+      {"version", toolchainCacheVersion},
+      {"entries", std::move(entries)},
+  };
+  auto tmpPath = fmt::format("{}.tmp", this->path);
+  {
+    std::ofstream output(tmpPath, std::ios_base::out | std::ios_base::binary
+                                      | std::ios_base::trunc);
+    output << llvm_ext::format(root);
+    if (output.fail()) {
+      spdlog::warn("failed to write toolchain cache to '{}'", tmpPath);
+      return;
+    }
+  }
+  std::error_code error;
+  std::filesystem::rename(tmpPath, this->path, error);
+  if (error) {
+    spdlog::warn("failed to write toolchain cache to '{}' ({})", this->path,
+                 error.message());
+    return;
+  }
+  this->modified = false;
 }
 
 // static
@@ -917,122 +1403,267 @@ ParseOptions ParseOptions::create(size_t refillCount, bool forTesting) {
   ENFORCE(refillCount > 0);
   return ParseOptions{refillCount, /*adjustCommandLine*/ !forTesting,
                       /*skipNonMainFileTuEntries*/ !forTesting,
-                      /*checkFilesExist*/ !forTesting};
+                      /*checkFilesExist*/ !forTesting,
+                      /*skipDuplicates*/ !forTesting};
 }
 
-void ResumableParser::initialize(compdb::File compdb, ParseOptions options) {
-  auto averageJobSize = compdb.sizeInBytes() / compdb.commandCount();
-  // Some customers have averageJobSize = 150KiB.
-  // If numWorkers == 300 (very high core count machine),
-  // then the computed hint will be ~88MiB. The 128MiB is rounded up from 88MiB.
-  // The fudge factor of 2 is to allow for oversized jobs.
-  auto bufferSize = std::min(size_t(128 * 1024 * 1024),
-                             averageJobSize * 2 * options.refillCount);
-  std::fseek(compdb.file, 0, SEEK_SET);
-  this->handler = CommandObjectHandler(options.refillCount);
-  this->jsonStreamBuffer.resize(bufferSize);
-  this->compDbStream =
-      rapidjson::FileReadStream(compdb.file, this->jsonStreamBuffer.data(),
-                                this->jsonStreamBuffer.size());
-  this->reader.IterativeParseInit();
-  this->options = options;
-  std::vector<std::string> extensions;
+namespace {
+
+bool hasTuFileExtension(std::string_view path) {
   // clang-format off
   // Via https://stackoverflow.com/a/3223792/2682729 (for C and C++)
   // For CUDA, see https://docs.nvidia.com/cuda/cuda-c-programming-guide/index.html#basics-cdp1
   // and https://github.com/github-linguist/linguist/blob/master/lib/linguist/languages.yml#L1342-L1346
   // clang-format on
-  for (auto ext : {"c", "C", "cc", "cpp", "CPP", "cxx", "c++", "cu"}) {
-    extensions.emplace_back(llvm::Regex::escape(fmt::format(".{}", ext)));
+  for (std::string_view ext :
+       {".c", ".C", ".cc", ".cpp", ".CPP", ".cxx", ".c++", ".cu"}) {
+    if (path.size() > ext.size() && path.ends_with(ext)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool doesFileExist(const std::string &path, const std::string &base) {
+  bool exists = false;
+  bool isAbsolute = false;
+  if (llvm::sys::path::is_absolute(path)) {
+    isAbsolute = true;
+    exists = llvm::sys::fs::exists(path);
+  } else {
+    exists = llvm::sys::fs::exists(fmt::format(
+        "{}{}{}", base, std::filesystem::path::preferred_separator, path));
+  }
+  if (!exists) {
+    spdlog::warn(R"("file": "{}" in compilation database{} not found on disk)",
+                 path,
+                 isAbsolute ? "" : fmt::format(" (in directory '{}')", base));
+  }
+  return exists;
+}
+
+/// See NOTE(ref: compdb-dedup).
+uint64_t deduplicationKey(const CommandObject &cmd) {
+  static const auto cleaner = CommandLineCleaner::forDeduplication();
+  auto arguments = cmd.arguments;
+  cleaner->clean(arguments);
+  HashValue hash{0};
+  auto mixString = [&hash](std::string_view s) {
+    uint64_t size = s.size();
+    hash.mix(reinterpret_cast<const uint8_t *>(&size), sizeof(size));
+    hash.mix(reinterpret_cast<const uint8_t *>(s.data()), s.size());
   };
-  this->fileExtensionRegex =
-      llvm::Regex(fmt::format(".+({})$", fmt::join(extensions, "|")));
+  mixString(cmd.workingDirectory);
+  mixString(cmd.filePath);
+  for (auto &arg : arguments) {
+    mixString(arg);
+  }
+  return hash.rawValue;
+}
+
+} // namespace
+
+void ResumableParser::initialize(compdb::File compdb, ParseOptions options) {
+  // Chunks from an earlier call write into pendingChunks.
+  for (auto &chunk : this->pendingChunks) {
+    chunk->done.wait();
+  }
+  this->pendingChunks.clear();
+  this->contents = compdb.contents();
+  this->commandObjects = compdb.commandObjects();
+  this->validationOptions = compdb.validationOptions();
+  this->nextChunkStart = 0;
+  this->options = options;
+  this->emittedErrors.clear();
+  this->emittedWarnings.clear();
+  this->seenCommands.clear();
+  this->stats = ParseStats{};
+  this->waitingCommands.clear();
+}
+
+void ResumableParser::useToolchainCache(std::string path) {
+  this->toolchainCache.emplace(std::move(path));
+}
+
+void ResumableParser::saveToolchainCache() {
+  if (this->toolchainCache) {
+    this->toolchainCache->save();
+  }
 }
 
 void ResumableParser::parseMore(std::vector<compdb::CommandObject> &out) {
-  if (this->reader.IterativeParseComplete()) {
-    if (this->reader.HasParseError()) {
-      spdlog::error(
-          "parse error: {} at offset {}",
-          rapidjson::GetParseError_En(this->reader.GetParseErrorCode()),
-          this->reader.GetErrorOffset());
-    }
+  if (!this->options.adjustCommandLine) {
+    this->parseCommands(out);
     return;
   }
-  ENFORCE(this->handler, "should've been handled by initializer method");
-  ENFORCE(this->compDbStream, "should've been handled by initializer method");
-
-  std::string pathBuffer;
-  auto doesFileExist = [&](const std::string &path,
-                           const std::string &base) -> bool {
-    bool exists = false;
-    bool isAbsolute = false;
-    if (llvm::sys::path::is_absolute(path)) {
-      isAbsolute = true;
-      exists = llvm::sys::fs::exists(path);
-    } else {
-      pathBuffer.clear();
-      fmt::format_to(std::back_inserter(pathBuffer), "{}{}{}", base,
-                     std::filesystem::path::preferred_separator, path);
-      exists = llvm::sys::fs::exists(pathBuffer);
-    }
-    if (!exists) {
-      spdlog::warn(
-          R"("file": "{}" in compilation database{} not found on disk)", path,
-          isAbsolute ? "" : fmt::format(" (in directory '{}')", base));
+  // See NOTE(ref: toolchain-cache)
+  std::vector<compdb::CommandObject> parsed{};
+  this->parseCommands(parsed);
+  for (auto &cmd : parsed) {
+    if (!cmd.arguments.empty()) {
+      this->startProbe(cmd.workingDirectory, cmd.arguments);
     }
-    return exists;
-  };
+    this->waitingCommands.push_back(std::move(cmd));
+  }
+  this->takeReadyCommands(out);
+}
 
+void ResumableParser::parseCommands(std::vector<compdb::CommandObject> &out) {
+  ENFORCE(this->commandObjects,
+          "should've been handled by initializer method");
   size_t initialSize = out.size();
   while (out.size() == initialSize) {
-    while (!this->handler->reachedLimit()
-           && !this->reader.IterativeParseComplete()) {
-      this->reader.IterativeParseNext<rapidjson::kParseIterativeFlag>(
-          this->compDbStream.value(), this->handler.value());
-    }
-    if (this->handler->commands.size() == 0) {
+    this->scheduleChunks();
+    if (this->pendingChunks.empty()) {
+      // Spans before a syntax error are still handed out by the scan,
+      // so the error is only reported once those have been parsed.
+      if (auto error = this->commandObjects->waitUntilDone()) {
+        spdlog::error("failed to parse compile_commands.json: {}", *error);
+        std::exit(EXIT_FAILURE);
+      }
       break;
     }
-    std::string pathBuffer;
-    for (auto &cmd : this->handler->commands) {
-      cmd.index = this->currentIndex;
-      ++this->currentIndex;
-      if (this->options.skipNonMainFileEntries) {
-        if (!this->fileExtensionRegex.match(cmd.filePath)) {
-          ++this->stats.skippedNonTuFileExtension;
-          continue;
-        }
+    auto chunk = std::move(this->pendingChunks.front());
+    this->pendingChunks.pop_front();
+    chunk->done.wait();
+    auto &result = chunk->result;
+    if (!result.errorMessage.empty()) {
+      spdlog::error("failed to parse compile_commands.json: {} at offset {}",
+                    result.errorMessage, result.errorOffset);
+      std::exit(EXIT_FAILURE);
+    }
+    for (auto &warning : result.warnings) {
+      if (this->emittedWarnings.insert(warning).second) {
+        spdlog::warn("in compile_commands.json: {}", warning);
       }
-      if (this->options.checkFilesExist
-          && !doesFileExist(cmd.filePath, cmd.workingDirectory)) {
-        ++this->stats.skippedNonExistentTuFile;
+    }
+    this->stats.merge(result.stats);
+    for (auto &cmd : result.commands) {
+      // See NOTE(ref: compdb-dedup)
+      if (this->options.skipDuplicates
+          && !this->seenCommands.insert(deduplicationKey(cmd)).second) {
+        ++this->stats.skippedDuplicate;
         continue;
       }
       out.emplace_back(std::move(cmd));
     }
-    this->handler->commands.clear();
   }
+}
+
+void ResumableParser::scheduleChunks() {
+  size_t maxPendingChunks = this->threadPool.getMaxConcurrency();
+  while (this->pendingChunks.size() < maxPendingChunks) {
+    // Only block on the background scan if there is nothing else to
+    // hand out. See NOTE(ref: compdb-scan).
+    auto nextSpans = this->commandObjects->getSpans(
+        this->nextChunkStart, this->options.refillCount,
+        /*wait*/ this->pendingChunks.empty());
+    if (!nextSpans || nextSpans->empty()) {
+      break;
+    }
+    size_t begin = this->nextChunkStart;
+    this->nextChunkStart += nextSpans->size();
+    auto chunk = std::make_unique<PendingChunk>();
+    chunk->done = this->threadPool.async(
+        [result = &chunk->result, contents = this->contents,
+         spans = std::move(*nextSpans), begin, options = this->options,
+         validationOptions = this->validationOptions]() -> void {
+          ResumableParser::parseChunk(contents->getBuffer(), spans, begin,
+                                      options, validationOptions, *result);
+        });
+    this->pendingChunks.push_back(std::move(chunk));
+  }
+}
+
+// static
+void ResumableParser::parseChunk(std::string_view json,
+                                 const std::vector<ObjectSpan> &spans,
+                                 size_t firstIndex, ParseOptions options,
+                                 ValidationOptions validationOptions,
+                                 ParsedChunk &out) {
+  CommandObjectHandler handler{};
+  ValidateHandler<CommandObjectHandler> validator(handler, validationOptions);
+  // The spans only cover the objects inside the outermost array.
+  validator.StartArray();
+  rapidjson::Reader reader;
+  for (auto &span : spans) {
+    rapidjson::MemoryStream stream(json.data() + span.offset, span.length);
+    auto parseResult = reader.Parse(stream, validator);
+    if (parseResult.IsError()) {
+      out.errorMessage = validator.errorMessage.empty()
+                             ? rapidjson::GetParseError_En(parseResult.Code())
+                             : validator.errorMessage;
+      out.errorOffset = span.offset + parseResult.Offset();
+      return;
+    }
+  }
+  out.warnings = std::move(validator.warnings);
+  for (size_t i = 0; i < handler.commands.size(); ++i) {
+    auto &cmd = handler.commands[i];
+    cmd.index = firstIndex + i;
+    if (options.skipNonMainFileEntries && !hasTuFileExtension(cmd.filePath)) {
+      ++out.stats.skippedNonTuFileExtension;
+      continue;
+    }
+    if (options.checkFilesExist
+        && !doesFileExist(cmd.filePath, cmd.workingDirectory)) {
+      ++out.stats.skippedNonExistentTuFile;
+      continue;
+    }
+    out.commands.emplace_back(std::move(cmd));
+  }
+}
 
-  if (this->options.adjustCommandLine) {
-    for (auto &cmd : out) {
-      if (cmd.arguments.empty()) {
+void ResumableParser::takeReadyCommands(
+    std::vector<compdb::CommandObject> &out) {
+  size_t initialSize = out.size();
+  while (!this->waitingCommands.empty()) {
+    std::vector<std::string> finishedProbes{};
+    for (auto &[compilerOrWrapperPath, probe] : this->pendingProbes) {
+      if (probe->done.wait_for(std::chrono::seconds(0))
+          == std::future_status::ready) {
+        finishedProbes.push_back(compilerOrWrapperPath);
+      }
+    }
+    for (auto &compilerOrWrapperPath : finishedProbes) {
+      this->finishProbe(compilerOrWrapperPath);
+    }
+    std::deque<compdb::CommandObject> stillWaiting{};
+    for (auto &cmd : this->waitingCommands) {
+      if (!cmd.arguments.empty()
+          && this->pendingProbes.contains(cmd.arguments.front())) {
+        stillWaiting.push_back(std::move(cmd));
         continue;
       }
-      this->adjustCommandLine(cmd.workingDirectory, cmd.arguments);
+      if (!cmd.arguments.empty()) {
+        this->adjustCommandLine(cmd.arguments);
+      }
+      out.push_back(std::move(cmd));
+    }
+    this->waitingCommands = std::move(stillWaiting);
+    if (out.size() != initialSize || this->waitingCommands.empty()) {
+      return;
     }
+    // Returning nothing would signal that all commands have been parsed.
+    this->finishProbe(this->waitingCommands.front().arguments.front());
+  }
+}
+
+void ResumableParser::adjustCommandLine(std::vector<std::string> &commandLine) {
+  auto it = this->toolchainInfoMap.find(commandLine.front());
+  ENFORCE(it != this->toolchainInfoMap.end(),
+          "toolchain should've been probed before adjusting command line");
+  auto &toolchain = it->second;
+  if (toolchain) {
+    toolchain->adjustCommandLine(commandLine);
   }
 }
 
-void ResumableParser::adjustCommandLine(const std::string &directoryPath,
-                                        std::vector<std::string> &commandLine) {
+void ResumableParser::startProbe(const std::string &directoryPath,
+                                 const std::vector<std::string> &commandLine) {
   auto &compilerOrWrapperPath = commandLine.front();
-  auto it = this->toolchainInfoMap.find(compilerOrWrapperPath);
-  if (it != this->toolchainInfoMap.end()) {
-    auto &toolchain = it->second;
-    if (toolchain) {
-      toolchain->adjustCommandLine(commandLine);
-    }
+  if (this->toolchainInfoMap.contains(compilerOrWrapperPath)
+      || this->pendingProbes.contains(compilerOrWrapperPath)) {
     return;
   }
 
@@ -1075,15 +1706,40 @@ void ResumableParser::adjustCommandLine(const std::string &directoryPath,
   if (compilerInvocationPath.asStringRef().empty()) {
     return fail();
   }
-  auto optToolchainInfo = ToolchainInfo::infer(compilerInvocationPath);
-  if (!optToolchainInfo || !optToolchainInfo->isWellFormed()) {
-    return fail();
+  if (this->toolchainCache) {
+    auto cached = this->toolchainCache->lookup(compilerInvocationPath);
+    // If the toolchain moved without the wrapper changing, probe again.
+    if (cached && cached->isWellFormed()) {
+      this->toolchainInfoMap.emplace(compilerOrWrapperPath, std::move(cached));
+      return;
+    }
   }
 
-  auto [newIt, inserted] = this->toolchainInfoMap.emplace(
-      compilerOrWrapperPath, std::move(optToolchainInfo));
+  auto probe = std::make_unique<PendingProbe>();
+  probe->compilerInvocationPath = compilerInvocationPath.asStringRef();
+  probe->done = this->threadPool.async(
+      [result = &probe->result, compilerInvocationPath]() -> void {
+        *result = ToolchainInfo::infer(compilerInvocationPath);
+      });
+  this->pendingProbes.emplace(compilerOrWrapperPath, std::move(probe));
+}
+
+void ResumableParser::finishProbe(const std::string &compilerOrWrapperPath) {
+  auto it = this->pendingProbes.find(compilerOrWrapperPath);
+  ENFORCE(it != this->pendingProbes.end());
+  auto probe = std::move(it->second);
+  this->pendingProbes.erase(it);
+  probe->done.wait();
+  auto &toolchain = probe->result;
+  if (!toolchain || !toolchain->isWellFormed()) {
+    toolchain = nullptr;
+  } else if (this->toolchainCache) {
+    this->toolchainCache->store(
+        AbsolutePath(std::move(probe->compilerInvocationPath)), *toolchain);
+  }
+  auto [_, inserted] = this->toolchainInfoMap.emplace(compilerOrWrapperPath,
+                                                      std::move(toolchain));
   ENFORCE(inserted);
-  newIt->second->adjustCommandLine(commandLine);
 }
 
 void ResumableParser::emitError(std::string &&error) {
@@ -1,21 +1,30 @@
 #ifndef SCIP_CLANG_COMPILATION_DATABASE_H
 #define SCIP_CLANG_COMPILATION_DATABASE_H
 
+#include <atomic>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
+#include <deque>
+#include <future>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
 
 #include "indexer/Enforce.h" // defines ENFORCE used by rapidjson headers
 
 #include "absl/container/flat_hash_map.h"
 #include "absl/container/flat_hash_set.h"
-#include "rapidjson/filereadstream.h"
 #include "rapidjson/reader.h"
 #include "spdlog/fmt/fmt.h"
 #include "spdlog/spdlog.h"
 
-#include "llvm/Support/Regex.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/ThreadPool.h"
 
 #include "indexer/Derive.h"
 #include "indexer/FileSystem.h"
@@ -24,6 +33,10 @@ namespace clang::tooling {
 struct CompileCommand;
 } // namespace clang::tooling
 
+namespace llvm {
+class MemoryBuffer;
+} // namespace llvm
+
 namespace scip_clang {
 
 class AbsolutePath;
@@ -35,25 +48,125 @@ struct ValidationOptions {
   bool tryDetectOutOfProjectRoot;
 };
 
+/// Byte range of a command object in a compilation database.
+struct ObjectSpan {
+  size_t offset;
+  size_t length;
+};
+
+/// NOTE(def: compdb-scan): Compilation databases can be more than a GB
+/// in size. Instead of validating and parsing the whole file upfront,
+/// the file is memory-mapped, and a structural scan finds the byte range
+/// for each command object, skipping over 8 bytes at a time inside
+/// objects when none of them are quotes, backslashes or brackets.
+///
+/// The scan runs on a background thread (see \c CommandObjectIndex),
+/// so that workers can be spawned before it finishes. Until then, the
+/// number of command objects (e.g. for progress reporting) is estimated
+/// based on how much of the file has been scanned so far.
+///
+/// The command objects themselves are validated and parsed in chunks
+/// on a thread pool by the \c ResumableParser, so that jobs can be
+/// scheduled as soon as the first chunk is ready.
+///
+/// Returns an error message if \p json is not an array of objects.
+/// The contents of the objects are not validated.
+std::optional<std::string> scanCommandObjects(std::string_view json,
+                                              std::vector<ObjectSpan> &out);
+
+struct CommandCount {
+  size_t value;
+  /// False if the background scan is still running.
+  bool isExact;
+};
+
+/// Byte ranges of the command objects in a compilation database,
+/// filled in by a background scan. See NOTE(ref: compdb-scan).
+class CommandObjectIndex final {
+  std::shared_ptr<const llvm::MemoryBuffer> contents;
+
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::vector<ObjectSpan> spans;
+  size_t scannedBytes;
+  bool done;
+  std::optional<std::string> error;
+
+  std::atomic<bool> cancelled;
+  /// Declared last, so that the scan starts after the fields above
+  /// have been initialized.
+  std::thread scanThread;
+
+public:
+  /// Starts scanning \p contents on a background thread.
+  explicit CommandObjectIndex(
+      std::shared_ptr<const llvm::MemoryBuffer> contents);
+  CommandObjectIndex(const CommandObjectIndex &) = delete;
+  CommandObjectIndex &operator=(const CommandObjectIndex &) = delete;
+  ~CommandObjectIndex();
+
+  /// Returns up to \p maxCount spans starting at index \p begin,
+  /// or an empty vector if there are no more spans.
+  ///
+  /// If \p wait is false, returns std::nullopt instead of blocking
+  /// when the scan hasn't found enough spans yet.
+  std::optional<std::vector<ObjectSpan>> getSpans(size_t begin, size_t maxCount,
+                                                  bool wait);
+
+  /// Blocks until \p limit spans have been found or the scan is done,
+  /// and returns the number of spans found, capped at \p limit.
+  size_t waitForCount(size_t limit);
+
+  /// Exact if the scan is done, otherwise an estimate.
+  CommandCount count();
+
+  /// Blocks until the scan is done, and returns the error, if any.
+  std::optional<std::string> waitUntilDone();
+
+private:
+  void scan();
+};
+
 class File {
   size_t _sizeInBytes;
-  size_t _commandCount;
+  ValidationOptions _validationOptions;
+  std::shared_ptr<const llvm::MemoryBuffer> _contents;
+  std::shared_ptr<CommandObjectIndex> _commandObjects;
 
 public:
   FILE *file;
 
   static File openAndExitOnErrors(const StdPath &, ValidationOptions);
 
+  /// Like \c openAndExitOnErrors, but returns an error message instead
+  /// of exiting. \p compdbFile is only valid if there is no error.
+  static std::optional<std::string>
+  tryOpen(const StdPath &, ValidationOptions, File &compdbFile);
+
   size_t sizeInBytes() const {
     return this->_sizeInBytes;
   }
+  /// Blocks until the background scan is done.
   size_t commandCount() const {
-    return this->_commandCount;
+    this->_commandObjects->waitUntilDone();
+    return this->_commandObjects->count().value;
+  }
+  ValidationOptions validationOptions() const {
+    return this->_validationOptions;
+  }
+  /// The mapping stays valid after \c file is closed.
+  const std::shared_ptr<const llvm::MemoryBuffer> &contents() const {
+    return this->_contents;
+  }
+  /// See NOTE(ref: compdb-scan).
+  const std::shared_ptr<CommandObjectIndex> &commandObjects() const {
+    return this->_commandObjects;
   }
 
 private:
   static File open(const StdPath &, ValidationOptions,
-                   std::error_code &fileSizeError);
+                   std::error_code &fileSizeError,
+                   std::error_code &readError);
 };
 
 // Key to identify fields in a command object
@@ -89,20 +202,15 @@ class CommandObjectHandler
                                           CommandObjectHandler> {
   compdb::Key previousKey;
   compdb::CommandObject wipCommand;
-  size_t parseLimit;
 
 public:
   std::vector<compdb::CommandObject> commands;
 
-  CommandObjectHandler(size_t parseLimit)
-      : previousKey(Key::Unset), wipCommand(), parseLimit(parseLimit),
-        commands() {}
+  CommandObjectHandler() : previousKey(Key::Unset), wipCommand(), commands() {}
 
   bool String(const char *str, rapidjson::SizeType length, bool copy);
   bool Key(const char *str, rapidjson::SizeType length, bool copy);
   bool EndObject(rapidjson::SizeType memberCount);
-
-  bool reachedLimit() const;
 };
 
 enum class CompilerKind {
@@ -122,6 +230,10 @@ struct ToolchainInfo {
   virtual void
   adjustCommandLine(std::vector<std::string> &commandLine) const = 0;
 
+  /// Serializes the results of probing the compiler, so that they can
+  /// be restored using \c fromJSON. See NOTE(ref: toolchain-cache).
+  virtual llvm::json::Object toJSON() const = 0;
+
   virtual ~ToolchainInfo() = default;
 
   /// Attempt to determine the toolchain information based on the path
@@ -131,11 +243,55 @@ struct ToolchainInfo {
   /// Returns nullptr if we failed to create a well-formed toolchain object.
   static std::unique_ptr<ToolchainInfo> infer(const AbsolutePath &compilerPath);
 
+  /// Returns nullptr if \p object wasn't created by \c toJSON.
+  static std::unique_ptr<ToolchainInfo>
+  fromJSON(const llvm::json::Object &object);
+
   static void logStdlibWarning();
 
   static void logDiagnosticsHint();
 };
 
+/// NOTE(def: toolchain-cache): Inferring the toolchain for a compiler
+/// involves invoking it a few times (see \c ToolchainInfo::infer), which
+/// adds up for compilation databases using dozens of distinct compiler
+/// wrappers. With --toolchain-cache-path, the results are persisted
+/// across runs, keyed by the compiler's path, modification time and size.
+/// Restored entries are still checked using \c ToolchainInfo::isWellFormed.
+///
+/// Compilers which are not in the cache are probed on a thread pool
+/// by the \c ResumableParser, so that commands for already known
+/// compilers can be scheduled in the meantime.
+class ToolchainCache final {
+  struct Entry {
+    int64_t modificationTime;
+    int64_t sizeInBytes;
+    llvm::json::Object toolchain;
+  };
+
+  std::string path;
+  /// Keyed by the absolute path of the compiler (or wrapper).
+  absl::flat_hash_map<std::string, Entry> entries;
+  bool modified;
+
+public:
+  /// Reads existing entries from \p path, if present and well-formed.
+  explicit ToolchainCache(std::string path);
+  ToolchainCache(ToolchainCache &&) = default;
+  ToolchainCache &operator=(ToolchainCache &&) = default;
+  ToolchainCache(const ToolchainCache &) = delete;
+  ToolchainCache &operator=(const ToolchainCache &) = delete;
+
+  /// Returns nullptr if there is no entry for \p compilerPath, or if
+  /// the compiler has been modified since the entry was stored.
+  std::unique_ptr<ToolchainInfo> lookup(const AbsolutePath &compilerPath);
+
+  void store(const AbsolutePath &compilerPath, const ToolchainInfo &);
+
+  /// Writes out the entries if any were added or removed.
+  void save();
+};
+
 /// The settings used to customize the parsed results generated from
 /// the compilation database.
 ///
@@ -149,6 +305,8 @@ struct ParseOptions {
   bool adjustCommandLine;
   bool skipNonMainFileEntries;
   bool checkFilesExist;
+  /// See NOTE(ref: compdb-dedup).
+  bool skipDuplicates;
 
   static ParseOptions create(size_t refillCount, bool forTesting = false);
 };
@@ -156,19 +314,55 @@ struct ParseOptions {
 struct ParseStats {
   unsigned skippedNonTuFileExtension = 0;
   unsigned skippedNonExistentTuFile = 0;
+  unsigned skippedDuplicate = 0;
+
+  void merge(const ParseStats &other) {
+    this->skippedNonTuFileExtension += other.skippedNonTuFileExtension;
+    this->skippedNonExistentTuFile += other.skippedNonExistentTuFile;
+    this->skippedDuplicate += other.skippedDuplicate;
+  }
 };
 
 class ResumableParser {
-  std::string jsonStreamBuffer;
-  std::optional<rapidjson::FileReadStream> compDbStream;
-  std::optional<CommandObjectHandler> handler;
-  rapidjson::Reader reader;
-  size_t currentIndex = 0;
+  std::shared_ptr<const llvm::MemoryBuffer> contents;
+  std::shared_ptr<CommandObjectIndex> commandObjects;
+  ValidationOptions validationOptions;
+  /// Index into commandObjects for the start of the next chunk.
+  size_t nextChunkStart = 0;
+
+  struct ParsedChunk {
+    std::vector<CommandObject> commands;
+    ParseStats stats;
+    absl::flat_hash_set<std::string> warnings;
+    /// Empty iff all command objects in the chunk are well-formed.
+    std::string errorMessage;
+    size_t errorOffset;
+  };
+
+  struct PendingChunk {
+    std::shared_future<void> done;
+    /// Written by the parsing thread before \c done is ready.
+    ParsedChunk result;
+  };
+
+  /// Chunks being parsed, in order. See NOTE(ref: compdb-scan).
+  std::deque<std::unique_ptr<PendingChunk>> pendingChunks;
 
   ParseOptions options;
   absl::flat_hash_set<std::string> emittedErrors;
-
-  llvm::Regex fileExtensionRegex;
+  absl::flat_hash_set<std::string> emittedWarnings;
+
+  /// NOTE(def: compdb-dedup): Build systems often emit several entries
+  /// for the same file which only differ in output-related options,
+  /// e.g. for several output paths.
+  /// Indexing each of them would redo the same semantic analysis, so
+  /// only the first entry for each combination of working directory,
+  /// file and arguments (after zapping output-related options with
+  /// \c CommandLineCleaner::forDeduplication) is kept.
+  ///
+  /// Only hashes are stored, to keep memory usage low for large
+  /// compilation databases.
+  absl::flat_hash_set<uint64_t> seenCommands;
 
   /// Mapping from compiler/wrapper path (the first element of argv
   /// as in the compilation database) to information about the toolchain
@@ -181,9 +375,34 @@ class ResumableParser {
   ///
   /// In case there is a failure to determine the toolchain information,
   /// a null value is stored for the unique_ptr.
+  ///
+  /// Kept across calls to \c initialize, see NOTE(ref: serve-mode).
   absl::flat_hash_map<std::string, std::unique_ptr<ToolchainInfo>>
       toolchainInfoMap;
 
+  struct PendingProbe {
+    std::shared_future<void> done;
+    /// Written by the probing thread before \c done is ready.
+    std::unique_ptr<ToolchainInfo> result;
+    std::string compilerInvocationPath;
+  };
+
+  /// Compilers currently being probed, with the same keys as
+  /// toolchainInfoMap. See NOTE(ref: toolchain-cache).
+  absl::flat_hash_map<std::string, std::unique_ptr<PendingProbe>>
+      pendingProbes;
+
+  /// Parsed commands whose compiler is still being probed, in order.
+  std::deque<CommandObject> waitingCommands;
+
+  std::optional<ToolchainCache> toolchainCache;
+
+  /// Used for parsing chunks and for probing compilers.
+  ///
+  /// Declared after pendingChunks and pendingProbes, so that running
+  /// tasks finish before the memory they write to is freed.
+  llvm::DefaultThreadPool threadPool;
+
 public:
   ParseStats stats;
 
@@ -193,12 +412,55 @@ public:
 
   void initialize(compdb::File compdb, ParseOptions);
 
-  /// Parses at most \c options.refillCount elements into \param out.
+  /// Reads cached toolchain information from \p path, and enables
+  /// writing it back using \c saveToolchainCache.
+  ///
+  /// See NOTE(ref: toolchain-cache).
+  void useToolchainCache(std::string path);
+
+  /// No-op unless \c useToolchainCache was called.
+  void saveToolchainCache();
+
+  /// See NOTE(ref: compdb-scan).
+  CommandCount commandCount() {
+    return this->commandObjects->count();
+  }
+
+  /// Parses roughly \c options.refillCount elements into \param out.
+  ///
+  /// If \c options.adjustCommandLine is set, commands for compilers
+  /// which are still being probed are held back, and returned by
+  /// a later call. Nothing is appended to \param out only once all
+  /// commands have been returned.
   void parseMore(std::vector<CommandObject> &out);
 
 private:
-  void adjustCommandLine(const std::string &directoryPath,
-                         std::vector<std::string> &commandLine);
+  void parseCommands(std::vector<CommandObject> &out);
+
+  /// Hands chunks to the thread pool, keeping about as many chunks
+  /// in flight as there are threads.
+  void scheduleChunks();
+
+  /// Validates and parses the command objects in \p spans, the first
+  /// of which is at index \p firstIndex in the compilation database.
+  static void parseChunk(std::string_view json,
+                         const std::vector<ObjectSpan> &spans,
+                         size_t firstIndex, ParseOptions, ValidationOptions,
+                         ParsedChunk &out);
+
+  /// Looks up or starts probing the compiler for \p commandLine,
+  /// unless it is already known.
+  void startProbe(const std::string &directoryPath,
+                  const std::vector<std::string> &commandLine);
+
+  /// Blocks until the toolchain for \p compilerOrWrapperPath is known.
+  void finishProbe(const std::string &compilerOrWrapperPath);
+
+  /// Moves commands whose toolchain is known from waitingCommands
+  /// to \p out, blocking if none are ready.
+  void takeReadyCommands(std::vector<CommandObject> &out);
+
+  void adjustCommandLine(std::vector<std::string> &commandLine);
   void emitError(std::string &&error);
 };
 
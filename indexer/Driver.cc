@@ -1,18 +1,24 @@
 #include <algorithm>
+#include <charconv>
 #include <chrono>
 #include <compare>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <deque>
+#include <fcntl.h>
 #include <filesystem>
 #include <fstream>
+#include <future>
 #include <ios>
 #include <iterator>
 #include <memory>
+#include <optional>
 #include <string>
 #include <string_view>
 #include <thread>
+#include <unistd.h>
+#include <utility>
 #include <variant>
 #include <vector>
 
@@ -35,11 +41,16 @@
 #include "spdlog/sinks/stdout_sinks.h"
 #include "spdlog/spdlog.h"
 
+#include "zlib.h"
+
 #include "llvm/ADT/StringMap.h"
 #include "llvm/Support/Path.h"
 #include "llvm/Support/StringSaver.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
 
 #include "proto/fwd_decls.pb.h"
+#include "proto/index_shard.pb.h"
 #include "scip/scip.pb.h"
 
 #include "indexer/CliOptions.h"
@@ -47,14 +58,22 @@
 #include "indexer/CompilationDatabase.h"
 #include "indexer/Driver.h"
 #include "indexer/FileSystem.h"
+#include "indexer/Hash.h"
+#include "indexer/HeaderDocumentCache.h"
+#include "indexer/IncludeGraph.h"
+#include "indexer/IncrementalCache.h"
 #include "indexer/IpcMessages.h"
 #include "indexer/JsonIpcQueue.h"
 #include "indexer/LlvmAdapter.h"
 #include "indexer/Logging.h"
+#include "indexer/PackageMap.h"
 #include "indexer/Path.h"
 #include "indexer/ProgressReporter.h"
 #include "indexer/RAII.h"
 #include "indexer/ScipExtras.h"
+#include "indexer/Server.h"
+#include "indexer/ShardCache.h"
+#include "indexer/ShardReader.h"
 #include "indexer/Statistics.h"
 #include "indexer/Timer.h"
 #include "indexer/Tracing.h"
@@ -209,18 +228,42 @@ struct DriverOptions {
   RootPath projectRootPath;
   AbsolutePath compdbPath;
   AbsolutePath indexOutputPath;
+  // See NOTE(ref: index-output-stream); if set, indexOutputPath is unused.
+  std::optional<int> indexOutputFd;
   AbsolutePath statsFilePath;
   AbsolutePath packageMapPath;
+  // See NOTE(ref: changed-files)
+  AbsolutePath includeGraphPath;
+  AbsolutePath changedFilesPath;
+  // See NOTE(ref: toolchain-cache)
+  AbsolutePath toolchainCachePath;
+  // See NOTE(ref: previous-plan)
+  bool reusePreviousPlan;
   bool showCompilerDiagnostics;
   bool showProgress;
   DriverIpcOptions ipcOptions;
   size_t numWorkers;
+  bool useShardLog;
+  uint64_t mergeMemoryBudgetBytes;
+  uint32_t workerPremergeCount;
+  bool splitIndexByPackage;
+  uint64_t indexOutputMaxSizeBytes;
+  bool compressIndexOutput;
+  StdPath incrementalCacheDir;
+  std::string shardCacheLocation;
+  // See NOTE(ref: header-document-cache); the driver appends a
+  // subdirectory for the current configuration before spawning workers.
+  StdPath headerCacheDir;
+  // See NOTE(ref: speculative-emission)
+  bool speculativeEmission;
   bool deterministic;
   std::string preprocessorRecordHistoryFilterRegex;
   StdPath supplementaryOutputDir;
   std::string workerFault;
   bool isTesting;
   bool noStacktrace;
+  // See NOTE(ref: serve-mode)
+  bool serve;
 
   StdPath temporaryOutputDir;
   bool deleteTemporaryOutputDir;
@@ -230,16 +273,29 @@ struct DriverOptions {
   explicit DriverOptions(std::string driverId, const CliOptions &cliOpts)
       : workerExecutablePath(),
         projectRootPath(AbsolutePath("/"), RootKind::Project), compdbPath(),
-        indexOutputPath(), statsFilePath(), packageMapPath(),
+        indexOutputPath(), indexOutputFd(), statsFilePath(), packageMapPath(),
+        includeGraphPath(), changedFilesPath(), toolchainCachePath(),
+        reusePreviousPlan(cliOpts.reusePreviousPlan),
         showCompilerDiagnostics(cliOpts.showCompilerDiagnostics),
         showProgress(cliOpts.showProgress),
         ipcOptions{cliOpts.ipcSizeHintBytes, cliOpts.receiveTimeout},
-        numWorkers(cliOpts.numWorkers), deterministic(cliOpts.deterministic),
+        numWorkers(cliOpts.numWorkers), useShardLog(cliOpts.useShardLog),
+        mergeMemoryBudgetBytes(cliOpts.mergeMemoryBudgetMiB * 1024 * 1024),
+        workerPremergeCount(cliOpts.workerPremergeCount),
+        splitIndexByPackage(cliOpts.splitIndexByPackage),
+        indexOutputMaxSizeBytes(cliOpts.indexOutputMaxSizeMiB * 1024 * 1024),
+        compressIndexOutput(cliOpts.compressIndexOutput),
+        incrementalCacheDir(cliOpts.incrementalCacheDir),
+        shardCacheLocation(cliOpts.shardCacheLocation),
+        headerCacheDir(cliOpts.headerCacheDir),
+        speculativeEmission(cliOpts.speculativeEmission),
+        deterministic(cliOpts.deterministic),
         preprocessorRecordHistoryFilterRegex(
             cliOpts.preprocessorRecordHistoryFilterRegex),
         supplementaryOutputDir(cliOpts.supplementaryOutputDir),
         workerFault(cliOpts.workerFault), isTesting(cliOpts.isTesting),
         noStacktrace(cliOpts.noStacktrace),
+        serve(!cliOpts.serveSocketPath.empty()),
         temporaryOutputDir(cliOpts.temporaryOutputDir),
         deleteTemporaryOutputDir(cliOpts.temporaryOutputDir.empty()),
         originalArgv(cliOpts.originalArgv) {
@@ -252,6 +308,26 @@ struct DriverOptions {
     this->projectRootPath =
         RootPath{AbsolutePath{std::move(cwd)}, RootKind::Project};
 
+    if (!this->incrementalCacheDir.empty()
+        || !this->shardCacheLocation.empty()) {
+      // See NOTE(ref: incremental-indexing) and NOTE(ref: shard-cache)
+      if (this->useShardLog || this->workerPremergeCount > 0) {
+        spdlog::warn("ignoring --shard-log and --worker-premerge-count as "
+                     "they are not supported with --incremental-cache-dir "
+                     "or --shard-cache");
+        this->useShardLog = false;
+        this->workerPremergeCount = 0;
+      }
+    }
+    if (this->serve && (this->useShardLog || this->workerPremergeCount > 0)) {
+      // Both rely on workers exiting at the end of a run.
+      // See NOTE(ref: serve-mode)
+      spdlog::warn("ignoring --shard-log and --worker-premerge-count as "
+                   "they are not supported with --serve-socket-path");
+      this->useShardLog = false;
+      this->workerPremergeCount = 0;
+    }
+
     auto setAbsolutePath = [this](const std::string &path, AbsolutePath &out) {
       out = path.empty()
                 ? AbsolutePath()
@@ -283,10 +359,33 @@ struct DriverOptions {
                       this->workerExecutablePath);
     }
 
-    setAbsolutePath(cliOpts.indexOutputPath, this->indexOutputPath);
+    this->setIndexOutput(cliOpts.indexOutputPath);
+    if (!this->indexOutputFd.has_value()) {
+      setAbsolutePath(cliOpts.indexOutputPath, this->indexOutputPath);
+    }
     setAbsolutePath(cliOpts.compdbPath, this->compdbPath);
     setAbsolutePath(cliOpts.statsFilePath, this->statsFilePath);
     setAbsolutePath(cliOpts.packageMapPath, this->packageMapPath);
+    setAbsolutePath(cliOpts.includeGraphPath, this->includeGraphPath);
+    setAbsolutePath(cliOpts.changedFilesPath, this->changedFilesPath);
+    setAbsolutePath(cliOpts.toolchainCachePath, this->toolchainCachePath);
+    if (!this->changedFilesPath.asStringRef().empty()
+        && this->includeGraphPath.asStringRef().empty()) {
+      spdlog::error("--changed-files requires --include-graph-path");
+      std::exit(EXIT_FAILURE);
+    }
+    if (this->reusePreviousPlan
+        && this->includeGraphPath.asStringRef().empty()) {
+      spdlog::error("--reuse-previous-plan requires --include-graph-path");
+      std::exit(EXIT_FAILURE);
+    }
+    if (this->reusePreviousPlan && !this->shardCacheLocation.empty()) {
+      // Workers with a matching plan start emitting before the driver
+      // gets to look up the shard cache.
+      spdlog::warn("ignoring --reuse-previous-plan as it is not supported "
+                   "with --shard-cache");
+      this->reusePreviousPlan = false;
+    }
 
     auto makeDirs = [](const StdPath &path, const char *name) {
       std::error_code error;
@@ -314,6 +413,90 @@ struct DriverOptions {
       this->temporaryOutputDir.append("scip-clang-" + driverId);
     }
     makeDirs(this->temporaryOutputDir, "temporary output directory");
+    if (!this->incrementalCacheDir.empty()) {
+      this->incrementalCacheDir =
+          std::filesystem::absolute(this->incrementalCacheDir);
+      makeDirs(this->incrementalCacheDir / "shards",
+               "incremental cache directory");
+    }
+  }
+
+  /// NOTE(def: index-output-stream): The final index is written strictly
+  /// sequentially (no seeking or re-reading), so it can be streamed into
+  /// a pipe using '-' (stdout) or '/dev/fd/N' (an inherited descriptor).
+  /// When streaming to stdout, the original stdout is duplicated for the
+  /// index, and stdout is pointed at stderr, so that progress reports,
+  /// summaries and worker output don't end up interleaved with the index.
+  void setIndexOutput(const std::string &path) {
+    std::string_view fdPrefix = "/dev/fd/";
+    if (path == "-" || path == "/dev/stdout") {
+      this->indexOutputFd = STDOUT_FILENO;
+    } else if (path.starts_with(fdPrefix)) {
+      int fd = -1;
+      auto *begin = path.data() + fdPrefix.size();
+      auto *end = path.data() + path.size();
+      auto result = std::from_chars(begin, end, fd);
+      if (result.ec != std::errc() || result.ptr != end || fd < 0
+          || ::fcntl(fd, F_GETFD) == -1) {
+        spdlog::error("--index-output-path={} does not refer to an open file "
+                      "descriptor",
+                      path);
+        std::exit(EXIT_FAILURE);
+      }
+      // Keep workers from holding the pipe open after the driver is done.
+      ::fcntl(fd, F_SETFD, ::fcntl(fd, F_GETFD) | FD_CLOEXEC);
+      this->indexOutputFd = fd;
+    } else {
+      return;
+    }
+    if (this->indexOutputFd == STDOUT_FILENO) {
+      // Close-on-exec, so that workers don't inherit the index pipe.
+      int fd = ::fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+      if (fd < 0 || ::dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+        spdlog::error("failed to redirect stdout for streaming index ({})",
+                      std::strerror(errno));
+        std::exit(EXIT_FAILURE);
+      }
+      this->indexOutputFd = fd;
+    }
+    if (this->splitIndexByPackage || this->indexOutputMaxSizeBytes != 0) {
+      spdlog::warn("ignoring --split-index-by-package and "
+                   "--index-output-max-size when streaming the index");
+      this->splitIndexByPackage = false;
+      this->indexOutputMaxSizeBytes = 0;
+    }
+  }
+
+  /// Sets the paths for a request in serve mode. Returns an error message
+  /// if the request is invalid. See NOTE(ref: serve-mode).
+  std::optional<std::string> setRequestPaths(const ServeRequest &request) {
+    if (request.compdbPath.empty() || request.indexOutputPath.empty()) {
+      return "compdbPath and indexOutputPath must be set";
+    }
+    for (auto *path : {&request.compdbPath, &request.indexOutputPath,
+                       &request.changedFilesPath}) {
+      if (!path->empty() && !llvm::sys::path::is_absolute(*path)) {
+        return fmt::format("expected absolute path but found '{}'", *path);
+      }
+    }
+    std::error_code error;
+    if (!std::filesystem::is_regular_file(request.compdbPath, error)) {
+      return fmt::format("compilation database not found at '{}'",
+                         request.compdbPath);
+    }
+    if (!request.changedFilesPath.empty()
+        && this->includeGraphPath.asStringRef().empty()) {
+      return "changedFilesPath requires starting the server with "
+             "--include-graph-path";
+    }
+    this->compdbPath = AbsolutePath(std::string(request.compdbPath));
+    this->indexOutputPath = AbsolutePath(std::string(request.indexOutputPath));
+    this->indexOutputFd = std::nullopt;
+    this->changedFilesPath =
+        request.changedFilesPath.empty()
+            ? AbsolutePath()
+            : AbsolutePath(std::string(request.changedFilesPath));
+    return {};
   }
 
   void addWorkerOptions(std::vector<std::string> &args,
@@ -327,6 +510,28 @@ struct DriverOptions {
     if (this->deterministic) {
       args.push_back("--deterministic");
     }
+    if (this->useShardLog) {
+      args.push_back("--shard-log");
+    }
+    if (this->workerPremergeCount > 0) {
+      args.push_back(fmt::format("--worker-premerge-count={}",
+                                 this->workerPremergeCount));
+    }
+    if (!this->headerCacheDir.empty()) {
+      args.push_back(
+          fmt::format("--header-cache-dir={}", this->headerCacheDir.c_str()));
+    }
+    if (this->speculativeEmission) {
+      args.push_back("--speculative-emission");
+    }
+    if (this->serve) {
+      args.push_back("--persistent-worker");
+    }
+    if (!this->incrementalCacheDir.empty()
+        || !this->shardCacheLocation.empty()) {
+      // See NOTE(ref: incremental-indexing) and NOTE(ref: shard-cache)
+      args.push_back("--self-contained-shards");
+    }
     if (!this->statsFilePath.asStringRef().empty()) {
       args.push_back("--measure-statistics");
     }
@@ -405,6 +610,10 @@ public:
   FileIndexingPlanner(FileIndexingPlanner &&) = default;
   FileIndexingPlanner(const FileIndexingPlanner &) = delete;
 
+  void clear() {
+    this->hashesSoFar.clear();
+  }
+
   void saveSemaResult(SemanticAnalysisJobResult &&semaResult,
                       std::vector<PreprocessedFileInfo> &filesToBeIndexed) {
     TRACE_EVENT(tracing::planning, "FileIndexingPlanner::saveSemaResult");
@@ -433,6 +642,44 @@ public:
     }
   }
 
+  /// Records files emitted by a TU whose shards are being reused.
+  ///
+  /// See NOTE(ref: incremental-indexing).
+  void saveReusedFiles(std::vector<PreprocessedFileInfo> &&reusedFiles) {
+    for (auto &fileInfo : reusedFiles) {
+      this->hashesSoFar[std::move(fileInfo.path)].insert(fileInfo.hashValue);
+    }
+  }
+
+  /// Assigns files which haven't been assigned to any TU yet,
+  /// appending them to \p claimed, and the rest to \p unclaimed.
+  ///
+  /// See NOTE(ref: previous-plan).
+  void claimFiles(std::vector<PreprocessedFileInfo> &&files,
+                  std::vector<PreprocessedFileInfo> &claimed,
+                  std::vector<PreprocessedFileInfo> &unclaimed) {
+    for (auto &fileInfo : files) {
+      auto [it, _] = this->hashesSoFar.try_emplace(std::move(fileInfo.path));
+      auto &[path, hashes] = *it;
+      if (hashes.insert(fileInfo.hashValue).second) {
+        claimed.push_back({path, fileInfo.hashValue}); // deliberate copy
+      } else {
+        unclaimed.push_back({path, fileInfo.hashValue}); // deliberate copy
+      }
+    }
+  }
+
+  /// Undoes \c claimFiles for files which a TU didn't touch after all,
+  /// so that other TUs can be assigned those files.
+  void releaseFiles(const std::vector<PreprocessedFileInfo> &files) {
+    for (auto &fileInfo : files) {
+      auto it = this->hashesSoFar.find(fileInfo.path);
+      if (it != this->hashesSoFar.end()) {
+        it->second.erase(fileInfo.hashValue);
+      }
+    }
+  }
+
   enum class MultiplyIndexed {
     True,
     False,
@@ -455,6 +702,25 @@ public:
   }
 };
 
+/// Files from the previous run for a TU which hasn't been sent to a worker.
+///
+/// See NOTE(ref: previous-plan).
+struct PlannedTu {
+  /// See IncludeGraph::digest.
+  HashValue digest;
+  /// Files assigned to the TU ahead of semantic analysis.
+  std::vector<PreprocessedFileInfo> files;
+  /// Files touched by the TU in the previous run which were assigned to
+  /// other TUs. Cleared once the TU is sent to a worker.
+  std::vector<PreprocessedFileInfo> unclaimedFiles;
+  /// Files in unclaimedFiles which were tentatively assigned to other
+  /// planned TUs when the TU was sent to a worker.
+  std::vector<PreprocessedFileInfo> standbyFiles;
+  /// Whether the plan has been sent to a worker; files are only
+  /// added to the plan before that.
+  bool sent;
+};
+
 struct TrackedIndexJob {
   IndexJob job;
   std::optional<WorkerId> assignedWorker;
@@ -536,6 +802,40 @@ public:
     this->checkInvariants();
   }
 
+  bool hasWorkers() const {
+    return !this->workers.empty();
+  }
+
+  /// Clears the jobs from the previous run, and marks the workers stopped
+  /// at the end of it as idle, respawning workers which exited since.
+  ///
+  /// \p spawn should only create the process, as for initializeWorkers.
+  ///
+  /// See NOTE(ref: serve-mode).
+  void resetForNextRun(absl::FunctionRef<Process(WorkerId workerId)> spawn) {
+    ENFORCE(this->stoppedWorkers.size() == this->workers.size(),
+            "workers should be stopped before starting the next run");
+    this->allJobList.clear();
+    this->pendingJobs.clear();
+    this->wipJobs.clear();
+    this->maybeErroredJobs.clear();
+    this->stoppedWorkers.clear();
+    for (WorkerId workerId = 0; workerId < this->workers.size(); ++workerId) {
+      auto &workerInfo = this->workers[workerId];
+      std::error_code error;
+      if (workerInfo.processHandle.running(error)) {
+        workerInfo.status = WorkerInfo::Status::Idle;
+      } else {
+        spdlog::info("respawning worker {} which exited after the previous "
+                     "run",
+                     workerId);
+        workerInfo = WorkerInfo(spawn(workerId));
+      }
+      this->idleWorkers.push_back(workerId);
+    }
+    this->checkInvariants();
+  }
+
   void logJobSkip(JobId jobId) const {
     spdlog::info("the worker was {}", [&]() -> std::string {
       auto it = this->allJobList.find(jobId);
@@ -590,7 +890,8 @@ public:
   /// reasoning about Scheduler state changes easier).
   void terminateLongRunningWorkersAndRespawn(
       Instant startedBefore,
-      absl::FunctionRef<Process(Process &&, WorkerId)> terminateAndRespawn) {
+      absl::FunctionRef<Process(Process &&, WorkerId, JobId)>
+          terminateAndRespawn) {
     TRACE_EVENT(tracing::scheduling,
                 "Scheduler::terminateLongRunningWorkersAndRespawn",
                 "workers.size", this->workers.size(), "wipJobs.size",
@@ -606,9 +907,10 @@ public:
         continue;
       case WorkerInfo::Status::Busy:
         if (workerInfo.startTime < startedBefore) {
+          auto jobId = workerInfo.currentlyProcessing.value();
           this->terminateRunningWorker(
               "worker timeout", workerId, [&](Process &&p) -> Process {
-                return terminateAndRespawn(std::move(p), workerId);
+                return terminateAndRespawn(std::move(p), workerId, jobId);
               });
         }
       }
@@ -636,11 +938,38 @@ public:
     }
   }
 
+  /// Unlike \c waitForAllWorkers, waits for up to \p timeout for each
+  /// worker to exit, for when workers write output while shutting down.
+  void waitForAllWorkersToExit(std::chrono::seconds timeout) {
+    for (size_t workerId = 0; workerId < this->workers.size(); workerId++) {
+      auto &worker = this->workers[workerId];
+      BOOST_TRY {
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        while (worker.processHandle.running()) {
+          if (std::chrono::steady_clock::now() > deadline) {
+            spdlog::warn("worker {} did not exit within {}s after being asked "
+                         "to shut down, pid: {}",
+                         workerId, timeout.count(), worker.processHandle.id());
+            break;
+          }
+          std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+      }
+      BOOST_CATCH(boost::process::process_error & error) {
+        spdlog::warn("driver got error when waiting for child {} to exit: {}",
+                     workerId, error.what());
+      }
+      BOOST_CATCH_END
+    }
+  }
+
   void queueSemaTask(compdb::CommandObject &&cmdObject) {
     auto jobId = JobId::newTask(cmdObject.index);
-    IndexJob job{IndexJob::Kind::SemanticAnalysis,
-                 SemanticAnalysisJobDetails{std::move(cmdObject)},
-                 EmitIndexJobDetails{}};
+    IndexJob job{
+        IndexJob::Kind::SemanticAnalysis,
+        SemanticAnalysisJobDetails{std::move(cmdObject), std::nullopt, {},
+                                   {}, {}},
+        EmitIndexJobDetails{}};
     auto [it, inserted] =
         this->allJobList.emplace(jobId, TrackedIndexJob{std::move(job), {}});
     ENFORCE(inserted,
@@ -765,11 +1094,6 @@ public:
   void runJobsTillCompletionAndShutdownWorkers(RunCallbacks callbacks) {
     this->checkInvariants();
     size_t refillCount = callbacks.refillJobs();
-    if (refillCount == 0) {
-      spdlog::error(
-          "compilation database has no entries that could be processed");
-      std::exit(EXIT_FAILURE);
-    }
     ENFORCE(this->pendingJobs.size() == refillCount);
     auto shutdownIdleWorkers = [this, &callbacks]() {
       while (!this->idleWorkers.empty()) {
@@ -779,6 +1103,12 @@ public:
         callbacks.shutdownWorker(workerId);
       }
     };
+    if (refillCount == 0) {
+      // Nothing to do, e.g. if all TUs were reused from the incremental
+      // cache; the caller is responsible for reporting an empty compdb.
+      shutdownIdleWorkers();
+      return;
+    }
 
     // NOTE(def: scheduling-invariant):
     // Jobs are refilled into the pending jobs list before WIP jobs are
@@ -813,6 +1143,12 @@ public:
             "all workers should be stopped after jobs have been completed");
   }
 
+  /// Returns false if the worker was terminated after \p jobId was
+  /// assigned to it.
+  bool isProcessing(WorkerId workerId, JobId jobId) const {
+    return this->workers[workerId].currentlyProcessing == jobId;
+  }
+
   /// This method should only be called after completing all work, since the
   /// result value may decrease with time. See NOTE(ref: mail-from-the-dead)
   size_t numErroredJobs() const {
@@ -883,6 +1219,430 @@ private:
   }
 };
 
+struct TuShards {
+  uint32_t taskId;
+  ShardPaths paths;
+  /// Number of external symbols which other workers may have omitted
+  /// from their shards because they're present in these shards.
+  ///
+  /// See NOTE(ref: external-symbol-dedup).
+  size_t reportedExternalSymbolCount;
+};
+
+/// Output for TUs which was accumulated by a worker, but not yet
+/// written to merged shards, along with the journal copies of the
+/// output for each TU, which are used if the worker exits early.
+///
+/// See NOTE(ref: worker-premerge).
+struct PendingPremerge {
+  std::vector<TuShards> journalShards;
+
+  size_t numTus() const {
+    return this->journalShards.size();
+  }
+
+  /// Task ID used to order merged shards containing the output held on
+  /// to, along with the output for \p taskId (if any).
+  uint32_t firstTaskId(std::optional<uint32_t> taskId = std::nullopt) const {
+    ENFORCE(taskId.has_value() || !this->journalShards.empty());
+    auto first = taskId.value_or(this->journalShards.front().taskId);
+    for (auto &tuShards : this->journalShards) {
+      first = std::min(first, tuShards.taskId);
+    }
+    return first;
+  }
+};
+
+/// Append-only log of hashes which are sent to workers incrementally,
+/// along with how much of the log has been sent to each worker.
+///
+/// Used for external symbols which are known to be present in some shard
+/// (see NOTE(ref: external-symbol-dedup)), and for files which have been
+/// assigned to some TU (see NOTE(ref: speculative-emission)).
+class HashLog final {
+  std::vector<HashValue> log;
+  absl::flat_hash_set<HashValue> seen;
+  // Index of the first entry in log not yet sent to a worker.
+  std::vector<size_t> cursors;
+
+public:
+  HashLog() = default;
+  HashLog(const HashLog &) = delete;
+  HashLog &operator=(const HashLog &) = delete;
+
+  void record(std::vector<HashValue> &&hashes) {
+    for (auto &hash : hashes) {
+      if (this->seen.insert(hash).second) {
+        this->log.push_back(hash);
+      }
+    }
+  }
+
+  /// Workers forget all hashes at the end of a run in serve mode.
+  void clear() {
+    this->log.clear();
+    this->seen.clear();
+    absl::c_fill(this->cursors, 0);
+  }
+
+  /// Should be called whenever a worker is (re)spawned, since a new
+  /// worker process doesn't know about any hashes sent earlier.
+  void resetCursor(WorkerId workerId) {
+    if (this->cursors.size() <= workerId) {
+      this->cursors.resize(workerId + 1, 0);
+    }
+    this->cursors[workerId] = 0;
+  }
+
+  /// Returns at most \p maxCount hashes which have not yet been sent to
+  /// \p workerId. The remaining hashes are sent with later jobs.
+  std::vector<HashValue> takeUnsent(WorkerId workerId, size_t maxCount) {
+    ENFORCE(workerId < this->cursors.size());
+    auto &cursor = this->cursors[workerId];
+    auto end = std::min(this->log.size(), cursor + maxCount);
+    std::vector<HashValue> unsent{this->log.begin() + cursor,
+                                  this->log.begin() + end};
+    cursor = end;
+    return unsent;
+  }
+};
+
+/// Compresses \p data as a single gzip member.
+///
+/// A sequence of gzip members is a valid gzip stream which decompresses
+/// to the concatenation of the members, so blocks can be compressed
+/// independently (and in parallel).
+std::string gzipCompress(std::string_view data) {
+  z_stream stream{};
+  int status = ::deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                              /*windowBits + gzip wrapper*/ 15 + 16,
+                              /*memLevel*/ 8, Z_DEFAULT_STRATEGY);
+  ENFORCE(status == Z_OK, "failed to initialize zlib");
+  std::string out(::deflateBound(&stream, uLong(data.size())), '\0');
+  stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+  stream.avail_in = uInt(data.size());
+  stream.next_out = reinterpret_cast<Bytef *>(out.data());
+  stream.avail_out = uInt(out.size());
+  status = ::deflate(&stream, Z_FINISH);
+  ENFORCE(status == Z_STREAM_END, "deflateBound underestimated output size");
+  out.resize(stream.total_out);
+  ::deflateEnd(&stream);
+  return out;
+}
+
+/// See NOTE(ref: split-index-output)
+///
+/// Writes the final index to one or more files, optionally splitting it
+/// by owning package (based on the package map) and/or by size. Every file
+/// starts with a copy of the metadata, so each one is a valid SCIP index
+/// by itself, and files can be uploaded or processed independently.
+///
+/// Serialized fragments are buffered per file and flushed on a separate
+/// thread pool, so different files are written concurrently, while the
+/// writes for any single file happen in submission order.
+///
+/// If compression is enabled, each flushed block is compressed as
+/// a separate gzip member on another thread pool. Block boundaries only
+/// depend on the sequence of fragments, so the output is byte-identical
+/// across runs (and thread counts) under --deterministic.
+class IndexOutputFiles final : public scip::IndexOutput {
+  using Block = std::shared_ptr<const std::string>;
+
+  struct OutputFile {
+    std::string path;
+    int fd;
+    std::string pending;
+    uint64_t size;
+    std::shared_future<void> lastFlush;
+    // Set by the flushing thread; only read once lastFlush is ready.
+    int writeErrno;
+  };
+
+  struct Group {
+    // Suffix added to the file name; empty for the project's own group.
+    std::string suffix;
+    uint32_t fileCount;
+    std::unique_ptr<OutputFile> current;
+  };
+
+  const AbsolutePath &basePath;
+  // See NOTE(ref: index-output-stream)
+  std::optional<int> streamFd;
+  const std::string &metadataBytes;
+  RootPath projectRootPath;
+  std::unique_ptr<PackageMap> packageMap;
+  std::string mainPackageName;
+  uint64_t maxFileSizeBytes;
+  std::vector<Group> groups;
+  absl::flat_hash_map<std::string, uint32_t> groupIds;
+  std::vector<std::unique_ptr<OutputFile>> closedFiles;
+  bool compress;
+  llvm::DefaultThreadPool compressionPool;
+  llvm::DefaultThreadPool ioPool;
+  // Pending writes across all files, to bound the number of blocks
+  // held in memory.
+  std::deque<std::shared_future<void>> inFlight;
+  size_t maxInFlight;
+
+  static constexpr size_t flushThresholdBytes = 4 * 1024 * 1024;
+
+public:
+  /// If \p streamFd is set, the main file is written to it instead of
+  /// \p basePath, and the file descriptor is closed by \c finish.
+  /// \p packageMapPath is ignored if \p splitByPackage is false.
+  /// \p maxFileSizeBytes = 0 means that there is no size limit;
+  /// the limit applies to the uncompressed size.
+  IndexOutputFiles(const AbsolutePath &basePath, std::optional<int> streamFd,
+                   const std::string &metadataBytes,
+                   const RootPath &projectRootPath, bool splitByPackage,
+                   const AbsolutePath &packageMapPath, bool isTesting,
+                   uint64_t maxFileSizeBytes, bool compress,
+                   unsigned numThreads)
+      : basePath(basePath), streamFd(streamFd), metadataBytes(metadataBytes),
+        projectRootPath(projectRootPath), packageMap(), mainPackageName(),
+        maxFileSizeBytes(maxFileSizeBytes), groups(), groupIds(),
+        closedFiles(), compress(compress),
+        compressionPool(llvm::hardware_concurrency(compress ? numThreads : 1)),
+        ioPool(llvm::hardware_concurrency(4)), inFlight(),
+        maxInFlight(2 * size_t(std::max(numThreads, 1u)) + 4) {
+    this->groups.push_back(Group{"", 0, nullptr});
+    if (!splitByPackage) {
+      return;
+    }
+    if (packageMapPath.asStringRef().empty()) {
+      spdlog::warn("--split-index-by-package has no effect without "
+                   "--package-map-path");
+      return;
+    }
+    this->packageMap = std::make_unique<PackageMap>(
+        projectRootPath, StdPath(packageMapPath.asStringRef()), isTesting);
+    auto mainPackage = this->packageMap->lookup(projectRootPath.asRef());
+    if (mainPackage.has_value()) {
+      this->mainPackageName = std::string(mainPackage->id.name);
+    }
+  }
+  IndexOutputFiles(const IndexOutputFiles &) = delete;
+  IndexOutputFiles &operator=(const IndexOutputFiles &) = delete;
+
+  uint32_t partForDocument(std::string_view relativePath) override {
+    if (!this->packageMap) {
+      return 0;
+    }
+    auto absPath = this->projectRootPath.makeAbsolute(
+        RootRelativePathRef(relativePath, RootKind::Project));
+    auto optPackage = this->packageMap->lookup(absPath.asRef());
+    if (!optPackage.has_value() || optPackage->isMainPackage) {
+      return 0;
+    }
+    return this->groupFor(optPackage->id.name);
+  }
+
+  uint32_t partForExternalSymbol(std::string_view symbol) override {
+    if (!this->packageMap) {
+      return 0;
+    }
+    // See SymbolBuilder::formatTo: symbols look like
+    // 'cxx . <package name> <version>$ <descriptors>', where spaces
+    // in the package name are escaped by doubling them.
+    std::string_view prefix = "cxx . ";
+    if (!symbol.starts_with(prefix)) {
+      return 0;
+    }
+    auto rest = symbol.substr(prefix.size());
+    std::string name;
+    for (size_t i = 0; i < rest.size(); ++i) {
+      if (rest[i] == ' ') {
+        if (i + 1 < rest.size() && rest[i + 1] == ' ') {
+          name.push_back(' ');
+          ++i;
+          continue;
+        }
+        break;
+      }
+      name.push_back(rest[i]);
+    }
+    if (name.empty() || name == "." || name == this->mainPackageName) {
+      return 0;
+    }
+    return this->groupFor(name);
+  }
+
+  void write(uint32_t part, std::string_view serializedIndex) override {
+    auto &group = this->groups[part];
+    if (group.current && this->maxFileSizeBytes != 0
+        && group.current->size > this->metadataBytes.size()
+        && group.current->size + serializedIndex.size()
+               > this->maxFileSizeBytes) {
+      this->close(std::move(group.current));
+    }
+    if (!group.current) {
+      group.current = this->open(group);
+    }
+    auto &file = *group.current;
+    file.pending.append(serializedIndex);
+    file.size += serializedIndex.size();
+    if (file.pending.size() >= flushThresholdBytes) {
+      this->flush(file);
+    }
+  }
+
+  /// Flushes and closes all files, adding the paths which were written
+  /// to \p paths. Returns an error message for the first file which
+  /// could not be written.
+  std::optional<std::string> finish(std::vector<std::string> &paths) {
+    if (this->groups[0].fileCount == 0) {
+      // Always write the main file, even if it only has metadata.
+      this->groups[0].current = this->open(this->groups[0]);
+    }
+    for (auto &group : this->groups) {
+      if (group.current) {
+        this->close(std::move(group.current));
+      }
+    }
+    this->ioPool.wait();
+    this->inFlight.clear();
+    std::optional<std::string> firstError{};
+    for (auto &file : this->closedFiles) {
+      int error = file->writeErrno;
+      if (file->fd >= 0 && ::close(file->fd) != 0 && error == 0) {
+        error = errno;
+      }
+      if (error != 0) {
+        if (!firstError) {
+          firstError = fmt::format("failed to write index to '{}' ({})",
+                                   file->path, std::strerror(error));
+        }
+        continue;
+      }
+      paths.push_back(std::move(file->path));
+    }
+    this->closedFiles.clear();
+    return firstError;
+  }
+
+private:
+  uint32_t groupFor(std::string_view packageName) {
+    auto [it, inserted] = this->groupIds.emplace(
+        std::string(packageName), uint32_t(this->groups.size()));
+    if (inserted) {
+      std::string suffix{};
+      for (auto c : packageName) {
+        bool ok = ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z')
+                  || ('0' <= c && c <= '9') || c == '.' || c == '_'
+                  || c == '-';
+        suffix.push_back(ok ? c : '_');
+      }
+      this->groups.push_back(Group{std::move(suffix), 0, nullptr});
+    }
+    return it->second;
+  }
+
+  std::unique_ptr<OutputFile> open(Group &group) {
+    auto file = std::make_unique<OutputFile>();
+    file->fd = -1;
+    file->writeErrno = 0;
+    file->pending = this->metadataBytes;
+    file->size = this->metadataBytes.size();
+    if (group.suffix.empty() && group.fileCount == 0 && this->streamFd) {
+      group.fileCount++;
+      file->path = fmt::format("<fd {}>", *this->streamFd);
+      file->fd = *this->streamFd;
+      return file;
+    }
+    std::string path{};
+    if (group.suffix.empty() && group.fileCount == 0) {
+      path = this->basePath.asStringRef();
+    } else {
+      StdPath stdPath{this->basePath.asStringRef()};
+      // Split off all extensions, so that index.scip.gz becomes
+      // index-<suffix>.scip.gz and not index.scip-<suffix>.gz
+      auto fileName = stdPath.filename().string();
+      auto dotIndex = fileName.find('.', 1);
+      std::string extensions{};
+      if (dotIndex != std::string::npos) {
+        extensions = fileName.substr(dotIndex);
+        fileName.resize(dotIndex);
+      }
+      if (!group.suffix.empty()) {
+        fileName += fmt::format("-{}", group.suffix);
+      }
+      if (group.fileCount != 0) {
+        fileName += fmt::format("-{}", group.fileCount);
+      }
+      fileName += extensions;
+      path = (stdPath.parent_path() / fileName).string();
+    }
+    group.fileCount++;
+    file->path = std::move(path);
+    file->fd = ::open(file->path.c_str(),
+                      O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (file->fd < 0) {
+      // Reported by finish; later writes to the file are skipped.
+      file->writeErrno = errno;
+    }
+    return file;
+  }
+
+  void flush(OutputFile &file) {
+    if (file.pending.empty()) {
+      return;
+    }
+    while (this->inFlight.size() >= this->maxInFlight) {
+      this->inFlight.front().wait();
+      this->inFlight.pop_front();
+    }
+    Block chunk = std::make_shared<std::string>(std::move(file.pending));
+    file.pending = std::string();
+    std::shared_future<Block> block;
+    if (this->compress) {
+      block = this->compressionPool.async([chunk]() -> Block {
+        TRACE_EVENT(tracing::indexIo, "IndexOutputFiles::compress", "size",
+                    chunk->size());
+        return std::make_shared<std::string>(gzipCompress(*chunk));
+      });
+    } else {
+      std::promise<Block> ready;
+      ready.set_value(std::move(chunk));
+      block = ready.get_future().share();
+    }
+    // The I/O pool runs tasks in FIFO order, so waiting for the previous
+    // write to the same file (submitted earlier) cannot deadlock.
+    auto previous = file.lastFlush;
+    auto *filePtr = &file;
+    file.lastFlush = this->ioPool.async([filePtr, previous, block]() -> void {
+      if (previous.valid()) {
+        previous.wait();
+      }
+      auto &data = *block.get();
+      TRACE_EVENT(tracing::indexIo, "IndexOutputFiles::flush", "size",
+                  data.size());
+      if (filePtr->writeErrno != 0) {
+        return;
+      }
+      // Plain sequential writes, so that pipes work too.
+      size_t written = 0;
+      while (written < data.size()) {
+        auto n = ::write(filePtr->fd, data.data() + written,
+                         data.size() - written);
+        if (n < 0) {
+          if (errno == EINTR) {
+            continue;
+          }
+          filePtr->writeErrno = errno;
+          return;
+        }
+        written += size_t(n);
+      }
+    });
+    this->inFlight.push_back(file.lastFlush);
+  }
+
+  void close(std::unique_ptr<OutputFile> &&file) {
+    this->flush(*file);
+    this->closedFiles.push_back(std::move(file));
+  }
+};
+
 /// Type responsible for administrative tasks like timeouts, progressively
 /// queueing jobs and terminating misbehaving workers.
 class Driver {
@@ -893,10 +1653,88 @@ class Driver {
   FileIndexingPlanner planner;
 
   std::vector<std::pair<JobId, IndexingStatistics>> allStatistics;
-  std::vector<ShardPaths> shardPaths;
-
-  /// Total number of commands in the compilation database.
-  size_t compdbCommandCount = 0;
+  std::vector<TuShards> shardPaths;
+  HashLog externalSymbolLog;
+  /// Keys (see PreprocessedFileInfo::key) for files assigned to some TU.
+  /// Only populated with --speculative-emission.
+  HashLog claimedFileLog;
+  /// Indexed by WorkerId.
+  std::vector<PendingPremerge> pendingPremerges;
+  /// End of the last shard reported in each shard log or premerge
+  /// journal, keyed by path. Not cleared between runs, since workers
+  /// (and their logs) outlive runs. See NOTE(ref: shard-log).
+  absl::flat_hash_map<std::string, uint64_t> reportedShardLogSizes;
+  /// Non-null iff --incremental-cache-dir was passed.
+  std::unique_ptr<IncrementalCache> incrementalCache;
+  /// Main file paths for TUs whose shards were reused, keyed by task ID.
+  absl::flat_hash_map<uint32_t, std::string> reusedTuPaths;
+  /// Non-null iff --shard-cache was passed.
+  std::unique_ptr<ShardCache> shardCache;
+  /// Shards found in the shard cache, for TUs whose EmitIndex job
+  /// hasn't completed yet, keyed by task ID.
+  absl::flat_hash_map<uint32_t, ShardPaths> cachedShards;
+  /// EmitIndex requests which are waiting for a shard cache lookup
+  /// before being sent. See NOTE(ref: shard-cache).
+  struct PendingCacheLookup {
+    WorkerId workerId;
+    IndexJobRequest request;
+    ShardCache::PendingLookup lookup;
+  };
+  std::vector<PendingCacheLookup> pendingCacheLookups;
+  /// Non-null iff --include-graph-path was passed.
+  std::unique_ptr<IncludeGraph> includeGraph;
+  /// Keyed by task ID, for TUs whose semantic analysis result hasn't
+  /// been received yet.
+  absl::flat_hash_map<uint32_t, PlannedTu> plannedTus;
+  /// Task IDs of the planned TUs to which files are tentatively assigned,
+  /// keyed by PreprocessedFileInfo::key(). See NOTE(ref: previous-plan).
+  absl::flat_hash_map<HashValue, uint32_t> tentativeOwners;
+  /// EmitIndex requests which are waiting for tentative assignments to
+  /// be confirmed or released before being sent, keyed by task ID.
+  /// See NOTE(ref: previous-plan).
+  struct HeldEmitIndexRequest {
+    WorkerId workerId;
+    IndexJobRequest request;
+    /// Whether the worker already has the files to be indexed.
+    bool filesAlreadySent;
+    size_t numFilesReceived;
+    /// Keys of tentatively assigned files which may still be released
+    /// to this TU.
+    absl::flat_hash_set<HashValue> waitingFor;
+  };
+  absl::flat_hash_map<uint32_t, HeldEmitIndexRequest> heldEmitIndexRequests;
+  /// Task IDs for held EmitIndex requests waiting for each file,
+  /// in the order in which they started waiting.
+  absl::flat_hash_map<HashValue, std::vector<uint32_t>> fileWaiters;
+  /// Whether the shards which can be reused have been identified for
+  /// all commands. See NOTE(ref: incremental-indexing).
+  bool decidedReuse = false;
+  /// Commands which need to be indexed; only used with
+  /// --incremental-cache-dir, once \c decidedReuse is set.
+  std::deque<compdb::CommandObject> commandsToIndex;
+
+  /// Total number of commands in the compilation database; an estimate
+  /// until the background scan is done. See NOTE(ref: compdb-scan).
+  compdb::CommandCount compdbCommandCount{0, false};
+  /// Number of commands obtained from the parser so far, which excludes
+  /// skipped commands.
+  size_t processedCommandCount = 0;
+  /// Number of TUs sent to workers with a plan from the previous run,
+  /// and the number of those for which the plan matched.
+  size_t plannedTuCount = 0;
+  size_t matchedPlanCount = 0;
+  /// Number of documents emitted speculatively by workers for files
+  /// which were assigned to other TUs.
+  size_t droppedDocumentCount = 0;
+  /// Number of external symbols which may be missing documentation, as
+  /// the shards which other workers relied on could not be read.
+  /// See NOTE(ref: external-symbol-dedup).
+  size_t lostExternalSymbolCount = 0;
+  /// Time spent by workers on TUs which completed, split into the time
+  /// spent waiting for the EmitIndex request after semantic analysis,
+  /// and the rest. See NOTE(ref: speculative-emission).
+  uint64_t workerWaitMicros = 0;
+  uint64_t workerBusyMicros = 0;
   TusIndexedCount indexedSoFar;
   compdb::ResumableParser compdbParser;
 
@@ -906,7 +1744,12 @@ public:
 
   Driver(std::string driverId, DriverOptions &&options)
       : options(std::move(options)), id(driverId), scheduler(),
-        planner(this->options.projectRootPath), shardPaths(), compdbParser() {
+        planner(this->options.projectRootPath), shardPaths(),
+        externalSymbolLog(), claimedFileLog(), pendingPremerges(),
+        reportedShardLogSizes(), incrementalCache(), reusedTuPaths(),
+        shardCache(), cachedShards(), pendingCacheLookups(), includeGraph(),
+        plannedTus(), tentativeOwners(), heldEmitIndexRequests(), fileWaiters(),
+        commandsToIndex(), compdbParser() {
     MessageQueues::deleteIfPresent(this->id, this->numWorkers());
     this->queues = MessageQueues(this->id, this->numWorkers(),
                                  options.ipcOptions.ipcSizeHintBytes);
@@ -914,6 +1757,10 @@ public:
     ENFORCE(numSendQueues > 0);
     ENFORCE(numSendQueues <= this->options.numWorkers);
     this->options.numWorkers = numSendQueues;
+    if (!this->options.toolchainCachePath.asStringRef().empty()) {
+      this->compdbParser.useToolchainCache(
+          this->options.toolchainCachePath.asStringRef());
+    }
   }
   ~Driver() {
     if (this->options.deleteTemporaryOutputDir) {
@@ -926,6 +1773,58 @@ public:
     }
   }
 
+  /// See NOTE(ref: serve-mode).
+  std::optional<std::string> setRequest(const ServeRequest &request) {
+    return this->options.setRequestPaths(request);
+  }
+
+  /// Clears the state for the previous request, keeping workers alive.
+  ///
+  /// See NOTE(ref: serve-mode).
+  void resetForNextRun() {
+    this->planner.clear();
+    this->allStatistics.clear();
+    this->shardPaths.clear();
+    this->externalSymbolLog.clear();
+    this->claimedFileLog.clear();
+    absl::c_fill(this->pendingPremerges, PendingPremerge{});
+    this->incrementalCache.reset();
+    this->reusedTuPaths.clear();
+    this->shardCache.reset();
+    this->cachedShards.clear();
+    this->pendingCacheLookups.clear();
+    this->includeGraph.reset();
+    this->plannedTus.clear();
+    this->tentativeOwners.clear();
+    this->heldEmitIndexRequests.clear();
+    this->fileWaiters.clear();
+    this->decidedReuse = false;
+    this->commandsToIndex.clear();
+    this->compdbCommandCount = compdb::CommandCount{0, false};
+    this->processedCommandCount = 0;
+    this->plannedTuCount = 0;
+    this->matchedPlanCount = 0;
+    this->droppedDocumentCount = 0;
+    this->lostExternalSymbolCount = 0;
+    this->workerWaitMicros = 0;
+    this->workerBusyMicros = 0;
+    this->indexedSoFar = TusIndexedCount{};
+    this->scheduler.resetForNextRun(
+        [&](WorkerId workerId) -> Scheduler::Process {
+          return this->spawnWorker(workerId);
+        });
+    if (!this->options.deleteTemporaryOutputDir) {
+      return;
+    }
+    // Shards from the previous run have been merged already.
+    std::error_code error;
+    for (auto &entry : std::filesystem::directory_iterator(
+             this->options.temporaryOutputDir, error)) {
+      std::error_code entryError;
+      std::filesystem::remove_all(entry.path(), entryError);
+    }
+  }
+
   void emitStatsFile() {
     if (this->options.statsFilePath.asStringRef().empty()) {
       return;
@@ -954,18 +1853,19 @@ public:
                         this->options.statsFilePath.asStringRef());
   }
 
-  void run() {
+  /// Returns an error message if indexing failed, in which case no index
+  /// is emitted. Call \c resetForNextRun before running again.
+  std::optional<std::string> run() {
     ManualTimer total, indexing, merging;
     std::pair<TusIndexedCount, size_t> numTus;
+    scip::MergeStatistics mergeStats{};
+    std::optional<std::string> error{};
 
-    TIME_IT(total, {
-      auto compdbGuard = this->openCompilationDatabase();
-      this->spawnWorkers(compdbGuard);
-      TIME_IT(indexing,
-              numTus = this->runJobsTillCompletionAndShutdownWorkers());
-      TIME_IT(merging, this->emitScipIndex());
-      spdlog::debug("indexing complete; driver shutting down now, kthxbai");
-    });
+    TIME_IT(total,
+            error = this->indexAndEmit(indexing, merging, numTus, mergeStats));
+    if (error) {
+      return error;
+    }
     this->emitStatsFile();
 
     using secs = std::chrono::seconds;
@@ -973,42 +1873,172 @@ public:
                "{:.1f}s, merging: {:.1f}s, num errored TUs: {}).\n",
                numTus.first.value, total.value<secs>(), indexing.value<secs>(),
                merging.value<secs>(), numTus.second);
+    if (this->incrementalCache) {
+      fmt::print("Reused partial indexes for {} unchanged translation units "
+                 "from the incremental cache.\n",
+                 this->incrementalCache->numReused());
+    }
+    if (this->shardCache) {
+      fmt::print("Shard cache: {} hits, {} misses.\n",
+                 this->shardCache->numHits(), this->shardCache->numMisses());
+    }
+    if (this->options.reusePreviousPlan) {
+      fmt::print("Reused the previous plan for {} of {} planned translation "
+                 "units.\n",
+                 this->matchedPlanCount, this->plannedTuCount);
+    }
+    if (this->options.speculativeEmission) {
+      fmt::print("Speculative emission: dropped {} documents for files "
+                 "assigned to other translation units.\n",
+                 this->droppedDocumentCount);
+      // The other half of the trade-off described in
+      // NOTE(ref: speculative-emission).
+      fmt::print("Workers spent {:.1f}s indexing, and {:.1f}s waiting for "
+                 "files to be assigned after semantic analysis.\n",
+                 double(this->workerBusyMicros) / 1'000'000.0,
+                 double(this->workerWaitMicros) / 1'000'000.0);
+    }
+    if (this->lostExternalSymbolCount != 0) {
+      fmt::print("Documentation for {} external symbols may be missing, as "
+                 "the shards containing them could not be read.\n",
+                 this->lostExternalSymbolCount);
+    }
+    if (!this->options.changedFilesPath.asStringRef().empty()) {
+      fmt::print("Skipped {} translation units unaffected by the changed "
+                 "files.\n",
+                 this->includeGraph->numSkipped());
+    }
     auto parseStats = this->compdbParser.stats;
     auto totalSkipped = parseStats.skippedNonExistentTuFile
-                        + parseStats.skippedNonTuFileExtension;
+                        + parseStats.skippedNonTuFileExtension
+                        + parseStats.skippedDuplicate;
     if (totalSkipped != 0) {
       fmt::print("Skipped: {} compilation database entries (non main file "
-                 "extension: {}, not found on disk: {}).\n",
+                 "extension: {}, not found on disk: {}, duplicate: {}).\n",
                  totalSkipped, parseStats.skippedNonTuFileExtension,
-                 parseStats.skippedNonExistentTuFile);
+                 parseStats.skippedNonExistentTuFile,
+                 parseStats.skippedDuplicate);
     }
+    if (mergeStats.skippedDuplicateVariants != 0) {
+      fmt::print("Skipped merging {} of {} variants of multiply-indexed files "
+                 "due to identical contents.\n",
+                 mergeStats.skippedDuplicateVariants,
+                 mergeStats.multiplyIndexedVariants);
+    }
+    return {};
   }
 
 private:
-  void emitScipIndex() {
-    auto &indexScipPath = this->options.indexOutputPath;
-    std::ofstream outputStream(indexScipPath.asStringRef(),
-                               std::ios_base::out | std::ios_base::binary
-                                   | std::ios_base::trunc);
-    if (outputStream.fail()) {
-      spdlog::error("failed to open '{}' for writing index ({})",
-                    indexScipPath.asStringRef(), std::strerror(errno));
-      std::exit(EXIT_FAILURE);
+  std::optional<std::string>
+  indexAndEmit(ManualTimer &indexing, ManualTimer &merging,
+               std::pair<TusIndexedCount, size_t> &numTus,
+               scip::MergeStatistics &mergeStats) {
+    compdb::File compdbFile{};
+    auto error = this->openCompilationDatabase(compdbFile);
+    if (error) {
+      return error;
+    }
+    FileGuard compdbGuard(compdbFile.file);
+    if (!this->options.incrementalCacheDir.empty()) {
+      this->incrementalCache = std::make_unique<IncrementalCache>(
+          this->options.incrementalCacheDir,
+          this->cacheConfigDigest(/*includeProjectRoot*/ true));
+    }
+    if (!this->options.shardCacheLocation.empty()) {
+      std::string cacheError{};
+      this->shardCache = ShardCache::open(
+          this->options.shardCacheLocation,
+          this->options.temporaryOutputDir / "shard-cache",
+          this->cacheConfigDigest(/*includeProjectRoot*/ false),
+          this->options.projectRootPath, cacheError);
+      if (!this->shardCache) {
+        return cacheError;
+      }
+    }
+    if (!this->options.includeGraphPath.asStringRef().empty()) {
+      this->includeGraph = std::make_unique<IncludeGraph>(
+          this->options.includeGraphPath, this->options.changedFilesPath);
+      error = this->includeGraph->load(this->options.changedFilesPath,
+                                       this->options.reusePreviousPlan,
+                                       this->options.projectRootPath);
+      if (error) {
+        return error;
+      }
+    }
+    auto headerCacheCutoff = std::filesystem::file_time_type::clock::now();
+    if (!this->scheduler.hasWorkers()) {
+      error = this->prepareHeaderCacheDir();
+      if (error) {
+        return error;
+      }
+      this->spawnWorkers(compdbGuard);
+    }
+    TIME_IT(indexing,
+            error = this->runJobsTillCompletionAndShutdownWorkers(numTus));
+    if (error) {
+      return error;
+    }
+    this->compdbParser.saveToolchainCache();
+    TIME_IT(merging, error = this->emitScipIndex(mergeStats));
+    if (error) {
+      return error;
+    }
+    if (this->incrementalCache) {
+      this->incrementalCache->save();
+    }
+    if (this->includeGraph) {
+      this->includeGraph->save();
+    }
+    if (!this->options.headerCacheDir.empty()) {
+      HeaderDocumentCache::removeUnusedEntries(this->options.headerCacheDir,
+                                               headerCacheCutoff);
     }
+    if (this->shardCache) {
+      // Uploads read from the temporary output directory,
+      // which is deleted when the driver is destroyed.
+      this->shardCache->wait();
+    }
+    spdlog::debug("indexing complete; driver shutting down now, kthxbai");
+    return {};
+  }
+
+  std::optional<std::string> emitScipIndex(scip::MergeStatistics &stats) {
+    auto metadataBytes = this->serializedMetadata();
+    // Most serialized documents are small, so IndexOutputFiles buffers
+    // fragments to avoid making a write syscall per document.
+    IndexOutputFiles output{this->options.indexOutputPath,
+                            this->options.indexOutputFd,
+                            metadataBytes,
+                            this->options.projectRootPath,
+                            this->options.splitIndexByPackage,
+                            this->options.packageMapPath,
+                            this->options.isTesting,
+                            this->options.indexOutputMaxSizeBytes,
+                            this->options.compressIndexOutput,
+                            unsigned(this->numWorkers())};
 
     if (this->options.deterministic) {
       // Sorting before merging so that mergeShards can be const
       absl::c_sort(this->shardPaths,
-                   [](const auto &paths1, const auto &paths2) -> bool {
-                     return paths1.docsAndExternals < paths2.docsAndExternals;
+                   [](const auto &shards1, const auto &shards2) -> bool {
+                     return shards1.taskId < shards2.taskId;
                    });
     }
-    this->mergeShardsAndEmit(outputStream);
+    stats = this->mergeShardsAndEmit(output, this->lostExternalSymbolCount);
+    std::vector<std::string> paths{};
+    auto error = output.finish(paths);
+    if (error) {
+      return error;
+    }
+    if (paths.size() > 1) {
+      spdlog::info("wrote index to {} files: {}", paths.size(),
+                   fmt::join(paths, ", "));
+    }
+    return {};
   }
 
   bool
-  isMultiplyIndexedApproximate(const std::string &relativePath,
-                               AbsolutePathRef shardPath,
+  isMultiplyIndexedApproximate(const std::string &relativePath, uint32_t taskId,
                                absl::flat_hash_set<uint32_t> &badJobIds) const {
     auto multiplyIndexed = this->planner.isMultiplyIndexed(
         RootRelativePathRef{relativePath, RootKind::Project});
@@ -1021,12 +2051,7 @@ private:
       isMultiplyIndexed = false;
       break;
     case FileIndexingPlanner::MultiplyIndexed::Unknown: {
-      if (auto optFileName = shardPath.fileName()) {
-        if (auto optJobId = ShardPaths::tryParseJobId(*optFileName)) {
-          auto jobId = optJobId.value();
-          badJobIds.insert(jobId);
-        }
-      }
+      badJobIds.insert(taskId);
       // Be conservative here
       isMultiplyIndexed = true;
     }
@@ -1034,9 +2059,7 @@ private:
     return isMultiplyIndexed;
   }
 
-  void mergeShardsAndEmit(std::ofstream &outputStream) const {
-    LogTimerRAII timer("index merging");
-
+  std::string serializedMetadata() const {
     scip::ToolInfo toolInfo;
     toolInfo.set_name("scip-clang");
     toolInfo.set_version(scip_clang::version);
@@ -1054,7 +2077,15 @@ private:
 
     scip::Index metadataFragment{};
     *metadataFragment.mutable_metadata() = std::move(metadata);
-    metadataFragment.SerializeToOstream(&outputStream);
+    return metadataFragment.SerializeAsString();
+  }
+
+  /// Adds the number of external symbols which may be missing
+  /// documentation due to unreadable shards to \p lostExternalSymbolCount.
+  scip::MergeStatistics
+  mergeShardsAndEmit(scip::IndexOutput &output,
+                     size_t &lostExternalSymbolCount) const {
+    LogTimerRAII timer("index merging");
 
     // TODO(def: faster-index-merging): Right now, the index merging
     // implementation has the overhead of serializing + deserializing all data
@@ -1067,26 +2098,12 @@ private:
     // about external symbols). However, that is more finicky to do,
     // so we should measure the overhead before doing that.
     //
-    // The implementation is also fully serial to avoid introducing
-    // a dependency on a library with a concurrent hash table.
-
-    auto readIndexShard = [](const AbsolutePath &path,
-                             auto &indexShard) -> bool {
-      TRACE_EVENT(tracing::indexIo, "(lambda readIndexShard)");
-      auto &shardPath = path.asStringRef();
-      std::ifstream inputStream(shardPath,
-                                std::ios_base::in | std::ios_base::binary);
-      if (inputStream.fail()) {
-        spdlog::warn("failed to open shard at '{}' ({})", shardPath,
-                     std::strerror(errno));
-        return false;
-      }
-      if (!indexShard.ParseFromIstream(&inputStream)) {
-        spdlog::warn("failed to parse shard at '{}'", shardPath);
-        return false;
-      }
-      return true;
-    };
+    // Merging is fully serial to avoid introducing a dependency on a
+    // library with a concurrent hash table. However, finishing and
+    // serializing the merged documents is done in parallel, since that
+    // doesn't need any shared mutable state.
+
+    ShardReader shardReader{};
 
     absl::flat_hash_set<uint32_t> badJobIds{};
 
@@ -1094,36 +2111,76 @@ private:
     llvm::UniqueStringSaver stringSaver{allocator};
     scip::SymbolNameInterner interner{stringSaver};
     scip::IndexBuilder builder{interner};
+    bool twoPass = this->options.mergeMemoryBudgetBytes > 0;
+    if (twoPass) {
+      builder.enableTwoPassMerge(
+          this->options.mergeMemoryBudgetBytes,
+          (this->options.temporaryOutputDir / "merge.spill").string());
+    }
     {
       ProgressReporter progressReporter(this->options.showProgress,
                                         "Merged partial index for",
                                         this->shardPaths.size());
       size_t count = 1;
-      for (auto &paths : this->shardPaths) {
-        scip::Index indexShard;
-        if (!readIndexShard(paths.docsAndExternals, indexShard)) {
+      std::vector<scip::SymbolNameRef> docSymbols{};
+      for (auto &[taskId, paths, reportedExternalSymbolCount] :
+           this->shardPaths) {
+        scip::IndexShard indexShard;
+        bool readShard = shardReader.read(
+            paths.docsAndExternals, paths.docsAndExternalsRange, indexShard);
+        // See NOTE(ref: shard-symbol-table)
+        std::optional<scip::ShardSymbolTable> symbolTable{};
+        if (readShard) {
+          symbolTable.emplace(indexShard);
+          if (symbolTable->isMalformed()) {
+            spdlog::error("skipping shard for '{}' at '{}' as it has a "
+                          "malformed symbol table",
+                          this->getTuPath(taskId),
+                          paths.docsAndExternals.asStringRef());
+          }
+        }
+        if (!readShard || symbolTable->isMalformed()) {
+          if (reportedExternalSymbolCount != 0) {
+            // See NOTE(ref: external-symbol-dedup)
+            spdlog::error(
+                "documentation for {} external symbols may be missing from "
+                "the index, as other workers omitted them in favor of the "
+                "unreadable shard for '{}'",
+                reportedExternalSymbolCount, this->getTuPath(taskId));
+            lostExternalSymbolCount += reportedExternalSymbolCount;
+          }
           continue;
         }
-        for (auto &doc : *indexShard.mutable_documents()) {
+        builder.addDocumentationTable(
+            std::move(*indexShard.mutable_documentation_table()));
+        bool hasDigests =
+            indexShard.document_digests_size() == indexShard.documents_size();
+        for (int i = 0; i < indexShard.documents_size(); ++i) {
+          auto &doc = *indexShard.mutable_documents(i);
           bool isMultiplyIndexed = this->isMultiplyIndexedApproximate(
-              doc.relative_path(), paths.docsAndExternals.asRef(), badJobIds);
-          builder.addDocument(std::move(doc), isMultiplyIndexed);
+              doc.relative_path(), taskId, badJobIds);
+          std::optional<uint64_t> contentDigest{};
+          if (hasDigests) {
+            contentDigest = indexShard.document_digests(i);
+          }
+          if (isMultiplyIndexed) {
+            symbolTable->intern(i, interner, docSymbols);
+          } else {
+            docSymbols.clear();
+            symbolTable->restore(i, doc);
+          }
+          builder.addDocument(std::move(doc), isMultiplyIndexed, contentDigest,
+                              docSymbols);
         }
-        // See NOTE(ref: precondition-deterministic-ext-symbol-docs); in
-        // deterministic mode, indexes should be the same, and iterated over in
-        // sorted order. So if external symbol emission in each part is
-        // deterministic, addExternalSymbol will be called in deterministic
-        // order.
+        // See NOTE(ref: order-independent-ext-symbol-docs); the
+        // documentation picked for external symbols doesn't depend on the
+        // order of calls to addExternalSymbol, and relationships are sorted
+        // in deterministic mode.
         for (auto &extSym : *indexShard.mutable_external_symbols()) {
           builder.addExternalSymbol(std::move(extSym));
         }
-        if (auto optFileName = paths.docsAndExternals.asRef().fileName()) {
-          if (auto optJobId = ShardPaths::tryParseJobId(optFileName.value())) {
-            progressReporter.report(
-                count,
-                this->scheduler.getTuPath(JobId::newTask(optJobId.value())));
-          }
-        }
+        progressReporter.report(
+            count, this->getTuPath(taskId));
         count++;
       }
     }
@@ -1145,20 +2202,63 @@ private:
 
     auto forwardDeclResolver = builder.populateForwardDeclResolver();
 
-    for (auto &paths : this->shardPaths) {
-      scip::ForwardDeclIndex indexShard;
-      if (!readIndexShard(paths.forwardDecls, indexShard)) {
-        continue;
-      }
+    // Reading and parsing shards is independent work, so do that in
+    // parallel.
+    // Adding forward declarations mutates shared state in an
+    // order-dependent way, so that stays serial, in the order of
+    // shardPaths (which is sorted in deterministic mode).
+    std::vector<const ShardPaths *> forwardDeclPaths{};
+    forwardDeclPaths.reserve(this->shardPaths.size());
+    for (auto &tuShards : this->shardPaths) {
+      forwardDeclPaths.push_back(&tuShards.paths);
+    }
+    ForwardDeclShardPrefetcher prefetcher{std::move(forwardDeclPaths),
+                                          unsigned(this->numWorkers())};
+    prefetcher.forEach([&](scip::ForwardDeclIndex &&indexShard) -> void {
       TRACE_EVENT(tracing::indexMerging, "addForwardDeclarations", "size",
                   indexShard.forward_decls_size());
+      builder.addDocumentationTable(
+          std::move(*indexShard.mutable_documentation_table()));
       for (auto &forwardDeclSym : *indexShard.mutable_forward_decls()) {
         builder.addForwardDeclaration(*forwardDeclResolver,
                                       std::move(forwardDeclSym));
       }
-    }
+    });
 
-    builder.finish(this->options.deterministic, outputStream);
+    if (!twoPass) {
+      builder.finish(this->options.deterministic, unsigned(this->numWorkers()),
+                     output);
+      return builder.statistics();
+    }
+    // See NOTE(ref: two-pass-merge)
+    builder.finishTwoPass(
+        this->options.deterministic, unsigned(this->numWorkers()),
+        [&](absl::FunctionRef<void(scip::Document &&)> sink) -> void {
+          TRACE_EVENT(tracing::indexMerging, "(lambda streamDocuments)");
+          absl::flat_hash_set<uint32_t> ignoredBadJobIds{};
+          for (auto &[taskId, paths, _] : this->shardPaths) {
+            scip::IndexShard indexShard;
+            if (!shardReader.read(paths.docsAndExternals,
+                                  paths.docsAndExternalsRange, indexShard)) {
+              continue;
+            }
+            scip::ShardSymbolTable symbolTable{indexShard};
+            if (symbolTable.isMalformed()) {
+              // Already reported in the first pass.
+              continue;
+            }
+            for (int i = 0; i < indexShard.documents_size(); ++i) {
+              auto &doc = *indexShard.mutable_documents(i);
+              if (!this->isMultiplyIndexedApproximate(
+                      doc.relative_path(), taskId, ignoredBadJobIds)) {
+                symbolTable.restore(i, doc);
+                sink(std::move(doc));
+              }
+            }
+          }
+        },
+        output);
+    return builder.statistics();
   }
 
   size_t numWorkers() const {
@@ -1185,13 +2285,448 @@ private:
     return 2 * this->numWorkers();
   }
 
+  /// Returns the number of jobs queued; 0 iff the compdb has been
+  /// fully consumed.
   size_t refillJobs() {
-    std::vector<compdb::CommandObject> commands{};
-    this->compdbParser.parseMore(commands);
+    size_t queued = 0;
+    // Keep going if all the parsed commands could be reused, since
+    // returning 0 signals that there is no more work.
+    while (queued == 0) {
+      std::vector<compdb::CommandObject> commands{};
+      if (!this->takeMoreCommands(commands)) {
+        break;
+      }
+      for (auto &command : commands) {
+        this->planFromPreviousRun(command);
+        this->scheduler.queueSemaTask(std::move(command));
+        queued++;
+      }
+    }
+    return queued;
+  }
+
+  /// Appends the next few commands which need to be indexed to \p out.
+  ///
+  /// Returns false iff the compdb has been fully consumed.
+  bool takeMoreCommands(std::vector<compdb::CommandObject> &out) {
+    if (!this->incrementalCache) {
+      std::vector<compdb::CommandObject> commands{};
+      this->compdbParser.parseMore(commands);
+      if (commands.empty()) {
+        return false;
+      }
+      this->filterCommands(std::move(commands), out);
+      return true;
+    }
+    // See NOTE(ref: incremental-indexing)
+    if (!this->decidedReuse) {
+      this->decidedReuse = true;
+      while (true) {
+        std::vector<compdb::CommandObject> commands{};
+        this->compdbParser.parseMore(commands);
+        if (commands.empty()) {
+          break;
+        }
+        std::vector<compdb::CommandObject> toIndex{};
+        this->filterCommands(std::move(commands), toIndex);
+        for (auto &command : toIndex) {
+          this->commandsToIndex.push_back(std::move(command));
+        }
+      }
+    }
+    if (this->commandsToIndex.empty()) {
+      return false;
+    }
+    for (size_t i = 0; i < this->refillCount(); ++i) {
+      if (this->commandsToIndex.empty()) {
+        break;
+      }
+      out.push_back(std::move(this->commandsToIndex.front()));
+      this->commandsToIndex.pop_front();
+    }
+    return true;
+  }
+
+  /// Appends the commands which are not skipped due to the include graph,
+  /// and whose shards cannot be reused, to \p out.
+  void filterCommands(std::vector<compdb::CommandObject> &&commands,
+                      std::vector<compdb::CommandObject> &out) {
+    this->processedCommandCount += commands.size();
     for (auto &command : commands) {
-      this->scheduler.queueSemaTask(std::move(command));
+      if (this->includeGraph && !this->includeGraph->shouldIndex(command)) {
+        continue;
+      }
+      if (this->tryReuseShards(command)) {
+        continue;
+      }
+      out.push_back(std::move(command));
+    }
+  }
+
+  /// See NOTE(ref: incremental-indexing).
+  bool tryReuseShards(const compdb::CommandObject &command) {
+    if (!this->incrementalCache) {
+      return false;
+    }
+    auto reused = this->incrementalCache->tryReuse(command);
+    if (!reused.has_value()) {
+      return false;
     }
-    return commands.size();
+    auto taskId = uint32_t(command.index);
+    this->planner.saveReusedFiles(std::move(reused->assignedFiles));
+    this->shardPaths.emplace_back(
+        TuShards{taskId, std::move(reused->paths), 0});
+    this->reusedTuPaths.emplace(taskId, command.filePath);
+    this->indexedSoFar.value += 1;
+    return true;
+  }
+
+  // NOTE(def: previous-plan): With --reuse-previous-plan, the driver
+  // assigns files to a TU before sending it to a worker, based on the
+  // include graph from the previous run (see NOTE(ref: changed-files)).
+  // Every file touched by the TU in the previous run which hasn't been
+  // assigned to another TU yet is assigned to it, and the request carries
+  // the assignment along with a digest of the files touched previously.
+  //
+  // If the files touched after semantic analysis match the digest, the
+  // worker reports its result and starts emitting immediately, instead of
+  // waiting for the driver to run the FileIndexingPlanner. All the files
+  // it touches have been assigned already, either to it or to TUs queued
+  // earlier, so the planner has nothing to add. Otherwise, the worker waits
+  // as usual; the driver keeps the assigned files which the TU still
+  // touches, releases the rest, and adds files assigned by the planner.
+  //
+  // Files assigned to a TU whose semantic analysis job is dropped (e.g.
+  // because the worker timed out) are released too.
+  //
+  // Until the semantic analysis result for a planned TU is processed, the
+  // files assigned to it are tentative. If another TU touches such a file,
+  // the file is taken away from the planned TU if it hasn't been sent to
+  // a worker yet. Otherwise, the EmitIndex request for the other TU is
+  // held back until the assignment is confirmed or the file is released.
+  // A released file goes to the first such TU waiting for it. If there
+  // are none, it is offered to planned TUs which haven't been sent to a
+  // worker yet, and which touched it in the previous run; failing that,
+  // it is left for the planner to assign to TUs processed afterwards.
+  // So a released file is not lost as long as some TU touches it.
+  //
+  // Workers for TUs with a matching plan can't wait for assignments, so
+  // the request also carries the files which were tentatively assigned
+  // to other TUs when it was sent. The worker emits documents for those
+  // too, and drops the ones not listed in the EmitIndex request, like
+  // NOTE(ref: speculative-emission).
+  void planFromPreviousRun(const compdb::CommandObject &command) {
+    if (!this->options.reusePreviousPlan) {
+      return;
+    }
+    std::vector<PreprocessedFileInfo> previousFiles{};
+    auto digest = this->includeGraph->previousFiles(command, previousFiles);
+    if (!digest.has_value()) {
+      return;
+    }
+    auto taskId = uint32_t(command.index);
+    PlannedTu plannedTu{*digest, {}, {}, {}, false};
+    this->planner.claimFiles(std::move(previousFiles), plannedTu.files,
+                             plannedTu.unclaimedFiles);
+    for (auto &fileInfo : plannedTu.files) {
+      this->tentativeOwners.insert_or_assign(fileInfo.key(), taskId);
+    }
+    this->plannedTus.insert_or_assign(taskId, std::move(plannedTu));
+    this->plannedTuCount++;
+  }
+
+  /// Undoes the assignment of \p files, and hands them to TUs waiting
+  /// for them, or offers them to planned TUs which haven't been sent to
+  /// a worker yet.
+  ///
+  /// See NOTE(ref: previous-plan).
+  void releasePlannedFiles(const std::vector<PreprocessedFileInfo> &files) {
+    if (files.empty()) {
+      return;
+    }
+    this->planner.releaseFiles(files);
+    absl::flat_hash_set<std::pair<std::string_view, HashValue>> released{};
+    std::vector<uint32_t> readyTaskIds{};
+    for (auto &fileInfo : files) {
+      auto key = fileInfo.key();
+      auto waitersIt = this->fileWaiters.find(key);
+      if (waitersIt == this->fileWaiters.end()) {
+        released.emplace(fileInfo.path.asStringRef(), fileInfo.hashValue);
+        continue;
+      }
+      bool handedOver = false;
+      for (auto taskId : waitersIt->second) {
+        auto heldIt = this->heldEmitIndexRequests.find(taskId);
+        ENFORCE(heldIt != this->heldEmitIndexRequests.end());
+        auto &held = heldIt->second;
+        held.waitingFor.erase(key);
+        if (held.waitingFor.empty()) {
+          readyTaskIds.push_back(taskId);
+        }
+        if (handedOver
+            || !this->scheduler.isProcessing(held.workerId, held.request.id)) {
+          continue;
+        }
+        std::vector<PreprocessedFileInfo> unclaimed{};
+        this->planner.claimFiles({fileInfo}, // deliberate copy
+                                 held.request.job.emitIndex.filesToBeIndexed,
+                                 unclaimed);
+        handedOver = true;
+      }
+      this->fileWaiters.erase(waitersIt);
+      if (!handedOver) {
+        released.emplace(fileInfo.path.asStringRef(), fileInfo.hashValue);
+      }
+    }
+    for (auto &[taskId, plannedTu] : this->plannedTus) {
+      if (released.empty()) {
+        break;
+      }
+      if (plannedTu.sent) {
+        continue;
+      }
+      auto &unclaimed = plannedTu.unclaimedFiles;
+      auto offeredBegin = std::stable_partition(
+          unclaimed.begin(), unclaimed.end(),
+          [&](const PreprocessedFileInfo &fileInfo) -> bool {
+            return !released.contains(std::make_pair(
+                std::string_view(fileInfo.path.asStringRef()),
+                fileInfo.hashValue));
+          });
+      if (offeredBegin == unclaimed.end()) {
+        continue;
+      }
+      std::vector<PreprocessedFileInfo> offered{
+          std::make_move_iterator(offeredBegin),
+          std::make_move_iterator(unclaimed.end())};
+      unclaimed.erase(offeredBegin, unclaimed.end());
+      auto numFilesBefore = plannedTu.files.size();
+      this->planner.claimFiles(std::move(offered), plannedTu.files, unclaimed);
+      for (size_t i = numFilesBefore; i < plannedTu.files.size(); ++i) {
+        auto &fileInfo = plannedTu.files[i];
+        this->tentativeOwners.insert_or_assign(fileInfo.key(), taskId);
+        released.erase(std::make_pair(
+            std::string_view(fileInfo.path.asStringRef()),
+            fileInfo.hashValue));
+      }
+    }
+    for (auto taskId : readyTaskIds) {
+      this->sendHeldEmitIndexRequest(taskId);
+    }
+  }
+
+  /// Marks the tentative assignment of \p files to a planned TU as final,
+  /// so that other TUs stop waiting for them.
+  ///
+  /// See NOTE(ref: previous-plan).
+  void keepPlannedFiles(const std::vector<PreprocessedFileInfo> &files) {
+    std::vector<uint32_t> readyTaskIds{};
+    for (auto &fileInfo : files) {
+      auto key = fileInfo.key();
+      auto waitersIt = this->fileWaiters.find(key);
+      if (waitersIt == this->fileWaiters.end()) {
+        continue;
+      }
+      for (auto taskId : waitersIt->second) {
+        auto heldIt = this->heldEmitIndexRequests.find(taskId);
+        ENFORCE(heldIt != this->heldEmitIndexRequests.end());
+        heldIt->second.waitingFor.erase(key);
+        if (heldIt->second.waitingFor.empty()) {
+          readyTaskIds.push_back(taskId);
+        }
+      }
+      this->fileWaiters.erase(waitersIt);
+    }
+    for (auto taskId : readyTaskIds) {
+      this->sendHeldEmitIndexRequest(taskId);
+    }
+  }
+
+  /// Handles files touched by a TU which are tentatively assigned to
+  /// other planned TUs. Assignments to TUs which haven't been sent to a
+  /// worker are undone, so that the planner can assign the files to this
+  /// TU. Files assigned to TUs which have been sent to a worker are
+  /// appended to \p waitingFor. If \p allowedKeys is non-null, other
+  /// files are skipped.
+  ///
+  /// See NOTE(ref: previous-plan).
+  void
+  resolveTentativeFiles(const SemanticAnalysisJobResult &semaResult,
+                        const absl::flat_hash_set<HashValue> *allowedKeys,
+                        std::vector<PreprocessedFileInfo> &waitingFor) {
+    if (this->tentativeOwners.empty()) {
+      return;
+    }
+    auto resolve = [&](const AbsolutePath &path, HashValue hashValue) {
+      PreprocessedFileInfo fileInfo{path, hashValue};
+      auto key = fileInfo.key();
+      auto ownerIt = this->tentativeOwners.find(key);
+      if (ownerIt == this->tentativeOwners.end()
+          || (allowedKeys && !allowedKeys->contains(key))) {
+        return;
+      }
+      auto planIt = this->plannedTus.find(ownerIt->second);
+      ENFORCE(planIt != this->plannedTus.end());
+      auto &owner = planIt->second;
+      if (owner.sent) {
+        waitingFor.push_back(std::move(fileInfo));
+        return;
+      }
+      auto fileIt = absl::c_find_if(
+          owner.files, [&](const PreprocessedFileInfo &ownedFileInfo) -> bool {
+            return ownedFileInfo.key() == key;
+          });
+      ENFORCE(fileIt != owner.files.end());
+      owner.unclaimedFiles.push_back(std::move(*fileIt));
+      owner.files.erase(fileIt);
+      this->tentativeOwners.erase(ownerIt);
+      this->planner.releaseFiles({std::move(fileInfo)});
+    };
+    for (auto &fileInfo : semaResult.wellBehavedFiles) {
+      resolve(fileInfo.path, fileInfo.hashValue);
+    }
+    for (auto &fileInfo : semaResult.illBehavedFiles) {
+      for (auto hashValue : fileInfo.hashValues) {
+        resolve(fileInfo.path, hashValue);
+      }
+    }
+  }
+
+  /// Releases the files assigned to a TU whose semantic analysis job
+  /// was dropped. See NOTE(ref: previous-plan).
+  void dropPlannedTu(JobId jobId) {
+    auto planIt = this->plannedTus.find(jobId.taskId());
+    if (planIt == this->plannedTus.end()) {
+      return;
+    }
+    auto plannedTu = std::move(planIt->second);
+    this->plannedTus.erase(planIt);
+    spdlog::debug("releasing {} files planned for dropped job {}",
+                  plannedTu.files.size(), jobId);
+    for (auto &fileInfo : plannedTu.files) {
+      this->tentativeOwners.erase(fileInfo.key());
+    }
+    this->releasePlannedFiles(plannedTu.files);
+  }
+
+  /// Computes the files to be indexed for a TU sent with a plan, and the
+  /// files it needs to wait for (see \c resolveTentativeFiles).
+  ///
+  /// See NOTE(ref: previous-plan).
+  void saveSemaResultWithPlan(
+      PlannedTu &&plannedTu, SemanticAnalysisJobResult &&semaResult,
+      std::vector<PreprocessedFileInfo> &filesToBeIndexed,
+      std::vector<PreprocessedFileInfo> &waitingFor) {
+    for (auto &fileInfo : plannedTu.files) {
+      this->tentativeOwners.erase(fileInfo.key());
+    }
+    if (semaResult.matchedPlan) {
+      this->matchedPlanCount++;
+      // The worker has started emitting, so it can only be given files
+      // which it emits on standby.
+      absl::flat_hash_set<HashValue> standbyKeys{};
+      for (auto &fileInfo : plannedTu.standbyFiles) {
+        standbyKeys.insert(fileInfo.key());
+      }
+      this->resolveTentativeFiles(semaResult, &standbyKeys, waitingFor);
+      std::vector<PreprocessedFileInfo> unexpectedFiles{};
+      this->planner.saveSemaResult(std::move(semaResult), unexpectedFiles);
+      this->keepPlannedFiles(plannedTu.files);
+      std::vector<PreprocessedFileInfo> releasedFiles{};
+      for (auto &fileInfo : unexpectedFiles) {
+        if (standbyKeys.contains(fileInfo.key())) {
+          plannedTu.files.push_back(std::move(fileInfo));
+        } else {
+          releasedFiles.push_back(std::move(fileInfo));
+        }
+      }
+      if (!releasedFiles.empty()) {
+        // The files were released by another TU after this TU was planned,
+        // but the worker has already started emitting.
+        spdlog::debug("releasing {} files not in the plan for a TU",
+                      releasedFiles.size());
+        this->releasePlannedFiles(releasedFiles);
+      }
+      filesToBeIndexed = std::move(plannedTu.files);
+      return;
+    }
+    this->resolveTentativeFiles(semaResult, nullptr, waitingFor);
+    absl::flat_hash_set<std::pair<std::string_view, HashValue>> touched{};
+    for (auto &fileInfo : semaResult.wellBehavedFiles) {
+      touched.emplace(fileInfo.path.asStringRef(), fileInfo.hashValue);
+    }
+    for (auto &fileInfo : semaResult.illBehavedFiles) {
+      for (auto hashValue : fileInfo.hashValues) {
+        touched.emplace(fileInfo.path.asStringRef(), hashValue);
+      }
+    }
+    std::vector<PreprocessedFileInfo> releasedFiles{};
+    for (auto &fileInfo : plannedTu.files) {
+      auto key = std::make_pair(std::string_view(fileInfo.path.asStringRef()),
+                                fileInfo.hashValue);
+      if (touched.contains(key)) {
+        filesToBeIndexed.push_back(std::move(fileInfo));
+      } else {
+        releasedFiles.push_back(std::move(fileInfo));
+      }
+    }
+    this->keepPlannedFiles(filesToBeIndexed);
+    this->releasePlannedFiles(releasedFiles);
+    this->planner.saveSemaResult(std::move(semaResult), filesToBeIndexed);
+  }
+
+  std::string_view getTuPath(uint32_t taskId) const {
+    auto it = this->reusedTuPaths.find(taskId);
+    if (it != this->reusedTuPaths.end()) {
+      return it->second;
+    }
+    return this->scheduler.getTuPath(JobId::newTask(taskId));
+  }
+
+  /// See NOTE(ref: header-document-cache).
+  std::optional<std::string> prepareHeaderCacheDir() {
+    auto &dir = this->options.headerCacheDir;
+    if (dir.empty()) {
+      return {};
+    }
+    dir = std::filesystem::absolute(dir)
+          / fmt::format("{:016x}",
+                        this->cacheConfigDigest(/*includeProjectRoot*/ false));
+    std::error_code error;
+    std::filesystem::create_directories(dir, error);
+    if (error) {
+      return fmt::format("failed to create header cache directory at '{}' "
+                         "({})",
+                         dir.c_str(), error.message());
+    }
+    return {};
+  }
+
+  /// Digest of the settings affecting shard contents, other than
+  /// the compilation commands and the files being indexed.
+  uint64_t cacheConfigDigest(bool includeProjectRoot) const {
+    HashValue hash{0};
+    auto mixString = [&hash](std::string_view s) {
+      uint64_t size = s.size();
+      hash.mix(reinterpret_cast<const uint8_t *>(&size), sizeof(size));
+      hash.mix(reinterpret_cast<const uint8_t *>(s.data()), s.size());
+    };
+    mixString(scip_clang::version);
+    // Symbols and occurrences are sorted in deterministic mode.
+    mixString(this->options.deterministic ? "deterministic" : "");
+    if (includeProjectRoot) {
+      mixString(this->options.projectRootPath.asRef().asStringView());
+    }
+    // Symbol names depend on the package map.
+    auto &packageMapPath = this->options.packageMapPath.asStringRef();
+    if (!packageMapPath.empty()) {
+      std::ifstream packageMapFile(packageMapPath, std::ios_base::in
+                                                       | std::ios_base::binary);
+      std::string contents{std::istreambuf_iterator<char>(packageMapFile),
+                           std::istreambuf_iterator<char>()};
+      mixString(contents);
+    }
+    return hash.rawValue;
   }
 
   void shutdownWorker(WorkerId workerId) {
@@ -1205,13 +2740,19 @@ private:
     (void)sendError;
   }
 
-  /// Returns the number of TUs processed
-  std::pair<TusIndexedCount, size_t> runJobsTillCompletionAndShutdownWorkers() {
+  /// Sets \p numTus to the number of TUs processed and the number of
+  /// errored TUs. Returns an error message if no TU could be processed.
+  std::optional<std::string> runJobsTillCompletionAndShutdownWorkers(
+      std::pair<TusIndexedCount, size_t> &numTus) {
     ProgressReporter progressReporter(this->options.showProgress, "Indexed",
-                                      this->compdbCommandCount);
+                                      0);
+    this->refreshCommandCount(progressReporter);
     this->scheduler.runJobsTillCompletionAndShutdownWorkers(
         Scheduler::RunCallbacks{
             [this, &progressReporter]() -> void {
+              if (!this->compdbCommandCount.isExact) {
+                this->refreshCommandCount(progressReporter);
+              }
               this->processOneOrMoreJobResults(progressReporter);
             },
             [this]() -> size_t { return this->refillJobs(); },
@@ -1219,30 +2760,186 @@ private:
               return this->tryAssignJobToWorker(std::move(workerId), jobId);
             },
             [this](WorkerId workerId) { this->shutdownWorker(workerId); }});
-    this->scheduler.waitForAllWorkers();
-    return {this->indexedSoFar, this->scheduler.numErroredJobs()};
+    if (this->options.workerPremergeCount > 0) {
+      this->collectFinalPremergedShards();
+      this->scheduler.waitForAllWorkersToExit(this->receiveTimeout());
+    } else if (!this->options.serve) {
+      this->scheduler.waitForAllWorkers();
+    }
+    if (this->processedCommandCount == 0) {
+      return "compilation database has no entries that could be processed";
+    }
+    numTus = {this->indexedSoFar, this->scheduler.numErroredJobs()};
+    return {};
+  }
+
+  void refreshCommandCount(ProgressReporter &progressReporter) {
+    this->compdbCommandCount = this->compdbParser.commandCount();
+    auto &count = this->compdbCommandCount;
+    if (!count.isExact) {
+      // The estimate may be too low if later objects are smaller.
+      count.value = std::max(count.value, this->processedCommandCount);
+    }
+    progressReporter.updateTotalCount(count.value, !count.isExact);
+  }
+
+  /// Receives the final shard paths from workers which were still holding
+  /// on to output after the last job was completed.
+  ///
+  /// See NOTE(ref: worker-premerge).
+  void collectFinalPremergedShards() {
+    size_t numPending = absl::c_count_if(
+        this->pendingPremerges,
+        [](const PendingPremerge &p) -> bool { return p.numTus() > 0; });
+    auto deadline = std::chrono::steady_clock::now() + this->receiveTimeout();
+    while (numPending > 0) {
+      auto now = std::chrono::steady_clock::now();
+      if (now >= deadline) {
+        break;
+      }
+      IndexJobResponse response;
+      auto recvError = this->queues.workerToDriver.timedReceive(
+          response, std::chrono::duration_cast<std::chrono::milliseconds>(
+                        deadline - now));
+      if (recvError.isA<TimeoutError>()) {
+        llvm::consumeError(std::move(recvError));
+        break;
+      } else if (recvError) {
+        spdlog::error("received malformed message: {}",
+                      llvm_ext::format(recvError));
+        llvm::consumeError(std::move(recvError));
+        continue;
+      }
+      // Other responses can only be mail from the dead at this point.
+      // See NOTE(ref: mail-from-the-dead)
+      if (response.jobId == JobId::Shutdown()
+          && this->recordFinalPremergedShards(std::move(response))) {
+        --numPending;
+      }
+    }
+    for (WorkerId workerId = 0; workerId < this->pendingPremerges.size();
+         ++workerId) {
+      auto &pending = this->pendingPremerges[workerId];
+      if (pending.numTus() > 0) {
+        spdlog::warn("no final shards from worker {}; using separate "
+                     "output for {} TUs processed by the worker instead",
+                     workerId, pending.numTus());
+        this->usePremergeJournal(pending);
+      }
+    }
   }
 
-  FileGuard openCompilationDatabase() {
+  /// Handles the response sent by a worker when it is asked to shut down.
+  /// Returns false if the worker wasn't holding on to any output.
+  ///
+  /// See NOTE(ref: worker-premerge).
+  bool recordFinalPremergedShards(IndexJobResponse &&response) {
+    this->recordShardLogSize(response.result.emitIndex.shardPaths);
+    if (response.workerId >= this->pendingPremerges.size()) {
+      return false;
+    }
+    auto &pending = this->pendingPremerges[response.workerId];
+    if (pending.numTus() == 0) {
+      return false;
+    }
+    auto &optPaths = response.result.emitIndex.shardPaths;
+    if (!optPaths.has_value()) {
+      spdlog::warn("missing final shards from worker {}; using separate "
+                   "output for {} TUs processed by the worker instead",
+                   response.workerId, pending.numTus());
+      this->usePremergeJournal(pending);
+      return true;
+    }
+    this->shardPaths.emplace_back(
+        TuShards{pending.firstTaskId(), std::move(optPaths.value()), 0});
+    pending = PendingPremerge{};
+    return true;
+  }
+
+  void recordShardLogSize(const std::optional<ShardPaths> &optPaths) {
+    if (!optPaths.has_value()
+        || !optPaths->docsAndExternalsRange.has_value()) {
+      return;
+    }
+    auto &paths = optPaths.value();
+    auto &docsAndExternalsRange = paths.docsAndExternalsRange.value();
+    auto &forwardDeclsRange = paths.forwardDeclsRange.value();
+    auto end =
+        std::max(docsAndExternalsRange.offset + docsAndExternalsRange.size,
+                 forwardDeclsRange.offset + forwardDeclsRange.size);
+    auto &size =
+        this->reportedShardLogSizes[paths.docsAndExternals.asStringRef()];
+    size = std::max(size, end);
+  }
+
+  /// Drops any bytes after the last shard reported in the shard log
+  /// at \p logPath, such as a partially written shard left behind by
+  /// a worker which crashed or was killed.
+  ///
+  /// See NOTE(ref: shard-log).
+  void truncateShardLog(const StdPath &logPath) {
     std::error_code error;
+    auto size = std::filesystem::file_size(logPath, error);
+    if (error) {
+      return;
+    }
+    uint64_t reportedSize = 0;
+    auto it = this->reportedShardLogSizes.find(logPath.string());
+    if (it != this->reportedShardLogSizes.end()) {
+      reportedSize = it->second;
+    }
+    if (size <= reportedSize) {
+      return;
+    }
+    spdlog::debug("truncating shard log at '{}' from {} to {} bytes",
+                  logPath.c_str(), size, reportedSize);
+    std::filesystem::resize_file(logPath, reportedSize, error);
+    if (error) {
+      spdlog::warn("failed to truncate shard log at '{}' ({})",
+                   logPath.c_str(), error.message());
+    }
+  }
+
+  /// Uses the journal copies of the output held on to by a worker
+  /// which didn't write the merged shards.
+  ///
+  /// See NOTE(ref: worker-premerge).
+  void usePremergeJournal(PendingPremerge &pending) {
+    absl::c_move(pending.journalShards, std::back_inserter(this->shardPaths));
+    pending = PendingPremerge{};
+  }
+
+  /// On success, the caller is responsible for closing \p compdbFile.
+  std::optional<std::string>
+  openCompilationDatabase(compdb::File &compdbFile) {
     StdPath compdbStdPath{this->compdbPath().asStringRef()};
-    auto compdbFile = compdb::File::openAndExitOnErrors(
+    auto error = compdb::File::tryOpen(
         compdbStdPath,
         compdb::ValidationOptions{
             .checkDirectoryPathsAreAbsolute = !this->options.isTesting,
-            .tryDetectOutOfProjectRoot = !this->options.isTesting});
-    this->compdbCommandCount = compdbFile.commandCount();
-    this->options.numWorkers =
-        std::min(this->compdbCommandCount, this->numWorkers());
-    spdlog::debug("total {} command objects in compilation database",
-                  this->compdbCommandCount);
+            .tryDetectOutOfProjectRoot = !this->options.isTesting},
+        compdbFile);
+    if (error) {
+      return error;
+    }
+    if (!this->options.serve) {
+      // In serve mode, workers are kept around for larger requests.
+      // Otherwise, this only waits for the background scan to find
+      // numWorkers command objects. See NOTE(ref: compdb-scan).
+      this->options.numWorkers =
+          compdbFile.commandObjects()->waitForCount(this->numWorkers());
+    }
+    this->compdbCommandCount = compdbFile.commandObjects()->count();
+    spdlog::debug("{} {} command objects in compilation database",
+                  this->compdbCommandCount.isExact ? "total" : "estimated",
+                  this->compdbCommandCount.value);
 
     // FIXME(def: resource-dir-extra): If we're passed in a resource dir
     // as an extra argument, we should not pass it here.
     this->compdbParser.initialize(
         compdbFile, compdb::ParseOptions::create(this->refillCount(),
                                                  this->options.isTesting));
-    return FileGuard(compdbFile.file);
+    return {};
   }
 
   boost::process::child spawnWorker(WorkerId workerId) {
@@ -1252,6 +2949,24 @@ private:
     args.push_back(fmt::format("--driver-id={}", this->id));
     args.push_back(fmt::format("--worker-id={}", workerId));
     this->options.addWorkerOptions(args, workerId);
+    this->externalSymbolLog.resetCursor(workerId);
+    this->claimedFileLog.resetCursor(workerId);
+    if (this->pendingPremerges.size() <= workerId) {
+      this->pendingPremerges.resize(workerId + 1);
+    }
+    auto &pending = this->pendingPremerges[workerId];
+    if (pending.numTus() > 0) {
+      // See NOTE(ref: worker-premerge)
+      spdlog::debug("using separate output for {} TUs accumulated by "
+                    "worker {} before it was restarted",
+                    pending.numTus(), workerId);
+      this->usePremergeJournal(pending);
+    }
+    // The new worker appends to the same files as the previous one.
+    this->truncateShardLog(this->options.temporaryOutputDir
+                           / ShardPaths::logFileName(workerId));
+    this->truncateShardLog(this->options.temporaryOutputDir
+                           / ShardPaths::journalFileName(workerId));
 
     spdlog::debug("spawning worker with arguments: '{}'", fmt::join(args, " "));
 
@@ -1265,9 +2980,11 @@ private:
   void terminateLongRunningWorkersAndRespawn(Instant startedBefore) {
     this->scheduler.terminateLongRunningWorkersAndRespawn(
         startedBefore,
-        [&](Scheduler::Process &&oldHandle,
-            WorkerId workerId) -> Scheduler::Process {
+        [&](Scheduler::Process &&oldHandle, WorkerId workerId,
+            JobId jobId) -> Scheduler::Process {
           oldHandle.terminate();
+          // No-op for EmitIndex jobs, as the plan is used up by then.
+          this->dropPlannedTu(jobId);
           return this->spawnWorker(workerId);
         });
   }
@@ -1276,6 +2993,11 @@ private:
                              const ProgressReporter &progressReporter) {
     TRACE_EVENT(tracing::indexing, "Driver::processWorkerResponse",
                 perfetto::TerminatingFlow::Global(response.jobId.traceId()));
+    if (response.jobId == JobId::Shutdown()) {
+      // Idle workers may be shut down while other workers are still busy.
+      this->recordFinalPremergedShards(std::move(response));
+      return;
+    }
     auto optLatestIdleWorkerId = this->scheduler.markCompleted(
         response.workerId, response.jobId, response.result.kind);
     if (!optLatestIdleWorkerId.has_value()) {
@@ -1292,60 +3014,123 @@ private:
 
       auto numFilesReceived = semaResult.illBehavedFiles.size()
                               + semaResult.wellBehavedFiles.size();
-      this->planner.saveSemaResult(std::move(semaResult), filesToBeIndexed);
-      auto numFilesSending = filesToBeIndexed.size();
+      auto taskId = response.jobId.taskId();
+      if (this->incrementalCache || this->shardCache || this->includeGraph) {
+        auto &jobMap = this->scheduler.getJobMap();
+        auto it = jobMap.find(response.jobId);
+        ENFORCE(it != jobMap.end());
+        auto &command = it->second.job.semanticAnalysis.command;
+        if (this->incrementalCache) {
+          this->incrementalCache->recordSemaResult(taskId, command, semaResult);
+        }
+        if (this->shardCache) {
+          this->shardCache->recordSemaResult(taskId, command, semaResult);
+        }
+        if (this->includeGraph) {
+          this->includeGraph->recordSemaResult(taskId, command, semaResult);
+        }
+      }
+      bool filesAlreadySent = false;
+      // See NOTE(ref: previous-plan)
+      std::vector<PreprocessedFileInfo> waitingFor{};
+      auto planIt = this->plannedTus.find(taskId);
+      if (planIt == this->plannedTus.end()) {
+        this->resolveTentativeFiles(semaResult, nullptr, waitingFor);
+        this->planner.saveSemaResult(std::move(semaResult), filesToBeIndexed);
+      } else {
+        auto plannedTu = std::move(planIt->second);
+        this->plannedTus.erase(planIt);
+        // The worker already got the files along with the plan, unless it
+        // needs to know which of the files on standby to keep.
+        filesAlreadySent =
+            semaResult.matchedPlan && plannedTu.standbyFiles.empty();
+        this->saveSemaResultWithPlan(std::move(plannedTu),
+                                     std::move(semaResult), filesToBeIndexed,
+                                     waitingFor);
+      }
 
       auto workerId = latestIdleWorkerId.id;
-      auto &queue = this->queues.driverToWorker[workerId];
       IndexJobRequest newRequest{
           this->scheduler.createSubtaskAndScheduleOnWorker(
               latestIdleWorkerId, response.jobId,
               IndexJob{
                   IndexJob::Kind::EmitIndex,
                   SemanticAnalysisJobDetails{},
-                  EmitIndexJobDetails{std::move(filesToBeIndexed)},
+                  EmitIndexJobDetails{std::move(filesToBeIndexed), {},
+                                      /*skipEmitting*/ false},
               })};
-      auto newRequestJobId = newRequest.id;
-      auto sendError = queue.send(std::move(newRequest));
-      if (sendError.has_value()) {
-        spdlog::warn("failed to send message to worker indicating the subset "
-                     "of files to be indexed: {}",
-                     sendError->what());
-        spdlog::info("this is probably a scip-clang bug; please report it "
-                     "(https://github.com/sourcegraph/scip-clang/issues/new)");
-        spdlog::info("received {} files, attempted to send {} files",
-                     numFilesReceived, numFilesSending);
-        // NOTE(def: terminate-on-send-emit-index)
-        // There are several things we could do here.
-        // 1. Kill the worker and start with a new job.
-        // 2. Send a smaller message (e.g. with an empty list) for the
-        //    worker to detect and reset itself (instead of waiting
-        //    for the list of files to be indexed).
-        // 3. Try serializing smaller subsets until something succeeds.
-        // For simplicity, let's go with option 1 here.
-        this->scheduler.descheduleJobDueToSendError(workerId, newRequestJobId);
-        this->scheduler.terminateRunningWorker(
-            "failure to communicate over IPC", workerId,
-            [&](Scheduler::Process &&oldHandle) -> Scheduler::Process {
-              oldHandle.terminate();
-              return this->spawnWorker(workerId);
-            });
+      if (!waitingFor.empty()) {
+        // The worker stays busy waiting for the request in the meantime.
+        HeldEmitIndexRequest held{workerId, std::move(newRequest),
+                                  filesAlreadySent, numFilesReceived, {}};
+        for (auto &fileInfo : waitingFor) {
+          auto key = fileInfo.key();
+          if (held.waitingFor.insert(key).second) {
+            this->fileWaiters[key].push_back(taskId);
+          }
+        }
+        spdlog::debug("holding back EmitIndex request for task {} until "
+                      "{} files assigned to other TUs are confirmed",
+                      taskId, held.waitingFor.size());
+        this->heldEmitIndexRequests.insert_or_assign(taskId, std::move(held));
         return;
       }
+      this->sendEmitIndexJob(workerId, std::move(newRequest), filesAlreadySent,
+                             numFilesReceived);
       break;
     }
     case IndexJob::Kind::EmitIndex: {
       auto &result = response.result.emitIndex;
+      this->recordShardLogSize(result.shardPaths);
+      this->recordShardLogSize(result.journalShardPaths);
+      auto &stats = result.statistics;
+      this->droppedDocumentCount += stats.numDroppedDocuments;
+      this->workerWaitMicros += stats.waitTimeMicros;
+      this->workerBusyMicros +=
+          stats.totalTimeMicros - std::min(stats.totalTimeMicros,
+                                           stats.waitTimeMicros);
       if (!this->options.statsFilePath.asStringRef().empty()) {
         this->allStatistics.emplace_back(response.jobId,
                                          std::move(result.statistics));
       }
-      this->shardPaths.emplace_back(std::move(result.shardPaths));
+      auto &pending = this->pendingPremerges[response.workerId];
+      auto taskId = response.jobId.taskId();
+      auto cachedIt = this->cachedShards.find(taskId);
+      if (cachedIt != this->cachedShards.end()) {
+        auto paths = std::move(cachedIt->second);
+        this->cachedShards.erase(cachedIt);
+        if (this->incrementalCache) {
+          paths = this->incrementalCache->recordShards(
+              taskId, std::move(paths), /*keepOriginals*/ true);
+        }
+        this->shardPaths.emplace_back(TuShards{taskId, std::move(paths), 0});
+      } else if (result.shardPaths.has_value()) {
+        auto paths = std::move(result.shardPaths.value());
+        if (this->shardCache) {
+          this->shardCache->store(taskId, paths);
+        }
+        if (this->incrementalCache) {
+          paths = this->incrementalCache->recordShards(
+              taskId, std::move(paths), /*keepOriginals*/ false);
+        }
+        // Workers only report symbols once the shards containing them
+        // have been written, so that other workers don't omit symbols
+        // which never make it to the driver.
+        // See NOTE(ref: worker-premerge) for the task ID used here.
+        this->shardPaths.emplace_back(
+            TuShards{pending.firstTaskId(taskId), std::move(paths),
+                     result.emittedExternalSymbols.size()});
+        pending = PendingPremerge{};
+      } else if (result.journalShardPaths.has_value()) {
+        // See NOTE(ref: worker-premerge)
+        pending.journalShards.emplace_back(
+            TuShards{taskId, std::move(result.journalShardPaths.value()), 0});
+      }
+      this->externalSymbolLog.record(std::move(result.emittedExternalSymbols));
       this->indexedSoFar.value += 1;
       if (this->options.showProgress) {
-        auto semaJobId = JobId::newTask(response.jobId.taskId());
         progressReporter.report(this->indexedSoFar.value,
-                                this->scheduler.getTuPath(semaJobId));
+                                this->getTuPath(taskId));
       }
       break;
     }
@@ -1353,16 +3138,156 @@ private:
     return;
   }
 
+  /// Records the files to be indexed for a TU, and sends the EmitIndex
+  /// request, unless it needs to wait for a shard cache lookup.
+  void sendEmitIndexJob(WorkerId workerId, IndexJobRequest &&request,
+                        bool filesAlreadySent, size_t numFilesReceived) {
+    auto taskId = request.id.taskId();
+    auto &filesToBeIndexed = request.job.emitIndex.filesToBeIndexed;
+    if (this->incrementalCache) {
+      this->incrementalCache->recordAssignedFiles(taskId, filesToBeIndexed);
+    }
+    if (this->includeGraph) {
+      this->includeGraph->recordAssignedFiles(taskId, filesToBeIndexed);
+    }
+    if (this->options.speculativeEmission) {
+      // See NOTE(ref: speculative-emission)
+      std::vector<HashValue> claimedFiles{};
+      claimedFiles.reserve(filesToBeIndexed.size());
+      for (auto &fileInfo : filesToBeIndexed) {
+        claimedFiles.push_back(fileInfo.key());
+      }
+      this->claimedFileLog.record(std::move(claimedFiles));
+    }
+    std::optional<ShardCache::PendingLookup> cacheLookup{};
+    if (this->shardCache) {
+      // See NOTE(ref: shard-cache)
+      cacheLookup = this->shardCache->startLookup(taskId, filesToBeIndexed);
+    }
+    auto numFilesSending = filesToBeIndexed.size();
+    // Only attached to the request, not the tracked job, to avoid
+    // keeping the hashes around for every job.
+    //
+    // Reused shards need to be self-contained, so skip deduplication
+    // when the shards may be reused. See NOTE(ref: incremental-indexing)
+    // and NOTE(ref: shard-cache).
+    if (!this->incrementalCache && !this->shardCache) {
+      request.job.emitIndex.knownExternalSymbols =
+          this->externalSymbolLog.takeUnsent(
+              workerId, maxExternalSymbolHashesPerMessage);
+    }
+    if (filesAlreadySent) {
+      filesToBeIndexed.clear();
+    }
+    if (cacheLookup.has_value()) {
+      // The worker stays busy waiting for the request in the meantime.
+      this->pendingCacheLookups.push_back(PendingCacheLookup{
+          workerId, std::move(request), std::move(*cacheLookup)});
+      return;
+    }
+    if (!this->sendEmitIndexRequest(workerId, std::move(request))) {
+      spdlog::info("received {} files, attempted to send {} files",
+                   numFilesReceived, numFilesSending);
+    }
+  }
+
+  /// Sends an EmitIndex request which is no longer waiting for any files.
+  /// See NOTE(ref: previous-plan).
+  void sendHeldEmitIndexRequest(uint32_t taskId) {
+    auto heldIt = this->heldEmitIndexRequests.find(taskId);
+    ENFORCE(heldIt != this->heldEmitIndexRequests.end());
+    auto held = std::move(heldIt->second);
+    this->heldEmitIndexRequests.erase(heldIt);
+    // The worker may have been terminated due to a timeout meanwhile.
+    if (!this->scheduler.isProcessing(held.workerId, held.request.id)) {
+      return;
+    }
+    this->sendEmitIndexJob(held.workerId, std::move(held.request),
+                           held.filesAlreadySent, held.numFilesReceived);
+  }
+
+  /// Returns false if sending failed, in which case the worker is
+  /// restarted.
+  bool sendEmitIndexRequest(WorkerId workerId, IndexJobRequest &&request) {
+    auto &queue = this->queues.driverToWorker[workerId];
+    auto requestJobId = request.id;
+    auto sendError = queue.send(std::move(request));
+    if (!sendError.has_value()) {
+      return true;
+    }
+    spdlog::warn("failed to send message to worker indicating the subset "
+                 "of files to be indexed: {}",
+                 sendError->what());
+    spdlog::info("this is probably a scip-clang bug; please report it "
+                 "(https://github.com/sourcegraph/scip-clang/issues/new)");
+    // NOTE(def: terminate-on-send-emit-index)
+    // There are several things we could do here.
+    // 1. Kill the worker and start with a new job.
+    // 2. Send a smaller message (e.g. with an empty list) for the
+    //    worker to detect and reset itself (instead of waiting
+    //    for the list of files to be indexed).
+    // 3. Try serializing smaller subsets until something succeeds.
+    // For simplicity, let's go with option 1 here.
+    this->scheduler.descheduleJobDueToSendError(workerId, requestJobId);
+    this->scheduler.terminateRunningWorker(
+        "failure to communicate over IPC", workerId,
+        [&](Scheduler::Process &&oldHandle) -> Scheduler::Process {
+          oldHandle.terminate();
+          return this->spawnWorker(workerId);
+        });
+    return false;
+  }
+
+  /// Sends EmitIndex requests whose shard cache lookups have finished.
+  ///
+  /// See NOTE(ref: shard-cache).
+  void sendEmitIndexRequestsAfterCacheLookup() {
+    auto &pending = this->pendingCacheLookups;
+    for (size_t i = 0; i < pending.size();) {
+      auto &entry = pending[i];
+      if (entry.lookup.result.wait_for(std::chrono::seconds(0))
+          != std::future_status::ready) {
+        ++i;
+        continue;
+      }
+      auto taskId = entry.request.id.taskId();
+      auto cached =
+          this->shardCache->finishLookup(taskId, std::move(entry.lookup));
+      // The worker may have been terminated due to a timeout meanwhile.
+      if (this->scheduler.isProcessing(entry.workerId, entry.request.id)) {
+        if (cached.has_value()) {
+          this->cachedShards.insert_or_assign(taskId, std::move(*cached));
+          entry.request.job.emitIndex.skipEmitting = true;
+        }
+        (void)this->sendEmitIndexRequest(entry.workerId,
+                                         std::move(entry.request));
+      }
+      if (i + 1 != pending.size()) {
+        entry = std::move(pending.back());
+      }
+      pending.pop_back();
+    }
+  }
+
   void processOneOrMoreJobResults(const ProgressReporter &progressReporter) {
     using namespace std::chrono_literals;
     auto workerTimeout = this->receiveTimeout();
+    this->sendEmitIndexRequestsAfterCacheLookup();
+    // Check for finished shard cache lookups periodically, instead of
+    // blocking until the next result or the worker timeout.
+    std::chrono::milliseconds waitDuration = workerTimeout;
+    if (!this->pendingCacheLookups.empty()) {
+      waitDuration = std::min(waitDuration, std::chrono::milliseconds(10));
+    }
     IndexJobResponse response;
     TRACE_EVENT_BEGIN(tracing::ipc, "driver.waitForResponse");
     auto recvError =
-        this->queues.workerToDriver.timedReceive(response, workerTimeout);
+        this->queues.workerToDriver.timedReceive(response, waitDuration);
     TRACE_EVENT_END(tracing::ipc);
     if (recvError.isA<TimeoutError>()) {
-      spdlog::warn("timeout: no workers have responded yet");
+      if (waitDuration == workerTimeout) {
+        spdlog::warn("timeout: no workers have responded yet");
+      }
       // All workers which are working have been doing so for too long,
       // because TimeoutError means we already exceeded the timeout limit.
     } else if (recvError) {
@@ -1407,11 +3332,39 @@ private:
                                           JobId jobId) {
     auto bareWorkerId = workerId.getValueNonConsuming();
     auto &queue = this->queues.driverToWorker[bareWorkerId];
-    auto sendError = queue.send(
-        this->scheduler.scheduleJobOnWorker(std::move(workerId), jobId));
+    auto request =
+        this->scheduler.scheduleJobOnWorker(std::move(workerId), jobId);
+    // Only attached to the request, not the tracked job, like the
+    // known external symbols for EmitIndex jobs.
+    auto planIt = this->plannedTus.find(jobId.taskId());
+    if (request.job.kind == IndexJob::Kind::SemanticAnalysis
+        && planIt != this->plannedTus.end()) {
+      auto &plannedTu = planIt->second;
+      auto &semaDetails = request.job.semanticAnalysis;
+      semaDetails.planDigest = plannedTu.digest;
+      semaDetails.tentativeFilesToBeIndexed = plannedTu.files;
+      for (auto &fileInfo : plannedTu.unclaimedFiles) {
+        if (this->tentativeOwners.contains(fileInfo.key())) {
+          plannedTu.standbyFiles.push_back(fileInfo);
+        }
+      }
+      semaDetails.standbyFilesToBeIndexed = plannedTu.standbyFiles;
+      plannedTu.sent = true;
+      plannedTu.unclaimedFiles = {};
+    }
+    if (request.job.kind == IndexJob::Kind::SemanticAnalysis
+        && this->options.speculativeEmission) {
+      request.job.semanticAnalysis.claimedFiles =
+          this->claimedFileLog.takeUnsent(bareWorkerId,
+                                          maxClaimedFilesPerMessage);
+    }
+    auto sendError = queue.send(request);
     if (sendError.has_value()) {
       spdlog::warn("failed to send job to worker: {}", sendError->what());
       this->scheduler.descheduleJobDueToSendError(bareWorkerId, jobId);
+      if (request.job.kind == IndexJob::Kind::SemanticAnalysis) {
+        this->dropPlannedTu(jobId);
+      }
       return false;
     }
     return true;
@@ -1420,12 +3373,77 @@ private:
 
 } // namespace
 
+/// NOTE(def: serve-mode): With --serve-socket-path, the driver doesn't
+/// exit after indexing. Instead, it listens on a Unix domain socket, and
+/// handles indexing requests (see ServeRequest) one at a time, replying
+/// once the index has been written. Flags other than the paths in the
+/// request are fixed when the server is started.
+///
+/// Workers are started with --persistent-worker, which makes them treat
+/// the shutdown signal at the end of a run as a signal to forget hashes
+/// sent by the driver during the run, and to wait for the next request,
+/// instead of exiting. So later requests avoid process startup and
+/// loading the package map, and the driver keeps the toolchain info
+/// for compilers seen in earlier requests (see ResumableParser). Workers
+/// exit once they notice that the driver has exited.
+///
+/// Errors which make a one-shot invocation fail (e.g. a compilation
+/// database which cannot be read) are reported in the response, and the
+/// server keeps handling requests. Infrastructure failures (e.g. running
+/// out of space for IPC queues or temporary files) still stop the server,
+/// so clients should treat a connection closed without a response as
+/// a failure.
+///
+/// Limitations:
+/// - --shard-log and --worker-premerge-count are not supported, as both
+///   rely on workers exiting at the end of a run.
+int serveMain(CliOptions &&cliOptions) {
+  auto driverId = cliOptions.driverId.empty() ? fmt::format("{}", ::getpid())
+                                              : cliOptions.driverId;
+  ServerSocket socket{cliOptions.serveSocketPath};
+  BOOST_TRY {
+    Driver driver(driverId, DriverOptions(driverId, std::move(cliOptions)));
+    while (true) {
+      ServeRequest request{};
+      auto error = socket.receiveRequest(request);
+      if (!error.has_value()) {
+        error = driver.setRequest(request);
+      }
+      if (error.has_value()) {
+        spdlog::warn("rejecting request: {}", *error);
+        socket.respond(ServeResponse{false, std::move(*error)});
+        continue;
+      }
+      spdlog::info("indexing '{}'", request.compdbPath);
+      error = driver.run();
+      driver.resetForNextRun();
+      if (error.has_value()) {
+        spdlog::error("failed to index '{}': {}", request.compdbPath, *error);
+        socket.respond(ServeResponse{false, std::move(*error)});
+        continue;
+      }
+      socket.respond(ServeResponse{
+          true, fmt::format("wrote index to '{}'", request.indexOutputPath)});
+    }
+  }
+  BOOST_CATCH(boost_ip::interprocess_exception & ex) {
+    spdlog::error("driver caught exception {}", ex.what());
+    return 1;
+  }
+  BOOST_CATCH_END
+  return 0;
+}
+
 int driverMain(CliOptions &&cliOptions) {
   auto driverId = cliOptions.driverId.empty() ? fmt::format("{}", ::getpid())
                                               : cliOptions.driverId;
   BOOST_TRY {
     Driver driver(driverId, DriverOptions(driverId, std::move(cliOptions)));
-    driver.run();
+    auto error = driver.run();
+    if (error.has_value()) {
+      spdlog::error("{}", *error);
+      return 1;
+    }
   }
   BOOST_CATCH(boost_ip::interprocess_exception & ex) {
     spdlog::error("driver caught exception {}", ex.what());
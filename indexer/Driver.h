@@ -7,6 +7,8 @@ struct CliOptions;
 
 int driverMain(CliOptions &&);
 
+int serveMain(CliOptions &&);
+
 } // namespace scip_clang
 
 #endif // SCIP_CLANG_DRIVER_H
\ No newline at end of file
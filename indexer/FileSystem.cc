@@ -1,4 +1,6 @@
+#include <cerrno>
 #include <string>
+#include <unistd.h>
 
 #include "llvm/Support/raw_ostream.h"
 
@@ -29,4 +31,23 @@ std::string readFileToString(const StdPath &path, std::error_code &ec) {
   return out;
 }
 
+bool preadExact(int fd, uint64_t offset, size_t size, std::string &out) {
+  out.resize(size);
+  size_t done = 0;
+  while (done < size) {
+    auto n = ::pread(fd, out.data() + done, size - done, off_t(offset + done));
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n == 0) {
+        errno = 0;
+      }
+      return false;
+    }
+    done += size_t(n);
+  }
+  return true;
+}
+
 } // namespace scip_clang
\ No newline at end of file
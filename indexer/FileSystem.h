@@ -1,8 +1,11 @@
 #ifndef SCIP_CLANG_FILESYSTEM_H
 #define SCIP_CLANG_FILESYSTEM_H
 
+#include <cstddef>
+#include <cstdint>
 #include <cstdio>
 #include <filesystem>
+#include <string>
 
 namespace scip_clang {
 
@@ -21,6 +24,12 @@ public:
   }
 };
 
+/// Reads exactly \p size bytes at \p offset in \p fd into \p out,
+/// retrying interrupted and short reads.
+///
+/// Returns false on failure, with errno set to 0 if the file ended early.
+bool preadExact(int fd, uint64_t offset, size_t size, std::string &out);
+
 } // namespace scip_clang
 
 #endif // SCIP_CLANG_FILESYSTEM_H
\ No newline at end of file
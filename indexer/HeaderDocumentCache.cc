@@ -0,0 +1,150 @@
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <ios>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "spdlog/fmt/fmt.h"
+#include "spdlog/spdlog.h"
+
+#include "proto/document_cache.pb.h"
+#include "proto/fwd_decls.pb.h"
+#include "scip/scip.pb.h"
+
+#include "indexer/FileSystem.h"
+#include "indexer/Hash.h"
+#include "indexer/HeaderDocumentCache.h"
+#include "indexer/Path.h"
+
+namespace {
+
+constexpr std::string_view entrySuffix = ".document.scip";
+
+} // namespace
+
+namespace scip_clang {
+
+HeaderDocumentCache::HeaderDocumentCache(StdPath dir) : dir(std::move(dir)) {}
+
+// static
+uint64_t HeaderDocumentCache::key(AbsolutePathRef path,
+                                  std::string_view relativePath,
+                                  HashValue preprocessorHash,
+                                  std::string_view contents) {
+  HashValue hash{preprocessorHash.rawValue};
+  auto mixString = [&hash](std::string_view s) {
+    uint64_t size = s.size();
+    hash.mix(reinterpret_cast<const uint8_t *>(&size), sizeof(size));
+    hash.mix(reinterpret_cast<const uint8_t *>(s.data()), s.size());
+  };
+  mixString(path.asStringView());
+  mixString(relativePath);
+  mixString(contents);
+  return hash.rawValue;
+}
+
+std::optional<scip::CachedDocument>
+HeaderDocumentCache::load(uint64_t key) const {
+  auto path = this->entryPath(key);
+  std::ifstream input(path, std::ios_base::in | std::ios_base::binary);
+  if (input.fail()) {
+    return {};
+  }
+  scip::CachedDocument entry{};
+  if (!entry.ParseFromIstream(&input)
+      || entry.document().relative_path().empty()) {
+    spdlog::debug("ignoring malformed header cache entry at '{}'",
+                  path.c_str());
+    return {};
+  }
+  // Mark the entry as used, see HeaderDocumentCache::removeUnusedEntries.
+  std::error_code error;
+  std::filesystem::last_write_time(
+      path, std::filesystem::file_time_type::clock::now(), error);
+  return entry;
+}
+
+void HeaderDocumentCache::store(
+    const std::vector<std::pair<uint64_t, const scip::Document *>> &documents,
+    const scip::ForwardDeclIndex &forwardDecls) const {
+  if (documents.empty()) {
+    return;
+  }
+  std::vector<scip::CachedDocument> entries(documents.size());
+  absl::flat_hash_map<std::string_view, scip::CachedDocument *> entriesByPath;
+  for (size_t i = 0; i < documents.size(); ++i) {
+    *entries[i].mutable_document() = *documents[i].second;
+    entriesByPath.emplace(documents[i].second->relative_path(), &entries[i]);
+  }
+  for (auto &forwardDecl : forwardDecls.forward_decls()) {
+    for (auto &ref : forwardDecl.references()) {
+      auto it = entriesByPath.find(ref.relative_path());
+      if (it == entriesByPath.end()) {
+        continue;
+      }
+      auto &cachedForwardDecls = *it->second->mutable_forward_decls();
+      // All references for a forward decl are visited together,
+      // so only the last entry needs to be checked.
+      auto size = cachedForwardDecls.size();
+      if (size == 0
+          || cachedForwardDecls[size - 1].suffix() != forwardDecl.suffix()) {
+        auto *cachedForwardDecl = it->second->add_forward_decls();
+        cachedForwardDecl->set_suffix(forwardDecl.suffix());
+        cachedForwardDecl->set_documentation(forwardDecl.documentation());
+        size++;
+      }
+      *cachedForwardDecls.Mutable(size - 1)->add_references() = ref;
+    }
+  }
+  for (size_t i = 0; i < documents.size(); ++i) {
+    auto path = this->entryPath(documents[i].first);
+    auto tmpPath = path;
+    tmpPath.concat(fmt::format(".tmp-{}", ::getpid()));
+    {
+      std::ofstream output(tmpPath, std::ios_base::out | std::ios_base::binary
+                                        | std::ios_base::trunc);
+      if (output.fail() || !entries[i].SerializeToOstream(&output)) {
+        spdlog::debug("failed to write header cache entry at '{}'",
+                      tmpPath.c_str());
+        continue;
+      }
+    }
+    std::error_code error;
+    std::filesystem::rename(tmpPath, path, error);
+    if (error) {
+      std::filesystem::remove(tmpPath, error);
+    }
+  }
+}
+
+// static
+void HeaderDocumentCache::removeUnusedEntries(
+    const StdPath &dir, std::filesystem::file_time_type cutoff) {
+  size_t numDeleted = 0;
+  std::error_code error;
+  for (auto &dirEntry : std::filesystem::directory_iterator(dir, error)) {
+    std::error_code entryError;
+    auto mtime = dirEntry.last_write_time(entryError);
+    if (entryError || mtime >= cutoff) {
+      continue;
+    }
+    if (std::filesystem::remove(dirEntry.path(), entryError)) {
+      numDeleted++;
+    }
+  }
+  spdlog::debug("deleted {} unused entries from the header cache",
+                numDeleted);
+}
+
+StdPath HeaderDocumentCache::entryPath(uint64_t key) const {
+  return this->dir / fmt::format("{:016x}{}", key, entrySuffix);
+}
+
+} // namespace scip_clang
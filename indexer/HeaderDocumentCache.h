@@ -0,0 +1,79 @@
+#ifndef SCIP_CLANG_HEADER_DOCUMENT_CACHE_H
+#define SCIP_CLANG_HEADER_DOCUMENT_CACHE_H
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "proto/document_cache.pb.h"
+#include "proto/fwd_decls.pb.h"
+#include "scip/scip.pb.h"
+
+#include "indexer/FileSystem.h"
+#include "indexer/Hash.h"
+#include "indexer/Path.h"
+
+namespace scip_clang {
+
+/// NOTE(def: header-document-cache): With --header-cache-dir, workers
+/// persist the document emitted for each header along with the forward
+/// declaration references inside it, keyed by the header's path, its
+/// preprocessor hash (as computed by IndexerPreprocessorWrapper and used
+/// by the FileIndexingPlanner) and a hash of its contents. When a header
+/// assigned to a TU has an entry, the worker skips emitting a document
+/// for it, and adds the cached document to its output instead. So
+/// heavily shared headers are indexed once per change, rather than once
+/// per run, even when the TUs including them need to be re-indexed.
+///
+/// The worker decides which headers to skip, rather than the driver, as
+/// the worker already has the contents of each header in memory, and
+/// knows the mapping from absolute paths to document paths.
+///
+/// The driver keeps entries for different scip-clang versions and package
+/// maps in different subdirectories, and deletes entries which were not
+/// used (or written) during a run after it finishes.
+///
+/// Limitations:
+/// - Main files and headers included with different preprocessor hashes
+///   in a single TU are never cached.
+/// - The key only has the contents of the header itself, so a change to
+///   another header which affects the symbols referenced from this header
+///   (e.g. a using-directive) without changing its include structure or
+///   macro usage will not invalidate the cached document. This is the same
+///   assumption as the one made by the FileIndexingPlanner across TUs,
+///   extended across runs.
+class HeaderDocumentCache final {
+  StdPath dir;
+
+public:
+  explicit HeaderDocumentCache(StdPath dir);
+  HeaderDocumentCache(const HeaderDocumentCache &) = delete;
+  HeaderDocumentCache &operator=(const HeaderDocumentCache &) = delete;
+
+  static uint64_t key(AbsolutePathRef path, std::string_view relativePath,
+                      HashValue preprocessorHash, std::string_view contents);
+
+  /// Returns the entry for \p key if present, and marks it as used.
+  std::optional<scip::CachedDocument> load(uint64_t key) const;
+
+  /// Writes entries for \p documents, taking forward declaration
+  /// references inside each document from \p forwardDecls.
+  void store(const std::vector<std::pair<uint64_t, const scip::Document *>>
+                 &documents,
+             const scip::ForwardDeclIndex &forwardDecls) const;
+
+  /// Deletes entries in \p dir which were neither used nor written
+  /// since \p cutoff.
+  static void removeUnusedEntries(const StdPath &dir,
+                                  std::filesystem::file_time_type cutoff);
+
+private:
+  StdPath entryPath(uint64_t key) const;
+};
+
+} // namespace scip_clang
+
+#endif // SCIP_CLANG_HEADER_DOCUMENT_CACHE_H
@@ -0,0 +1,311 @@
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <ios>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "absl/algorithm/container.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/ascii.h"
+#include "spdlog/fmt/fmt.h"
+#include "spdlog/spdlog.h"
+
+#include "proto/include_graph.pb.h"
+
+#include "indexer/CompilationDatabase.h"
+#include "indexer/FileSystem.h"
+#include "indexer/Hash.h"
+#include "indexer/IncludeGraph.h"
+#include "indexer/IpcMessages.h"
+#include "indexer/Path.h"
+
+namespace {
+
+std::string mainFilePath(const scip_clang::compdb::CommandObject &command) {
+  StdPath path{command.filePath};
+  if (!path.is_absolute()) {
+    path = StdPath(command.workingDirectory) / path;
+  }
+  return path.lexically_normal().string();
+}
+
+bool isValid(const scip::IncludeGraph &graph) {
+  auto numFiles = uint32_t(graph.files_size());
+  for (auto &tu : graph.tus()) {
+    if (tu.files_size() != tu.hashes_size()
+        || tu.files_size() != tu.emitted_size()) {
+      return false;
+    }
+    for (auto fileId : tu.files()) {
+      if (fileId >= numFiles) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+} // namespace
+
+namespace scip_clang {
+
+IncludeGraph::IncludeGraph(AbsolutePath path,
+                           const AbsolutePath &changedFilesPath)
+    : path(std::move(path)),
+      filtering(!changedFilesPath.asStringRef().empty()), changedFiles(),
+      previous(), previousTus(), previousFileChanged(), carriedOverMainFiles(),
+      next(), nextFileIds(), pendingTus(), skippedCount(0) {}
+
+std::optional<std::string>
+IncludeGraph::load(const AbsolutePath &changedFilesPath,
+                   bool reusePreviousPlan, const RootPath &projectRootPath) {
+  std::optional<std::string> error{};
+  if (this->filtering) {
+    error = this->loadPrevious(/*mustExist*/ true);
+    if (!error) {
+      error = this->loadChangedFiles(changedFilesPath, projectRootPath);
+    }
+  } else if (reusePreviousPlan) {
+    error = this->loadPrevious(/*mustExist*/ false);
+  }
+  if (error) {
+    return error;
+  }
+  for (int i = 0; i < this->previous.tus_size(); ++i) {
+    this->previousTus[this->previous.tus(i).main_file()].push_back(i);
+  }
+  if (!this->filtering) {
+    return {};
+  }
+  this->previousFileChanged.reserve(this->previous.files_size());
+  for (auto &file : this->previous.files()) {
+    this->previousFileChanged.push_back(this->changedFiles.contains(file));
+  }
+  return {};
+}
+
+std::optional<std::string> IncludeGraph::loadPrevious(bool mustExist) {
+  auto &pathStr = this->path.asStringRef();
+  std::ifstream input(pathStr, std::ios_base::in | std::ios_base::binary);
+  if (input.fail() && !mustExist) {
+    spdlog::info("no include graph from a previous run at '{}'; planning "
+                 "from scratch",
+                 pathStr);
+    return {};
+  }
+  if (input.fail()) {
+    return fmt::format("--changed-files requires the include graph from a "
+                       "previous run, but failed to open '{}'",
+                       pathStr);
+  }
+  if (!this->previous.ParseFromIstream(&input) || !::isValid(this->previous)) {
+    if (!mustExist) {
+      spdlog::warn("ignoring malformed include graph at '{}'", pathStr);
+      this->previous.Clear();
+      return {};
+    }
+    return fmt::format("failed to parse include graph at '{}'", pathStr);
+  }
+  return {};
+}
+
+std::optional<std::string>
+IncludeGraph::loadChangedFiles(const AbsolutePath &changedFilesPath,
+                               const RootPath &projectRootPath) {
+  std::ifstream input(changedFilesPath.asStringRef());
+  if (input.fail()) {
+    return fmt::format("failed to open list of changed files at '{}'",
+                       changedFilesPath.asStringRef());
+  }
+  StdPath projectRoot{projectRootPath.asRef().asStringView()};
+  std::string line;
+  while (std::getline(input, line)) {
+    auto trimmed = absl::StripAsciiWhitespace(line);
+    if (trimmed.empty()) {
+      continue;
+    }
+    StdPath changedPath{std::string(trimmed)};
+    if (!changedPath.is_absolute()) {
+      changedPath = projectRoot / changedPath;
+    }
+    changedPath = changedPath.lexically_normal();
+    this->changedFiles.insert(changedPath.string());
+    // Paths reported by Clang have symlinks resolved.
+    std::error_code error;
+    auto canonicalPath = std::filesystem::weakly_canonical(changedPath, error);
+    if (!error) {
+      this->changedFiles.insert(canonicalPath.string());
+    }
+  }
+  spdlog::debug("read {} changed paths from '{}'", this->changedFiles.size(),
+                changedFilesPath.asStringRef());
+  return {};
+}
+
+bool IncludeGraph::shouldIndex(const compdb::CommandObject &command) {
+  if (!this->filtering) {
+    return true;
+  }
+  auto mainFile = ::mainFilePath(command);
+  if (this->carriedOverMainFiles.contains(mainFile)) {
+    this->skippedCount++;
+    return false;
+  }
+  auto it = this->previousTus.find(mainFile);
+  if (it == this->previousTus.end() || this->changedFiles.contains(mainFile)) {
+    return true;
+  }
+  for (auto tuIndex : it->second) {
+    for (auto fileId : this->previous.tus(tuIndex).files()) {
+      if (this->previousFileChanged[fileId]) {
+        return true;
+      }
+    }
+  }
+  this->carriedOverMainFiles.insert(std::move(mainFile));
+  this->skippedCount++;
+  return false;
+}
+
+std::optional<HashValue>
+IncludeGraph::previousFiles(const compdb::CommandObject &command,
+                            std::vector<PreprocessedFileInfo> &files) const {
+  auto it = this->previousTus.find(::mainFilePath(command));
+  if (it == this->previousTus.end() || it->second.size() != 1) {
+    return {};
+  }
+  auto &tu = this->previous.tus(it->second[0]);
+  std::vector<std::pair<std::string_view, uint64_t>> edges{};
+  edges.reserve(tu.files_size());
+  for (int i = 0; i < tu.files_size(); ++i) {
+    auto &filePath = this->previous.files(int(tu.files(i)));
+    edges.emplace_back(filePath, tu.hashes(i));
+    files.push_back({AbsolutePath(std::string(filePath)), {tu.hashes(i)}});
+  }
+  return IncludeGraph::digestFiles(edges);
+}
+
+// static
+HashValue IncludeGraph::digest(const SemanticAnalysisJobResult &semaResult) {
+  std::vector<std::pair<std::string_view, uint64_t>> edges{};
+  for (auto &fileInfo : semaResult.wellBehavedFiles) {
+    edges.emplace_back(fileInfo.path.asStringRef(),
+                       fileInfo.hashValue.rawValue);
+  }
+  for (auto &fileInfo : semaResult.illBehavedFiles) {
+    for (auto hashValue : fileInfo.hashValues) {
+      edges.emplace_back(fileInfo.path.asStringRef(), hashValue.rawValue);
+    }
+  }
+  return IncludeGraph::digestFiles(edges);
+}
+
+// static
+HashValue IncludeGraph::digestFiles(
+    std::vector<std::pair<std::string_view, uint64_t>> &files) {
+  absl::c_sort(files);
+  HashValue hash{0};
+  for (auto &[filePath, fileHash] : files) {
+    uint64_t size = filePath.size();
+    hash.mix(reinterpret_cast<const uint8_t *>(&size), sizeof(size));
+    hash.mix(reinterpret_cast<const uint8_t *>(filePath.data()),
+             filePath.size());
+    hash.mix(reinterpret_cast<const uint8_t *>(&fileHash), sizeof(fileHash));
+  }
+  return hash;
+}
+
+void IncludeGraph::recordSemaResult(
+    uint32_t taskId, const compdb::CommandObject &command,
+    const SemanticAnalysisJobResult &semaResult) {
+  scip::IncludeGraphTu tu{};
+  tu.set_main_file(::mainFilePath(command));
+  for (auto &fileInfo : semaResult.wellBehavedFiles) {
+    tu.add_files(this->addFile(fileInfo.path.asStringRef()));
+    tu.add_hashes(fileInfo.hashValue.rawValue);
+    tu.add_emitted(false);
+  }
+  for (auto &fileInfo : semaResult.illBehavedFiles) {
+    auto fileId = this->addFile(fileInfo.path.asStringRef());
+    for (auto hashValue : fileInfo.hashValues) {
+      tu.add_files(fileId);
+      tu.add_hashes(hashValue.rawValue);
+      tu.add_emitted(false);
+    }
+  }
+  this->pendingTus.insert_or_assign(taskId, this->next.tus_size());
+  *this->next.add_tus() = std::move(tu);
+}
+
+void IncludeGraph::recordAssignedFiles(
+    uint32_t taskId, const std::vector<PreprocessedFileInfo> &assigned) {
+  auto it = this->pendingTus.find(taskId);
+  if (it == this->pendingTus.end()) {
+    return;
+  }
+  auto &tu = *this->next.mutable_tus(it->second);
+  this->pendingTus.erase(it);
+  absl::flat_hash_map<std::pair<uint32_t, uint64_t>, int> edges{};
+  for (int i = 0; i < tu.files_size(); ++i) {
+    edges.emplace(std::make_pair(tu.files(i), tu.hashes(i)), i);
+  }
+  for (auto &fileInfo : assigned) {
+    auto fileIt = this->nextFileIds.find(fileInfo.path.asStringRef());
+    if (fileIt == this->nextFileIds.end()) {
+      continue;
+    }
+    auto edgeIt =
+        edges.find(std::make_pair(fileIt->second, fileInfo.hashValue.rawValue));
+    if (edgeIt != edges.end()) {
+      tu.set_emitted(edgeIt->second, true);
+    }
+  }
+}
+
+void IncludeGraph::save() {
+  for (auto &tu : this->previous.tus()) {
+    if (!this->carriedOverMainFiles.contains(tu.main_file())) {
+      continue;
+    }
+    auto &newTu = *this->next.add_tus();
+    newTu.set_main_file(tu.main_file());
+    for (int i = 0; i < tu.files_size(); ++i) {
+      newTu.add_files(this->addFile(this->previous.files(int(tu.files(i)))));
+      newTu.add_hashes(tu.hashes(i));
+      newTu.add_emitted(tu.emitted(i));
+    }
+  }
+
+  auto &pathStr = this->path.asStringRef();
+  auto tmpPath = fmt::format("{}.tmp", pathStr);
+  {
+    std::ofstream output(tmpPath, std::ios_base::out | std::ios_base::binary
+                                      | std::ios_base::trunc);
+    if (output.fail() || !this->next.SerializeToOstream(&output)) {
+      spdlog::warn("failed to write include graph to '{}'", tmpPath);
+      return;
+    }
+  }
+  std::error_code error;
+  std::filesystem::rename(tmpPath, pathStr, error);
+  if (error) {
+    spdlog::warn("failed to write include graph to '{}' ({})", pathStr,
+                 error.message());
+  }
+}
+
+uint32_t IncludeGraph::addFile(const std::string &path) {
+  auto [it, inserted] =
+      this->nextFileIds.emplace(path, uint32_t(this->next.files_size()));
+  if (inserted) {
+    this->next.add_files(path);
+  }
+  return it->second;
+}
+
+} // namespace scip_clang
@@ -0,0 +1,118 @@
+#ifndef SCIP_CLANG_INCLUDE_GRAPH_H
+#define SCIP_CLANG_INCLUDE_GRAPH_H
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
+
+#include "proto/include_graph.pb.h"
+
+#include "indexer/CompilationDatabase.h"
+#include "indexer/FileSystem.h"
+#include "indexer/Hash.h"
+#include "indexer/IpcMessages.h"
+#include "indexer/Path.h"
+
+namespace scip_clang {
+
+/// NOTE(def: changed-files): With --include-graph-path, the driver writes
+/// out the set of files touched by each TU (as reported after semantic
+/// analysis), along with the preprocessor hash for each (TU, file) edge
+/// and whether the TU emitted the document for the file.
+///
+/// With --changed-files, the graph from a previous run is read back, and
+/// only TUs which are new or which touched one of the changed files (e.g.
+/// from `git diff --name-only`) are indexed. The resulting index only
+/// covers the affected TUs. Records for the skipped TUs are carried over
+/// to the new graph, so it stays usable for the next run.
+///
+/// TUs are identified by the absolute path of their main file, so a file
+/// with several compilation database entries is either re-indexed for all
+/// of them or for none of them.
+///
+/// The graph from a previous run is also used for planning with
+/// --reuse-previous-plan, see NOTE(ref: previous-plan).
+class IncludeGraph final {
+  AbsolutePath path;
+
+  /// Set iff --changed-files was passed.
+  bool filtering;
+  absl::flat_hash_set<std::string> changedFiles;
+  /// Empty unless --changed-files or --reuse-previous-plan was passed.
+  scip::IncludeGraph previous;
+  /// main file -> indexes into previous.tus
+  absl::flat_hash_map<std::string, std::vector<int>> previousTus;
+  /// Indexed by previous file index.
+  std::vector<bool> previousFileChanged;
+  absl::flat_hash_set<std::string> carriedOverMainFiles;
+
+  scip::IncludeGraph next;
+  /// path -> index into next.files
+  absl::flat_hash_map<std::string, uint32_t> nextFileIds;
+  /// task ID -> index into next.tus
+  absl::flat_hash_map<uint32_t, int> pendingTus;
+
+  size_t skippedCount;
+
+public:
+  IncludeGraph(AbsolutePath path, const AbsolutePath &changedFilesPath);
+  IncludeGraph(const IncludeGraph &) = delete;
+  IncludeGraph &operator=(const IncludeGraph &) = delete;
+
+  /// Loads the graph from a previous run at \p path if \p changedFilesPath
+  /// is non-empty, returning an error message on failure. Otherwise, if
+  /// \p reusePreviousPlan is set, loads the graph if it is present and
+  /// well-formed.
+  std::optional<std::string> load(const AbsolutePath &changedFilesPath,
+                                  bool reusePreviousPlan,
+                                  const RootPath &projectRootPath);
+
+  /// Returns false if the command should be skipped, as none of the
+  /// files it touched in the previous run were changed.
+  bool shouldIndex(const compdb::CommandObject &);
+
+  /// Appends the files touched by the TU in the previous run to \p files,
+  /// and returns their digest (see \c digest). Returns std::nullopt if
+  /// the main file had zero or several TUs in the previous run.
+  std::optional<HashValue>
+  previousFiles(const compdb::CommandObject &,
+                std::vector<PreprocessedFileInfo> &files) const;
+
+  /// Order-independent digest of the files touched by a TU, with each
+  /// file paired with its preprocessor hash.
+  static HashValue digest(const SemanticAnalysisJobResult &);
+
+  /// Records the files touched by a TU after semantic analysis.
+  void recordSemaResult(uint32_t taskId, const compdb::CommandObject &,
+                        const SemanticAnalysisJobResult &);
+
+  /// Records the files which a TU was asked to emit into its shard.
+  void recordAssignedFiles(uint32_t taskId,
+                           const std::vector<PreprocessedFileInfo> &assigned);
+
+  /// Writes out the graph, including records carried over for skipped TUs.
+  void save();
+
+  size_t numSkipped() const {
+    return this->skippedCount;
+  }
+
+private:
+  std::optional<std::string> loadPrevious(bool mustExist);
+  std::optional<std::string>
+  loadChangedFiles(const AbsolutePath &changedFilesPath,
+                   const RootPath &projectRootPath);
+  uint32_t addFile(const std::string &path);
+  static HashValue
+  digestFiles(std::vector<std::pair<std::string_view, uint64_t>> &files);
+};
+
+} // namespace scip_clang
+
+#endif // SCIP_CLANG_INCLUDE_GRAPH_H
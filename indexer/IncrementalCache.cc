@@ -0,0 +1,332 @@
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <ios>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "spdlog/fmt/fmt.h"
+#include "spdlog/spdlog.h"
+
+#include "llvm/Support/Path.h"
+
+#include "proto/incremental_manifest.pb.h"
+
+#include "indexer/CompilationDatabase.h"
+#include "indexer/FileSystem.h"
+#include "indexer/Hash.h"
+#include "indexer/IncrementalCache.h"
+#include "indexer/IpcMessages.h"
+#include "indexer/Path.h"
+
+namespace {
+
+constexpr std::string_view manifestFileName = "manifest.pb";
+
+uint64_t commandDigest(const scip_clang::compdb::CommandObject &command) {
+  scip_clang::HashValue hash{0};
+  auto mixString = [&hash](std::string_view s) {
+    uint64_t size = s.size();
+    hash.mix(reinterpret_cast<const uint8_t *>(&size), sizeof(size));
+    hash.mix(reinterpret_cast<const uint8_t *>(s.data()), s.size());
+  };
+  mixString(command.workingDirectory);
+  mixString(command.filePath);
+  for (auto &arg : command.arguments) {
+    mixString(arg);
+  }
+  return hash.rawValue;
+}
+
+scip::FileFingerprint fingerprint(const std::string &path) {
+  scip::FileFingerprint fingerprint{};
+  fingerprint.set_path(path);
+  std::error_code error;
+  auto size = std::filesystem::file_size(path, error);
+  if (error) {
+    fingerprint.set_mtime_ns(-1);
+    return fingerprint;
+  }
+  auto mtime = std::filesystem::last_write_time(path, error);
+  if (error) {
+    fingerprint.set_mtime_ns(-1);
+    return fingerprint;
+  }
+  fingerprint.set_size(uint64_t(size));
+  fingerprint.set_mtime_ns(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          mtime.time_since_epoch())
+          .count());
+  return fingerprint;
+}
+
+bool moveFile(const scip_clang::AbsolutePath &from, const StdPath &to,
+              bool keepOriginal) {
+  std::error_code error;
+  if (!keepOriginal) {
+    std::filesystem::rename(from.asStringRef(), to, error);
+    if (!error) {
+      return true;
+    }
+  }
+  // The temporary directory may be on a different file system.
+  std::filesystem::copy_file(from.asStringRef(), to,
+                             std::filesystem::copy_options::overwrite_existing,
+                             error);
+  if (error) {
+    spdlog::warn("failed to copy shard '{}' to incremental cache at '{}' ({})",
+                 from.asStringRef(), to.c_str(), error.message());
+    return false;
+  }
+  if (!keepOriginal) {
+    std::filesystem::remove(from.asStringRef(), error);
+  }
+  return true;
+}
+
+bool isValid(const scip::IncrementalManifest &manifest) {
+  auto numFiles = uint32_t(manifest.files_size());
+  for (auto &tu : manifest.tus()) {
+    if (tu.assigned_files_size() != tu.assigned_hashes_size()) {
+      return false;
+    }
+    for (auto fileId : tu.touched_files()) {
+      if (fileId >= numFiles) {
+        return false;
+      }
+    }
+    for (auto fileId : tu.assigned_files()) {
+      if (fileId >= numFiles) {
+        return false;
+      }
+    }
+  }
+  for (auto &file : manifest.files()) {
+    if (!scip_clang::AbsolutePathRef::tryFrom(std::string_view(file.path()))
+             .has_value()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace
+
+namespace scip_clang {
+
+IncrementalCache::IncrementalCache(StdPath cacheDir, uint64_t configDigest)
+    : cacheDir(std::move(cacheDir)), configDigest(configDigest), previous(),
+      previousTus(), previousFileUnchanged(), next(), nextFileIds(),
+      pendingTus(), claimedDigests(), reusedCount(0) {
+  auto manifestPath = this->cacheDir / manifestFileName;
+  std::error_code error;
+  if (!std::filesystem::exists(manifestPath, error)) {
+    spdlog::info("no incremental manifest found at '{}'; indexing all TUs",
+                 manifestPath.c_str());
+    return;
+  }
+  std::ifstream input(manifestPath, std::ios_base::in | std::ios_base::binary);
+  scip::IncrementalManifest manifest{};
+  if (input.fail() || !manifest.ParseFromIstream(&input)
+      || !::isValid(manifest)) {
+    spdlog::warn("ignoring malformed incremental manifest at '{}'",
+                 manifestPath.c_str());
+    return;
+  }
+  if (manifest.config_digest() != this->configDigest) {
+    spdlog::info("scip-clang version or options changed since the last run; "
+                 "indexing all TUs");
+    return;
+  }
+  this->previous = std::move(manifest);
+  for (int i = 0; i < this->previous.tus_size(); ++i) {
+    this->previousTus.emplace(this->previous.tus(i).command_digest(), i);
+  }
+  this->previousFileUnchanged.resize(this->previous.files_size());
+}
+
+std::optional<IncrementalCache::ReusedTu>
+IncrementalCache::tryReuse(const compdb::CommandObject &command) {
+  auto digest = ::commandDigest(command);
+  if (this->claimedDigests.contains(digest)) {
+    return {};
+  }
+  auto it = this->previousTus.find(digest);
+  if (it == this->previousTus.end()) {
+    return {};
+  }
+  auto &entry = this->previous.tus(it->second);
+  for (auto fileId : entry.touched_files()) {
+    if (!this->isUnchanged(int(fileId))) {
+      return {};
+    }
+  }
+  auto paths = ShardPaths::forFiles(this->shardPrefix(digest));
+  std::error_code error;
+  if (!std::filesystem::exists(paths.docsAndExternals.asStringRef(), error)
+      || !std::filesystem::exists(paths.forwardDecls.asStringRef(), error)) {
+    return {};
+  }
+
+  scip::TuEntry nextEntry{};
+  nextEntry.set_command_digest(digest);
+  for (auto fileId : entry.touched_files()) {
+    auto &file = this->previous.files(int(fileId));
+    nextEntry.add_touched_files(this->addFile(file.path(), &file));
+  }
+  std::vector<PreprocessedFileInfo> assignedFiles{};
+  for (int i = 0; i < entry.assigned_files_size(); ++i) {
+    auto &file = this->previous.files(int(entry.assigned_files(i)));
+    nextEntry.add_assigned_files(this->addFile(file.path(), &file));
+    nextEntry.add_assigned_hashes(entry.assigned_hashes(i));
+    assignedFiles.push_back(
+        PreprocessedFileInfo{AbsolutePath(std::string(file.path())),
+                             HashValue{entry.assigned_hashes(i)}});
+  }
+  *this->next.add_tus() = std::move(nextEntry);
+  this->claimedDigests.insert(digest);
+  this->reusedCount++;
+  return ReusedTu{std::move(paths), std::move(assignedFiles)};
+}
+
+void IncrementalCache::recordSemaResult(
+    uint32_t taskId, const compdb::CommandObject &command,
+    const SemanticAnalysisJobResult &semaResult) {
+  scip::TuEntry entry{};
+  entry.set_command_digest(::commandDigest(command));
+  // The preprocessor should report the main file too, but be defensive.
+  std::string mainFilePath = command.filePath;
+  if (!llvm::sys::path::is_absolute(mainFilePath)) {
+    mainFilePath = (StdPath(command.workingDirectory) / mainFilePath).string();
+  }
+  if (llvm::sys::path::is_absolute(mainFilePath)) {
+    entry.add_touched_files(this->addFile(mainFilePath, nullptr));
+  }
+  for (auto &fileInfo : semaResult.wellBehavedFiles) {
+    entry.add_touched_files(
+        this->addFile(fileInfo.path.asStringRef(), nullptr));
+  }
+  for (auto &fileInfo : semaResult.illBehavedFiles) {
+    entry.add_touched_files(
+        this->addFile(fileInfo.path.asStringRef(), nullptr));
+  }
+  this->pendingTus.insert_or_assign(taskId, std::move(entry));
+}
+
+void IncrementalCache::recordAssignedFiles(
+    uint32_t taskId, const std::vector<PreprocessedFileInfo> &assigned) {
+  auto it = this->pendingTus.find(taskId);
+  if (it == this->pendingTus.end()) {
+    return;
+  }
+  auto &entry = it->second;
+  for (auto &fileInfo : assigned) {
+    entry.add_assigned_files(
+        this->addFile(fileInfo.path.asStringRef(), nullptr));
+    entry.add_assigned_hashes(fileInfo.hashValue.rawValue);
+  }
+}
+
+ShardPaths IncrementalCache::recordShards(uint32_t taskId, ShardPaths &&paths,
+                                          bool keepOriginals) {
+  auto it = this->pendingTus.find(taskId);
+  if (it == this->pendingTus.end() || paths.docsAndExternalsRange.has_value()) {
+    return std::move(paths);
+  }
+  auto entry = std::move(it->second);
+  this->pendingTus.erase(it);
+  auto digest = entry.command_digest();
+  if (this->claimedDigests.contains(digest)) {
+    return std::move(paths);
+  }
+  auto cachedPaths = ShardPaths::forFiles(this->shardPrefix(digest));
+  if (!::moveFile(paths.docsAndExternals,
+                  StdPath(cachedPaths.docsAndExternals.asStringRef()),
+                  keepOriginals)
+      || !::moveFile(paths.forwardDecls,
+                     StdPath(cachedPaths.forwardDecls.asStringRef()),
+                     keepOriginals)) {
+    return std::move(paths);
+  }
+  *this->next.add_tus() = std::move(entry);
+  this->claimedDigests.insert(digest);
+  return cachedPaths;
+}
+
+void IncrementalCache::save() {
+  this->next.set_config_digest(this->configDigest);
+  auto manifestPath = this->cacheDir / manifestFileName;
+  auto tmpPath = this->cacheDir / fmt::format("{}.tmp", manifestFileName);
+  {
+    std::ofstream output(tmpPath, std::ios_base::out | std::ios_base::binary
+                                      | std::ios_base::trunc);
+    if (output.fail() || !this->next.SerializeToOstream(&output)) {
+      spdlog::warn("failed to write incremental manifest to '{}'",
+                   tmpPath.c_str());
+      return;
+    }
+  }
+  std::error_code error;
+  std::filesystem::rename(tmpPath, manifestPath, error);
+  if (error) {
+    spdlog::warn("failed to write incremental manifest to '{}' ({})",
+                 manifestPath.c_str(), error.message());
+    return;
+  }
+
+  // Shards are named <16 hex digits of command digest>-<kind>.shard.scip
+  size_t numDeleted = 0;
+  for (auto &dirEntry : std::filesystem::directory_iterator(
+           this->cacheDir / "shards", error)) {
+    auto fileName = dirEntry.path().filename().string();
+    uint64_t digest = 0;
+    auto digestLength = std::min(fileName.size(), size_t(16));
+    auto result = std::from_chars(
+        fileName.data(), fileName.data() + digestLength, digest, 16);
+    if (result.ec == std::errc() && this->claimedDigests.contains(digest)) {
+      continue;
+    }
+    std::error_code removeError;
+    if (std::filesystem::remove(dirEntry.path(), removeError)) {
+      numDeleted++;
+    }
+  }
+  spdlog::debug("deleted {} stale shards from the incremental cache",
+                numDeleted);
+}
+
+StdPath IncrementalCache::shardPrefix(uint64_t commandDigest) const {
+  return this->cacheDir / "shards" / fmt::format("{:016x}", commandDigest);
+}
+
+uint32_t
+IncrementalCache::addFile(const std::string &path,
+                          const scip::FileFingerprint *knownFingerprint) {
+  auto [it, inserted] =
+      this->nextFileIds.emplace(path, uint32_t(this->next.files_size()));
+  if (inserted) {
+    *this->next.add_files() =
+        knownFingerprint ? *knownFingerprint : ::fingerprint(path);
+  }
+  return it->second;
+}
+
+bool IncrementalCache::isUnchanged(int previousFileIndex) {
+  auto &cached = this->previousFileUnchanged[previousFileIndex];
+  if (!cached.has_value()) {
+    auto &file = this->previous.files(previousFileIndex);
+    auto current = ::fingerprint(file.path());
+    cached = current.size() == file.size()
+             && current.mtime_ns() == file.mtime_ns();
+  }
+  return *cached;
+}
+
+} // namespace scip_clang
@@ -0,0 +1,118 @@
+#ifndef SCIP_CLANG_INCREMENTAL_CACHE_H
+#define SCIP_CLANG_INCREMENTAL_CACHE_H
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
+
+#include "proto/incremental_manifest.pb.h"
+
+#include "indexer/CompilationDatabase.h"
+#include "indexer/FileSystem.h"
+#include "indexer/IpcMessages.h"
+
+namespace scip_clang {
+
+/// NOTE(def: incremental-indexing): With --incremental-cache-dir, the
+/// driver keeps the shards for each TU in the cache directory, along with
+/// a manifest recording, for each TU, a digest of its command, fingerprints
+/// (size + mtime) of every file it touched, and the (path, preprocessor
+/// hash) pairs it was responsible for emitting into its shard.
+///
+/// On the next run, TUs whose command and touched files are unchanged are
+/// not re-indexed; their shards are reused as-is, and their assigned files
+/// are fed to the FileIndexingPlanner as if they had just been indexed, so
+/// that re-indexed TUs don't emit the same files again.
+///
+/// For that to work, the assigned files of reused TUs must be known before
+/// any file is assigned to a re-indexed TU, whether by the planner or by
+/// NOTE(ref: previous-plan). So the driver parses the whole compilation
+/// database before queueing the first TU in this mode, instead of
+/// streaming it (NOTE(ref: compdb-scan)); the commands which need to be
+/// re-indexed are kept in memory until they are queued.
+///
+/// Limitations:
+/// - If a re-indexed TU used to be responsible for a header which it no
+///   longer includes, but which some reused TU still includes, then that
+///   header will be missing from the index until a TU including it is
+///   re-indexed (similar to NOTE(ref: header-recovery)).
+/// - Shards need to be self-contained, so external symbol deduplication
+///   across workers (NOTE(ref: external-symbol-dedup)) as well as within
+///   a worker, shard logs and worker-side pre-merging are disabled in
+///   this mode.
+class IncrementalCache final {
+  StdPath cacheDir;
+  uint64_t configDigest;
+
+  scip::IncrementalManifest previous;
+  /// command_digest -> index into previous.tus
+  absl::flat_hash_map<uint64_t, int> previousTus;
+  /// Indexed by previous file index; lazily computed.
+  std::vector<std::optional<bool>> previousFileUnchanged;
+
+  scip::IncrementalManifest next;
+  /// path -> index into next.files
+  absl::flat_hash_map<std::string, uint32_t> nextFileIds;
+  /// Entries for TUs whose semantic analysis completed, but which haven't
+  /// emitted shards yet, keyed by task ID.
+  absl::flat_hash_map<uint32_t, scip::TuEntry> pendingTus;
+  /// Digests of TUs which are present in the next manifest (or are being
+  /// reused), to avoid sharing shards across duplicate compdb entries.
+  absl::flat_hash_set<uint64_t> claimedDigests;
+
+  size_t reusedCount;
+
+public:
+  struct ReusedTu {
+    ShardPaths paths;
+    std::vector<PreprocessedFileInfo> assignedFiles;
+  };
+
+  /// Loads the manifest from a previous run in \p cacheDir, if present and
+  /// if it was written with the same \p configDigest.
+  IncrementalCache(StdPath cacheDir, uint64_t configDigest);
+  IncrementalCache(const IncrementalCache &) = delete;
+  IncrementalCache &operator=(const IncrementalCache &) = delete;
+
+  /// Returns the shards from the previous run if neither the command nor
+  /// any file touched by the TU changed since then.
+  std::optional<ReusedTu> tryReuse(const compdb::CommandObject &);
+
+  /// Records the files touched by a TU after semantic analysis.
+  void recordSemaResult(uint32_t taskId, const compdb::CommandObject &,
+                        const SemanticAnalysisJobResult &);
+
+  /// Records the files which a TU was asked to emit into its shard.
+  void recordAssignedFiles(uint32_t taskId,
+                           const std::vector<PreprocessedFileInfo> &assigned);
+
+  /// Moves freshly written shards into the cache directory, and returns
+  /// the new paths. Returns \p paths as-is if the TU can't be cached.
+  ///
+  /// If \p keepOriginals is true, the shards are copied instead,
+  /// e.g. for shards owned by the shard cache.
+  ShardPaths recordShards(uint32_t taskId, ShardPaths &&paths,
+                          bool keepOriginals);
+
+  /// Writes out the manifest for the next run, and deletes shards which
+  /// are no longer referenced.
+  void save();
+
+  size_t numReused() const {
+    return this->reusedCount;
+  }
+
+private:
+  StdPath shardPrefix(uint64_t commandDigest) const;
+  uint32_t addFile(const std::string &path,
+                   const scip::FileFingerprint *knownFingerprint);
+  bool isUnchanged(int previousFileIndex);
+};
+
+} // namespace scip_clang
+
+#endif // SCIP_CLANG_INCREMENTAL_CACHE_H
@@ -1,11 +1,9 @@
-#include <charconv>
 #include <compare>
 #include <cstdint>
+#include <filesystem>
 #include <string_view>
-#include <system_error>
 #include <type_traits>
 
-#include "absl/strings/str_split.h"
 #include "spdlog/fmt/fmt.h"
 #include "spdlog/spdlog.h"
 
@@ -128,18 +126,19 @@ bool fromJSON(const llvm::json::Value &jsonValue, HashValue &h,
   return false;
 }
 
-DERIVE_SERIALIZE_1_NEWTYPE(scip_clang::IndexingStatistics, totalTimeMicros)
-DERIVE_SERIALIZE_1_NEWTYPE(scip_clang::EmitIndexJobDetails, filesToBeIndexed)
 DERIVE_SERIALIZE_1_NEWTYPE(scip_clang::IpcTestMessage, content)
-DERIVE_SERIALIZE_1_NEWTYPE(scip_clang::SemanticAnalysisJobDetails, command)
 
-DERIVE_SERIALIZE_2(scip_clang::ShardPaths, docsAndExternals, forwardDecls)
-DERIVE_SERIALIZE_2(scip_clang::EmitIndexJobResult, statistics, shardPaths)
+DERIVE_SERIALIZE_2(scip_clang::ShardLogRange, offset, size)
 DERIVE_SERIALIZE_2(scip_clang::PreprocessedFileInfo, path, hashValue)
 DERIVE_SERIALIZE_2(scip_clang::PreprocessedFileInfoMulti, path, hashValues)
 DERIVE_SERIALIZE_2(scip_clang::IndexJobRequest, id, job)
-DERIVE_SERIALIZE_2(scip_clang::SemanticAnalysisJobResult, wellBehavedFiles,
-                   illBehavedFiles)
+
+HashValue PreprocessedFileInfo::key() const {
+  HashValue hash{this->hashValue.rawValue};
+  auto &pathStr = this->path.asStringRef();
+  hash.mix(reinterpret_cast<const uint8_t *>(pathStr.data()), pathStr.size());
+  return hash;
+}
 
 std::strong_ordering operator<=>(const PreprocessedFileInfo &lhs,
                                  const PreprocessedFileInfo &rhs) {
@@ -167,23 +166,140 @@ bool fromJSON(const llvm::json::Value &value, IndexJobResponse &r,
          && mapper.map("jobId", r.jobId) && mapper.map("result", r.result);
 }
 
+llvm::json::Value toJSON(const ShardPaths &p) {
+  return llvm::json::Object{
+      {"docsAndExternals", p.docsAndExternals},
+      {"forwardDecls", p.forwardDecls},
+      {"docsAndExternalsRange", p.docsAndExternalsRange},
+      {"forwardDeclsRange", p.forwardDeclsRange},
+  };
+}
+
+bool fromJSON(const llvm::json::Value &value, ShardPaths &p,
+              llvm::json::Path path) {
+  llvm::json::ObjectMapper mapper(value, path);
+  return mapper && mapper.map("docsAndExternals", p.docsAndExternals)
+         && mapper.map("forwardDecls", p.forwardDecls)
+         && mapper.map("docsAndExternalsRange", p.docsAndExternalsRange)
+         && mapper.map("forwardDeclsRange", p.forwardDeclsRange);
+}
+
+llvm::json::Value toJSON(const SemanticAnalysisJobDetails &d) {
+  return llvm::json::Object{
+      {"command", d.command},
+      {"planDigest", d.planDigest},
+      {"tentativeFilesToBeIndexed", d.tentativeFilesToBeIndexed},
+      {"standbyFilesToBeIndexed", d.standbyFilesToBeIndexed},
+      {"claimedFiles", d.claimedFiles},
+  };
+}
+
+bool fromJSON(const llvm::json::Value &value, SemanticAnalysisJobDetails &d,
+              llvm::json::Path path) {
+  llvm::json::ObjectMapper mapper(value, path);
+  return mapper && mapper.map("command", d.command)
+         && mapper.map("planDigest", d.planDigest)
+         && mapper.map("tentativeFilesToBeIndexed",
+                       d.tentativeFilesToBeIndexed)
+         && mapper.map("standbyFilesToBeIndexed", d.standbyFilesToBeIndexed)
+         && mapper.map("claimedFiles", d.claimedFiles);
+}
+
+llvm::json::Value toJSON(const SemanticAnalysisJobResult &r) {
+  return llvm::json::Object{
+      {"wellBehavedFiles", r.wellBehavedFiles},
+      {"illBehavedFiles", r.illBehavedFiles},
+      {"matchedPlan", r.matchedPlan},
+  };
+}
+
+bool fromJSON(const llvm::json::Value &value, SemanticAnalysisJobResult &r,
+              llvm::json::Path path) {
+  llvm::json::ObjectMapper mapper(value, path);
+  return mapper && mapper.map("wellBehavedFiles", r.wellBehavedFiles)
+         && mapper.map("illBehavedFiles", r.illBehavedFiles)
+         && mapper.map("matchedPlan", r.matchedPlan);
+}
+
+llvm::json::Value toJSON(const IndexingStatistics &s) {
+  return llvm::json::Object{
+      {"totalTimeMicros", s.totalTimeMicros},
+      {"waitTimeMicros", s.waitTimeMicros},
+      {"numDroppedDocuments", s.numDroppedDocuments},
+  };
+}
+
+bool fromJSON(const llvm::json::Value &value, IndexingStatistics &s,
+              llvm::json::Path path) {
+  llvm::json::ObjectMapper mapper(value, path);
+  return mapper && mapper.map("totalTimeMicros", s.totalTimeMicros)
+         && mapper.map("waitTimeMicros", s.waitTimeMicros)
+         && mapper.map("numDroppedDocuments", s.numDroppedDocuments);
+}
+
+llvm::json::Value toJSON(const EmitIndexJobDetails &d) {
+  return llvm::json::Object{
+      {"filesToBeIndexed", d.filesToBeIndexed},
+      {"knownExternalSymbols", d.knownExternalSymbols},
+      {"skipEmitting", d.skipEmitting},
+  };
+}
+
+bool fromJSON(const llvm::json::Value &value, EmitIndexJobDetails &d,
+              llvm::json::Path path) {
+  llvm::json::ObjectMapper mapper(value, path);
+  return mapper && mapper.map("filesToBeIndexed", d.filesToBeIndexed)
+         && mapper.map("knownExternalSymbols", d.knownExternalSymbols)
+         && mapper.map("skipEmitting", d.skipEmitting);
+}
+
+llvm::json::Value toJSON(const EmitIndexJobResult &r) {
+  return llvm::json::Object{
+      {"statistics", r.statistics},
+      {"shardPaths", r.shardPaths},
+      {"journalShardPaths", r.journalShardPaths},
+      {"emittedExternalSymbols", r.emittedExternalSymbols},
+  };
+}
+
+bool fromJSON(const llvm::json::Value &value, EmitIndexJobResult &r,
+              llvm::json::Path path) {
+  llvm::json::ObjectMapper mapper(value, path);
+  return mapper && mapper.map("statistics", r.statistics)
+         && mapper.map("shardPaths", r.shardPaths)
+         && mapper.map("journalShardPaths", r.journalShardPaths)
+         && mapper.map("emittedExternalSymbols", r.emittedExternalSymbols);
+}
+
 // static
 std::string ShardPaths::prefix(uint32_t taskId, WorkerId workerId) {
-  // SYNC(def: prefix-format): Keep in sync with tryParseJobId
   return fmt::format("job-{}-worker-{}", taskId, workerId);
 }
 
 // static
-std::optional<uint32_t> ShardPaths::tryParseJobId(std::string_view fileName) {
-  // SYNC(id: prefix-format): Keep in sync with prefix
-  std::vector<std::string_view> parts = absl::StrSplit(fileName, '-');
-  uint32_t taskId;
-  if (parts.size() >= 3 && parts[0] == "job" && parts[2] == "worker"
-      && std::from_chars(parts[1].begin(), parts[1].end(), taskId).ec
-             == std::errc{}) {
-    return taskId;
-  }
-  return {};
+std::string ShardPaths::logFileName(WorkerId workerId) {
+  return fmt::format("worker-{}.shard-log", workerId);
+}
+
+// static
+std::string ShardPaths::journalFileName(WorkerId workerId) {
+  return fmt::format("worker-{}.premerge-journal", workerId);
+}
+
+// static
+std::string ShardPaths::finalPrefix(WorkerId workerId) {
+  return fmt::format("worker-{}-final", workerId);
+}
+
+// static
+ShardPaths ShardPaths::forFiles(const std::filesystem::path &prefix) {
+  auto docsAndExternalsPath = prefix;
+  docsAndExternalsPath.concat("-docs_and_externals.shard.scip");
+  auto forwardDeclsPath = prefix;
+  forwardDeclsPath.concat("-forward_decls.shard.scip");
+  return ShardPaths{AbsolutePath{docsAndExternalsPath.string()},
+                    AbsolutePath{forwardDeclsPath.string()}, std::nullopt,
+                    std::nullopt};
 }
 
 } // namespace scip_clang
@@ -4,6 +4,7 @@
 #include <chrono>
 #include <compare>
 #include <cstdint>
+#include <filesystem>
 #include <optional>
 #include <string>
 #include <string_view>
@@ -99,11 +100,6 @@ template <> struct fmt::formatter<scip_clang::JobId> {
 
 namespace scip_clang {
 
-struct SemanticAnalysisJobDetails {
-  compdb::CommandObject command;
-};
-SERIALIZABLE(SemanticAnalysisJobDetails)
-
 } // namespace scip_clang
 
 namespace clang::tooling {
@@ -112,10 +108,15 @@ SERIALIZABLE(clang::tooling::CompileCommand) // Not implemented upstream 😕
 
 namespace scip_clang {
 
+SERIALIZABLE(HashValue)
+
 struct PreprocessedFileInfo {
   AbsolutePath path;
   HashValue hashValue;
 
+  /// Combined hash of the path and the preprocessor hash.
+  HashValue key() const;
+
   friend std::strong_ordering operator<=>(const PreprocessedFileInfo &lhs,
                                           const PreprocessedFileInfo &rhs);
 };
@@ -130,8 +131,48 @@ struct PreprocessedFileInfoMulti {
 };
 SERIALIZABLE(PreprocessedFileInfoMulti)
 
+struct SemanticAnalysisJobDetails {
+  compdb::CommandObject command;
+  /// Digest of the files touched by the TU in the previous run, set only
+  /// in the request sent to the worker.
+  ///
+  /// See NOTE(ref: previous-plan).
+  std::optional<HashValue> planDigest;
+  /// Files the worker should emit if the digest matches, without waiting
+  /// for an EmitIndex request.
+  std::vector<PreprocessedFileInfo> tentativeFilesToBeIndexed;
+  /// Files the worker should also emit if the digest matches, as they may
+  /// be released by the planned TUs they are assigned to. Documents for
+  /// these files are dropped unless the EmitIndex request lists them.
+  std::vector<PreprocessedFileInfo> standbyFilesToBeIndexed;
+  /// Keys of files assigned to some TU since the last SemanticAnalysis
+  /// request sent to this worker.
+  ///
+  /// See NOTE(ref: speculative-emission).
+  std::vector<HashValue> claimedFiles;
+};
+SERIALIZABLE(SemanticAnalysisJobDetails)
+
+/// Upper bound on the number of external symbol hashes in a single
+/// message, to keep messages well under the IPC size limit.
+constexpr size_t maxExternalSymbolHashesPerMessage = 4096;
+
+/// Upper bound on SemanticAnalysisJobDetails::claimedFiles, similar to
+/// maxExternalSymbolHashesPerMessage.
+constexpr size_t maxClaimedFilesPerMessage = 4096;
+
 struct EmitIndexJobDetails {
   std::vector<PreprocessedFileInfo> filesToBeIndexed;
+  /// Hashes of external symbols emitted by other workers since the last
+  /// EmitIndex job sent to this worker.
+  ///
+  /// See NOTE(ref: external-symbol-dedup).
+  std::vector<HashValue> knownExternalSymbols;
+  /// Set when the driver already has shards for this TU, so the worker
+  /// should skip traversing the AST and only report back.
+  ///
+  /// See NOTE(ref: shard-cache).
+  bool skipEmitting;
 };
 SERIALIZABLE(EmitIndexJobDetails)
 
@@ -160,11 +201,12 @@ struct IndexJobRequest {
 };
 SERIALIZABLE(IndexJobRequest)
 
-SERIALIZABLE(HashValue)
-
 struct SemanticAnalysisJobResult {
   std::vector<PreprocessedFileInfo> wellBehavedFiles;
   std::vector<PreprocessedFileInfoMulti> illBehavedFiles;
+  /// Set if the files matched SemanticAnalysisJobDetails::planDigest,
+  /// in which case the worker has already started emitting the index.
+  bool matchedPlan = false;
 
   // clang-format off
   SemanticAnalysisJobResult() = default;
@@ -178,22 +220,67 @@ SERIALIZABLE(SemanticAnalysisJobResult)
 
 struct IndexingStatistics {
   uint64_t totalTimeMicros;
+  /// Time spent waiting for the EmitIndex request after semantic analysis.
+  uint64_t waitTimeMicros;
+  /// Number of documents emitted speculatively but assigned to other TUs.
+  ///
+  /// See NOTE(ref: speculative-emission).
+  uint64_t numDroppedDocuments;
 };
 SERIALIZABLE(IndexingStatistics)
 
+/// Byte range of a single shard inside a per-worker shard log.
+///
+/// See NOTE(ref: shard-log).
+struct ShardLogRange {
+  uint64_t offset;
+  uint64_t size;
+};
+SERIALIZABLE(ShardLogRange)
+
 struct ShardPaths {
   AbsolutePath docsAndExternals;
   AbsolutePath forwardDecls;
+  // Both ranges are set iff the shards were appended to a shard log,
+  // in which case both the paths above point to the same log file.
+  std::optional<ShardLogRange> docsAndExternalsRange;
+  std::optional<ShardLogRange> forwardDeclsRange;
 
   static std::string prefix(uint32_t taskId, WorkerId workerId);
 
-  static std::optional<uint32_t> tryParseJobId(std::string_view fileName);
+  static std::string logFileName(WorkerId workerId);
+
+  /// See NOTE(ref: worker-premerge).
+  static std::string journalFileName(WorkerId workerId);
+
+  /// Prefix for shards written by a worker when shutting down.
+  ///
+  /// See NOTE(ref: worker-premerge).
+  static std::string finalPrefix(WorkerId workerId);
+
+  /// Paths for standalone shard files (i.e. not part of a shard log)
+  /// whose names start with \p prefix.
+  static ShardPaths forFiles(const std::filesystem::path &prefix);
 };
 SERIALIZABLE(ShardPaths)
 
 struct EmitIndexJobResult {
   IndexingStatistics statistics;
-  ShardPaths shardPaths;
+  /// Unset if the worker held on to the output for pre-merging.
+  ///
+  /// See NOTE(ref: worker-premerge).
+  std::optional<ShardPaths> shardPaths;
+  /// Set iff the worker held on to the output for pre-merging. Points
+  /// to a standalone copy of the output for this TU only, which the
+  /// driver uses if the worker exits before writing the merged shards.
+  ///
+  /// See NOTE(ref: worker-premerge).
+  std::optional<ShardPaths> journalShardPaths;
+  /// Hashes of external symbols with documentation which were
+  /// emitted in the shard. This may be a subset if there are too many.
+  ///
+  /// See NOTE(ref: external-symbol-dedup).
+  std::vector<HashValue> emittedExternalSymbols;
 };
 SERIALIZABLE(EmitIndexJobResult)
 
@@ -90,11 +90,8 @@ public:
   }
 
   template <typename T>
-  llvm::Error timedReceive(T &t, std::chrono::seconds waitDuration) {
-    auto durationMillis =
-        std::chrono::duration_cast<std::chrono::milliseconds>(waitDuration)
-            .count();
-    auto valueOrErr = this->timedReceive(durationMillis);
+  llvm::Error timedReceive(T &t, std::chrono::milliseconds waitDuration) {
+    auto valueOrErr = this->timedReceive(uint64_t(waitDuration.count()));
     if (auto err = valueOrErr.takeError()) {
       return err;
     }
@@ -13,13 +13,9 @@ namespace scip_clang {
 
 ProgressReporter::ProgressReporter(bool active, std::string_view msg,
                                    size_t totalCount)
-    : message(msg), totalCount(totalCount), countWidth(), active(active),
-      isTty(false) {
-  if (this->totalCount == 0) {
-    countWidth = 1;
-  } else {
-    countWidth = std::log10(double(this->totalCount)) + 1;
-  }
+    : message(msg), totalCount(), totalIsEstimate(false), countWidth(),
+      active(active), isTty(false) {
+  this->updateTotalCount(totalCount, /*isEstimate*/ false);
 #if __linux__ || __APPLE__
   std::error_code ec;
   auto status = std::filesystem::status("/dev/stdout", ec);
@@ -29,19 +25,32 @@ ProgressReporter::ProgressReporter(bool active, std::string_view msg,
 #endif
 }
 
+void ProgressReporter::updateTotalCount(size_t totalCount,
+                                        bool isEstimate) {
+  this->totalCount = totalCount;
+  this->totalIsEstimate = isEstimate;
+  if (this->totalCount == 0) {
+    countWidth = 1;
+  } else {
+    countWidth = std::log10(double(this->totalCount)) + 1;
+  }
+}
+
 void ProgressReporter::report(size_t count, std::string_view extraData) const {
   if (!this->active) {
     return;
   }
   int maxExtraWidth = 256;
   auto backspaceCount = std::max(maxExtraWidth - int(extraData.size()), 0);
+  auto total = fmt::format("{}{}", this->totalIsEstimate ? "~" : "",
+                           this->totalCount);
   if (this->isTty) {
     fmt::print("\r[{1:>{0}}/{2:>{0}}] {3} {4:<{5}}{6:\b<{7}}", countWidth,
-               count, this->totalCount, this->message, extraData, maxExtraWidth,
-               "", backspaceCount);
+               count, total, this->message, extraData, maxExtraWidth, "",
+               backspaceCount);
   } else {
-    fmt::print("[{1:>{0}}/{2:>{0}}] {3} {4}\n", countWidth, count,
-               this->totalCount, this->message, extraData);
+    fmt::print("[{1:>{0}}/{2:>{0}}] {3} {4}\n", countWidth, count, total,
+               this->message, extraData);
   }
   std::flush(std::cout);
 }
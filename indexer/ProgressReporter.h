@@ -9,6 +9,7 @@ namespace scip_clang {
 class ProgressReporter {
   std::string_view message;
   size_t totalCount;
+  bool totalIsEstimate;
   size_t countWidth;
   bool active;
   bool isTty;
@@ -16,6 +17,9 @@ class ProgressReporter {
 public:
   ProgressReporter(bool active, std::string_view msg, size_t totalCount);
 
+  /// Estimated totals are shown with a '~' prefix.
+  void updateTotalCount(size_t totalCount, bool isEstimate);
+
   void report(size_t count, std::string_view extraData) const;
 
   ~ProgressReporter();
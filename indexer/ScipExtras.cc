@@ -1,25 +1,44 @@
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <charconv>
 #include <compare>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <future>
 #include <iterator>
 #include <memory>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <system_error>
 #include <tuple>
+#include <unistd.h>
 #include <utility>
 #include <vector>
 
 #include "absl/algorithm/container.h"
 #include "absl/functional/function_ref.h"
 #include "perfetto/perfetto.h"
+#include "spdlog/spdlog.h"
 #include "utfcpp/utf8.h"
 
 #include "llvm/Support/Path.h"
 #include "llvm/Support/StringSaver.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
 
 #include "proto/fwd_decls.pb.h"
+#include "proto/index_shard.pb.h"
 #include "scip/scip.pb.h"
 
 #include "indexer/AbslExtras.h"
 #include "indexer/Comparison.h"
 #include "indexer/Enforce.h"
+#include "indexer/FileSystem.h"
+#include "indexer/Hash.h"
 #include "indexer/ScipExtras.h"
 #include "indexer/SymbolName.h"
 #include "indexer/Tracing.h"
@@ -84,7 +103,252 @@ std::strong_ordering operator<=>(const OccurrenceExt &lhs,
   return scip::compareOccurrences(lhs.occ, rhs.occ);
 }
 
+namespace {
+
+// Range of an occurrence packed so that comparing (hi, lo) as unsigned
+// integers matches compareScipRange.
+struct OccurrenceSortKey {
+  uint64_t hi; // start line, start column
+  uint64_t lo; // is multiline, end line or column, end column
+  uint32_t index;
+
+  bool sameRange(const OccurrenceSortKey &other) const {
+    return this->hi == other.hi && this->lo == other.lo;
+  }
+};
+
+std::optional<OccurrenceSortKey> packRange(const scip::Occurrence &occ,
+                                           uint32_t index) {
+  auto &range = occ.range();
+  if (range.size() != 3 && range.size() != 4) {
+    return {};
+  }
+  if (absl::c_any_of(range, [](int32_t v) { return v < 0; })) {
+    return {};
+  }
+  bool isMultiline = range.size() == 4;
+  uint64_t hi = (uint64_t(range[0]) << 32) | uint64_t(range[1]);
+  // Each non-negative int32 fits in 31 bits.
+  uint64_t lo = (uint64_t(isMultiline) << 62) | (uint64_t(range[2]) << 31)
+                | uint64_t(isMultiline ? range[3] : 0);
+  return OccurrenceSortKey{hi, lo, index};
+}
+
+// Stable LSD radix sort with 8-bit digits. Passes where all keys have
+// the same digit (e.g. high bytes of line numbers) are skipped.
+void radixSort(std::vector<OccurrenceSortKey> &keys) {
+  constexpr size_t numPasses = 16;
+  auto digit = [](const OccurrenceSortKey &key, size_t pass) -> uint8_t {
+    uint64_t word = pass < 8 ? key.lo : key.hi;
+    return uint8_t(word >> (8 * (pass % 8)));
+  };
+  std::vector<std::array<uint32_t, 256>> counts(numPasses);
+  for (auto &key : keys) {
+    for (size_t pass = 0; pass < numPasses; ++pass) {
+      counts[pass][digit(key, pass)]++;
+    }
+  }
+  std::vector<OccurrenceSortKey> buffer(keys.size());
+  for (size_t pass = 0; pass < numPasses; ++pass) {
+    auto &count = counts[pass];
+    if (absl::c_any_of(count, [&](uint32_t c) { return c == keys.size(); })) {
+      continue;
+    }
+    uint32_t offset = 0;
+    for (auto &c : count) {
+      auto bucketSize = c;
+      c = offset;
+      offset += bucketSize;
+    }
+    for (auto &key : keys) {
+      buffer[count[digit(key, pass)]++] = key;
+    }
+    keys.swap(buffer);
+  }
+}
+
+} // namespace
+
+void sortOccurrences(
+    google::protobuf::RepeatedPtrField<scip::Occurrence> &occurrences) {
+  auto lessThan = [](const scip::Occurrence &lhs,
+                     const scip::Occurrence &rhs) -> bool {
+    return scip::compareOccurrences(lhs, rhs) == std::strong_ordering::less;
+  };
+  // Below this size, the fixed cost of the radix sort dominates.
+  constexpr int minRadixSortSize = 256;
+  if (occurrences.size() < minRadixSortSize) {
+    absl::c_sort(occurrences, lessThan);
+    return;
+  }
+  TRACE_EVENT(scip_clang::tracing::indexMerging, "scip::sortOccurrences",
+              "size", occurrences.size());
+  std::vector<OccurrenceSortKey> keys;
+  keys.reserve(occurrences.size());
+  for (int i = 0; i < occurrences.size(); ++i) {
+    auto optKey = packRange(occurrences[i], uint32_t(i));
+    if (!optKey.has_value()) {
+      absl::c_sort(occurrences, lessThan);
+      return;
+    }
+    keys.push_back(*optKey);
+  }
+  radixSort(keys);
+  for (size_t start = 0; start < keys.size();) {
+    size_t end = start + 1;
+    while (end < keys.size() && keys[end].sameRange(keys[start])) {
+      ++end;
+    }
+    if (end - start > 1) {
+      std::sort(keys.begin() + start, keys.begin() + end,
+                [&](const auto &lhs, const auto &rhs) -> bool {
+                  return lessThan(occurrences[lhs.index],
+                                  occurrences[rhs.index]);
+                });
+    }
+    start = end;
+  }
+  // Permute the element pointers instead of moving the messages.
+  std::vector<scip::Occurrence *> sorted;
+  sorted.reserve(keys.size());
+  auto pointers = occurrences.pointer_begin();
+  for (auto &key : keys) {
+    sorted.push_back(pointers[key.index]);
+  }
+  absl::c_copy(sorted, occurrences.pointer_begin());
+}
+
+SpillFile::SpillFile(std::string &&path)
+    : path(std::move(path)), fd(-1), size(0) {
+  this->fd = ::open(this->path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    0644);
+  if (this->fd < 0) {
+    spdlog::error("failed to create spill file at '{}' ({})", this->path,
+                  std::strerror(errno));
+    std::exit(EXIT_FAILURE);
+  }
+}
+
+SpillFile::~SpillFile() {
+  ::close(this->fd);
+  ::unlink(this->path.c_str());
+}
+
+SpillFile::Range SpillFile::append(std::string_view data) {
+  size_t written = 0;
+  while (written < data.size()) {
+    auto n = ::pwrite(this->fd, data.data() + written, data.size() - written,
+                      off_t(this->size + written));
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      spdlog::error("failed to write to spill file at '{}' ({})", this->path,
+                    std::strerror(errno));
+      std::exit(EXIT_FAILURE);
+    }
+    written += size_t(n);
+  }
+  Range range{this->size, data.size()};
+  this->size += data.size();
+  return range;
+}
+
+void SpillFile::read(Range range, std::string &out) const {
+  if (!preadExact(this->fd, range.offset, range.size, out)) {
+    spdlog::error("failed to read from spill file at '{}' ({})", this->path,
+                  errno == 0 ? "unexpected EOF" : std::strerror(errno));
+    std::exit(EXIT_FAILURE);
+  }
+}
+
+namespace {
+
+// References start with a NUL byte, which never occurs in documentation
+// extracted from comments. The hash is hex-encoded because Protobuf
+// requires string fields to be valid UTF-8.
+constexpr size_t documentationRefSize = 17;
+
+bool isDocumentationRef(std::string_view doc) {
+  return doc.size() == documentationRefSize && doc[0] == '\0';
+}
+
+} // namespace
+
+// static
+void DocumentationTable::intern(std::string &doc, ShardTable &table) {
+  if (doc.size() < DocumentationTable::minInternedSize) {
+    return;
+  }
+  auto hash = scip_clang::HashValue::forText(doc);
+  auto ref = fmt::format("{}{:016x}", '\0', hash);
+  ENFORCE(isDocumentationRef(ref));
+  if (!table.contains(hash)) {
+    table[hash] = std::move(doc);
+  }
+  doc = std::move(ref);
+}
+
+// static
+void DocumentationTable::internAll(
+    google::protobuf::RepeatedPtrField<std::string> &docs, ShardTable &table) {
+  for (auto &doc : docs) {
+    DocumentationTable::intern(doc, table);
+  }
+}
+
+void DocumentationTable::merge(ShardTable &&table) {
+  for (auto &tableEntry : table) {
+    auto [it, inserted] = this->entries.try_emplace(tableEntry.first);
+    if (inserted) {
+      this->inMemorySize += tableEntry.second.size();
+      it->second.value = std::move(tableEntry.second);
+      this->unspilledKeys.push_back(tableEntry.first);
+    }
+  }
+}
+
+void DocumentationTable::spill(SpillFile &spillFile) {
+  for (auto key : this->unspilledKeys) {
+    auto &entry = this->entries[key];
+    ENFORCE(!entry.spilled.has_value());
+    entry.spilled = spillFile.append(entry.value);
+    entry.value = std::string();
+  }
+  this->unspilledKeys.clear();
+  this->inMemorySize = 0;
+}
+
+void DocumentationTable::resolveAll(
+    google::protobuf::RepeatedPtrField<std::string> &docs,
+    const SpillFile *spillFile) const {
+  for (auto &doc : docs) {
+    if (!isDocumentationRef(doc)) {
+      continue;
+    }
+    uint64_t hash = 0;
+    auto hexDigits = std::string_view(doc).substr(1);
+    auto result = std::from_chars(
+        hexDigits.data(), hexDigits.data() + hexDigits.size(), hash, 16);
+    ENFORCE(result.ec == std::errc(), "malformed documentation reference");
+    auto it = this->entries.find(hash);
+    ENFORCE(it != this->entries.end(),
+            "missing documentation table entry for hash {}", hash);
+    auto &entry = it->second;
+    if (entry.spilled.has_value()) {
+      ENFORCE(spillFile, "documentation was spilled without a spill file");
+      spillFile->read(entry.spilled.value(), doc);
+    } else {
+      // Not moved, since the same entry may be referenced multiple times.
+      doc = entry.value;
+    }
+  }
+}
+
 bool SymbolInformationBuilder::hasDocumentation() const {
+  if (this->spilledDocumentation.has_value()) {
+    return true;
+  }
   return !this->documentation.empty()
          && this->documentation[0] != scip::missingDocumentationPlaceholder;
 }
@@ -97,9 +361,49 @@ bool SymbolInformationBuilder::hasDocumentation(
                 != scip::missingDocumentationPlaceholder;
 }
 
+size_t SymbolInformationBuilder::documentationSize() const {
+  size_t total = 0;
+  for (auto &doc : this->documentation) {
+    total += doc.size();
+  }
+  return total;
+}
+
+void SymbolInformationBuilder::spillDocumentation(SpillFile &spillFile) {
+  if (this->spilledDocumentation.has_value() || !this->hasDocumentation()) {
+    return;
+  }
+  scip::SymbolInformation docsOnly{};
+  for (auto &doc : this->documentation) {
+    *docsOnly.add_documentation() = std::move(doc);
+  }
+  this->documentation.clear();
+  this->spilledDocumentation = spillFile.append(docsOnly.SerializeAsString());
+}
+
+void SymbolInformationBuilder::restoreDocumentation(
+    const SpillFile &spillFile) {
+  if (!this->spilledDocumentation.has_value()) {
+    return;
+  }
+  std::string buffer;
+  spillFile.read(this->spilledDocumentation.value(), buffer);
+  scip::SymbolInformation docsOnly{};
+  bool parsed = docsOnly.ParseFromString(buffer);
+  ENFORCE(parsed, "failed to parse spilled documentation for '{}'",
+          this->name.value);
+  (void)parsed;
+  this->spilledDocumentation.reset();
+  this->documentation.clear();
+  absl::c_move(std::move(*docsOnly.mutable_documentation()),
+               std::back_inserter(this->documentation));
+}
+
 void SymbolInformationBuilder::finish(bool deterministic,
                                       scip::SymbolInformation &out) {
   this->_bomb.defuse();
+  ENFORCE(!this->spilledDocumentation.has_value(),
+          "forgot to call restoreDocumentation for '{}'", this->name.value);
 
   out.mutable_documentation()->Reserve(this->documentation.size());
   for (auto &doc : this->documentation) {
@@ -124,6 +428,12 @@ void ForwardDeclResolver::insert(SymbolSuffix suffix,
   this->docInternalMap.emplace(suffix, SymbolInfoOrBuilderPtr{symbolInfo});
 }
 
+void ForwardDeclResolver::insert(SymbolSuffix suffix,
+                                 DeferredSymbolInfo *deferredSymbolInfo) {
+  this->docInternalMap.emplace(suffix,
+                               SymbolInfoOrBuilderPtr{deferredSymbolInfo});
+}
+
 void ForwardDeclResolver::insertExternal(SymbolNameRef symbol) {
   if (auto optSuffix = symbol.getPackageAgnosticSuffix()) {
     this->externalsMap[*optSuffix].insert(symbol);
@@ -152,6 +462,65 @@ void ForwardDeclResolver::deleteExternals(SymbolSuffix suffix) {
   this->externalsMap.erase(suffix);
 }
 
+static bool isCompactRepresentable(const scip::Occurrence &occ) {
+  return (occ.range_size() == 3 || occ.range_size() == 4)
+         && occ.override_documentation_size() == 0
+         && occ.diagnostics_size() == 0;
+}
+
+// static
+std::optional<CompactOccurrence>
+CompactOccurrence::tryFrom(scip::Occurrence &occ,
+                           SymbolNameInterner &interner) {
+  if (!isCompactRepresentable(occ)) {
+    return {};
+  }
+  return CompactOccurrence::tryFrom(
+      occ, interner.intern(std::move(*occ.mutable_symbol())));
+}
+
+// static
+std::optional<CompactOccurrence>
+CompactOccurrence::tryFrom(const scip::Occurrence &occ, SymbolNameRef symbol) {
+  if (!isCompactRepresentable(occ)) {
+    return {};
+  }
+  std::array<int32_t, 4> range;
+  range.fill(-1);
+  for (int i = 0; i < occ.range_size(); ++i) {
+    range[i] = occ.range()[i];
+  }
+  return CompactOccurrence{range, symbol, occ.symbol_roles(),
+                           static_cast<int32_t>(occ.syntax_kind())};
+}
+
+void CompactOccurrence::addTo(scip::Occurrence &occ) const {
+  for (size_t i = 0; i < 4 && this->range[i] != -1; ++i) {
+    occ.add_range(this->range[i]);
+  }
+  occ.set_symbol(this->symbol.value.data(), this->symbol.value.size());
+  occ.set_symbol_roles(this->symbolRoles);
+  occ.set_syntax_kind(static_cast<scip::SyntaxKind>(this->syntaxKind));
+}
+
+std::strong_ordering operator<=>(const CompactOccurrence &lhs,
+                                 const CompactOccurrence &rhs) {
+  // Same order as compareScipRange and compareOccurrences
+  CMP_EXPR(lhs.range[0], rhs.range[0]);
+  CMP_EXPR(lhs.range[1], rhs.range[1]);
+  bool lhsMultiline = lhs.range[3] != -1;
+  bool rhsMultiline = rhs.range[3] != -1;
+  CMP_EXPR(lhsMultiline, rhsMultiline);
+  CMP_EXPR(lhs.range[2], rhs.range[2]);
+  CMP_EXPR(lhs.range[3], rhs.range[3]);
+  if (lhs.symbol.value.data() != rhs.symbol.value.data()) {
+    CMP_STR(lhs.symbol.value, rhs.symbol.value);
+  }
+  CMP_EXPR(lhs.symbolRoles, rhs.symbolRoles);
+  CMP_EXPR(lhs.syntaxKind, rhs.syntaxKind);
+  return std::strong_ordering::equal;
+}
+
 SymbolNameRef SymbolNameInterner::intern(std::string &&s) {
   return SymbolNameRef{std::string_view(this->impl.save(s))};
 }
@@ -162,6 +531,7 @@ SymbolNameRef SymbolNameInterner::intern(SymbolNameRef s) {
 }
 
 DocumentBuilder::DocumentBuilder(scip::Document &&first,
+                                 const std::vector<SymbolNameRef> &symbols,
                                  SymbolNameInterner interner)
     : soFar(), interner(interner),
       _bomb(BOMB_INIT(
@@ -170,15 +540,48 @@ DocumentBuilder::DocumentBuilder(scip::Document &&first,
   this->soFar.set_language(std::move(language));
   auto &relativePath = *first.mutable_relative_path();
   this->soFar.set_relative_path(std::move(relativePath));
-  this->merge(std::move(first));
+  this->merge(std::move(first), symbols);
 }
 
-void DocumentBuilder::merge(scip::Document &&doc) {
+void DocumentBuilder::merge(scip::Document &&doc,
+                            const std::vector<SymbolNameRef> &symbols) {
+  // See NOTE(ref: shard-symbol-table)
+  bool hasSymbolRefs = !symbols.empty();
+  size_t nextSymbolIndex = 0;
+  auto nextSymbol = [&]() -> SymbolNameRef {
+    ENFORCE(nextSymbolIndex < symbols.size(),
+            "too few symbol references for document '{}'",
+            doc.relative_path());
+    return symbols[nextSymbolIndex++];
+  };
   for (auto &occ : *doc.mutable_occurrences()) {
-    this->occurrences.insert({std::move(occ)});
+    std::optional<CompactOccurrence> optCompactOcc;
+    if (hasSymbolRefs) {
+      auto symbol = nextSymbol();
+      optCompactOcc = CompactOccurrence::tryFrom(occ, symbol);
+      if (!optCompactOcc.has_value()) {
+        occ.set_symbol(symbol.value.data(), symbol.value.size());
+      }
+    } else {
+      optCompactOcc = CompactOccurrence::tryFrom(occ, this->interner);
+    }
+    if (optCompactOcc.has_value()) {
+      this->compactOccurrences.insert(optCompactOcc.value());
+    } else {
+      this->occurrences.insert({std::move(occ)});
+    }
   }
   for (auto &symbolInfo : *doc.mutable_symbols()) {
-    auto name = this->interner.intern(std::move(*symbolInfo.mutable_symbol()));
+    SymbolNameRef name;
+    if (hasSymbolRefs) {
+      name = nextSymbol();
+      for (auto &rel : *symbolInfo.mutable_relationships()) {
+        auto relSymbol = nextSymbol();
+        rel.set_symbol(relSymbol.value.data(), relSymbol.value.size());
+      }
+    } else {
+      name = this->interner.intern(std::move(*symbolInfo.mutable_symbol()));
+    }
     auto it = this->symbolInfos.find(name);
     if (it == this->symbolInfos.end()) {
       // SAFETY: Don't inline this initializer call since lack of
@@ -213,14 +616,23 @@ void DocumentBuilder::populateForwardDeclResolver(
 void DocumentBuilder::finish(bool deterministic, scip::Document &out) {
   this->_bomb.defuse();
 
-  this->soFar.mutable_occurrences()->Reserve(this->occurrences.size());
+  this->soFar.mutable_occurrences()->Reserve(this->compactOccurrences.size()
+                                             + this->occurrences.size());
   this->soFar.mutable_symbols()->Reserve(this->symbolInfos.size());
 
   scip_clang::extractTransform(
-      std::move(this->occurrences), deterministic,
+      std::move(this->compactOccurrences), /*deterministic*/ false,
+      absl::FunctionRef<void(CompactOccurrence &&)>([&](auto &&compactOcc) {
+        compactOcc.addTo(*this->soFar.add_occurrences());
+      }));
+  scip_clang::extractTransform(
+      std::move(this->occurrences), /*deterministic*/ false,
       absl::FunctionRef<void(OccurrenceExt &&)>([&](auto &&occExt) {
         *this->soFar.add_occurrences() = std::move(occExt.occ);
       }));
+  if (deterministic) {
+    scip::sortOccurrences(*this->soFar.mutable_occurrences());
+  }
 
   scip_clang::extractTransform(
       std::move(this->symbolInfos), deterministic,
@@ -248,35 +660,303 @@ void ForwardDeclOccurrence::addTo(scip::Occurrence &occ) {
   }
 }
 
+uint64_t documentContentDigest(const scip::Document &doc) {
+  // In non-deterministic mode, occurrences and symbols are emitted in
+  // arbitrary order, so the hashes for individual entries are sorted
+  // before being combined. Unlike combining them with a commutative
+  // operation, this doesn't let different entries cancel out.
+  std::string buffer;
+  std::vector<uint64_t> entryHashes{};
+  scip_clang::HashValue digest{0};
+  auto mixEntries = [&](const auto &entries) {
+    entryHashes.clear();
+    for (auto &entry : entries) {
+      entry.SerializeToString(&buffer);
+      entryHashes.push_back(scip_clang::HashValue::forText(buffer));
+    }
+    absl::c_sort(entryHashes);
+    // Mix in the count, so that entries can't move between lists.
+    uint64_t count = entryHashes.size();
+    digest.mix(reinterpret_cast<const uint8_t *>(&count), sizeof(count));
+    digest.mix(reinterpret_cast<const uint8_t *>(entryHashes.data()),
+               entryHashes.size() * sizeof(uint64_t));
+  };
+  auto &path = doc.relative_path();
+  digest.mix(reinterpret_cast<const uint8_t *>(path.data()), path.size());
+  mixEntries(doc.occurrences());
+  mixEntries(doc.symbols());
+  return digest.rawValue;
+}
+
+void toIndexShard(scip::Index &&index, scip::IndexShard &shard) {
+  TRACE_EVENT(scip_clang::tracing::indexIo, "scip::toIndexShard", "size",
+              index.documents_size());
+  shard.mutable_documents()->Swap(index.mutable_documents());
+  shard.mutable_external_symbols()->Swap(index.mutable_external_symbols());
+  shard.mutable_document_digests()->Reserve(shard.documents_size());
+  for (auto &doc : shard.documents()) {
+    shard.add_document_digests(scip::documentContentDigest(doc));
+  }
+  auto &table = *shard.mutable_documentation_table();
+  for (auto &doc : *shard.mutable_documents()) {
+    for (auto &symbolInfo : *doc.mutable_symbols()) {
+      DocumentationTable::internAll(*symbolInfo.mutable_documentation(),
+                                    table);
+    }
+  }
+  for (auto &extSym : *shard.mutable_external_symbols()) {
+    DocumentationTable::internAll(*extSym.mutable_documentation(), table);
+  }
+  ShardSymbolTable::encode(shard);
+}
+
+void internDocumentation(scip::ForwardDeclIndex &forwardDeclIndex) {
+  auto &table = *forwardDeclIndex.mutable_documentation_table();
+  for (auto &forwardDecl : *forwardDeclIndex.mutable_forward_decls()) {
+    DocumentationTable::intern(*forwardDecl.mutable_documentation(), table);
+  }
+}
+
+/// Calls \p f with each symbol name in \p doc in the order used for
+/// IndexShard.symbol_refs. See NOTE(ref: shard-symbol-table).
+template <typename F>
+static void forEachSymbolName(scip::Document &doc, F &&f) {
+  for (auto &occ : *doc.mutable_occurrences()) {
+    f(*occ.mutable_symbol());
+  }
+  for (auto &symbolInfo : *doc.mutable_symbols()) {
+    f(*symbolInfo.mutable_symbol());
+    for (auto &rel : *symbolInfo.mutable_relationships()) {
+      f(*rel.mutable_symbol());
+    }
+  }
+}
+
+static size_t symbolNameCount(const scip::Document &doc) {
+  size_t count = size_t(doc.occurrences_size());
+  for (auto &symbolInfo : doc.symbols()) {
+    count += 1 + size_t(symbolInfo.relationships_size());
+  }
+  return count;
+}
+
+// static
+void ShardSymbolTable::encode(scip::IndexShard &shard) {
+  TRACE_EVENT(scip_clang::tracing::indexIo, "ShardSymbolTable::encode");
+  absl::flat_hash_map<std::string, uint32_t> indexes;
+  auto &table = *shard.mutable_symbol_table();
+  auto &refs = *shard.mutable_symbol_refs();
+  for (auto &doc : *shard.mutable_documents()) {
+    forEachSymbolName(doc, [&](std::string &name) {
+      auto [it, inserted] =
+          indexes.try_emplace(std::move(name), uint32_t(table.size()));
+      if (inserted) {
+        table.Add(std::string(it->first));
+      }
+      refs.Add(it->second);
+      name.clear();
+    });
+  }
+}
+
+ShardSymbolTable::ShardSymbolTable(scip::IndexShard &shard)
+    : table(), refs(), documentOffsets(), interned(), malformed(false) {
+  if (shard.symbol_table_size() == 0) {
+    this->malformed = shard.symbol_refs_size() > 0;
+    return;
+  }
+  this->table.reserve(shard.symbol_table_size());
+  absl::c_move(*shard.mutable_symbol_table(), std::back_inserter(this->table));
+  this->refs.assign(shard.symbol_refs().begin(), shard.symbol_refs().end());
+  this->interned.resize(this->table.size());
+  this->documentOffsets.reserve(shard.documents_size() + 1);
+  size_t offset = 0;
+  for (auto &doc : shard.documents()) {
+    this->documentOffsets.push_back(offset);
+    offset += symbolNameCount(doc);
+  }
+  this->documentOffsets.push_back(offset);
+  auto tableSize = this->table.size();
+  bool valid = offset == this->refs.size()
+               && absl::c_all_of(this->refs, [tableSize](uint32_t ref) {
+                    return ref < tableSize;
+                  });
+  if (!valid) {
+    spdlog::debug("malformed symbol table in shard ({} entries, "
+                  "{} references, expected {} references)",
+                  tableSize, this->refs.size(), offset);
+    this->refs.clear();
+    this->documentOffsets.clear();
+    this->malformed = true;
+  }
+}
+
+void ShardSymbolTable::restore(int documentIndex, scip::Document &doc) const {
+  if (this->documentOffsets.empty()) {
+    return;
+  }
+  auto next = this->documentOffsets[documentIndex];
+  forEachSymbolName(doc, [&](std::string &name) {
+    name = this->table[this->refs[next++]];
+  });
+}
+
+void ShardSymbolTable::intern(int documentIndex, SymbolNameInterner &interner,
+                              std::vector<SymbolNameRef> &out) {
+  out.clear();
+  if (this->documentOffsets.empty()) {
+    return;
+  }
+  auto begin = this->documentOffsets[documentIndex];
+  auto end = this->documentOffsets[documentIndex + 1];
+  out.reserve(end - begin);
+  for (auto i = begin; i < end; ++i) {
+    auto ref = this->refs[i];
+    auto &optName = this->interned[ref];
+    if (!optName.has_value()) {
+      optName = interner.intern(SymbolNameRef{this->table[ref]});
+    }
+    out.push_back(optName.value());
+  }
+}
+
 IndexBuilder::IndexBuilder(SymbolNameInterner interner)
-    : multiplyIndexed(), externalSymbols(), interner(interner),
-      _bomb(BOMB_INIT("IndexBuilder")) {}
+    : twoPass(false), deferredSymbols(), deferredSymbolsMap(), memoryBudget(0),
+      externalDocumentationSize(0), spillFilePath(), spillFile(),
+      documentationTable(), multiplyIndexed(), externalSymbols(),
+      interner(interner), stats(), _bomb(BOMB_INIT("IndexBuilder")) {}
 
-void IndexBuilder::addDocument(scip::Document &&doc, bool isMultiplyIndexed) {
+void IndexBuilder::enableTwoPassMerge(uint64_t memoryBudgetBytes,
+                                      std::string &&spillFilePath) {
+  ENFORCE(this->documents.empty() && this->multiplyIndexed.empty(),
+          "two-pass merging should be enabled before adding documents");
+  this->twoPass = true;
+  this->memoryBudget = memoryBudgetBytes;
+  this->spillFilePath = std::move(spillFilePath);
+}
+
+void IndexBuilder::addDocument(scip::Document &&doc, bool isMultiplyIndexed,
+                               std::optional<uint64_t> contentDigest,
+                               const std::vector<SymbolNameRef> &symbols) {
   ENFORCE(!doc.relative_path().empty());
   if (isMultiplyIndexed) {
+    this->stats.multiplyIndexedVariants++;
     RootRelativePath docPath{std::string(doc.relative_path())};
     auto it = this->multiplyIndexed.find(docPath);
     if (it == this->multiplyIndexed.end()) {
-      this->multiplyIndexed.insert(
-          {std::move(docPath),
-           std::make_unique<DocumentBuilder>(std::move(doc), this->interner)});
+      auto docBuilder = std::make_unique<DocumentBuilder>(
+          std::move(doc), symbols, this->interner);
+      if (contentDigest.has_value()) {
+        docBuilder->addDigest(contentDigest.value());
+      }
+      this->multiplyIndexed.insert({std::move(docPath), std::move(docBuilder)});
     } else {
       auto &docBuilder = it->second;
-      docBuilder->merge(std::move(doc));
+      if (contentDigest.has_value()
+          && !docBuilder->addDigest(contentDigest.value())) {
+        this->stats.skippedDuplicateVariants++;
+        return;
+      }
+      docBuilder->merge(std::move(doc), symbols);
     }
   } else {
+    ENFORCE(symbols.empty(),
+            "symbol names for Document with path '{}' should have been "
+            "restored instead of being interned",
+            doc.relative_path());
     ENFORCE(!this->multiplyIndexed.contains(
                 RootRelativePath{std::string(doc.relative_path())}),
             "Document with path '{}' found in multiplyIndexed map despite "
             "!isMultiplyIndexed",
             doc.relative_path());
-    this->documents.emplace_back(std::move(doc));
+    if (this->twoPass) {
+      this->addDeferredSymbols(std::move(doc));
+    } else {
+      this->documents.emplace_back(std::move(doc));
+    }
   }
 }
 
+void IndexBuilder::addDeferredSymbols(scip::Document &&doc) {
+  for (auto &symbolInfo : *doc.mutable_symbols()) {
+    bool hasDocumentation =
+        SymbolInformationBuilder::hasDocumentation(symbolInfo);
+    auto name = this->interner.intern(std::move(*symbolInfo.mutable_symbol()));
+    if (this->deferredSymbolsMap.contains(name)) {
+      continue;
+    }
+    this->deferredSymbols.emplace_back(
+        DeferredSymbolInfo{name, hasDocumentation, std::nullopt});
+    this->deferredSymbolsMap.emplace(name, &this->deferredSymbols.back());
+  }
+}
+
+void IndexBuilder::applyDeferredSymbolInfo(scip::Document &doc) {
+  for (auto &symbolInfo : *doc.mutable_symbols()) {
+    if (SymbolInformationBuilder::hasDocumentation(symbolInfo)) {
+      continue;
+    }
+    auto it = this->deferredSymbolsMap.find(
+        SymbolNameRef{std::string_view(symbolInfo.symbol())});
+    if (it == this->deferredSymbolsMap.end()
+        || !it->second->pendingDocumentation.has_value()) {
+      continue;
+    }
+    symbolInfo.mutable_documentation()->Clear();
+    *symbolInfo.add_documentation() =
+        std::move(it->second->pendingDocumentation.value());
+    it->second->pendingDocumentation.reset();
+  }
+}
+
+void IndexBuilder::trackExternalDocumentation(
+    SymbolInformationBuilder &builder) {
+  if (!this->twoPass) {
+    return;
+  }
+  if (this->spillFile) {
+    builder.spillDocumentation(*this->spillFile);
+    return;
+  }
+  this->externalDocumentationSize += builder.documentationSize();
+  this->spillIfOverBudget();
+}
+
+void IndexBuilder::addDocumentationTable(
+    DocumentationTable::ShardTable &&table) {
+  this->documentationTable.merge(std::move(table));
+  if (!this->twoPass) {
+    return;
+  }
+  if (this->spillFile) {
+    this->documentationTable.spill(*this->spillFile);
+    return;
+  }
+  this->spillIfOverBudget();
+}
+
+void IndexBuilder::spillIfOverBudget() {
+  ENFORCE(this->twoPass && !this->spillFile);
+  if (this->externalDocumentationSize + this->documentationTable.memorySize()
+      <= this->memoryBudget) {
+    return;
+  }
+  spdlog::debug("documentation for external symbols exceeded memory budget "
+                "({} bytes); spilling to '{}'",
+                this->memoryBudget, this->spillFilePath);
+  this->spillFile = std::make_unique<SpillFile>(std::move(this->spillFilePath));
+  for (auto &[_, extSymBuilder] : this->externalSymbols) {
+    extSymBuilder->spillDocumentation(*this->spillFile);
+  }
+  this->documentationTable.spill(*this->spillFile);
+  this->externalDocumentationSize = 0;
+}
+
 void IndexBuilder::addExternalSymbolUnchecked(
     SymbolNameRef name, scip::SymbolInformation &&extSym) {
+  auto documentationDigest =
+      SymbolInformationBuilder::computeDocumentationDigest(
+          extSym.documentation());
   std::vector<std::string> docs{};
   absl::c_move(*extSym.mutable_documentation(), std::back_inserter(docs));
   absl::flat_hash_set<RelationshipExt> rels{};
@@ -285,7 +965,10 @@ void IndexBuilder::addExternalSymbolUnchecked(
   }
   auto builder = std::make_unique<SymbolInformationBuilder>(
       name, std::move(docs), std::move(rels));
+  builder->documentationDigest = documentationDigest;
+  auto &builderRef = *builder;
   this->externalSymbols.emplace(name, std::move(builder));
+  this->trackExternalDocumentation(builderRef);
 }
 
 void IndexBuilder::addExternalSymbol(scip::SymbolInformation &&extSym) {
@@ -295,12 +978,27 @@ void IndexBuilder::addExternalSymbol(scip::SymbolInformation &&extSym) {
     this->addExternalSymbolUnchecked(name, std::move(extSym));
     return;
   }
-  // NOTE(def: precondition-deterministic-ext-symbol-docs)
-  // Picking the first non-empty bit of documentation will be deterministic
-  // so long as external symbols are added in a deterministic order.
+  // NOTE(def: order-independent-ext-symbol-docs)
+  // If different shards have different documentation for the same symbol,
+  // pick the one with the smallest digest, so that the result depends
+  // neither on the order in which shards are merged, nor on which shards
+  // have copies of the symbol (see NOTE(ref: external-symbol-dedup)).
   auto &builder = it->second;
-  if (!builder->hasDocumentation() && extSym.documentation_size() > 0) {
-    builder->setDocumentation(std::move(*extSym.mutable_documentation()));
+  if (extSym.documentation_size() > 0) {
+    auto documentationDigest =
+        SymbolInformationBuilder::computeDocumentationDigest(
+            extSym.documentation());
+    if (!builder->hasDocumentation()) {
+      builder->setDocumentation(std::move(*extSym.mutable_documentation()));
+      builder->documentationDigest = documentationDigest;
+      this->trackExternalDocumentation(*builder);
+    } else if (SymbolInformationBuilder::hasDocumentation(extSym)
+               && documentationDigest < builder->documentationDigest) {
+      builder->replaceDocumentation(
+          std::move(*extSym.mutable_documentation()));
+      builder->documentationDigest = documentationDigest;
+      this->trackExternalDocumentation(*builder);
+    }
   }
   builder->mergeRelationships(std::move(*extSym.mutable_relationships()));
 }
@@ -320,6 +1018,11 @@ IndexBuilder::populateForwardDeclResolver() {
       }
     }
   }
+  for (auto &deferredSymbolInfo : this->deferredSymbols) {
+    if (auto optSuffix = deferredSymbolInfo.name.getPackageAgnosticSuffix()) {
+      forwardDeclResolver.insert(*optSuffix, &deferredSymbolInfo);
+    }
+  }
   for (auto &[_, docBuilder] : this->multiplyIndexed) {
     docBuilder->populateForwardDeclResolver(forwardDeclResolver);
   }
@@ -352,6 +1055,7 @@ void IndexBuilder::addForwardDeclaration(
         if (!it->second->hasDocumentation()) {
           llvm::SmallVector<std::string, 1> vec{forwardDeclSym.documentation()};
           it->second->setDocumentation(std::move(vec));
+          this->trackExternalDocumentation(*it->second);
         }
         this->addForwardDeclOccurrences(symbolName,
                                         scip::ForwardDecl{forwardDeclSym});
@@ -389,6 +1093,9 @@ void IndexBuilder::addForwardDeclaration(
   if (auto *symbolInfo =
           symbolInfoOrBuilderPtr.dyn_cast<scip::SymbolInformation *>()) {
     name = SymbolNameRef{std::string_view(symbolInfo->symbol())};
+  } else if (auto *deferredSymbolInfo =
+                 symbolInfoOrBuilderPtr.dyn_cast<DeferredSymbolInfo *>()) {
+    name = deferredSymbolInfo->name;
   } else {
     auto *symbolInfoBuilder =
         symbolInfoOrBuilderPtr.get<SymbolInformationBuilder *>();
@@ -407,6 +1114,13 @@ void IndexBuilder::addForwardDeclaration(
         *symbolInfo->add_documentation() =
             std::move(*forwardDeclSym.mutable_documentation());
       }
+    } else if (auto *deferredSymbolInfo =
+                   symbolInfoOrBuilderPtr.dyn_cast<DeferredSymbolInfo *>()) {
+      if (!deferredSymbolInfo->hasDocumentation) {
+        deferredSymbolInfo->hasDocumentation = true;
+        deferredSymbolInfo->pendingDocumentation =
+            std::move(*forwardDeclSym.mutable_documentation());
+      }
     } else {
       auto &symbolInfoBuilder =
           *symbolInfoOrBuilderPtr.get<SymbolInformationBuilder *>();
@@ -433,83 +1147,228 @@ void IndexBuilder::addForwardDeclOccurrences(SymbolNameRef name,
   }
 }
 
-struct IndexWriter {
-  scip::Index index;
-  ForwardDeclOccurrenceMap forwardDeclOccurenceMap;
-  std::ostream &outputStream;
+namespace {
 
-  ~IndexWriter() {
-    this->write();
+void appendForwardDeclOccurrences(
+    const ForwardDeclOccurrenceMap &occurrenceMap, bool deterministic,
+    scip::Document &doc) {
+  auto path = std::string_view(doc.relative_path());
+  auto it = occurrenceMap.find(path);
+  if (it == occurrenceMap.end()) {
+    return;
+  }
+  for (auto fwdDeclOcc : it->second) {
+    scip::Occurrence occ;
+    fwdDeclOcc.addTo(occ);
+    *doc.add_occurrences() = std::move(occ);
   }
+  if (deterministic) {
+    scip::sortOccurrences(*doc.mutable_occurrences());
+  }
+}
 
-  void writeDocument(scip::Document &&doc, bool deterministic) {
-    auto path = std::string_view(doc.relative_path());
-    auto it = this->forwardDeclOccurenceMap.find(path);
-    if (it != this->forwardDeclOccurenceMap.end()) {
-      for (auto fwdDeclOcc : it->second) {
-        scip::Occurrence occ;
-        fwdDeclOcc.addTo(occ);
-        *doc.add_occurrences() = std::move(occ);
-      }
-      if (deterministic) {
-        absl::c_sort(*doc.mutable_occurrences(),
-                     [](const scip::Occurrence &lhs,
-                        const scip::Occurrence &rhs) -> bool {
-                       return scip::compareOccurrences(lhs, rhs)
-                              == std::strong_ordering::less;
-                     });
-      }
+void resolveDocumentation(const DocumentationTable &documentationTable,
+                          const SpillFile *spillFile, scip::Index &index) {
+  for (auto &doc : *index.mutable_documents()) {
+    for (auto &symbolInfo : *doc.mutable_symbols()) {
+      documentationTable.resolveAll(*symbolInfo.mutable_documentation(),
+                                    spillFile);
     }
-    *this->index.add_documents() = std::move(doc);
-    this->write();
   }
+  for (auto &extSym : *index.mutable_external_symbols()) {
+    documentationTable.resolveAll(*extSym.mutable_documentation(), spillFile);
+  }
+}
+
+/// Serializes Index fragments on a thread pool, and writes them out
+/// in the order in which they were submitted.
+///
+/// The number of fragments which have been submitted but not yet written
+/// is bounded, so that the serialized bytes don't pile up in memory if
+/// the output stream is slower than serialization.
+class IndexWriter final {
+  IndexOutput &output;
+  const DocumentationTable &documentationTable;
+  const SpillFile *spillFile;
+  llvm::DefaultThreadPool threadPool;
+  std::deque<std::pair</*part*/ uint32_t, std::shared_future<std::string>>>
+      inFlight;
+  size_t maxInFlight;
+
+public:
+  IndexWriter(IndexOutput &output, const DocumentationTable &documentationTable,
+              const SpillFile *spillFile, unsigned numThreads)
+      : output(output), documentationTable(documentationTable),
+        spillFile(spillFile),
+        threadPool(llvm::hardware_concurrency(numThreads)), inFlight(),
+        maxInFlight(4 * size_t(std::max(numThreads, 1u))) {}
 
-  void writeExternalSymbol(scip::SymbolInformation &&symbolInfo) {
-    *this->index.add_external_symbols() = std::move(symbolInfo);
-    if (this->index.external_symbols_size() % 1024 == 0) {
-      this->write();
+  ~IndexWriter() {
+    while (!this->inFlight.empty()) {
+      this->writeOldest();
+    }
+  }
+
+  /// The callable must be copyable, and must fill in the Index passed to it.
+  /// References to the documentation table in the filled Index are resolved
+  /// before serialization; see NOTE(ref: documentation-table).
+  ///
+  /// Any state referenced by the callable must be kept alive until
+  /// the IndexWriter is destroyed.
+  ///
+  /// See NOTE(ref: split-index-output) for \p part.
+  template <typename F> void submit(uint32_t part, F &&fillIndex) {
+    if (this->inFlight.size() >= this->maxInFlight) {
+      this->writeOldest();
     }
+    this->inFlight.emplace_back(part, this->threadPool.async(
+        [fillIndex, documentationTable = &this->documentationTable,
+         spillFile = this->spillFile]() -> std::string {
+          TRACE_EVENT(scip_clang::tracing::indexIo, "IndexWriter::serialize");
+          scip::Index index{};
+          fillIndex(index);
+          resolveDocumentation(*documentationTable, spillFile, index);
+          return index.SerializeAsString();
+        }));
   }
 
 private:
-  void write() {
-    this->index.SerializeToOstream(&this->outputStream);
-    this->index.clear_documents();
-    this->index.clear_external_symbols();
+  void writeOldest() {
+    auto &[part, future] = this->inFlight.front();
+    auto &bytes = future.get();
+    {
+      TRACE_EVENT(scip_clang::tracing::indexIo, "IndexWriter::writeOldest",
+                  "size", bytes.size());
+      this->output.write(part, bytes);
+    }
+    this->inFlight.pop_front();
   }
 };
 
-void IndexBuilder::finish(bool deterministic, std::ostream &outputStream) {
+} // namespace
+
+void IndexBuilder::finish(bool deterministic, unsigned numThreads,
+                          IndexOutput &output) {
+  ENFORCE(!this->twoPass, "call finishTwoPass instead");
+  this->finishImpl(deterministic, numThreads, std::nullopt, output);
+}
+
+void IndexBuilder::finishTwoPass(bool deterministic, unsigned numThreads,
+                                 DeferredDocumentStreamer streamDocuments,
+                                 IndexOutput &output) {
+  ENFORCE(this->twoPass, "call finish instead");
+  this->finishImpl(deterministic, numThreads, streamDocuments, output);
+}
+
+void IndexBuilder::finishImpl(
+    bool deterministic, unsigned numThreads,
+    std::optional<DeferredDocumentStreamer> optStreamDocuments,
+    IndexOutput &output) {
   TRACE_EVENT(scip_clang::tracing::indexIo, "IndexBuilder::finish",
               "documents.size", this->documents.size(), "multiplyIndexed.size",
               this->multiplyIndexed.size(), "externalSymbols.size",
               this->externalSymbols.size());
   this->_bomb.defuse();
-  IndexWriter writer{scip::Index{}, std::move(this->forwardDeclOccurenceMap),
-                     outputStream};
 
-  for (auto &doc : this->documents) {
-    writer.writeDocument(std::move(doc), deterministic);
-  }
+  // Extract everything up-front (in sorted order if needed), so that
+  // the serialization tasks only need to hold pointers.
+  std::vector<std::unique_ptr<DocumentBuilder>> docBuilders{};
+  docBuilders.reserve(this->multiplyIndexed.size());
   scip_clang::extractTransform(
       std::move(this->multiplyIndexed), deterministic,
       absl::FunctionRef<void(RootRelativePath &&,
                              std::unique_ptr<DocumentBuilder> &&)>(
           [&](auto && /*path*/, auto &&builder) -> void {
-            scip::Document doc{};
-            builder->finish(deterministic, doc);
-            writer.writeDocument(std::move(doc), deterministic);
+            docBuilders.emplace_back(std::move(builder));
           }));
+  struct ExtSymEntry {
+    uint32_t part;
+    SymbolNameRef name;
+    std::unique_ptr<SymbolInformationBuilder> builder;
+  };
+  std::vector<ExtSymEntry> extSymBuilders{};
+  extSymBuilders.reserve(this->externalSymbols.size());
   scip_clang::extractTransform(
       std::move(this->externalSymbols), deterministic,
       absl::FunctionRef<void(SymbolNameRef &&,
                              std::unique_ptr<SymbolInformationBuilder> &&)>(
           [&](auto &&name, auto &&builder) -> void {
-            scip::SymbolInformation extSym{};
-            extSym.set_symbol(name.value.data(), name.value.size());
-            builder->finish(deterministic, extSym);
-            writer.writeExternalSymbol(std::move(extSym));
+            extSymBuilders.emplace_back(
+                ExtSymEntry{output.partForExternalSymbol(name.value), name,
+                            std::move(builder)});
           }));
+  // Batches of external symbols are serialized together, so group them
+  // by part, preserving the (possibly sorted) order within each part.
+  std::stable_sort(extSymBuilders.begin(), extSymBuilders.end(),
+                   [](const auto &lhs, const auto &rhs) -> bool {
+                     return lhs.part < rhs.part;
+                   });
+
+  const auto &occurrenceMap = this->forwardDeclOccurenceMap;
+  const SpillFile *spillFile = this->spillFile.get();
+  // Declared after all the state referenced by the tasks, so that
+  // the destructor finishes writing before that state is destroyed.
+  IndexWriter writer{output, this->documentationTable, spillFile, numThreads};
+
+  if (optStreamDocuments.has_value()) {
+    (*optStreamDocuments)([&](scip::Document &&doc) -> void {
+      this->applyDeferredSymbolInfo(doc);
+      auto part = output.partForDocument(doc.relative_path());
+      auto docPtr = std::make_shared<scip::Document>(std::move(doc));
+      writer.submit(
+          part, [docPtr, &occurrenceMap, deterministic](scip::Index &index) {
+            appendForwardDeclOccurrences(occurrenceMap, deterministic,
+                                         *docPtr);
+            *index.add_documents() = std::move(*docPtr);
+          });
+    });
+  }
+  for (auto &doc : this->documents) {
+    auto *docPtr = &doc;
+    writer.submit(output.partForDocument(doc.relative_path()),
+                  [docPtr, &occurrenceMap, deterministic](scip::Index &index) {
+                    appendForwardDeclOccurrences(occurrenceMap, deterministic,
+                                                 *docPtr);
+                    *index.add_documents() = std::move(*docPtr);
+                  });
+  }
+  for (auto &docBuilder : docBuilders) {
+    auto *builderPtr = docBuilder.get();
+    writer.submit(
+        output.partForDocument(builderPtr->relativePath()),
+        [builderPtr, &occurrenceMap, deterministic](scip::Index &index) {
+          scip::Document doc{};
+          builderPtr->finish(deterministic, doc);
+          appendForwardDeclOccurrences(occurrenceMap, deterministic, doc);
+          *index.add_documents() = std::move(doc);
+        });
+  }
+  const size_t extSymBatchSize = 1024;
+  for (size_t start = 0; start < extSymBuilders.size();) {
+    auto part = extSymBuilders[start].part;
+    size_t endIndex = start + 1;
+    while (endIndex < extSymBuilders.size()
+           && endIndex - start < extSymBatchSize
+           && extSymBuilders[endIndex].part == part) {
+      ++endIndex;
+    }
+    auto *begin = extSymBuilders.data() + start;
+    auto *end = extSymBuilders.data() + endIndex;
+    writer.submit(part, [begin, end, spillFile,
+                         deterministic](scip::Index &index) {
+      for (auto *it = begin; it != end; ++it) {
+        auto &builder = it->builder;
+        if (spillFile) {
+          builder->restoreDocumentation(*spillFile);
+        }
+        scip::SymbolInformation extSym{};
+        extSym.set_symbol(it->name.value.data(), it->name.value.size());
+        builder->finish(deterministic, extSym);
+        *index.add_external_symbols() = std::move(extSym);
+      }
+    });
+    start = endIndex;
+  }
 }
 
 } // namespace scip
@@ -3,14 +3,20 @@
 
 #include <array>
 #include <compare>
+#include <deque>
 #include <iterator>
 #include <memory>
+#include <optional>
+#include <ostream>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include "absl/algorithm/container.h"
 #include "absl/container/flat_hash_map.h"
 #include "absl/container/flat_hash_set.h"
+#include "absl/functional/function_ref.h"
+#include "google/protobuf/map.h"
 #include "spdlog/fmt/fmt.h"
 
 #include "scip/scip.pb.h"
@@ -20,6 +26,7 @@
 #include "indexer/Comparison.h"
 #include "indexer/Derive.h"
 #include "indexer/Enforce.h"
+#include "indexer/Hash.h"
 #include "indexer/RAII.h"
 #include "indexer/SymbolName.h"
 
@@ -55,6 +62,13 @@ compareScipRange(const google::protobuf::RepeatedField<int32_t> &lhs,
 std::strong_ordering compareOccurrences(const scip::Occurrence &lhs,
                                         const scip::Occurrence &rhs);
 
+/// Sorts occurrences in the order defined by \c compareOccurrences.
+///
+/// Uses a radix sort on ranges packed into integers, falling back to
+/// comparing other fields only for occurrences with identical ranges.
+void sortOccurrences(
+    google::protobuf::RepeatedPtrField<scip::Occurrence> &occurrences);
+
 struct OccurrenceExt {
   scip::Occurrence occ;
 
@@ -86,20 +100,103 @@ struct OccurrenceExt {
 constexpr char missingDocumentationPlaceholder[28] =
     "No documentation available.";
 
+/// Append-only scratch file for data which doesn't need to be kept
+/// in memory until the end of index merging.
+///
+/// Reads may happen concurrently from multiple threads, but appends
+/// must not overlap with reads or other appends.
+class SpillFile final {
+  std::string path;
+  int fd;
+  uint64_t size;
+
+public:
+  struct Range {
+    uint64_t offset;
+    uint64_t size;
+  };
+
+  /// Logs an error and exits if the file cannot be created.
+  SpillFile(std::string &&path);
+  ~SpillFile();
+  SpillFile(const SpillFile &) = delete;
+  SpillFile &operator=(const SpillFile &) = delete;
+
+  Range append(std::string_view data);
+  void read(Range range, std::string &out) const;
+};
+
+/// NOTE(def: documentation-table): Long documentation strings (e.g. Doxygen
+/// comments for widely used classes) are frequently repeated across shards.
+/// Workers move these into a per-shard table keyed by hash, and replace
+/// the documentation fields with short references. IndexBuilder keeps a
+/// single copy of each string, and references are only resolved when
+/// the final index is written out.
+class DocumentationTable final {
+  struct Entry {
+    std::string value;
+    // Set iff the value was moved to a SpillFile.
+    std::optional<SpillFile::Range> spilled;
+  };
+  absl::flat_hash_map<uint64_t, Entry> entries;
+  /// Keys for entries merged since the last call to spill, so that
+  /// spilling doesn't need to walk over all the entries.
+  std::vector<uint64_t> unspilledKeys;
+  size_t inMemorySize;
+
+public:
+  using ShardTable = google::protobuf::Map<uint64_t, std::string>;
+
+  /// Shorter documentation strings are always stored inline.
+  static constexpr size_t minInternedSize = 64;
+
+  DocumentationTable() : entries(), unspilledKeys(), inMemorySize(0) {}
+  DocumentationTable(const DocumentationTable &) = delete;
+  DocumentationTable &operator=(const DocumentationTable &) = delete;
+
+  /// Replaces \p doc with a reference if it is long enough,
+  /// moving the original value into \p table.
+  static void intern(std::string &doc, ShardTable &table);
+  static void
+  internAll(google::protobuf::RepeatedPtrField<std::string> &docs,
+            ShardTable &table);
+
+  void merge(ShardTable &&table);
+
+  /// Returns the number of bytes of documentation held in memory.
+  size_t memorySize() const {
+    return this->inMemorySize;
+  }
+
+  /// Moves all entries which are in memory to \p spillFile.
+  void spill(SpillFile &spillFile);
+
+  /// Replaces references in \p docs with the original values.
+  ///
+  /// Safe to call concurrently, since it doesn't modify the table.
+  void resolveAll(google::protobuf::RepeatedPtrField<std::string> &docs,
+                  const SpillFile *spillFile) const;
+};
+
 class SymbolInformationBuilder final {
   std::vector<std::string> documentation;
+  // Set iff the documentation was moved to a SpillFile.
+  std::optional<SpillFile::Range> spilledDocumentation;
   absl::flat_hash_set<RelationshipExt> relationships;
   scip_clang::Bomb _bomb;
 
 public:
   SymbolNameRef name;
+  // Only tracked for external symbols.
+  // See NOTE(ref: order-independent-ext-symbol-docs).
+  uint64_t documentationDigest;
 
   template <typename C1, typename C2>
   SymbolInformationBuilder(SymbolNameRef name, C1 &&docs, C2 &&rels)
-      : documentation(), relationships(),
+      : documentation(), spilledDocumentation(), relationships(),
         _bomb(BOMB_INIT(
             fmt::format("SymbolInformationBuilder for '{}'", name.value))),
-        name(name) {
+        name(name), documentationDigest(0) {
     (void)name;
     this->setDocumentation(std::move(docs));
     this->mergeRelationships(std::move(rels));
@@ -116,6 +213,25 @@ public:
                  std::back_inserter(this->documentation));
   };
 
+  /// Unlike \c setDocumentation, this can be called when documentation
+  /// is already present. If the old documentation was spilled, the space
+  /// in the SpillFile is not reclaimed.
+  template <typename C> void replaceDocumentation(C &&newDocumentation) {
+    this->spilledDocumentation.reset();
+    this->documentation.clear();
+    absl::c_move(std::move(newDocumentation),
+                 std::back_inserter(this->documentation));
+  };
+
+  template <typename C>
+  static uint64_t computeDocumentationDigest(const C &docs) {
+    scip_clang::HashValue digest{0};
+    for (auto &doc : docs) {
+      digest.mix(reinterpret_cast<const uint8_t *>(doc.data()), doc.size());
+    }
+    return digest.rawValue;
+  }
+
   template <typename C> void mergeRelationships(C &&newRelationships) {
     for (auto &rel : newRelationships) {
       this->relationships.insert({std::move(rel)});
@@ -126,12 +242,32 @@ public:
     this->_bomb.defuse();
   }
 
+  /// Returns the number of bytes of documentation held in memory.
+  size_t documentationSize() const;
+
+  /// Moves the documentation, if any, to \p spillFile.
+  void spillDocumentation(SpillFile &spillFile);
+  void restoreDocumentation(const SpillFile &spillFile);
+
   void finish(bool deterministic, scip::SymbolInformation &out);
 };
 
+/// Stand-in for a SymbolInformation value for a Document which
+/// is not kept in memory during two-pass merging.
+///
+/// See NOTE(ref: two-pass-merge).
+struct DeferredSymbolInfo {
+  SymbolNameRef name;
+  bool hasDocumentation;
+  /// Documentation found via a forward declaration, which should be
+  /// added to the SymbolInformation when the Document is written.
+  std::optional<std::string> pendingDocumentation;
+};
+
 class ForwardDeclResolver {
   using SymbolInfoOrBuilderPtr =
-      llvm::PointerUnion<SymbolInformation *, SymbolInformationBuilder *>;
+      llvm::PointerUnion<SymbolInformation *, SymbolInformationBuilder *,
+                         DeferredSymbolInfo *>;
 
   absl::flat_hash_map<SymbolSuffix, SymbolInfoOrBuilderPtr> docInternalMap;
 
@@ -143,6 +279,7 @@ public:
 
   void insert(SymbolSuffix, SymbolInformationBuilder *);
   void insert(SymbolSuffix, SymbolInformation *);
+  void insert(SymbolSuffix, DeferredSymbolInfo *);
   void insertExternal(SymbolNameRef);
 
   std::optional<SymbolInfoOrBuilderPtr> lookupInDocuments(SymbolSuffix) const;
@@ -162,21 +299,90 @@ public:
   SymbolNameRef intern(SymbolNameRef);
 };
 
+/// Compact version of an Occurrence without override_documentation
+/// or diagnostics, which covers almost all Occurrences emitted by
+/// scip-clang. Unlike OccurrenceExt, hashing and equality checks don't
+/// need to look at the symbol string, since the symbol is interned.
+class CompactOccurrence final {
+  // The last element is -1 for single-line ranges.
+  std::array<int32_t, 4> range;
+  SymbolNameRef symbol;
+  int32_t symbolRoles;
+  int32_t syntaxKind;
+
+  CompactOccurrence(std::array<int32_t, 4> range, SymbolNameRef symbol,
+                    int32_t symbolRoles, int32_t syntaxKind)
+      : range(range), symbol(symbol), symbolRoles(symbolRoles),
+        syntaxKind(syntaxKind) {}
+
+public:
+  /// Returns nullopt if \p occ has fields which cannot be represented.
+  /// The symbol name is moved out of \p occ only on success.
+  static std::optional<CompactOccurrence> tryFrom(scip::Occurrence &occ,
+                                                  SymbolNameInterner &);
+  /// Variant of \c tryFrom for when the symbol name is already
+  /// interned. The symbol field of \p occ is ignored.
+  static std::optional<CompactOccurrence> tryFrom(const scip::Occurrence &occ,
+                                                  SymbolNameRef symbol);
+
+  void addTo(scip::Occurrence &) const;
+
+  friend bool operator==(const CompactOccurrence &lhs,
+                         const CompactOccurrence &rhs) {
+    // Pointer equality for symbols is sufficient due to interning.
+    return lhs.range == rhs.range
+           && lhs.symbol.value.data() == rhs.symbol.value.data()
+           && lhs.symbol.value.size() == rhs.symbol.value.size()
+           && lhs.symbolRoles == rhs.symbolRoles
+           && lhs.syntaxKind == rhs.syntaxKind;
+  }
+
+  /// Matches the ordering for OccurrenceExt.
+  friend std::strong_ordering operator<=>(const CompactOccurrence &lhs,
+                                          const CompactOccurrence &rhs);
+
+  template <typename H>
+  friend H AbslHashValue(H h, const CompactOccurrence &self) {
+    return H::combine(std::move(h), self.range,
+                      static_cast<const void *>(self.symbol.value.data()),
+                      self.symbol.value.size(), self.symbolRoles,
+                      self.syntaxKind);
+  }
+};
+
 class DocumentBuilder final {
   scip::Document soFar;
   SymbolNameInterner interner;
   scip_clang::Bomb _bomb;
 
+  absl::flat_hash_set<CompactOccurrence> compactOccurrences;
+  // Occurrences which cannot be represented as CompactOccurrence
   absl::flat_hash_set<OccurrenceExt> occurrences;
 
+  // Content digests of the variants merged so far, if available.
+  absl::flat_hash_set<uint64_t> mergedDigests;
+
   // Keyed by the symbol name. The SymbolInformationBuilder value
   // doesn't carry the name to avoid redundant allocations.
   absl::flat_hash_map<SymbolNameRef, SymbolInformationBuilder> symbolInfos;
 
 public:
-  DocumentBuilder(scip::Document &&document, SymbolNameInterner interner);
-  void merge(scip::Document &&doc);
+  /// If \p symbols is non-empty, it must contain the symbol names for
+  /// the document in the order used for IndexShard.symbol_refs.
+  /// See NOTE(ref: shard-symbol-table).
+  DocumentBuilder(scip::Document &&document,
+                  const std::vector<SymbolNameRef> &symbols,
+                  SymbolNameInterner interner);
+  void merge(scip::Document &&doc, const std::vector<SymbolNameRef> &symbols);
+  /// Returns false if a variant with the same content digest
+  /// was already merged.
+  bool addDigest(uint64_t contentDigest) {
+    return this->mergedDigests.insert(contentDigest).second;
+  }
   void populateForwardDeclResolver(ForwardDeclResolver &);
+  std::string_view relativePath() const {
+    return this->soFar.relative_path();
+  }
   void finish(bool deterministic, scip::Document &out);
 };
 
@@ -212,8 +418,151 @@ public:
 using ForwardDeclOccurrenceMap =
     absl::flat_hash_map</*relative path*/ std::string_view,
                         std::vector<ForwardDeclOccurrence>>;
+
+/// Callback for re-supplying Documents which were not kept in memory
+/// during two-pass merging. The callback must pass the same Documents
+/// to the sink, in the same order, as the ones previously passed to
+/// IndexBuilder::addDocument with isMultiplyIndexed = false.
+using DeferredDocumentStreamer =
+    absl::FunctionRef<void(absl::FunctionRef<void(scip::Document &&)>)>;
+
+class IndexShard;
+
+/// NOTE(def: split-index-output): The final index may be split across
+/// several files (e.g. one per package). IndexBuilder picks the part of
+/// the output for each Document and external symbol when submitting it
+/// for serialization, and serialized fragments are handed to the output
+/// in submission order, so the contents of each part are as deterministic
+/// as for a single output file.
+class IndexOutput {
+public:
+  virtual ~IndexOutput() = default;
+
+  /// The methods below are only called from the thread calling
+  /// IndexBuilder::finish (or finishTwoPass).
+  virtual uint32_t partForDocument(std::string_view relativePath) = 0;
+  virtual uint32_t partForExternalSymbol(std::string_view symbol) = 0;
+  virtual void write(uint32_t part, std::string_view serializedIndex) = 0;
+};
+
+/// IndexOutput which writes everything to a single stream.
+class SingleStreamIndexOutput final : public IndexOutput {
+  std::ostream &outputStream;
+
+public:
+  SingleStreamIndexOutput(std::ostream &outputStream)
+      : outputStream(outputStream) {}
+
+  uint32_t partForDocument(std::string_view) override {
+    return 0;
+  }
+  uint32_t partForExternalSymbol(std::string_view) override {
+    return 0;
+  }
+  void write(uint32_t, std::string_view serializedIndex) override {
+    this->outputStream.write(serializedIndex.data(),
+                             std::streamsize(serializedIndex.size()));
+  }
+};
+
+/// Order-independent digest of the contents of a Document.
+///
+/// The digest is computed by workers so that identical variants of a
+/// multiply-indexed Document can be skipped during merging.
+uint64_t documentContentDigest(const scip::Document &);
+
+/// Moves the documents and external symbols from \p index into
+/// \p shard, attaching content digests for each document, moving
+/// long documentation strings into the shard's documentation table,
+/// and replacing symbol names in documents with references into the
+/// shard's symbol table.
+void toIndexShard(scip::Index &&index, scip::IndexShard &shard);
+
+class ForwardDeclIndex;
+
+/// Moves long documentation strings into the shard's documentation table.
+/// See NOTE(ref: documentation-table).
+void internDocumentation(scip::ForwardDeclIndex &);
+
+/// NOTE(def: shard-symbol-table): Most occurrences in a shard refer to
+/// a small number of symbols, with names which are often long. So the
+/// worker stores each distinct symbol name once per shard, and replaces
+/// symbol names in documents with integer references into the table.
+///
+/// When merging, the table is used to intern each distinct name at most
+/// once for multiply-indexed documents, instead of once per occurrence.
+/// Documents which are not multiply-indexed get their names restored,
+/// so that the standard SCIP representation is used after reading.
+class ShardSymbolTable final {
+  std::vector<std::string> table;
+  std::vector<uint32_t> refs;
+  // Offset into refs for the first symbol of each document, with an
+  // extra trailing entry equal to refs.size().
+  std::vector<size_t> documentOffsets;
+  // Lazily populated, as the names for documents which are
+  // not multiply-indexed don't need to be interned.
+  std::vector<std::optional<SymbolNameRef>> interned;
+  bool malformed;
+
+public:
+  /// Replaces the symbol names in \p shard's documents with references.
+  static void encode(scip::IndexShard &shard);
+
+  /// Takes the symbol table from \p shard. If the shard doesn't have a
+  /// symbol table (e.g. for pre-merged shards), the other methods are
+  /// no-ops.
+  explicit ShardSymbolTable(scip::IndexShard &shard);
+  ShardSymbolTable(const ShardSymbolTable &) = delete;
+  ShardSymbolTable &operator=(const ShardSymbolTable &) = delete;
+
+  /// If true, the references don't match the documents in the shard,
+  /// so the symbol names in the shard can't be recovered, and the
+  /// shard should be treated like an unreadable one.
+  bool isMalformed() const {
+    return this->malformed;
+  }
+
+  /// Restores the symbol names for the document at \p documentIndex.
+  void restore(int documentIndex, scip::Document &) const;
+
+  /// Collects the interned symbol names for the document at
+  /// \p documentIndex, in the order used for references.
+  void intern(int documentIndex, SymbolNameInterner &,
+              std::vector<SymbolNameRef> &out);
+};
+
+struct MergeStatistics {
+  uint64_t multiplyIndexedVariants;
+  // Variants skipped because a variant with the same content digest
+  // was already merged.
+  uint64_t skippedDuplicateVariants;
+};
+
 class IndexBuilder final {
   std::vector<scip::Document> documents;
+
+  // NOTE(def: two-pass-merge): In two-pass mode, Documents which are
+  // not multiply indexed are not stored in memory. Instead, only the
+  // information required for resolving forward declarations is stored
+  // in deferredSymbols, and the Documents are re-read in the second pass
+  // in IndexBuilder::finishTwoPass, and immediately written out after
+  // applying the information from resolving forward declarations.
+  //
+  // Additionally, once the external symbols' documentation exceeds the
+  // memory budget, it is moved to spillFile, and only read back right
+  // before writing the symbols out.
+  bool twoPass;
+  std::deque<DeferredSymbolInfo> deferredSymbols;
+  absl::flat_hash_map<SymbolNameRef, DeferredSymbolInfo *> deferredSymbolsMap;
+  uint64_t memoryBudget;
+  uint64_t externalDocumentationSize;
+  std::string spillFilePath;
+  // Non-null iff the external symbols' documentation is being spilled.
+  std::unique_ptr<SpillFile> spillFile;
+
+  // See NOTE(ref: documentation-table)
+  DocumentationTable documentationTable;
+
   // The key is deliberately the path only, not the path+hash, so that we can
   // aggregate information across different hashes into a single Document.
   absl::flat_hash_map<RootRelativePath, std::unique_ptr<DocumentBuilder>>
@@ -225,20 +574,59 @@ class IndexBuilder final {
 
   SymbolNameInterner interner;
 
+  MergeStatistics stats;
+
   scip_clang::Bomb _bomb;
 
 public:
   IndexBuilder(SymbolNameInterner interner);
-  void addDocument(scip::Document &&doc, bool isMultiplyIndexed);
+
+  const MergeStatistics &statistics() const {
+    return this->stats;
+  }
+
+  /// Switches to two-pass merging, which should be done before adding
+  /// any Documents. See NOTE(ref: two-pass-merge).
+  void enableTwoPassMerge(uint64_t memoryBudgetBytes,
+                          std::string &&spillFilePath);
+
+  /// If \p contentDigest is set, and a variant of a multiply-indexed
+  /// Document with the same digest was already added, \p doc is dropped.
+  ///
+  /// \p symbols may only be non-empty for multiply-indexed Documents.
+  /// See NOTE(ref: shard-symbol-table).
+  void addDocument(scip::Document &&doc, bool isMultiplyIndexed,
+                   std::optional<uint64_t> contentDigest,
+                   const std::vector<SymbolNameRef> &symbols);
   void addExternalSymbol(scip::SymbolInformation &&extSym);
 
+  /// Should be called for the documentation table of each shard, before
+  /// passing the shard's contents to other methods.
+  void addDocumentationTable(DocumentationTable::ShardTable &&);
+
   // The map contains interior references into IndexBuilder's state.
   std::unique_ptr<ForwardDeclResolver> populateForwardDeclResolver();
   void addForwardDeclaration(ForwardDeclResolver &, scip::ForwardDecl &&);
 
-  void finish(bool deterministic, std::ostream &);
+  /// Finishes and serializes documents using \p numThreads threads,
+  /// while still writing out documents and external symbols in a fixed
+  /// order (sorted if \p deterministic is true).
+  void finish(bool deterministic, unsigned numThreads, IndexOutput &);
+
+  /// Equivalent of \c finish for two-pass merging.
+  void finishTwoPass(bool deterministic, unsigned numThreads,
+                     DeferredDocumentStreamer, IndexOutput &);
 
 private:
+  void finishImpl(bool deterministic, unsigned numThreads,
+                  std::optional<DeferredDocumentStreamer>, IndexOutput &);
+
+  void addDeferredSymbols(scip::Document &&doc);
+  void applyDeferredSymbolInfo(scip::Document &doc);
+
+  void trackExternalDocumentation(SymbolInformationBuilder &);
+  void spillIfOverBudget();
+
   void addExternalSymbolUnchecked(SymbolNameRef,
                                   scip::SymbolInformation &&symWithoutName);
 
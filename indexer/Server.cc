@@ -0,0 +1,216 @@
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <system_error>
+#include <unistd.h>
+#include <utility>
+
+#include "spdlog/fmt/fmt.h"
+#include "spdlog/spdlog.h"
+
+#include "llvm/Support/Error.h"
+#include "llvm/Support/JSON.h"
+
+#include "indexer/Derive.h"
+#include "indexer/Enforce.h"
+#include "indexer/LlvmAdapter.h"
+#include "indexer/Server.h"
+
+namespace {
+
+// Requests only have a handful of paths.
+constexpr size_t maxRequestSizeBytes = 64 * 1024;
+
+// Requests are sent right after connecting, so a client which takes
+// longer than this is stuck, and shouldn't block other clients. The same
+// limit applies to sending the response.
+constexpr time_t clientTimeoutSeconds = 30;
+
+// The sockets are close-on-exec, so that workers don't inherit them.
+// macOS doesn't support SOCK_CLOEXEC or accept4, but the server is
+// single-threaded, so setting the flag separately doesn't race with
+// spawning workers.
+int createListenSocket() {
+#ifdef __linux__
+  return ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+#else
+  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd >= 0) {
+    ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+  }
+  return fd;
+#endif
+}
+
+int acceptConnection(int listenFd) {
+#ifdef __linux__
+  return ::accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+#else
+  int fd = ::accept(listenFd, nullptr, nullptr);
+  if (fd >= 0) {
+    ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+  }
+  return fd;
+#endif
+}
+
+bool writeAll(int fd, std::string_view data) {
+  while (!data.empty()) {
+    auto n = ::write(fd, data.data(), data.size());
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data.remove_prefix(size_t(n));
+  }
+  return true;
+}
+
+} // namespace
+
+namespace scip_clang {
+
+llvm::json::Value toJSON(const ServeRequest &r) {
+  return llvm::json::Object{
+      {"compdbPath", r.compdbPath},
+      {"indexOutputPath", r.indexOutputPath},
+      {"changedFilesPath", r.changedFilesPath},
+  };
+}
+
+bool fromJSON(const llvm::json::Value &value, ServeRequest &r,
+              llvm::json::Path path) {
+  llvm::json::ObjectMapper mapper(value, path);
+  return mapper && mapper.map("compdbPath", r.compdbPath)
+         && mapper.map("indexOutputPath", r.indexOutputPath)
+         && mapper.mapOptional("changedFilesPath", r.changedFilesPath);
+}
+
+DERIVE_SERIALIZE_2(scip_clang::ServeResponse, success, message)
+
+ServerSocket::ServerSocket(std::string path)
+    : path(std::move(path)), listenFd(-1), connectionFd(-1) {
+  sockaddr_un address{};
+  if (this->path.size() >= sizeof(address.sun_path)) {
+    spdlog::error("socket path '{}' is too long (limit: {} bytes)", this->path,
+                  sizeof(address.sun_path) - 1);
+    std::exit(EXIT_FAILURE);
+  }
+  address.sun_family = AF_UNIX;
+  std::memcpy(address.sun_path, this->path.data(), this->path.size());
+
+  std::error_code error;
+  if (std::filesystem::is_socket(this->path, error)) {
+    // Left behind by a server which didn't exit cleanly.
+    ::unlink(this->path.c_str());
+  }
+  this->listenFd = ::createListenSocket();
+  if (this->listenFd < 0
+      || ::bind(this->listenFd, reinterpret_cast<sockaddr *>(&address),
+                sizeof(address))
+             < 0
+      || ::listen(this->listenFd, SOMAXCONN) < 0) {
+    spdlog::error("failed to listen on socket at '{}' ({})", this->path,
+                  std::strerror(errno));
+    std::exit(EXIT_FAILURE);
+  }
+  // Clients going away shouldn't take down the server; writes fail
+  // with EPIPE instead.
+  std::signal(SIGPIPE, SIG_IGN);
+  spdlog::info("listening for requests on '{}'", this->path);
+}
+
+ServerSocket::~ServerSocket() {
+  if (this->connectionFd >= 0) {
+    ::close(this->connectionFd);
+  }
+  if (this->listenFd >= 0) {
+    ::close(this->listenFd);
+    ::unlink(this->path.c_str());
+  }
+}
+
+std::optional<std::string>
+ServerSocket::receiveRequest(ServeRequest &request) {
+  ENFORCE(this->connectionFd < 0, "previous client was not sent a response");
+  while (this->connectionFd < 0) {
+    this->connectionFd = ::acceptConnection(this->listenFd);
+    if (this->connectionFd >= 0 || errno == EINTR || errno == ECONNABORTED) {
+      continue;
+    }
+    spdlog::error("failed to accept connection on '{}' ({})", this->path,
+                  std::strerror(errno));
+    std::exit(EXIT_FAILURE);
+  }
+  timeval timeout{clientTimeoutSeconds, 0};
+  if (::setsockopt(this->connectionFd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                   sizeof(timeout))
+          < 0
+      || ::setsockopt(this->connectionFd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                      sizeof(timeout))
+             < 0) {
+    return fmt::format("failed to set timeout for client ({})",
+                       std::strerror(errno));
+  }
+
+  std::string buffer;
+  char chunk[4096];
+  while (buffer.find('\n') == std::string::npos) {
+    if (buffer.size() > maxRequestSizeBytes) {
+      return fmt::format("request exceeds {} bytes", maxRequestSizeBytes);
+    }
+    auto n = ::read(this->connectionFd, chunk, sizeof(chunk));
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return fmt::format("timed out after {}s waiting for request",
+                           clientTimeoutSeconds);
+      }
+      return fmt::format("failed to read request ({})", std::strerror(errno));
+    }
+    if (n == 0) {
+      break;
+    }
+    buffer.append(chunk, size_t(n));
+  }
+  auto line = std::string_view(buffer).substr(0, buffer.find('\n'));
+  auto valueOrErr = llvm::json::parse(line);
+  if (!valueOrErr) {
+    return fmt::format("malformed request: {}",
+                       llvm::toString(valueOrErr.takeError()));
+  }
+  llvm::json::Path::Root root("request");
+  if (!fromJSON(*valueOrErr, request, root)) {
+    return fmt::format("malformed request: {}",
+                       llvm::toString(root.getError()));
+  }
+  return {};
+}
+
+void ServerSocket::respond(const ServeResponse &response) {
+  if (this->connectionFd < 0) {
+    return;
+  }
+  auto line = fmt::format("{}\n", llvm_ext::format(toJSON(response)));
+  if (!::writeAll(this->connectionFd, line)) {
+    spdlog::warn("failed to send response to client ({})",
+                 std::strerror(errno));
+  }
+  ::close(this->connectionFd);
+  this->connectionFd = -1;
+}
+
+} // namespace scip_clang
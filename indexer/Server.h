@@ -0,0 +1,62 @@
+#ifndef SCIP_CLANG_SERVER_H
+#define SCIP_CLANG_SERVER_H
+
+#include <optional>
+#include <string>
+
+#include "llvm/Support/JSON.h"
+
+#include "indexer/Derive.h"
+
+namespace scip_clang {
+
+/// Indexing request accepted with --serve-socket-path, sent by a client
+/// as a single line of JSON. All paths must be absolute.
+///
+/// See NOTE(ref: serve-mode).
+struct ServeRequest {
+  std::string compdbPath;
+  std::string indexOutputPath;
+  /// Optional; see NOTE(ref: changed-files).
+  std::string changedFilesPath;
+};
+SERIALIZABLE(ServeRequest)
+
+/// Sent back to the client as a single line of JSON once the request
+/// has been processed.
+struct ServeResponse {
+  bool success;
+  std::string message;
+};
+SERIALIZABLE(ServeResponse)
+
+/// Listening Unix domain socket which handles one client at a time.
+class ServerSocket final {
+  std::string path;
+  int listenFd;
+  /// -1 when no client is connected.
+  int connectionFd;
+
+public:
+  /// Removes a stale socket file at \p path if present, and exits
+  /// if binding to the path fails.
+  explicit ServerSocket(std::string path);
+  ServerSocket(const ServerSocket &) = delete;
+  ServerSocket &operator=(const ServerSocket &) = delete;
+  ~ServerSocket();
+
+  /// Waits for the next client to connect and reads its request.
+  ///
+  /// Returns an error message if the request couldn't be read or parsed,
+  /// including if the client doesn't finish sending it in time.
+  /// In that case, the caller should still call \c respond, so that the
+  /// client gets to know about the error.
+  std::optional<std::string> receiveRequest(ServeRequest &request);
+
+  /// Sends \p response to the current client and disconnects it.
+  void respond(const ServeResponse &response);
+};
+
+} // namespace scip_clang
+
+#endif // SCIP_CLANG_SERVER_H
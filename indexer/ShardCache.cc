@@ -0,0 +1,400 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <ios>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "absl/algorithm/container.h"
+#include "boost/core/no_exceptions_support.hpp"
+#include "boost/process/io.hpp"
+#include "boost/process/search_path.hpp"
+#include "boost/process/system.hpp"
+#include "spdlog/fmt/fmt.h"
+#include "spdlog/spdlog.h"
+
+#include "llvm/Support/Path.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+
+#include "indexer/CompilationDatabase.h"
+#include "indexer/FileSystem.h"
+#include "indexer/Hash.h"
+#include "indexer/IpcMessages.h"
+#include "indexer/Path.h"
+#include "indexer/ShardCache.h"
+
+namespace {
+
+using namespace scip_clang;
+
+void mixString(HashValue &hash, std::string_view s) {
+  uint64_t size = s.size();
+  hash.mix(reinterpret_cast<const uint8_t *>(&size), sizeof(size));
+  hash.mix(reinterpret_cast<const uint8_t *>(s.data()), s.size());
+}
+
+void mixU64(HashValue &hash, uint64_t value) {
+  hash.mix(reinterpret_cast<const uint8_t *>(&value), sizeof(value));
+}
+
+/// Object names mirror ShardPaths::forFiles.
+std::pair<std::string, std::string> objectNames(uint64_t key) {
+  return {fmt::format("{:016x}-docs_and_externals.shard.scip", key),
+          fmt::format("{:016x}-forward_decls.shard.scip", key)};
+}
+
+bool copyToStaging(const AbsolutePath &from, const StdPath &to) {
+  std::error_code error;
+  std::filesystem::copy_file(from.asStringRef(), to,
+                             std::filesystem::copy_options::overwrite_existing,
+                             error);
+  if (error) {
+    spdlog::warn("failed to copy shard '{}' for the shard cache ({})",
+                 from.asStringRef(), error.message());
+    return false;
+  }
+  return true;
+}
+
+class LocalDirBackend final : public ShardCacheBackend {
+  StdPath dir;
+
+public:
+  explicit LocalDirBackend(StdPath dir) : dir(std::move(dir)) {}
+
+  std::optional<AbsolutePath> fetch(std::string_view objectName) override {
+    auto path = this->dir / objectName;
+    std::error_code error;
+    if (!std::filesystem::is_regular_file(path, error)) {
+      return {};
+    }
+    return AbsolutePath(path.string());
+  }
+
+  void store(std::string_view objectName,
+             const AbsolutePath &stagedPath) override {
+    // Write under a unique name first and rename, so that concurrent
+    // readers (possibly other scip-clang processes) never see partial files.
+    StdPath from{stagedPath.asStringRef()};
+    auto tmpPath = this->dir
+                   / fmt::format("{}.tmp-{}", objectName,
+                                 from.filename().string());
+    std::error_code error;
+    std::filesystem::rename(from, tmpPath, error);
+    if (error) {
+      // The staging directory may be on a different file system.
+      std::filesystem::copy_file(
+          from, tmpPath, std::filesystem::copy_options::overwrite_existing,
+          error);
+    }
+    if (!error) {
+      std::filesystem::rename(tmpPath, this->dir / objectName, error);
+    }
+    if (error) {
+      spdlog::warn("failed to store '{}' in the shard cache at '{}' ({})",
+                   objectName, this->dir.c_str(), error.message());
+      std::filesystem::remove(tmpPath, error);
+    }
+    std::filesystem::remove(stagedPath.asStringRef(), error);
+  }
+};
+
+/// Shells out to curl instead of linking an HTTP client, as uploads and
+/// downloads are coarse-grained (two objects per TU).
+class HttpBackend final : public ShardCacheBackend {
+  std::string baseUrl;
+  StdPath downloadDir;
+  std::string curlPath;
+
+public:
+  HttpBackend(std::string_view baseUrl, StdPath downloadDir,
+              std::string curlPath)
+      : baseUrl(baseUrl), downloadDir(std::move(downloadDir)),
+        curlPath(std::move(curlPath)) {
+    while (this->baseUrl.ends_with('/')) {
+      this->baseUrl.pop_back();
+    }
+  }
+
+  std::optional<AbsolutePath> fetch(std::string_view objectName) override {
+    auto path = this->downloadDir / objectName;
+    if (!this->runCurl({"--output", path.string(), this->url(objectName)})) {
+      std::error_code error;
+      std::filesystem::remove(path, error);
+      return {};
+    }
+    return AbsolutePath(path.string());
+  }
+
+  void store(std::string_view objectName,
+             const AbsolutePath &stagedPath) override {
+    if (!this->runCurl({"--upload-file", stagedPath.asStringRef(),
+                        this->url(objectName)})) {
+      spdlog::warn("failed to upload '{}' to the shard cache at '{}'",
+                   objectName, this->baseUrl);
+    }
+    std::error_code error;
+    std::filesystem::remove(stagedPath.asStringRef(), error);
+  }
+
+private:
+  std::string url(std::string_view objectName) const {
+    return fmt::format("{}/{}", this->baseUrl, objectName);
+  }
+
+  bool runCurl(std::vector<std::string> &&args) const {
+    args.insert(args.begin(),
+                {this->curlPath, "--silent", "--fail", "--location"});
+    int exitCode = -1;
+    BOOST_TRY {
+      exitCode = boost::process::system(args,
+                                        boost::process::std_out
+                                            > boost::process::null,
+                                        boost::process::std_err
+                                            > boost::process::null);
+    }
+    BOOST_CATCH(boost::process::process_error & error) {
+      spdlog::warn("failed to run curl for the shard cache: {}", error.what());
+    }
+    BOOST_CATCH_END
+    return exitCode == 0;
+  }
+};
+
+} // namespace
+
+namespace scip_clang {
+
+ShardCache::ShardCache(std::unique_ptr<ShardCacheBackend> &&backend,
+                       StdPath stagingDir, uint64_t configDigest,
+                       const RootPath &projectRootPath)
+    : backend(std::move(backend)), stagingDir(std::move(stagingDir)),
+      configDigest(configDigest),
+      projectRoot(projectRootPath.asRef().asStringView()), contentHashes(),
+      pendingInputDigests(), missedKeys(),
+      storePool(llvm::hardware_concurrency(4)), hitCount(0), missCount(0),
+      stagedCount(0) {}
+
+ShardCache::~ShardCache() {
+  this->wait();
+}
+
+// static
+std::unique_ptr<ShardCache> ShardCache::open(std::string_view location,
+                                             StdPath stagingDir,
+                                             uint64_t configDigest,
+                                             const RootPath &projectRootPath,
+                                             std::string &error) {
+  std::error_code ec;
+  std::filesystem::create_directories(stagingDir, ec);
+  if (ec) {
+    error = fmt::format("failed to create staging directory for the shard "
+                        "cache at '{}' ({})",
+                        stagingDir.c_str(), ec.message());
+    return nullptr;
+  }
+  std::unique_ptr<ShardCacheBackend> backend;
+  if (location.starts_with("http://") || location.starts_with("https://")) {
+    auto curlPath = boost::process::search_path("curl");
+    if (curlPath.empty()) {
+      error = fmt::format("--shard-cache={} requires curl to be on PATH",
+                          location);
+      return nullptr;
+    }
+    backend = std::make_unique<HttpBackend>(location, stagingDir,
+                                            curlPath.string());
+  } else {
+    auto dir = std::filesystem::absolute(StdPath(location));
+    std::filesystem::create_directories(dir, ec);
+    if (ec) {
+      error = fmt::format("failed to create shard cache directory at '{}' "
+                          "({})",
+                          dir.c_str(), ec.message());
+      return nullptr;
+    }
+    backend = std::make_unique<LocalDirBackend>(std::move(dir));
+  }
+  return std::make_unique<ShardCache>(std::move(backend), std::move(stagingDir),
+                                      configDigest, projectRootPath);
+}
+
+void ShardCache::recordSemaResult(uint32_t taskId,
+                                  const compdb::CommandObject &command,
+                                  const SemanticAnalysisJobResult &semaResult) {
+  HashValue digest{this->configDigest};
+  ::mixString(digest, this->normalize(command.workingDirectory));
+  ::mixString(digest, this->normalize(command.filePath));
+  ::mixU64(digest, command.arguments.size());
+  for (auto &arg : command.arguments) {
+    ::mixString(digest, this->normalize(arg));
+  }
+
+  std::string mainFilePath = command.filePath;
+  if (!llvm::sys::path::is_absolute(mainFilePath)) {
+    mainFilePath = (StdPath(command.workingDirectory) / mainFilePath).string();
+  }
+  using Input = std::tuple<std::string, uint64_t, uint64_t>;
+  std::vector<Input> inputs{};
+  auto addInput = [&](const std::string &path, uint64_t hashValue) -> bool {
+    auto contentHash = this->contentHash(path);
+    if (!contentHash.has_value()) {
+      return false;
+    }
+    inputs.emplace_back(this->normalize(path), contentHash->rawValue,
+                        hashValue);
+    return true;
+  };
+  bool ok = addInput(mainFilePath, 0);
+  for (auto &fileInfo : semaResult.wellBehavedFiles) {
+    ok = ok
+         && addInput(fileInfo.path.asStringRef(), fileInfo.hashValue.rawValue);
+  }
+  for (auto &fileInfo : semaResult.illBehavedFiles) {
+    for (auto hashValue : fileInfo.hashValues) {
+      ok = ok && addInput(fileInfo.path.asStringRef(), hashValue.rawValue);
+    }
+  }
+  if (!ok) {
+    // Not caching TUs with unreadable inputs is safer than caching
+    // them with partial keys.
+    return;
+  }
+  absl::c_sort(inputs);
+  ::mixU64(digest, inputs.size());
+  for (auto &[path, contentHash, hashValue] : inputs) {
+    ::mixString(digest, path);
+    ::mixU64(digest, contentHash);
+    ::mixU64(digest, hashValue);
+  }
+  this->pendingInputDigests.insert_or_assign(taskId, digest);
+}
+
+std::optional<ShardCache::PendingLookup>
+ShardCache::startLookup(uint32_t taskId,
+                        const std::vector<PreprocessedFileInfo> &assigned) {
+  auto it = this->pendingInputDigests.find(taskId);
+  if (it == this->pendingInputDigests.end()) {
+    return {};
+  }
+  auto digest = it->second;
+  this->pendingInputDigests.erase(it);
+
+  std::vector<std::pair<std::string, uint64_t>> assignedKeys{};
+  for (auto &fileInfo : assigned) {
+    assignedKeys.emplace_back(this->normalize(fileInfo.path.asStringRef()),
+                              fileInfo.hashValue.rawValue);
+  }
+  absl::c_sort(assignedKeys);
+  ::mixU64(digest, assignedKeys.size());
+  for (auto &[path, hashValue] : assignedKeys) {
+    ::mixString(digest, path);
+    ::mixU64(digest, hashValue);
+  }
+
+  auto result = this->storePool.async(
+      [backend = this->backend.get(),
+       key = digest.rawValue]() -> std::optional<ShardPaths> {
+        auto [docsAndExternalsName, forwardDeclsName] = ::objectNames(key);
+        auto docsAndExternals = backend->fetch(docsAndExternalsName);
+        if (!docsAndExternals.has_value()) {
+          return {};
+        }
+        auto forwardDecls = backend->fetch(forwardDeclsName);
+        if (!forwardDecls.has_value()) {
+          return {};
+        }
+        return ShardPaths{std::move(docsAndExternals.value()),
+                          std::move(forwardDecls.value()), std::nullopt,
+                          std::nullopt};
+      });
+  return PendingLookup{digest.rawValue, std::move(result)};
+}
+
+std::optional<ShardPaths> ShardCache::finishLookup(uint32_t taskId,
+                                                   PendingLookup &&lookup) {
+  auto cached = lookup.result.get();
+  if (!cached.has_value()) {
+    this->missCount++;
+    this->missedKeys.insert_or_assign(taskId, lookup.key);
+    return {};
+  }
+  this->hitCount++;
+  return cached;
+}
+
+void ShardCache::store(uint32_t taskId, const ShardPaths &paths) {
+  auto it = this->missedKeys.find(taskId);
+  if (it == this->missedKeys.end() || paths.docsAndExternalsRange.has_value()) {
+    return;
+  }
+  auto [docsAndExternalsName, forwardDeclsName] = ::objectNames(it->second);
+  this->missedKeys.erase(it);
+  this->stageAndStore(paths.forwardDecls, std::move(forwardDeclsName));
+  this->stageAndStore(paths.docsAndExternals, std::move(docsAndExternalsName));
+}
+
+void ShardCache::stageAndStore(const AbsolutePath &path,
+                               std::string &&objectName) {
+  auto stagedPath =
+      this->stagingDir / fmt::format("upload-{}", this->stagedCount++);
+  if (!::copyToStaging(path, stagedPath)) {
+    return;
+  }
+  this->storePool.async([backend = this->backend.get(),
+                         objectName = std::move(objectName),
+                         stagedPath = AbsolutePath(stagedPath.string())]() {
+    backend->store(objectName, stagedPath);
+  });
+}
+
+void ShardCache::wait() {
+  this->storePool.wait();
+}
+
+std::optional<HashValue> ShardCache::contentHash(const std::string &path) {
+  auto it = this->contentHashes.find(path);
+  if (it != this->contentHashes.end()) {
+    return it->second;
+  }
+  std::optional<HashValue> result{};
+  std::ifstream file(path, std::ios_base::in | std::ios_base::binary);
+  if (!file.fail()) {
+    std::string contents{std::istreambuf_iterator<char>(file),
+                         std::istreambuf_iterator<char>()};
+    if (!file.bad()) {
+      result = HashValue{HashValue::forText(contents)};
+    }
+  }
+  this->contentHashes.emplace(path, result);
+  return result;
+}
+
+std::string ShardCache::normalize(std::string_view text) const {
+  std::string result{};
+  std::string_view root = this->projectRoot;
+  size_t start = 0;
+  while (true) {
+    // Skip normalization if the project root is '/' (e.g. in tests).
+    auto pos = root.size() <= 1 ? std::string_view::npos
+                                : text.find(root, start);
+    if (pos == std::string_view::npos) {
+      result.append(text.substr(start));
+      return result;
+    }
+    result.append(text.substr(start, pos - start));
+    result.append("$PROJECT_ROOT");
+    start = pos + root.size();
+  }
+}
+
+} // namespace scip_clang
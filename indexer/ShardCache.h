@@ -0,0 +1,156 @@
+#ifndef SCIP_CLANG_SHARD_CACHE_H
+#define SCIP_CLANG_SHARD_CACHE_H
+
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+
+#include "llvm/Support/ThreadPool.h"
+
+#include "indexer/CompilationDatabase.h"
+#include "indexer/FileSystem.h"
+#include "indexer/Hash.h"
+#include "indexer/IpcMessages.h"
+#include "indexer/Path.h"
+
+namespace scip_clang {
+
+/// Storage for shard cache objects, addressed by file name.
+class ShardCacheBackend {
+public:
+  virtual ~ShardCacheBackend() = default;
+
+  /// Returns the path to a local copy of the object, if it is present.
+  /// The returned file must not be modified or deleted by the caller.
+  /// May be called concurrently.
+  virtual std::optional<AbsolutePath> fetch(std::string_view objectName) = 0;
+
+  /// Takes ownership of the file at \p stagedPath, and makes it available
+  /// under \p objectName. May be called concurrently.
+  virtual void store(std::string_view objectName,
+                     const AbsolutePath &stagedPath) = 0;
+};
+
+/// NOTE(def: shard-cache): With --shard-cache, the driver looks up the
+/// shards for each TU in a content-addressed store, which can be a local
+/// directory or an HTTP server supporting GET and PUT (e.g. a build cache
+/// shared by CI machines), so that identical TUs across checkouts, commits
+/// or machines are only indexed once.
+///
+/// The key for a TU is computed from:
+/// - The scip-clang version and the package map contents.
+/// - The compilation command, with the project root replaced by a
+///   placeholder, so that checkouts at different paths share entries.
+/// - The (path, content hash, preprocessor hash) triples for the main file
+///   and every file touched by the preprocessor. The preprocessor hashes
+///   (see IndexerPreprocessorWrapper) only cover the include structure and
+///   macro expansions, not file contents, so contents are hashed separately.
+/// - The (path, preprocessor hash) pairs which the FileIndexingPlanner
+///   assigned to the TU, as a shard only has documents for those files.
+///
+/// Since the preprocessor hashes are only available after semantic
+/// analysis, a cache hit saves the AST traversal and shard serialization,
+/// but not the semantic analysis itself. On a hit, the worker is told to
+/// skip emitting, and the cached shards are merged in place of fresh ones.
+///
+/// Fetches (which may involve running curl) happen on a background thread.
+/// Meanwhile, the driver keeps processing results from other workers, and
+/// only sends the EmitIndex request to the worker once the fetch is done.
+///
+/// Shards need to be self-contained, so external symbols are neither
+/// deduplicated across workers (NOTE(ref: external-symbol-dedup)) nor
+/// across the TUs handled by one worker, and shard logs and worker-side
+/// pre-merging are disabled in this mode.
+class ShardCache final {
+  std::unique_ptr<ShardCacheBackend> backend;
+  StdPath stagingDir;
+  uint64_t configDigest;
+  std::string projectRoot;
+
+  /// Content hashes for files seen so far, keyed by absolute path.
+  /// Files for which reading failed are mapped to std::nullopt.
+  absl::flat_hash_map<std::string, std::optional<HashValue>> contentHashes;
+  /// Digests of the command and touched files, for TUs whose semantic
+  /// analysis completed, but for which lookup hasn't been called yet.
+  absl::flat_hash_map<uint32_t, HashValue> pendingInputDigests;
+  /// Keys for TUs which missed the cache, and whose shards should be stored.
+  absl::flat_hash_map<uint32_t, uint64_t> missedKeys;
+
+  /// Used for both fetches and uploads.
+  llvm::DefaultThreadPool storePool;
+  size_t hitCount;
+  size_t missCount;
+  size_t stagedCount;
+
+public:
+  ShardCache(std::unique_ptr<ShardCacheBackend> &&backend, StdPath stagingDir,
+             uint64_t configDigest, const RootPath &projectRootPath);
+  ShardCache(const ShardCache &) = delete;
+  ShardCache &operator=(const ShardCache &) = delete;
+  ~ShardCache();
+
+  /// Creates a cache backed by a local directory, or by an HTTP server
+  /// if \p location starts with http:// or https://.
+  ///
+  /// \p stagingDir is used for downloads and for files being uploaded.
+  /// Returns nullptr and sets \p error if the cache cannot be set up.
+  static std::unique_ptr<ShardCache> open(std::string_view location,
+                                          StdPath stagingDir,
+                                          uint64_t configDigest,
+                                          const RootPath &projectRootPath,
+                                          std::string &error);
+
+  /// Hashes the inputs for a TU after semantic analysis.
+  void recordSemaResult(uint32_t taskId, const compdb::CommandObject &,
+                        const SemanticAnalysisJobResult &);
+
+  /// A fetch started by \c startLookup.
+  struct PendingLookup {
+    uint64_t key;
+    std::shared_future<std::optional<ShardPaths>> result;
+  };
+
+  /// Computes the key for the TU given the files assigned to it, and
+  /// starts fetching the shards for it on a background thread.
+  ///
+  /// Returns nullopt if the TU can't be cached, e.g. if some of its
+  /// inputs couldn't be read.
+  std::optional<PendingLookup>
+  startLookup(uint32_t taskId,
+              const std::vector<PreprocessedFileInfo> &assigned);
+
+  /// Returns cached shards for the TU, if present, waiting for the fetch
+  /// to finish if needed. Otherwise, the TU is remembered for \c store.
+  std::optional<ShardPaths> finishLookup(uint32_t taskId,
+                                         PendingLookup &&lookup);
+
+  /// Uploads freshly written shards for a TU which missed the cache.
+  /// The shards are copied first, so the caller can move or delete
+  /// them right after this returns.
+  void store(uint32_t taskId, const ShardPaths &paths);
+
+  /// Waits for pending fetches and uploads to finish.
+  void wait();
+
+  size_t numHits() const {
+    return this->hitCount;
+  }
+  size_t numMisses() const {
+    return this->missCount;
+  }
+
+private:
+  void stageAndStore(const AbsolutePath &path, std::string &&objectName);
+  std::optional<HashValue> contentHash(const std::string &path);
+  std::string normalize(std::string_view text) const;
+};
+
+} // namespace scip_clang
+
+#endif // SCIP_CLANG_SHARD_CACHE_H
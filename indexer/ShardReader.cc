@@ -0,0 +1,169 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <ios>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "perfetto/perfetto.h"
+#include "spdlog/spdlog.h"
+
+#include "llvm/Support/Threading.h"
+
+#include "proto/fwd_decls.pb.h"
+
+#include "indexer/FileSystem.h"
+#include "indexer/IpcMessages.h"
+#include "indexer/Path.h"
+#include "indexer/ShardReader.h"
+#include "indexer/Tracing.h"
+
+namespace scip_clang {
+
+ShardReader::~ShardReader() {
+  for (auto &[_, fd] : this->logFds) {
+    if (fd >= 0) {
+      ::close(fd);
+    }
+  }
+}
+
+bool ShardReader::read(const AbsolutePath &path,
+                       const std::optional<ShardLogRange> &optRange,
+                       google::protobuf::Message &shard) {
+  TRACE_EVENT(tracing::indexIo, "ShardReader::read");
+  auto &shardPath = path.asStringRef();
+  if (!optRange.has_value()) {
+    std::ifstream inputStream(shardPath,
+                              std::ios_base::in | std::ios_base::binary);
+    if (inputStream.fail()) {
+      spdlog::warn("failed to open shard at '{}' ({})", shardPath,
+                   std::strerror(errno));
+      return false;
+    }
+    if (!shard.ParseFromIstream(&inputStream)) {
+      spdlog::warn("failed to parse shard at '{}'", shardPath);
+      return false;
+    }
+    return true;
+  }
+  auto [it, inserted] = this->logFds.try_emplace(shardPath, -1);
+  if (inserted) {
+    it->second = ShardReader::openLog(shardPath);
+  }
+  return ShardReader::readFromLog(it->second, shardPath, optRange.value(),
+                                  this->buffer, shard);
+}
+
+// static
+int ShardReader::openLog(const std::string &logPath) {
+  int fd = ::open(logPath.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    spdlog::warn("failed to open shard log at '{}' ({})", logPath,
+                 std::strerror(errno));
+  }
+  return fd;
+}
+
+// static
+bool ShardReader::readFromLog(int logFd, const std::string &logPath,
+                              const ShardLogRange &range, std::string &buffer,
+                              google::protobuf::Message &shard) {
+  if (logFd < 0) {
+    return false;
+  }
+  if (!preadExact(logFd, range.offset, range.size, buffer)) {
+    spdlog::warn("failed to read {} bytes at offset {} from shard log '{}' "
+                 "({})",
+                 range.size, range.offset, logPath,
+                 errno == 0 ? "unexpected EOF" : std::strerror(errno));
+    return false;
+  }
+  if (!shard.ParseFromArray(buffer.data(), int(buffer.size()))) {
+    spdlog::warn("failed to parse shard at offset {} in shard log '{}'",
+                 range.offset, logPath);
+    return false;
+  }
+  return true;
+}
+
+ForwardDeclShardPrefetcher::ForwardDeclShardPrefetcher(
+    std::vector<const ShardPaths *> &&shards, unsigned numThreads)
+    : shards(std::move(shards)), logFds(),
+      threadPool(llvm::hardware_concurrency(numThreads)), inFlight(),
+      nextToSubmit(0), maxInFlight(4 * size_t(std::max(numThreads, 1u))) {
+  for (auto *paths : this->shards) {
+    if (!paths->forwardDeclsRange.has_value()) {
+      continue;
+    }
+    auto &logPath = paths->forwardDecls.asStringRef();
+    auto [it, inserted] = this->logFds.try_emplace(logPath, -1);
+    if (inserted) {
+      it->second = ShardReader::openLog(logPath);
+    }
+  }
+}
+
+ForwardDeclShardPrefetcher::~ForwardDeclShardPrefetcher() {
+  // Wait for in-flight reads before closing the descriptors.
+  this->threadPool.wait();
+  for (auto &[_, fd] : this->logFds) {
+    if (fd >= 0) {
+      ::close(fd);
+    }
+  }
+}
+
+void ForwardDeclShardPrefetcher::forEach(
+    absl::FunctionRef<void(scip::ForwardDeclIndex &&)> consume) {
+  while (true) {
+    while (this->nextToSubmit < this->shards.size()
+           && this->inFlight.size() < this->maxInFlight) {
+      auto *paths = this->shards[this->nextToSubmit];
+      int logFd = -1;
+      if (paths->forwardDeclsRange.has_value()) {
+        logFd = this->logFds.at(paths->forwardDecls.asStringRef());
+      }
+      this->inFlight.push_back(
+          this->threadPool.async([paths, logFd]() -> Result {
+            TRACE_EVENT(tracing::indexIo, "ForwardDeclShardPrefetcher::read");
+            auto shard = std::make_shared<scip::ForwardDeclIndex>();
+            if (!ForwardDeclShardPrefetcher::read(*paths, logFd, *shard)) {
+              return nullptr;
+            }
+            return shard;
+          }));
+      this->nextToSubmit++;
+    }
+    if (this->inFlight.empty()) {
+      return;
+    }
+    auto shard = this->inFlight.front().get();
+    this->inFlight.pop_front();
+    if (shard) {
+      consume(std::move(*shard));
+    }
+  }
+}
+
+// static
+bool ForwardDeclShardPrefetcher::read(const ShardPaths &paths, int logFd,
+                                      scip::ForwardDeclIndex &shard) {
+  if (!paths.forwardDeclsRange.has_value()) {
+    // Standalone files are only read once, so there is nothing to share.
+    ShardReader shardReader{};
+    return shardReader.read(paths.forwardDecls, std::nullopt, shard);
+  }
+  std::string buffer;
+  return ShardReader::readFromLog(logFd, paths.forwardDecls.asStringRef(),
+                                  paths.forwardDeclsRange.value(), buffer,
+                                  shard);
+}
+
+} // namespace scip_clang
@@ -0,0 +1,103 @@
+#ifndef SCIP_CLANG_SHARD_READER_H
+#define SCIP_CLANG_SHARD_READER_H
+
+#include <cstddef>
+#include <deque>
+#include <future>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/functional/function_ref.h"
+
+#include "llvm/Support/ThreadPool.h"
+
+#include "proto/fwd_decls.pb.h"
+
+#include "indexer/IpcMessages.h"
+#include "indexer/Path.h"
+
+namespace google::protobuf {
+class Message;
+}
+
+namespace scip_clang {
+
+/// Reads shards written by workers, either as standalone files
+/// or as byte ranges inside shard logs.
+///
+/// See NOTE(ref: shard-log).
+class ShardReader final {
+  // Entries are -1 for logs which couldn't be opened.
+  absl::flat_hash_map<std::string, int> logFds;
+  std::string buffer;
+
+public:
+  ShardReader() : logFds(), buffer() {}
+  ~ShardReader();
+  ShardReader(const ShardReader &) = delete;
+  ShardReader &operator=(const ShardReader &) = delete;
+
+  bool read(const AbsolutePath &path,
+            const std::optional<ShardLogRange> &optRange,
+            google::protobuf::Message &shard);
+
+  /// Opens the shard log at \p logPath for reading with \c readFromLog,
+  /// logging a warning on failure.
+  ///
+  /// Returns -1 if the log couldn't be opened.
+  static int openLog(const std::string &logPath);
+
+  /// Reads the shard at \p range in the shard log opened as \p logFd,
+  /// using \p buffer as scratch space.
+  ///
+  /// Safe to call concurrently for the same \p logFd with different
+  /// buffers, since the file offset is not modified.
+  static bool readFromLog(int logFd, const std::string &logPath,
+                          const ShardLogRange &range, std::string &buffer,
+                          google::protobuf::Message &shard);
+};
+
+/// Reads and parses forward declaration shards on a thread pool, while
+/// handing them out in the original order, so that they can still be
+/// added to an IndexBuilder serially (and deterministically).
+///
+/// The number of shards which have been parsed but not yet handed out
+/// is bounded, so that all the shards aren't held in memory at once.
+class ForwardDeclShardPrefetcher final {
+  // Null if the shard couldn't be read.
+  using Result = std::shared_ptr<scip::ForwardDeclIndex>;
+
+  std::vector<const ShardPaths *> shards;
+  // Shard logs are opened once up front, so that tasks can share
+  // the file descriptors without re-opening the logs.
+  // The map is not modified after construction. Entries are -1 for
+  // logs which couldn't be opened.
+  absl::flat_hash_map<std::string, int> logFds;
+  llvm::DefaultThreadPool threadPool;
+  std::deque<std::shared_future<Result>> inFlight;
+  size_t nextToSubmit;
+  size_t maxInFlight;
+
+public:
+  ForwardDeclShardPrefetcher(std::vector<const ShardPaths *> &&shards,
+                             unsigned numThreads);
+  ~ForwardDeclShardPrefetcher();
+  ForwardDeclShardPrefetcher(const ForwardDeclShardPrefetcher &) = delete;
+  ForwardDeclShardPrefetcher &
+  operator=(const ForwardDeclShardPrefetcher &) = delete;
+
+  /// Calls \p consume for each shard which could be read, in the same
+  /// order as the paths passed to the constructor.
+  void forEach(absl::FunctionRef<void(scip::ForwardDeclIndex &&)> consume);
+
+private:
+  static bool read(const ShardPaths &paths, int logFd,
+                   scip::ForwardDeclIndex &shard);
+};
+
+} // namespace scip_clang
+
+#endif // SCIP_CLANG_SHARD_READER_H
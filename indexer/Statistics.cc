@@ -14,6 +14,8 @@ llvm::json::Value toJSON(const StatsEntry &entry) {
       {"stats",
        llvm::json::Object{
            {"total_time_s", double(stats.totalTimeMicros) / 1'000'000.0},
+           {"wait_time_s", double(stats.waitTimeMicros) / 1'000'000.0},
+           {"dropped_documents", stats.numDroppedDocuments},
        }}};
 }
 
@@ -1,9 +1,16 @@
 #include <chrono>
 #include <filesystem>
 #include <fstream>
+#include <iterator>
+#include <sstream>
 #include <string>
 #include <string_view>
+#include <unistd.h>
+#include <utility>
 
+#include "absl/algorithm/container.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
 #include "boost/interprocess/exceptions.hpp"
 #include "perfetto/perfetto.h"
 
@@ -12,15 +19,22 @@
 #include "clang/Tooling/Tooling.h"
 #include "llvm/ADT/IntrusiveRefCntPtr.h"
 #include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/StringSaver.h"
 #include "llvm/Support/YAMLTraits.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include "proto/index_shard.pb.h"
+
 #include "indexer/AstConsumer.h"
 #include "indexer/CliOptions.h"
 #include "indexer/CompilationDatabase.h"
+#include "indexer/HeaderDocumentCache.h"
+#include "indexer/IncludeGraph.h"
 #include "indexer/IpcMessages.h"
 #include "indexer/Logging.h"
 #include "indexer/Preprocessing.h"
+#include "indexer/ScipExtras.h"
 #include "indexer/Statistics.h"
 #include "indexer/Tracing.h"
 #include "indexer/Worker.h"
@@ -88,8 +102,184 @@ public:
                         const clang::Diagnostic &) override {}
 };
 
+/// Appends the files touched by a TU which are not known to be claimed
+/// by other TUs. See NOTE(ref: speculative-emission).
+void addUnclaimedFiles(const SemanticAnalysisJobResult &semaResult,
+                       const absl::flat_hash_set<HashValue> &claimedFiles,
+                       std::vector<PreprocessedFileInfo> &files) {
+  auto add = [&](const AbsolutePath &path, HashValue hashValue) {
+    PreprocessedFileInfo fileInfo{path, hashValue};
+    if (!claimedFiles.contains(fileInfo.key())) {
+      files.push_back(std::move(fileInfo));
+    }
+  };
+  for (auto &fileInfo : semaResult.wellBehavedFiles) {
+    add(fileInfo.path, fileInfo.hashValue);
+  }
+  for (auto &fileInfoMulti : semaResult.illBehavedFiles) {
+    for (auto hashValue : fileInfoMulti.hashValues) {
+      add(fileInfoMulti.path, hashValue);
+    }
+  }
+}
+
+/// Removes documents emitted speculatively for files which the driver
+/// assigned to other TUs, along with forward declaration references
+/// inside them. A document is kept if any of the variants of its file
+/// was assigned to this TU. Returns the number of documents removed.
+uint64_t
+dropUnassignedDocuments(const std::vector<PreprocessedFileInfo> &assigned,
+                        TuIndexingOutput &output) {
+  absl::flat_hash_set<HashValue> assignedKeys{};
+  for (auto &fileInfo : assigned) {
+    assignedKeys.insert(fileInfo.key());
+  }
+  absl::flat_hash_set<std::string_view> keptPaths{};
+  absl::flat_hash_set<std::string_view> droppedPaths{};
+  for (auto &[fileInfo, documentPath] : output.emittedFiles) {
+    if (assignedKeys.contains(fileInfo.key())) {
+      keptPaths.insert(documentPath);
+    } else {
+      droppedPaths.insert(documentPath);
+    }
+  }
+  for (auto path : keptPaths) {
+    droppedPaths.erase(path);
+  }
+  if (droppedPaths.empty()) {
+    return 0;
+  }
+  auto &documents = *output.docsAndExternals.mutable_documents();
+  int kept = 0;
+  for (int i = 0; i < documents.size(); ++i) {
+    if (droppedPaths.contains(documents[i].relative_path())) {
+      continue;
+    }
+    if (kept != i) {
+      documents.SwapElements(kept, i);
+    }
+    kept++;
+  }
+  auto numDropped = uint64_t(documents.size() - kept);
+  documents.DeleteSubrange(kept, documents.size() - kept);
+
+  auto &forwardDecls = *output.forwardDecls.mutable_forward_decls();
+  int keptDecls = 0;
+  for (int i = 0; i < forwardDecls.size(); ++i) {
+    auto &references = *forwardDecls[i].mutable_references();
+    int keptRefs = 0;
+    for (int j = 0; j < references.size(); ++j) {
+      if (droppedPaths.contains(references[j].relative_path())) {
+        continue;
+      }
+      if (keptRefs != j) {
+        references.SwapElements(keptRefs, j);
+      }
+      keptRefs++;
+    }
+    references.DeleteSubrange(keptRefs, references.size() - keptRefs);
+    if (references.empty()) {
+      continue;
+    }
+    if (keptDecls != i) {
+      forwardDecls.SwapElements(keptDecls, i);
+    }
+    keptDecls++;
+  }
+  forwardDecls.DeleteSubrange(keptDecls, forwardDecls.size() - keptDecls);
+  return numDropped;
+}
+
 } // namespace
 
+/// Accumulates the output for several TUs and merges it.
+///
+/// See NOTE(ref: worker-premerge).
+class ShardPremerger final {
+  // Outputs are only handed to an IndexBuilder when flushing, since
+  // whether a document needs to be merged depends on whether another TU
+  // in the same batch emitted a document for the same path. They are
+  // kept along with the task IDs, so that they can be merged in the same
+  // order as the driver would merge separate shards.
+  struct Output {
+    uint32_t taskId;
+    scip::Index docsAndExternals;
+    // Serialized ForwardDeclIndex
+    std::string forwardDecls;
+  };
+  std::vector<Output> outputs;
+  std::vector<HashValue> emittedExternalSymbols;
+  bool deterministic;
+
+public:
+  explicit ShardPremerger(bool deterministic)
+      : outputs(), emittedExternalSymbols(), deterministic(deterministic) {}
+  ShardPremerger(const ShardPremerger &) = delete;
+  ShardPremerger &operator=(const ShardPremerger &) = delete;
+
+  size_t size() const {
+    return this->outputs.size();
+  }
+
+  void add(uint32_t taskId, TuIndexingOutput &&output,
+           std::vector<HashValue> &&newlyEmittedExternalSymbols) {
+    TRACE_EVENT(tracing::indexing, "ShardPremerger::add");
+    std::string forwardDecls;
+    output.forwardDecls.AppendToString(&forwardDecls);
+    this->outputs.emplace_back(Output{
+        taskId, std::move(output.docsAndExternals), std::move(forwardDecls)});
+    absl::c_move(newlyEmittedExternalSymbols,
+                 std::back_inserter(this->emittedExternalSymbols));
+  }
+
+  /// Merges all the accumulated output, leaving the premerger empty.
+  ///
+  /// The serialized \c scip::Index is wire-compatible with
+  /// \c scip::IndexShard, but doesn't have content digests.
+  void flush(std::string &docsAndExternals, std::string &forwardDecls,
+             std::vector<HashValue> &emitted) {
+    TRACE_EVENT(tracing::indexing, "ShardPremerger::flush", "numTus",
+                this->outputs.size());
+    // Task IDs are unique, so there is no need for a stable sort.
+    absl::c_sort(this->outputs, [](const Output &o1, const Output &o2) {
+      return o1.taskId < o2.taskId;
+    });
+    absl::flat_hash_map<std::string, std::vector<scip::Document>> documents;
+    for (auto &output : this->outputs) {
+      for (auto &doc : *output.docsAndExternals.mutable_documents()) {
+        auto &docs = documents[doc.relative_path()];
+        docs.emplace_back(std::move(doc));
+      }
+    }
+    llvm::BumpPtrAllocator allocator;
+    llvm::UniqueStringSaver stringSaver{allocator};
+    scip::IndexBuilder builder{scip::SymbolNameInterner{stringSaver}};
+    for (auto &[_, docs] : documents) {
+      bool isMultiplyIndexed = docs.size() > 1;
+      for (auto &doc : docs) {
+        builder.addDocument(std::move(doc), isMultiplyIndexed, std::nullopt,
+                            /*symbols*/ {});
+      }
+    }
+    forwardDecls.clear();
+    for (auto &output : this->outputs) {
+      auto &externals = *output.docsAndExternals.mutable_external_symbols();
+      for (auto &extSym : externals) {
+        builder.addExternalSymbol(std::move(extSym));
+      }
+      // Concatenating serialized ForwardDeclIndex values gives
+      // a valid serialized ForwardDeclIndex.
+      forwardDecls.append(output.forwardDecls);
+    }
+    std::ostringstream outputStream;
+    scip::SingleStreamIndexOutput output{outputStream};
+    builder.finish(this->deterministic, /*numThreads*/ 1, output);
+    docsAndExternals = std::move(outputStream).str();
+    emitted = std::exchange(this->emittedExternalSymbols, {});
+    this->outputs.clear();
+  }
+};
+
 WorkerOptions WorkerOptions::fromCliOptions(const CliOptions &cliOptions) {
   RootPath projectRootPath{
       AbsolutePath{std::filesystem::current_path().string()},
@@ -127,6 +317,12 @@ WorkerOptions WorkerOptions::fromCliOptions(const CliOptions &cliOptions) {
                            cliOptions.preprocessorRecordHistoryFilterRegex,
                            cliOptions.preprocessorHistoryLogPath, false, ""},
                        cliOptions.temporaryOutputDir,
+                       cliOptions.useShardLog,
+                       cliOptions.workerPremergeCount,
+                       cliOptions.headerCacheDir,
+                       cliOptions.speculativeEmission,
+                       cliOptions.persistentWorker,
+                       cliOptions.selfContainedShards,
                        cliOptions.workerFault};
 }
 
@@ -135,12 +331,31 @@ Worker::Worker(WorkerOptions &&options)
       packageMap(this->options.projectRootPath, this->options.packageMapPath,
                  this->options.mode == WorkerMode::Testing),
       messageQueues(), compileCommands(), commandIndex(0), recorder(),
-      statistics() {
+      statistics(), shardLog(), premergeJournal(), knownExternalSymbols(),
+      premerger(), headerDocumentCache(), claimedFiles() {
+  if (!this->options.headerCacheDir.empty()) {
+    this->headerDocumentCache =
+        std::make_unique<HeaderDocumentCache>(this->options.headerCacheDir);
+  }
   switch (this->options.mode) {
-  case WorkerMode::Ipc:
+  case WorkerMode::Ipc: {
     this->messageQueues = std::make_unique<MessageQueuePair>(
         MessageQueuePair::forWorker(this->options.ipcOptions));
+    auto workerId = this->options.ipcOptions.workerId;
+    if (this->options.premergeCount > 0) {
+      this->premerger =
+          std::make_unique<ShardPremerger>(this->options.deterministic);
+      this->premergeJournal.emplace(
+          Worker::openShardLog(this->options.temporaryOutputDir
+                               / ShardPaths::journalFileName(workerId)));
+    }
+    if (this->options.useShardLog) {
+      this->shardLog.emplace(
+          Worker::openShardLog(this->options.temporaryOutputDir
+                               / ShardPaths::logFileName(workerId)));
+    }
     break;
+  }
   case WorkerMode::Compdb: {
     auto compdbFile = compdb::File::openAndExitOnErrors(
         this->options.compdbPath,
@@ -150,7 +365,15 @@ Worker::Worker(WorkerOptions &&options)
     parser.initialize(compdbFile,
                       compdb::ParseOptions::create(
                           /*refillCount*/ std::numeric_limits<size_t>::max()));
-    parser.parseMore(this->compileCommands);
+    // Commands may be held back while their compiler is being probed,
+    // see NOTE(ref: toolchain-cache).
+    while (true) {
+      auto oldSize = this->compileCommands.size();
+      parser.parseMore(this->compileCommands);
+      if (this->compileCommands.size() == oldSize) {
+        break;
+      }
+    }
     std::fclose(compdbFile.file);
     break;
   }
@@ -191,6 +414,9 @@ Worker::Worker(WorkerOptions &&options)
       std::make_pair(std::move(ostream), std::move(recorder)));
 }
 
+// Defined here as ShardPremerger is incomplete in the header.
+Worker::~Worker() = default;
+
 const IpcOptions &Worker::ipcOptions() const {
   return this->options.ipcOptions;
 }
@@ -226,7 +452,10 @@ void Worker::processTranslationUnit(SemanticAnalysisJobDetails &&job,
       this->options.deterministic};
   IndexerAstConsumerOptions astConsumerOptions{
       this->options.projectRootPath, buildRootPath, std::move(workerCallback),
-      this->options.deterministic, this->packageMap};
+      this->options.deterministic, this->packageMap,
+      this->headerDocumentCache.get(),
+      this->options.speculativeEmission
+          && this->options.mode == WorkerMode::Ipc};
   auto frontendActionFactory = IndexerFrontendActionFactory(
       preprocessorOptions, astConsumerOptions, tuIndexingOutput);
 
@@ -259,6 +488,109 @@ void Worker::emitIndex(google::protobuf::Message &&message,
   message.SerializeToOstream(&outputStream);
 }
 
+// static
+Worker::ShardLog Worker::openShardLog(StdPath logPath) {
+  std::error_code error;
+  auto existingSize = std::filesystem::file_size(logPath, error);
+  if (error) {
+    existingSize = 0;
+  }
+  std::ofstream logStream(logPath, std::ios_base::out | std::ios_base::binary
+                                       | std::ios_base::app);
+  if (logStream.fail()) {
+    spdlog::error("failed to open shard log at '{}' ({})", logPath.c_str(),
+                  std::strerror(errno));
+    std::exit(EXIT_FAILURE);
+  }
+  return ShardLog{logPath, std::move(logStream), uint64_t(existingSize)};
+}
+
+// static
+ShardLogRange
+Worker::appendToShardLog(ShardLog &log,
+                         const google::protobuf::Message &message) {
+  std::string buffer;
+  if (!message.SerializeToString(&buffer)) {
+    spdlog::error("failed to serialize shard for '{}'", log.path.c_str());
+    std::exit(EXIT_FAILURE);
+  }
+  return Worker::appendToShardLog(log, std::string_view(buffer));
+}
+
+// static
+ShardLogRange Worker::appendToShardLog(ShardLog &log,
+                                       std::string_view serializedMessage) {
+  log.stream.write(serializedMessage.data(), serializedMessage.size());
+  if (log.stream.fail()) {
+    spdlog::error("failed to append shard to '{}' ({})", log.path.c_str(),
+                  std::strerror(errno));
+    std::exit(EXIT_FAILURE);
+  }
+  ShardLogRange range{log.size, serializedMessage.size()};
+  log.size += serializedMessage.size();
+  return range;
+}
+
+ShardPaths Worker::appendToPremergeJournal(const TuIndexingOutput &output) {
+  ENFORCE(this->premergeJournal.has_value());
+  auto &journal = this->premergeJournal.value();
+  // The serialized scip::Index is wire-compatible with scip::IndexShard,
+  // like the pre-merged shards.
+  auto docsAndExternalsRange =
+      Worker::appendToShardLog(journal, output.docsAndExternals);
+  auto forwardDeclsRange =
+      Worker::appendToShardLog(journal, output.forwardDecls);
+  // The driver may need to read the ranges if this worker dies
+  // right after sending the result.
+  journal.stream.flush();
+  AbsolutePath journalPath{journal.path.string()};
+  return ShardPaths{journalPath, journalPath, docsAndExternalsRange,
+                    forwardDeclsRange};
+}
+
+std::optional<ShardPaths>
+Worker::flushPremergedShards(std::optional<uint32_t> taskId,
+                             std::vector<HashValue> &emittedExternalSymbols) {
+  ENFORCE(this->premerger);
+  if (this->premerger->size() == 0) {
+    return std::nullopt;
+  }
+  std::string docsAndExternals;
+  std::string forwardDecls;
+  this->premerger->flush(docsAndExternals, forwardDecls,
+                         emittedExternalSymbols);
+  if (this->shardLog.has_value()) {
+    auto &log = this->shardLog.value();
+    auto docsAndExternalsRange =
+        Worker::appendToShardLog(log, docsAndExternals);
+    auto forwardDeclsRange = Worker::appendToShardLog(log, forwardDecls);
+    log.stream.flush();
+    AbsolutePath logPath{log.path.string()};
+    return ShardPaths{logPath, logPath, docsAndExternalsRange,
+                      forwardDeclsRange};
+  }
+  auto prefix =
+      this->options.temporaryOutputDir
+      / (taskId.has_value()
+             ? ShardPaths::prefix(*taskId, this->ipcOptions().workerId)
+             : ShardPaths::finalPrefix(this->ipcOptions().workerId));
+  auto shardPaths = ShardPaths::forFiles(prefix);
+  auto writeFile = [](const AbsolutePath &path, std::string_view contents) {
+    std::ofstream outputStream(path.asStringRef(),
+                               std::ios_base::out | std::ios_base::binary
+                                   | std::ios_base::trunc);
+    outputStream.write(contents.data(), contents.size());
+    if (outputStream.fail()) {
+      spdlog::warn("failed to write shard at '{}' ({})", path.asStringRef(),
+                   std::strerror(errno));
+      std::exit(EXIT_FAILURE);
+    }
+  };
+  writeFile(shardPaths.docsAndExternals, docsAndExternals);
+  writeFile(shardPaths.forwardDecls, forwardDecls);
+  return shardPaths;
+}
+
 void Worker::sendResult(JobId requestId, IndexJobResult &&result) {
   ENFORCE(this->options.mode == WorkerMode::Ipc);
   spdlog::debug("sending result for {}", requestId);
@@ -273,13 +605,53 @@ void Worker::sendResult(JobId requestId, IndexJobResult &&result) {
   this->flushStreams();
 }
 
+void Worker::omitKnownExternalSymbols(scip::Index &index,
+                                      std::vector<HashValue> &newlyEmitted) {
+  TRACE_EVENT(tracing::indexing, "Worker::omitKnownExternalSymbols");
+  if (this->options.selfContainedShards) {
+    return;
+  }
+  auto &externalSymbols = *index.mutable_external_symbols();
+  std::string buffer;
+  int kept = 0;
+  for (int i = 0; i < externalSymbols.size(); ++i) {
+    auto &extSym = externalSymbols[i];
+    // Symbols without documentation are cheap to serialize and merge,
+    // so don't bother sending their hashes around.
+    if (scip::SymbolInformationBuilder::hasDocumentation(extSym)) {
+      extSym.SerializeToString(&buffer);
+      HashValue hashValue{HashValue::forText(buffer)};
+      if (!this->knownExternalSymbols.insert(hashValue).second) {
+        continue;
+      }
+      newlyEmitted.push_back(hashValue);
+    }
+    if (kept != i) {
+      externalSymbols.SwapElements(kept, i);
+    }
+    kept++;
+  }
+  externalSymbols.DeleteSubrange(kept, externalSymbols.size() - kept);
+}
+
 Worker::ReceiveStatus Worker::sendRequestAndReceive(
     JobId semaRequestId, std::string_view tuMainFilePath,
     SemanticAnalysisJobResult &&semaResult, IndexJobRequest &emitIndexRequest) {
   this->sendResult(semaRequestId,
                    IndexJobResult{IndexJob::Kind::SemanticAnalysis,
                                   std::move(semaResult), EmitIndexJobResult{}});
+  return this->receiveEmitIndexRequest(tuMainFilePath, emitIndexRequest);
+}
+
+Worker::ReceiveStatus
+Worker::receiveEmitIndexRequest(std::string_view tuMainFilePath,
+                                IndexJobRequest &emitIndexRequest) {
+  ManualTimer waitTimer{};
+  waitTimer.start();
   auto status = this->waitForRequest(emitIndexRequest);
+  waitTimer.stop();
+  this->statistics.waitTimeMicros =
+      uint64_t(waitTimer.value<std::chrono::microseconds>());
   if (status != ReceiveStatus::OK) {
     return status;
   }
@@ -288,6 +660,11 @@ Worker::ReceiveStatus Worker::sendRequestAndReceive(
                  tuMainFilePath);
     std::exit(EXIT_FAILURE);
   }
+  ENFORCE(emitIndexRequest.job.kind == IndexJob::Kind::EmitIndex,
+          "expected EmitIndex request for '{}' but got SemanticAnalysis "
+          "request for '{}'",
+          tuMainFilePath,
+          emitIndexRequest.job.semanticAnalysis.command.filePath);
   return status;
 }
 
@@ -298,6 +675,7 @@ Worker::ReceiveStatus Worker::processTranslationUnitAndRespond(
       perfetto::Flow::Global(semanticAnalysisRequest.id.traceId()));
   ManualTimer indexingTimer{};
   indexingTimer.start();
+  this->statistics = IndexingStatistics{};
 
   SemanticAnalysisJobResult semaResult{};
   auto semaRequestId = semanticAnalysisRequest.id;
@@ -306,11 +684,26 @@ Worker::ReceiveStatus Worker::processTranslationUnitAndRespond(
   Worker::ReceiveStatus innerStatus;
   JobId emitIndexRequestId;
   unsigned callbackInvoked = 0;
+  bool skipEmitting = false;
+  auto &semaDetails = semanticAnalysisRequest.job.semanticAnalysis;
+  // See NOTE(ref: previous-plan)
+  auto planDigest = semaDetails.planDigest;
+  auto tentativeFiles = std::move(semaDetails.tentativeFilesToBeIndexed);
+  auto standbyFiles = std::move(semaDetails.standbyFilesToBeIndexed);
+  // See NOTE(ref: speculative-emission)
+  this->claimedFiles.insert(semaDetails.claimedFiles.begin(),
+                            semaDetails.claimedFiles.end());
+  // Set if documents for files not listed in the EmitIndex request
+  // need to be dropped.
+  bool speculative = false;
+  bool emitIndexRequestPending = false;
 
   auto callback =
       [this, semaRequestId, &innerStatus, &emitIndexRequestId, &tuMainFilePath,
-       &callbackInvoked](SemanticAnalysisJobResult &&semaResult,
-                         EmitIndexJobDetails &emitIndexDetails) -> bool {
+       &callbackInvoked, &skipEmitting, &planDigest, &tentativeFiles,
+       &standbyFiles, &speculative, &emitIndexRequestPending](
+          SemanticAnalysisJobResult &&semaResult,
+          EmitIndexJobDetails &emitIndexDetails) -> bool {
     TRACE_EVENT_END(tracing::indexing);
     callbackInvoked++;
     if (this->options.mode == WorkerMode::Compdb) {
@@ -325,6 +718,34 @@ Worker::ReceiveStatus Worker::processTranslationUnitAndRespond(
       }
       return true;
     }
+    bool matchedPlan = planDigest.has_value()
+                       && IncludeGraph::digest(semaResult) == *planDigest;
+    if (matchedPlan || this->options.speculativeEmission) {
+      // Report the result without waiting for the EmitIndex request,
+      // which is received after traversing the AST.
+      if (matchedPlan) {
+        // See NOTE(ref: previous-plan)
+        emitIndexDetails.filesToBeIndexed = std::move(tentativeFiles);
+        if (!standbyFiles.empty()) {
+          speculative = true;
+          absl::c_move(standbyFiles,
+                       std::back_inserter(emitIndexDetails.filesToBeIndexed));
+        }
+      } else {
+        speculative = true;
+        ::addUnclaimedFiles(semaResult, this->claimedFiles,
+                            emitIndexDetails.filesToBeIndexed);
+      }
+      emitIndexRequestPending = true;
+      semaResult.matchedPlan = matchedPlan;
+      this->sendResult(semaRequestId,
+                       IndexJobResult{IndexJob::Kind::SemanticAnalysis,
+                                      std::move(semaResult),
+                                      EmitIndexJobResult{}});
+      TRACE_EVENT_BEGIN(tracing::indexing, "worker.emitIndex",
+                        perfetto::Flow::Global(semaRequestId.traceId()));
+      return true;
+    }
     IndexJobRequest emitIndexRequest{};
     innerStatus = this->sendRequestAndReceive(
         semaRequestId, tuMainFilePath, std::move(semaResult), emitIndexRequest);
@@ -333,17 +754,16 @@ Worker::ReceiveStatus Worker::processTranslationUnitAndRespond(
     }
     TRACE_EVENT_BEGIN(tracing::indexing, "worker.emitIndex",
                       perfetto::Flow::Global(emitIndexRequest.id.traceId()));
-    ENFORCE(emitIndexRequest.job.kind == IndexJob::Kind::EmitIndex,
-            "expected EmitIndex request for '{}' but got SemanticAnalysis "
-            "request for '{}'",
-            tuMainFilePath,
-            emitIndexRequest.job.semanticAnalysis.command.filePath);
     emitIndexDetails = std::move(emitIndexRequest.job.emitIndex);
     emitIndexRequestId = emitIndexRequest.id;
-    return true;
+    this->knownExternalSymbols.insert(
+        emitIndexDetails.knownExternalSymbols.begin(),
+        emitIndexDetails.knownExternalSymbols.end());
+    // See NOTE(ref: shard-cache)
+    skipEmitting = emitIndexDetails.skipEmitting;
+    return !skipEmitting;
   };
   TuIndexingOutput tuIndexingOutput{};
-  auto &semaDetails = semanticAnalysisRequest.job.semanticAnalysis;
   // deliberate copy
   std::vector<std::string> commandLine = semaDetails.command.arguments;
 
@@ -376,6 +796,24 @@ Worker::ReceiveStatus Worker::processTranslationUnitAndRespond(
             "callbackInvoked = {} for TU with main file '{}'", callbackInvoked,
             tuMainFilePath);
   }
+  if (emitIndexRequestPending) {
+    IndexJobRequest emitIndexRequest{};
+    innerStatus =
+        this->receiveEmitIndexRequest(tuMainFilePath, emitIndexRequest);
+    if (innerStatus == ReceiveStatus::OK) {
+      emitIndexRequestId = emitIndexRequest.id;
+      auto &emitIndexDetails = emitIndexRequest.job.emitIndex;
+      this->knownExternalSymbols.insert(
+          emitIndexDetails.knownExternalSymbols.begin(),
+          emitIndexDetails.knownExternalSymbols.end());
+      // See NOTE(ref: shard-cache)
+      skipEmitting = emitIndexDetails.skipEmitting;
+      if (speculative && !skipEmitting) {
+        this->statistics.numDroppedDocuments = ::dropUnassignedDocuments(
+            emitIndexDetails.filesToBeIndexed, tuIndexingOutput);
+      }
+    }
+  }
   if (innerStatus != ReceiveStatus::OK) {
     return innerStatus;
   }
@@ -398,23 +836,97 @@ Worker::ReceiveStatus Worker::processTranslationUnitAndRespond(
     return ReceiveStatus::OK;
   }
 
-  StdPath prefix = this->options.temporaryOutputDir
-                   / ShardPaths::prefix(emitIndexRequestId.taskId(),
-                                        this->ipcOptions().workerId);
-  StdPath docsAndExternalsOutputPath = prefix;
-  docsAndExternalsOutputPath.concat("-docs_and_externals.shard.scip");
-  StdPath forwardDeclsOutputPath = prefix;
-  forwardDeclsOutputPath.concat("-forward_decls.shard.scip");
-  this->emitIndex(std::move(tuIndexingOutput.docsAndExternals),
-                  docsAndExternalsOutputPath);
-  this->emitIndex(std::move(tuIndexingOutput.forwardDecls),
-                  forwardDeclsOutputPath);
+  if (skipEmitting) {
+    stopTimer();
+    this->sendResult(emitIndexRequestId,
+                     IndexJobResult{IndexJob::Kind::EmitIndex,
+                                    SemanticAnalysisJobResult{},
+                                    EmitIndexJobResult{this->statistics,
+                                                       std::nullopt,
+                                                       std::nullopt,
+                                                       {}}});
+    return Worker::ReceiveStatus::OK;
+  }
+
+  std::vector<HashValue> emittedExternalSymbols{};
+  this->omitKnownExternalSymbols(tuIndexingOutput.docsAndExternals,
+                                 emittedExternalSymbols);
+  if (emittedExternalSymbols.size() > maxExternalSymbolHashesPerMessage) {
+    // Not reporting some hashes only means that other workers
+    // may emit duplicates for the corresponding symbols.
+    emittedExternalSymbols.resize(maxExternalSymbolHashesPerMessage);
+  }
+  if (this->premerger) {
+    scip::internDocumentation(tuIndexingOutput.forwardDecls);
+    std::optional<ShardPaths> journalShardPaths{};
+    // See NOTE(ref: worker-premerge). The output for the TU which
+    // triggers a flush is covered by the merged shards.
+    if (this->premerger->size() + 1 < this->options.premergeCount) {
+      journalShardPaths = this->appendToPremergeJournal(tuIndexingOutput);
+    }
+    this->premerger->add(emitIndexRequestId.taskId(),
+                         std::move(tuIndexingOutput),
+                         std::move(emittedExternalSymbols));
+    std::optional<ShardPaths> optShardPaths{};
+    // Hashes are only reported once the corresponding shard is written,
+    // so that other workers don't omit symbols which may never reach
+    // the driver.
+    emittedExternalSymbols.clear();
+    if (this->premerger->size() >= this->options.premergeCount) {
+      optShardPaths = this->flushPremergedShards(emitIndexRequestId.taskId(),
+                                                 emittedExternalSymbols);
+      if (emittedExternalSymbols.size() > maxExternalSymbolHashesPerMessage) {
+        emittedExternalSymbols.resize(maxExternalSymbolHashesPerMessage);
+      }
+    }
+    stopTimer();
+    this->sendResult(
+        emitIndexRequestId,
+        IndexJobResult{IndexJob::Kind::EmitIndex, SemanticAnalysisJobResult{},
+                       EmitIndexJobResult{this->statistics,
+                                          std::move(optShardPaths),
+                                          std::move(journalShardPaths),
+                                          std::move(emittedExternalSymbols)}});
+    return Worker::ReceiveStatus::OK;
+  }
+  scip::IndexShard docsAndExternalsShard{};
+  scip::toIndexShard(std::move(tuIndexingOutput.docsAndExternals),
+                     docsAndExternalsShard);
+  scip::internDocumentation(tuIndexingOutput.forwardDecls);
+  ShardPaths shardPaths{};
+  if (this->shardLog.has_value()) {
+    auto &log = this->shardLog.value();
+    auto docsAndExternalsRange =
+        Worker::appendToShardLog(log, docsAndExternalsShard);
+    auto forwardDeclsRange =
+        Worker::appendToShardLog(log, tuIndexingOutput.forwardDecls);
+    // Make sure the driver can read the ranges as soon as it gets the result.
+    log.stream.flush();
+    AbsolutePath logPath{log.path.string()};
+    shardPaths = ShardPaths{logPath, logPath, docsAndExternalsRange,
+                            forwardDeclsRange};
+  } else {
+    shardPaths = ShardPaths::forFiles(
+        this->options.temporaryOutputDir
+        / ShardPaths::prefix(emitIndexRequestId.taskId(),
+                             this->ipcOptions().workerId));
+    this->emitIndex(std::move(docsAndExternalsShard),
+                    StdPath(shardPaths.docsAndExternals.asStringRef()));
+    this->emitIndex(std::move(tuIndexingOutput.forwardDecls),
+                    StdPath(shardPaths.forwardDecls.asStringRef()));
+    if (this->options.workerFault == "lose-shard"
+        && emitIndexRequestId.taskId() == 0) {
+      spdlog::warn("about to lose shard");
+      std::error_code error;
+      std::filesystem::remove(shardPaths.docsAndExternals.asStringRef(),
+                              error);
+    }
+  }
   stopTimer();
 
-  EmitIndexJobResult emitIndexResult{
-      this->statistics,
-      ShardPaths{AbsolutePath{docsAndExternalsOutputPath.string()},
-                 AbsolutePath{forwardDeclsOutputPath.string()}}};
+  EmitIndexJobResult emitIndexResult{this->statistics, std::move(shardPaths),
+                                     std::nullopt,
+                                     std::move(emittedExternalSymbols)};
 
   this->sendResult(emitIndexRequestId,
                    IndexJobResult{IndexJob::Kind::EmitIndex,
@@ -460,6 +972,9 @@ void Worker::triggerFaultIfApplicable() const {
       }
       devNull << j;
     }
+  } else if (fault == "lose-shard") {
+    // Triggered after writing the shard for the first TU instead.
+    return;
   } else {
     spdlog::error("Unknown fault kind {}", fault);
     std::exit(EXIT_FAILURE);
@@ -480,7 +995,8 @@ Worker::ReceiveStatus Worker::waitForRequest(IndexJobRequest &request) {
     ++this->commandIndex;
     request.job =
         IndexJob{IndexJob::Kind::SemanticAnalysis,
-                 SemanticAnalysisJobDetails{command}, EmitIndexJobDetails{}};
+                 SemanticAnalysisJobDetails{command, std::nullopt, {}, {}, {}},
+                 EmitIndexJobDetails{}};
     return Status::OK;
   }
 
@@ -488,7 +1004,12 @@ Worker::ReceiveStatus Worker::waitForRequest(IndexJobRequest &request) {
   auto recvError = this->messageQueues->driverToWorker.timedReceive(
       request, this->ipcOptions().receiveTimeout);
   if (recvError.isA<TimeoutError>()) {
-    spdlog::error("timeout in worker; is the driver dead?... shutting down");
+    if (this->options.persistent) {
+      // See NOTE(ref: serve-mode); the caller checks if the driver is alive.
+      spdlog::debug("timeout in persistent worker");
+    } else {
+      spdlog::error("timeout in worker; is the driver dead?... shutting down");
+    }
     return Status::DriverTimeout;
   }
   if (recvError) {
@@ -505,9 +1026,39 @@ Worker::ReceiveStatus Worker::waitForRequest(IndexJobRequest &request) {
   return Status::OK;
 }
 
+void Worker::finishPremerging() {
+  if (!this->premerger) {
+    return;
+  }
+  // The driver doesn't assign any more jobs at this point,
+  // so there is no point in reporting emitted external symbols.
+  std::vector<HashValue> emittedExternalSymbols{};
+  auto optShardPaths =
+      this->flushPremergedShards(std::nullopt, emittedExternalSymbols);
+  if (optShardPaths.has_value()) {
+    spdlog::debug("wrote final pre-merged shards to '{}'",
+                  optShardPaths->docsAndExternals.asStringRef());
+  }
+  // Always respond, so that the driver doesn't need to wait for
+  // a timeout if there was nothing left to flush.
+  this->sendResult(
+      JobId::Shutdown(),
+      IndexJobResult{IndexJob::Kind::EmitIndex, SemanticAnalysisJobResult{},
+                     EmitIndexJobResult{IndexingStatistics{},
+                                        std::move(optShardPaths),
+                                        /*journalShardPaths*/ std::nullopt,
+                                        /*emittedExternalSymbols*/ {}}});
+}
+
+void Worker::resetForNextRun() {
+  this->knownExternalSymbols.clear();
+  this->claimedFiles.clear();
+}
+
 void Worker::run() {
   ENFORCE(this->options.mode != WorkerMode::Testing,
           "tests typically call method individually");
+  auto driverPid = ::getppid();
   [&]() {
     while (true) {
       IndexJobRequest request{};
@@ -515,6 +1066,8 @@ void Worker::run() {
 #define CHECK_STATUS(_expr)      \
   switch (_expr) {               \
   case Status::Shutdown:         \
+    this->finishPremerging();    \
+    return;                      \
   case Status::DriverTimeout:    \
     return;                      \
   case Status::MalformedMessage: \
@@ -522,7 +1075,19 @@ void Worker::run() {
   case Status::OK:               \
     break;                       \
   }
-      CHECK_STATUS(this->waitForRequest(request));
+      auto status = this->waitForRequest(request);
+      if (this->options.persistent) {
+        // See NOTE(ref: serve-mode)
+        if (status == Status::Shutdown) {
+          this->finishPremerging();
+          this->resetForNextRun();
+          continue;
+        }
+        if (status == Status::DriverTimeout && ::getppid() == driverPid) {
+          continue;
+        }
+      }
+      CHECK_STATUS(status);
       ENFORCE(request.job.kind == IndexJob::Kind::SemanticAnalysis);
       CHECK_STATUS(this->processTranslationUnitAndRespond(std::move(request)));
     }
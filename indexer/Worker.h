@@ -1,12 +1,15 @@
 #ifndef SCIP_CLANG_WORKER_H
 #define SCIP_CLANG_WORKER_H
 
+#include <fstream>
 #include <memory>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 
+#include "absl/container/flat_hash_set.h"
 #include "absl/functional/function_ref.h"
 #include "spdlog/fwd.h"
 
@@ -27,10 +30,17 @@ namespace google::protobuf {
 class Message;
 } // namespace google::protobuf
 
+namespace scip {
+class Index;
+} // namespace scip
+
 namespace scip_clang {
 
 int workerMain(CliOptions &&);
 
+class HeaderDocumentCache;
+class ShardPremerger;
+
 struct PreprocessorHistoryRecordingOptions {
   std::string filterRegex;
   std::string preprocessorHistoryLogPath;
@@ -65,6 +75,14 @@ struct WorkerOptions {
   bool measureStatistics;
   PreprocessorHistoryRecordingOptions recordingOptions;
   StdPath temporaryOutputDir;
+  bool useShardLog;
+  uint32_t premergeCount;
+  StdPath headerCacheDir;
+  bool speculativeEmission;
+  /// See NOTE(ref: serve-mode).
+  bool persistent;
+  /// See NOTE(ref: incremental-indexing) and NOTE(ref: shard-cache).
+  bool selfContainedShards;
   std::string workerFault;
 
   // This is a static method instead of a constructor so that the
@@ -97,8 +115,97 @@ class Worker final {
 
   IndexingStatistics statistics;
 
+  /// Set iff options.useShardLog is true and options.mode == Ipc.
+  ///
+  /// NOTE(def: shard-log): When using a shard log, rather than creating
+  /// two files per TU, each worker appends serialized shards to a single
+  /// file under the temporary output directory, and reports the byte range
+  /// for each shard to the driver. A respawned worker re-uses the same
+  /// file, starting from the existing end-of-file. Before respawning a
+  /// worker, the driver truncates the file to the end of the last shard
+  /// reported in it, so that a partially written shard left behind by a
+  /// worker which crashed doesn't stay in the middle of the log.
+  struct ShardLog {
+    StdPath path;
+    std::ofstream stream;
+    uint64_t size;
+  };
+  std::optional<ShardLog> shardLog;
+
+  /// Set iff premerger is non-null. See NOTE(ref: worker-premerge).
+  std::optional<ShardLog> premergeJournal;
+
+  /// NOTE(def: external-symbol-dedup): Most TUs emit identical copies of
+  /// external symbols with documentation (e.g. for the standard library).
+  /// To avoid writing (and later merging) these repeatedly, the worker
+  /// omits an external symbol from a shard if an identical copy is known
+  /// to be present in a shard which will be merged, i.e. one written
+  /// earlier by this worker, or one reported by another worker, which
+  /// the driver forwards incrementally via EmitIndexJobDetails.
+  ///
+  /// Only exact duplicates are omitted, and documentation for external
+  /// symbols is picked independent of the order of shards in IndexBuilder,
+  /// so the merged index is unaffected.
+  ///
+  /// Symbols are only reported to the driver once the shard containing
+  /// them has been written. If that shard can't be read back when merging,
+  /// the driver reports how many symbols may be missing documentation.
+  absl::flat_hash_set<HashValue> knownExternalSymbols;
+
+  /// Non-null iff options.premergeCount > 0 and options.mode == Ipc.
+  ///
+  /// NOTE(def: worker-premerge): With pre-merging, instead of writing
+  /// shards for every TU, the worker accumulates the output for up to
+  /// options.premergeCount TUs, merges it using an IndexBuilder, and
+  /// writes a single pair of shards. The result for the TU which triggered
+  /// the flush carries the shard paths; results for other TUs have no
+  /// shard paths. Output accumulated when the driver asks the worker to
+  /// shut down is merged too, and the shard paths are sent in a final
+  /// response for JobId::Shutdown().
+  ///
+  /// Since documentation for symbols in multiply-indexed documents is
+  /// picked in a first-wins fashion, the output for the TUs is merged
+  /// in order of task IDs, and the driver orders a merged shard by the
+  /// smallest task ID in it. In deterministic mode, the output is the
+  /// same as without pre-merging, unless TUs with interleaved task IDs
+  /// end up on different workers and provide different documentation
+  /// for the same symbol (e.g. due to different macro definitions).
+  ///
+  /// Before reporting the result for a TU whose output is held on to,
+  /// the worker appends a copy of the TU's output to a per-worker journal,
+  /// laid out like a shard log (see NOTE(ref: shard-log)), and reports
+  /// the ranges. If the worker crashes or is killed before writing the
+  /// merged shards, the driver merges the journal copies instead, so no
+  /// TUs are lost. This costs an extra serialization and write per TU,
+  /// but the driver still only reads the merged shards in the common case.
+  std::unique_ptr<ShardPremerger> premerger;
+
+  /// Non-null iff options.headerCacheDir is non-empty.
+  std::unique_ptr<HeaderDocumentCache> headerDocumentCache;
+
+  /// NOTE(def: speculative-emission): With --speculative-emission, after
+  /// semantic analysis, the worker reports its result and immediately
+  /// starts emitting the index for every file the TU touched, except for
+  /// files which the driver has already assigned to some TU. Keys for
+  /// those files (see PreprocessedFileInfo::key) are forwarded by the
+  /// driver incrementally via SemanticAnalysisJobDetails, like
+  /// NOTE(ref: external-symbol-dedup).
+  ///
+  /// The EmitIndex request is only received after traversing the AST,
+  /// and documents for files which the driver assigned to other TUs are
+  /// dropped before writing the shards. Since assignments are never
+  /// revoked, every file assigned to a TU was either emitted, or was
+  /// already assigned elsewhere when the TU was sent to the worker.
+  ///
+  /// This trades duplicate traversal work (reported as dropped documents
+  /// in the statistics) for the time spent waiting for the driver (also
+  /// reported in the statistics). A document with several variants in a
+  /// TU is kept if any of the variants was assigned to the TU.
+  absl::flat_hash_set<HashValue> claimedFiles;
+
 public:
   Worker(WorkerOptions &&options);
+  ~Worker();
   void run();
 
 private:
@@ -122,9 +229,35 @@ private:
                                       SemanticAnalysisJobResult &&,
                                       IndexJobRequest &emitIndexRequest);
 
+  ReceiveStatus receiveEmitIndexRequest(std::string_view tuMainFilePath,
+                                        IndexJobRequest &emitIndexRequest);
+
   void emitIndex(google::protobuf::Message &&scipIndex,
                  const StdPath &outputPath);
 
+  static ShardLog openShardLog(StdPath logPath);
+  static ShardLogRange appendToShardLog(ShardLog &log,
+                                        const google::protobuf::Message &);
+  static ShardLogRange appendToShardLog(ShardLog &log,
+                                        std::string_view serializedMessage);
+
+  /// See NOTE(ref: worker-premerge).
+  ShardPaths appendToPremergeJournal(const TuIndexingOutput &);
+
+  /// See NOTE(ref: worker-premerge).
+  std::optional<ShardPaths>
+  flushPremergedShards(std::optional<uint32_t> taskId,
+                       std::vector<HashValue> &emittedExternalSymbols);
+  void finishPremerging();
+
+  /// Forgets hashes sent by the driver during a run.
+  /// See NOTE(ref: serve-mode).
+  void resetForNextRun();
+
+  /// See NOTE(ref: external-symbol-dedup).
+  void omitKnownExternalSymbols(scip::Index &,
+                                std::vector<HashValue> &newlyEmitted);
+
   ReceiveStatus processRequest(IndexJobRequest &&, IndexJobResult &);
   void triggerFaultIfApplicable() const;
 
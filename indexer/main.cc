@@ -37,7 +37,9 @@ static scip_clang::CliOptions parseArguments(int argc, char *argv[]) {
     cxxopts::value<std::string>(cliOptions.compdbPath)->default_value("compile_commands.json"));
   parser.add_options(defaultGroup)(
     "index-output-path",
-    "Path to write the SCIP index to",
+    "Path to write the SCIP index to."
+    " Use '-' to stream the index to stdout (other output goes to stderr),"
+    " or '/dev/fd/N' to stream it to an inherited file descriptor.",
     cxxopts::value<std::string>(cliOptions.indexOutputPath)->default_value("index.scip"));
   parser.add_options(defaultGroup)(
     "package-map-path",
@@ -79,6 +81,110 @@ static scip_clang::CliOptions parseArguments(int argc, char *argv[]) {
     "receive-timeout-seconds",
     "How long should the driver wait for a worker before marking it as timed out?",
     cxxopts::value<uint32_t>()->default_value("300"));
+  parser.add_options("Performance")(
+    "shard-log",
+    "Have each worker append its partial indexes to a single log file,"
+    " instead of writing two files per translation unit."
+    " Reduces file system metadata overhead for large compilation databases.",
+    cxxopts::value<bool>(cliOptions.useShardLog));
+  parser.add_options("Performance")(
+    "merge-memory-budget",
+    "Approximate memory budget (in MiB) for merging partial indexes."
+    " If set, documents which are indexed only once are re-read from disk"
+    " when writing the final index instead of being kept in memory,"
+    " and documentation for external symbols is spilled to disk"
+    " once it exceeds the budget.",
+    cxxopts::value<uint64_t>(cliOptions.mergeMemoryBudgetMiB)->default_value("0"));
+  parser.add_options("Performance")(
+    "worker-premerge-count",
+    "Have each worker merge the partial indexes for this many translation units"
+    " before handing them off to the driver, reducing the number of shards"
+    " written and the amount of merging done by the driver.",
+    cxxopts::value<uint32_t>(cliOptions.workerPremergeCount)->default_value("0"));
+  parser.add_options("Performance")(
+    "split-index-by-package",
+    "Write documents and external symbols belonging to packages other than"
+    " the current project (based on --package-map-path) to separate files"
+    " next to the main index, named like index-<package>.scip.",
+    cxxopts::value<bool>(cliOptions.splitIndexByPackage));
+  parser.add_options("Performance")(
+    "index-output-max-size",
+    "Approximate maximum size (in MiB) for each output index file."
+    " Larger indexes are split across files named like index-1.scip, index-2.scip etc."
+    " Each file is a valid SCIP index, so files can be uploaded in parallel."
+    " 0 means no limit.",
+    cxxopts::value<uint64_t>(cliOptions.indexOutputMaxSizeMiB)->default_value("0"));
+  parser.add_options("Performance")(
+    "compress-index-output",
+    "Gzip-compress the index while writing it, using multiple threads."
+    " The output consists of several gzip members, which standard tools"
+    " like gunzip decompress as a single file. Consider passing"
+    " --index-output-path=index.scip.gz along with this.",
+    cxxopts::value<bool>(cliOptions.compressIndexOutput));
+  parser.add_options("Performance")(
+    "incremental-cache-dir",
+    "Directory for keeping partial indexes across runs. If set, translation units"
+    " whose compilation command and included files are unchanged since the"
+    " previous run with the same directory are not re-indexed."
+    " Disables --shard-log and --worker-premerge-count.",
+    cxxopts::value<std::string>(cliOptions.incrementalCacheDir)->default_value(""));
+  parser.add_options("Performance")(
+    "shard-cache",
+    "Directory or http(s):// URL for a content-addressed cache of partial indexes,"
+    " which can be shared across checkouts and machines. Translation units with"
+    " identical compilation commands and included file contents reuse cached"
+    " partial indexes instead of traversing the AST. An HTTP cache must support"
+    " GET and PUT; requests are made using curl."
+    " Disables --shard-log and --worker-premerge-count.",
+    cxxopts::value<std::string>(cliOptions.shardCacheLocation)->default_value(""));
+  parser.add_options("Performance")(
+    "header-cache-dir",
+    "Directory for keeping the partial index for each header across runs,"
+    " keyed by the header's contents and the preprocessor state it was included in."
+    " Headers which are unchanged since an earlier run are not re-indexed,"
+    " even if the translation units including them are."
+    " Entries which are not used during a run are deleted at the end.",
+    cxxopts::value<std::string>(cliOptions.headerCacheDir)->default_value(""));
+  parser.add_options("Performance")(
+    "toolchain-cache-path",
+    "Path for persisting information about compilers (e.g. the resource directory)"
+    " across runs, keyed by the path, modification time and size of each compiler"
+    " or compiler wrapper in the compilation database. Avoids invoking each compiler"
+    " a few times at the start of every run.",
+    cxxopts::value<std::string>(cliOptions.toolchainCachePath)->default_value(""));
+  parser.add_options("Performance")(
+    "include-graph-path",
+    "Path for writing the files touched by each translation unit, along with"
+    " the preprocessor state each file was included in. Used by --changed-files.",
+    cxxopts::value<std::string>(cliOptions.includeGraphPath)->default_value(""));
+  parser.add_options("Performance")(
+    "changed-files",
+    "Path to a file listing changed files, one per line (e.g. the output of"
+    " 'git diff --name-only'); relative paths are resolved against the project root."
+    " Only translation units which are new, or which touched a changed file"
+    " as per the graph at --include-graph-path from a previous run, are indexed."
+    " The graph is updated afterwards for use by the next run.",
+    cxxopts::value<std::string>(cliOptions.changedFilesPath)->default_value(""));
+  parser.add_options("Performance")(
+    "reuse-previous-plan",
+    "Use the graph at --include-graph-path from a previous run to decide which"
+    " translation unit emits each header before semantic analysis. Workers whose"
+    " included files are unchanged start emitting without waiting for the driver.",
+    cxxopts::value<bool>(cliOptions.reusePreviousPlan));
+  parser.add_options("Performance")(
+    "speculative-emission",
+    "Have workers start emitting the index for every file touched by a translation unit"
+    " right after semantic analysis, instead of waiting for the driver to assign files."
+    " Documents for files assigned to other translation units are discarded afterwards.",
+    cxxopts::value<bool>(cliOptions.speculativeEmission));
+  parser.add_options("Performance")(
+    "serve-socket-path",
+    "Instead of indexing once, keep the driver and workers running, and accept"
+    " indexing requests over a Unix domain socket at this path. Each request is a"
+    " single line of JSON with absolute paths: {\"compdbPath\": ..., \"indexOutputPath\": ...,"
+    " \"changedFilesPath\": ...} (the last one is optional, and requires --include-graph-path)."
+    " A single line of JSON is sent back once the index is written.",
+    cxxopts::value<std::string>(cliOptions.serveSocketPath)->default_value(""));
   parser.add_options("Debugging")(
     "worker-mode",
     "[worker-only] Spawn an indexing worker instead of invoking the driver directly."
@@ -126,8 +232,9 @@ static scip_clang::CliOptions parseArguments(int argc, char *argv[]) {
     cxxopts::value<bool>(cliOptions.noStacktrace));
   parser.add_options(testGroup)(
     "force-worker-fault",
-    "One of 'crash', 'sleep' or 'spin'."
-    " Forces faulty behavior in a worker process instead of normal processing.",
+    "One of 'crash', 'sleep', 'spin' or 'lose-shard'."
+    " Forces faulty behavior in a worker process instead of normal processing."
+    " 'lose-shard' deletes the shard written for the first TU.",
     cxxopts::value<std::string>(cliOptions.workerFault)->default_value(""));
   parser.add_options(testGroup)(
     "testing",
@@ -143,6 +250,17 @@ static scip_clang::CliOptions parseArguments(int argc, char *argv[]) {
     "to communicate with the worker, but it may be used to set the driver ID "
     "in tests as the PID is deterministic in a Bazel sandbox.",
     cxxopts::value<std::string>(cliOptions.driverId));
+  parser.add_options("Internal")(
+    "persistent-worker",
+    "[worker-only] Wait for more work after the driver signals the end of a run,"
+    " instead of exiting. Used with --serve-socket-path.",
+    cxxopts::value<bool>(cliOptions.persistentWorker));
+  parser.add_options("Internal")(
+    "self-contained-shards",
+    "[worker-only] Keep every external symbol in each shard, even if the worker"
+    " emitted it for an earlier translation unit. Used when shards may be reused"
+    " across runs.",
+    cxxopts::value<bool>(cliOptions.selfContainedShards));
   parser.add_options("Internal")(
     "worker-id",
     "[worker-only] An opaque ID for the worker itself.",
@@ -240,5 +358,8 @@ int main(int argc, char *argv[]) {
     return scip_clang::workerMain(std::move(cliOptions));
   }
   spdlog::debug("running {}", scip_clang::full_version_string);
+  if (!cliOptions.serveSocketPath.empty()) {
+    return scip_clang::serveMain(std::move(cliOptions));
+  }
   return scip_clang::driverMain(std::move(cliOptions));
 }
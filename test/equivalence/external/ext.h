@@ -0,0 +1,10 @@
+#pragma once
+
+namespace ext {
+
+/// Declared outside the project root, so that the index has external
+/// symbols for it. Both a.cc and c.cc reference it, so it comes up in
+/// the shards of different workers.
+int triple(int x);
+
+} // namespace ext
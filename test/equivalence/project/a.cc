@@ -0,0 +1,9 @@
+#include "ext.h"
+#include "shared.h"
+
+#define EQ_VARIANT_A
+#include "variant.h"
+
+int fromA(eq::Shared s) {
+  return ext::triple(s.get()) + eq::variant();
+}
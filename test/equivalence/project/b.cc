@@ -0,0 +1,8 @@
+// Resolving the forward declaration needs information from other TUs.
+namespace eq {
+struct Shared;
+} // namespace eq
+
+int fromB(eq::Shared *s, int x) {
+  return s ? x + 1 : x;
+}
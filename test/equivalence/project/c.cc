@@ -0,0 +1,8 @@
+#include "dep/dep.h"
+#include "ext.h"
+#include "shared.h"
+#include "variant.h"
+
+int fromC(const eq::Shared &s) {
+  return ext::triple(dep::twice(eq::variant(s.value)));
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+namespace dep {
+
+inline int twice(int x) {
+  return 2 * x;
+}
+
+} // namespace dep
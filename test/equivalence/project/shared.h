@@ -0,0 +1,15 @@
+#pragma once
+
+namespace eq {
+
+/// Included by both a.cc and c.cc, so exactly one of them should be
+/// assigned this header.
+struct Shared {
+  int value;
+
+  int get() const {
+    return value;
+  }
+};
+
+} // namespace eq
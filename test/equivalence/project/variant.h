@@ -0,0 +1,17 @@
+// No include guard: a.cc and c.cc include this with different macro
+// definitions, so it is indexed once per variant, and the driver has to
+// merge the variants.
+
+namespace eq {
+
+#ifdef EQ_VARIANT_A
+inline int variant() {
+  return 1;
+}
+#else
+inline int variant(int x) {
+  return x;
+}
+#endif
+
+} // namespace eq
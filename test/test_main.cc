@@ -1,27 +1,44 @@
+#include <chrono>
 #include <cstdlib>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <iterator>
 #include <optional>
 #include <string>
 #include <string_view>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
 #include <utility>
 #include <vector>
 
 #include "absl/algorithm/container.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
+#include "absl/strings/match.h"
 #include "absl/strings/str_join.h"
 #include "absl/strings/str_replace.h"
 #include "absl/strings/str_split.h"
 #include "boost/process/child.hpp"
 #include "boost/process/io.hpp"
+#include "boost/process/pipe.hpp"
 #include "boost/process/start_dir.hpp"
 #include "cxxopts.hpp"
 #include "doctest/doctest.h"
 #include "spdlog/fmt/fmt.h"
 #include "spdlog/fmt/ranges.h"
 
+#include "zlib.h"
+
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/JSON.h"
 #include "llvm/Support/YAMLTraits.h"
 
+#include "proto/fwd_decls.pb.h"
+#include "proto/incremental_manifest.pb.h"
+#include "proto/index_shard.pb.h"
 #include "scip/scip.pb.h"
 
 #include "indexer/CliOptions.h"
@@ -29,6 +46,9 @@
 #include "indexer/CompilationDatabase.h"
 #include "indexer/Enforce.h"
 #include "indexer/FileSystem.h"
+#include "indexer/ScipExtras.h"
+#include "indexer/Server.h"
+#include "indexer/ShardReader.h"
 #include "indexer/Worker.h"
 
 #include "test/Snapshot.h"
@@ -42,6 +62,7 @@ enum class Kind {
   PreprocessorTests,
   RobustnessTests,
   IndexTests,
+  EquivalenceTests,
 };
 
 struct CliOptions {
@@ -156,6 +177,7 @@ TEST_CASE("UNIT_TESTS") {
     struct CommandLineCleaningTestCase {
       std::vector<std::string> before;
       std::vector<std::string> after;
+      bool forDeduplication = false;
     };
     std::vector<CommandLineCleaningTestCase> testCases{
         {{
@@ -166,11 +188,19 @@ TEST_CASE("UNIT_TESTS") {
          {
              .before = {"gcc", "-mfix-cortex-a53-843419", "tmp2.c"},
              .after = {"gcc", "tmp2.c"},
+         },
+         {
+             .before = {"clang", "-fPIC", "-MMD", "-MF", "a.o.d", "-c", "a.c",
+                        "-o", "a.o", "-Wp,-MD,.a.o.d", "-MT=a.o"},
+             .after = {"clang", "-fPIC", "-c", "a.c"},
+             .forDeduplication = true,
          }}};
     auto cleaner = scip_clang::compdb::CommandLineCleaner::forClangOrGcc();
+    auto dedupCleaner =
+        scip_clang::compdb::CommandLineCleaner::forDeduplication();
     for (auto &testCase : testCases) {
       std::vector<std::string> input = testCase.before;
-      cleaner->clean(input);
+      (testCase.forDeduplication ? dedupCleaner : cleaner)->clean(input);
       CHECK_MESSAGE(absl::c_equal(testCase.after, input),
                     fmt::format("cleaned command-line invocation:\n  expected: "
                                 "{}\n    actual: {}",
@@ -178,6 +208,198 @@ TEST_CASE("UNIT_TESTS") {
                                 fmt::join(input, " ")));
     }
   }
+
+  {
+    struct CompdbScanTestCase {
+      std::string json;
+      std::vector<std::string> objects;
+      bool isValid;
+    };
+    // Objects longer than 8 bytes exercise skipping over whole words.
+    std::vector<CompdbScanTestCase> testCases{
+        {"[]", {}, true},
+        {" [ {} ,\n{ } ] \n", {"{}", "{ }"}, true},
+        {R"([{"file": "a}b{c", "arguments": ["[", "]"]}, {"x": "\"}\\"}])",
+         {R"({"file": "a}b{c", "arguments": ["[", "]"]})",
+          R"({"x": "\"}\\"})"},
+         true},
+        {"", {}, false},
+        {"{}", {}, false},
+        {"[{}, ]", {}, false},
+        {"[{} {}]", {}, false},
+        {"[{}] []", {}, false},
+        {R"([{"file": "unterminated}])", {}, false},
+    };
+    for (auto &testCase : testCases) {
+      std::vector<compdb::ObjectSpan> spans{};
+      auto error = compdb::scanCommandObjects(testCase.json, spans);
+      CHECK_MESSAGE(!error.has_value() == testCase.isValid,
+                    fmt::format("expected {} to be {}", testCase.json,
+                                testCase.isValid ? "valid" : "invalid"));
+      if (!testCase.isValid) {
+        continue;
+      }
+      std::vector<std::string> gotObjects{};
+      for (auto &span : spans) {
+        gotObjects.push_back(testCase.json.substr(span.offset, span.length));
+      }
+      CHECK_MESSAGE(absl::c_equal(testCase.objects, gotObjects),
+                    fmt::format("expected objects: {}\n  actual objects: {}",
+                                fmt::join(testCase.objects, " "),
+                                fmt::join(gotObjects, " ")));
+    }
+  }
+
+  {
+    // Small coordinates and few symbols, so that there are many
+    // occurrences with identical ranges.
+    uint32_t state = 1;
+    auto nextRandom = [&state](uint32_t bound) -> int32_t {
+      state = state * 1103515245 + 12345;
+      return int32_t((state >> 16) % bound);
+    };
+    google::protobuf::RepeatedPtrField<scip::Occurrence> occurrences;
+    for (int i = 0; i < 1000; ++i) {
+      auto &occ = *occurrences.Add();
+      for (int j = 0; j < 3; ++j) {
+        occ.add_range(nextRandom(40));
+      }
+      if (nextRandom(3) == 0) {
+        occ.add_range(nextRandom(40));
+      }
+      occ.set_symbol(fmt::format("sym{}", nextRandom(3)));
+      occ.set_symbol_roles(nextRandom(2));
+    }
+    auto expected = occurrences;
+    absl::c_sort(expected, [](const auto &lhs, const auto &rhs) -> bool {
+      return scip::compareOccurrences(lhs, rhs) == std::strong_ordering::less;
+    });
+    scip::sortOccurrences(occurrences);
+    REQUIRE(expected.size() == occurrences.size());
+    for (int i = 0; i < occurrences.size(); ++i) {
+      CHECK_MESSAGE(scip::compareOccurrences(expected[i], occurrences[i])
+                        == std::strong_ordering::equal,
+                    fmt::format("sortOccurrences differs from sorting with "
+                                "compareOccurrences at index {}",
+                                i));
+    }
+  }
+
+  {
+    auto makeShard = []() -> scip::IndexShard {
+      scip::IndexShard shard{};
+      auto &doc = *shard.add_documents();
+      doc.set_relative_path("a.h");
+      for (auto name : {"sym1", "sym2", "sym1"}) {
+        doc.add_occurrences()->set_symbol(name);
+      }
+      doc.add_symbols()->set_symbol("sym2");
+      scip::ShardSymbolTable::encode(shard);
+      return shard;
+    };
+    auto shard = makeShard();
+    CHECK(shard.symbol_table_size() == 2);
+    scip::ShardSymbolTable symbolTable{shard};
+    CHECK(!symbolTable.isMalformed());
+    auto &doc = *shard.mutable_documents(0);
+    symbolTable.restore(0, doc);
+    CHECK(doc.occurrences(0).symbol() == "sym1");
+    CHECK(doc.occurrences(1).symbol() == "sym2");
+    CHECK(doc.occurrences(2).symbol() == "sym1");
+    CHECK(doc.symbols(0).symbol() == "sym2");
+
+    auto badShard = makeShard();
+    badShard.mutable_symbol_refs()->RemoveLast();
+    CHECK(scip::ShardSymbolTable{badShard}.isMalformed());
+    auto outOfBoundsShard = makeShard();
+    outOfBoundsShard.set_symbol_refs(0, 2);
+    CHECK(scip::ShardSymbolTable{outOfBoundsShard}.isMalformed());
+  }
+
+  {
+    auto makeDoc = [](std::vector<std::string_view> occSymbols,
+                      std::vector<std::string_view> symbols) {
+      scip::Document doc{};
+      doc.set_relative_path("a.h");
+      for (auto name : occSymbols) {
+        auto &occ = *doc.add_occurrences();
+        occ.set_symbol(std::string(name));
+        occ.add_range(0);
+        occ.add_range(0);
+        occ.add_range(1);
+      }
+      for (auto name : symbols) {
+        doc.add_symbols()->set_symbol(std::string(name));
+      }
+      return scip::documentContentDigest(doc);
+    };
+    auto digest = makeDoc({"sym1", "sym2", "sym3"}, {"sym1", "sym2"});
+    CHECK(digest == makeDoc({"sym3", "sym1", "sym2"}, {"sym2", "sym1"}));
+    // Variants which differ in a single entry.
+    CHECK(digest != makeDoc({"sym1", "sym2", "sym4"}, {"sym1", "sym2"}));
+    CHECK(digest != makeDoc({"sym1", "sym2", "sym3"}, {"sym1", "sym3"}));
+    CHECK(digest
+          != makeDoc({"sym1", "sym2", "sym3", "sym3"}, {"sym1", "sym2"}));
+    CHECK(makeDoc({"sym1", "sym1", "sym2"}, {})
+          != makeDoc({"sym1", "sym2", "sym2"}, {}));
+  }
+
+  {
+    // Mix shards from a log with standalone files, and make earlier
+    // shards larger, so that later shards tend to be parsed first.
+    auto dir = std::filesystem::temp_directory_path()
+               / fmt::format("scip-clang-prefetch-{}", ::getpid());
+    std::filesystem::create_directories(dir);
+    auto logPath = AbsolutePath((dir / "shards.log").string());
+    std::ofstream log(logPath.asStringRef(),
+                      std::ios_base::out | std::ios_base::binary);
+    size_t numShards = 64;
+    std::vector<ShardPaths> paths{};
+    for (size_t i = 0; i < numShards; ++i) {
+      scip::ForwardDeclIndex shard{};
+      for (size_t j = 0; j < (numShards - i) * 50; ++j) {
+        shard.add_forward_decls()->set_suffix(fmt::format("{}#{}", i, j));
+      }
+      auto bytes = shard.SerializeAsString();
+      if (i % 5 == 0) {
+        auto shardPath =
+            AbsolutePath((dir / fmt::format("{}.shard", i)).string());
+        std::ofstream(shardPath.asStringRef(),
+                      std::ios_base::out | std::ios_base::binary)
+            << bytes;
+        paths.push_back(ShardPaths{shardPath, shardPath, {}, {}});
+        continue;
+      }
+      auto offset = uint64_t(log.tellp());
+      log << bytes;
+      auto range = ShardLogRange{offset, bytes.size()};
+      paths.push_back(ShardPaths{logPath, logPath, range, range});
+    }
+    auto offset = uint64_t(log.tellp());
+    log.close();
+    // A range past the end of the log, which should be skipped.
+    auto badRange = ShardLogRange{offset, 10};
+    paths.insert(paths.begin() + 7,
+                 ShardPaths{logPath, logPath, badRange, badRange});
+
+    std::vector<const ShardPaths *> pathPtrs{};
+    for (auto &shardPaths : paths) {
+      pathPtrs.push_back(&shardPaths);
+    }
+    std::vector<std::string> seen{};
+    {
+      ForwardDeclShardPrefetcher prefetcher{std::move(pathPtrs), 4};
+      prefetcher.forEach([&](scip::ForwardDeclIndex &&shard) -> void {
+        CHECK(shard.forward_decls_size() > 0);
+        seen.push_back(shard.forward_decls(0).suffix());
+      });
+    }
+    REQUIRE(seen.size() == numShards);
+    for (size_t i = 0; i < numShards; ++i) {
+      CHECK(seen[i] == fmt::format("{}#0", i));
+    }
+    std::filesystem::remove_all(dir);
+  }
 };
 
 TEST_CASE("COMPDB_PARSING") {
@@ -194,6 +416,11 @@ TEST_CASE("COMPDB_PARSING") {
   auto testOptionsSkip = testOptions;
   testOptionsSkip.skipNonMainFileEntries = true;
   testCases.push_back(CompDbTestCase{"skipping.json", 9, {4}, testOptionsSkip});
+  // PIC and non-PIC entries are both kept. See NOTE(ref: compdb-dedup).
+  auto testOptionsDedup = testOptions;
+  testOptionsDedup.skipDuplicates = true;
+  testCases.push_back(
+      CompDbTestCase{"duplicates.json", 5, {8}, testOptionsDedup});
 
   auto dataDir =
       std::filesystem::current_path().append("test").append("compdb");
@@ -370,8 +597,9 @@ TEST_CASE("PREPROCESSING") {
                            EmitIndexJobDetails &) -> bool { return false; };
         TuIndexingOutput tuIndexingOutput{};
         worker.processTranslationUnit(
-            SemanticAnalysisJobDetails{std::move(command)}, callback,
-            tuIndexingOutput);
+            SemanticAnalysisJobDetails{std::move(command), std::nullopt, {},
+                                       {}, {}},
+            callback, tuIndexingOutput);
         worker.flushStreams();
         std::string actual(test::readFileToString(tmpYamlFile.path));
 
@@ -531,12 +759,668 @@ TEST_CASE("INDEX") {
       });
 }
 
+namespace {
+
+/// Decompresses all gzip members in the file, like gunzip.
+std::string readGzipFile(const std::string &path) {
+  gzFile file = ::gzopen(path.c_str(), "rb");
+  REQUIRE_MESSAGE(file != nullptr,
+                  fmt::format("failed to open gzip file at '{}'", path));
+  std::string contents;
+  char buffer[64 * 1024];
+  int numRead;
+  while ((numRead = ::gzread(file, buffer, sizeof(buffer))) > 0) {
+    contents.append(buffer, size_t(numRead));
+  }
+  ::gzclose(file);
+  REQUIRE_MESSAGE(numRead == 0,
+                  fmt::format("failed to decompress '{}'", path));
+  return contents;
+}
+
+/// Sends \p request to a server started with --serve-socket-path, and
+/// waits for the response. Retries connecting until the server starts
+/// listening.
+ServeResponse sendServeRequest(const std::string &socketPath,
+                               const ServeRequest &request) {
+  sockaddr_un address{};
+  REQUIRE(socketPath.size() < sizeof(address.sun_path));
+  address.sun_family = AF_UNIX;
+  std::memcpy(address.sun_path, socketPath.data(), socketPath.size());
+  int fd = -1;
+  for (int attempt = 0;; ++attempt) {
+    fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    REQUIRE_MESSAGE(fd >= 0, "failed to create socket");
+    if (::connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address))
+        == 0) {
+      break;
+    }
+    ::close(fd);
+    REQUIRE_MESSAGE(attempt < 600, fmt::format("failed to connect to '{}'",
+                                               socketPath));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  std::string line;
+  llvm::raw_string_ostream os(line);
+  os << llvm::json::Value(request) << '\n';
+  os.flush();
+  std::string_view remaining = line;
+  while (!remaining.empty()) {
+    auto n = ::write(fd, remaining.data(), remaining.size());
+    REQUIRE_MESSAGE(n > 0, "failed to send request");
+    remaining.remove_prefix(size_t(n));
+  }
+  std::string buffer;
+  char chunk[4096];
+  while (buffer.find('\n') == std::string::npos) {
+    auto n = ::read(fd, chunk, sizeof(chunk));
+    if (n <= 0) {
+      break;
+    }
+    buffer.append(chunk, size_t(n));
+  }
+  ::close(fd);
+  auto newline = buffer.find('\n');
+  REQUIRE_MESSAGE(newline != std::string::npos,
+                  fmt::format("incomplete response '{}'", buffer));
+  auto response = llvm::json::parse<ServeResponse>(buffer.substr(0, newline));
+  if (!response) {
+    FAIL(llvm::toString(response.takeError()));
+  }
+  return std::move(*response);
+}
+
+/// Copy of test/equivalence in a temporary directory, so that tests can
+/// change files between runs. Source files are under project/, which is
+/// the project root, and headers outside the project root are under
+/// external/.
+class EquivalenceTest final {
+  std::string name;
+  StdPath dir;
+  StdPath projectDir;
+
+public:
+  explicit EquivalenceTest(std::string_view name)
+      // The temporary directory may be behind a symlink (e.g. on macOS),
+      // whereas paths seen by the indexer have symlinks resolved.
+      : name(name),
+        dir(std::filesystem::canonical(std::filesystem::temp_directory_path())
+            / fmt::format("equivalence-{}", name)),
+        projectDir(this->dir / "project") {
+    std::filesystem::remove_all(this->dir);
+    std::filesystem::create_directories(this->dir);
+    // Symlinks in the runfiles tree are followed, so this copies contents.
+    std::filesystem::copy(std::filesystem::current_path() / "test/equivalence",
+                          this->dir, std::filesystem::copy_options::recursive);
+  }
+  EquivalenceTest(const EquivalenceTest &) = delete;
+  EquivalenceTest &operator=(const EquivalenceTest &) = delete;
+
+  ~EquivalenceTest() {
+    std::filesystem::remove_all(this->dir);
+  }
+
+  RootPath projectRoot() const {
+    return RootPath{AbsolutePath{this->projectDir.string()},
+                    RootKind::Project};
+  }
+
+  /// Path for files outside the project, such as compilation databases.
+  StdPath scratchPath(std::string_view fileName) const {
+    return this->dir / fileName;
+  }
+
+  /// Appends \p text to a file in the project directory.
+  void appendToFile(std::string_view relativePath, std::string_view text) {
+    auto contents = test::readFileToString(this->projectDir / relativePath);
+    contents.append(text);
+    this->writeFile(relativePath, contents);
+  }
+
+  /// Replaces the contents of a file in the project directory.
+  void writeFile(std::string_view relativePath, std::string_view contents) {
+    auto path = this->projectDir / relativePath;
+    // The copied file may be read-only, so replace it instead.
+    std::filesystem::remove(path);
+    std::ofstream out(path, std::ios_base::out | std::ios_base::binary);
+    out << contents;
+    ENFORCE(!out.fail(), "failed to write to {}", path.string());
+  }
+
+  /// Compilation database for the given TUs in the project, in the
+  /// given order.
+  std::string compdb(const std::vector<std::string_view> &tuPaths) const {
+    test::CompilationDatabaseBuilder builder{};
+    for (auto tuPath : tuPaths) {
+      builder.entries.push_back(test::CommandObjectBuilder{
+          builder.entries.size(),
+          RootRelativePathRef{tuPath, RootKind::Project},
+          {"clang", "-I", ".", "-I", "../external", std::string(tuPath)}});
+    }
+    std::string buffer;
+    llvm::raw_string_ostream os(buffer);
+    os << builder.toJSON(this->projectRoot());
+    os.flush();
+    return buffer;
+  }
+
+  /// Runs scip-clang in the project directory, and returns its stdout.
+  ///
+  /// Unless overridden in \p extraArgs, the index is written under
+  /// \c outputDir(runName), and 2 workers are used.
+  std::string run(std::string_view runName, std::string_view compdbContents,
+                  std::vector<std::string> &&extraArgs) const {
+    auto hasArg = [&](std::string_view prefix) -> bool {
+      return absl::c_any_of(extraArgs, [&](const std::string &arg) {
+        return absl::StartsWith(arg, prefix);
+      });
+    };
+    auto args = this->commonArgs(runName);
+    auto compdbPath = this->writeCompdb(runName, compdbContents);
+    args.push_back(fmt::format("--compdb-path={}", compdbPath.string()));
+    auto outputDir = this->createOutputDir(runName);
+    if (!hasArg("--index-output-path=")) {
+      args.push_back(fmt::format("--index-output-path={}",
+                                 (outputDir / "index.scip").string()));
+    }
+    if (!hasArg("--jobs=")) {
+      args.push_back("--jobs=2");
+    }
+    absl::c_move(std::move(extraArgs), std::back_inserter(args));
+
+    boost::process::ipstream stdoutStream;
+    boost::process::child driver(
+        args, boost::process::start_dir(this->projectDir.string()),
+        boost::process::std_out > stdoutStream,
+        boost::process::std_err > stderr);
+    std::string output{std::istreambuf_iterator<char>(stdoutStream),
+                       std::istreambuf_iterator<char>()};
+    driver.wait();
+    REQUIRE_MESSAGE(driver.exit_code() == 0,
+                    fmt::format("scip-clang failed for run {}; stdout:\n{}",
+                                runName, output));
+    return output;
+  }
+
+  /// Starts scip-clang in the project directory, listening for requests
+  /// on \p socketPath.
+  boost::process::child serve(const std::string &socketPath) const {
+    auto args = this->commonArgs("server");
+    args.push_back(fmt::format("--serve-socket-path={}", socketPath));
+    args.push_back("--jobs=2");
+    return boost::process::child(
+        args, boost::process::start_dir(this->projectDir.string()),
+        boost::process::std_out > stdout, boost::process::std_err > stderr);
+  }
+
+  /// Sends a request to a server started with \c serve, with the index
+  /// written under \c outputDir(runName).
+  ServeResponse request(const std::string &socketPath,
+                        std::string_view runName,
+                        std::string_view compdbContents) const {
+    auto compdbPath = this->writeCompdb(runName, compdbContents);
+    auto outputDir = this->createOutputDir(runName);
+    return ::sendServeRequest(
+        socketPath, ServeRequest{compdbPath.string(),
+                                 (outputDir / "index.scip").string(), ""});
+  }
+
+  /// Like \c run, but returns the index instead of stdout.
+  scip::Index index(std::string_view runName, std::string_view compdbContents,
+                    std::vector<std::string> &&extraArgs) const {
+    this->run(runName, compdbContents, std::move(extraArgs));
+    return this->readIndex(runName);
+  }
+
+  /// The index may be split across several files, so each run gets its
+  /// own output directory. See NOTE(ref: split-index-output).
+  StdPath outputDir(std::string_view runName) const {
+    return this->dir / fmt::format("{}-output", runName);
+  }
+
+  /// Merges all the index files written by a run, decompressing files
+  /// with a .gz extension.
+  scip::Index readIndex(std::string_view runName) const {
+    scip::Index index{};
+    for (auto &entry :
+         std::filesystem::directory_iterator(this->outputDir(runName))) {
+      auto path = entry.path().string();
+      scip::Index part{};
+      if (entry.path().extension() == ".gz") {
+        REQUIRE_MESSAGE(
+            part.ParseFromString(::readGzipFile(path)),
+            fmt::format("failed to parse SCIP index at '{}'", path));
+        index.MergeFrom(part);
+        continue;
+      }
+      std::ifstream inputStream(path,
+                                std::ios_base::in | std::ios_base::binary);
+      REQUIRE_MESSAGE(!inputStream.fail(),
+                      fmt::format("failed to open index file at '{}'", path));
+      REQUIRE_MESSAGE(
+          part.ParseFromIstream(&inputStream),
+          fmt::format("failed to parse SCIP index at '{}'", path));
+      index.MergeFrom(part);
+    }
+    return index;
+  }
+
+private:
+  std::vector<std::string> commonArgs(std::string_view runName) const {
+    std::vector<std::string> args;
+    args.push_back(
+        (std::filesystem::current_path() / "indexer/scip-clang").string());
+    args.push_back("--log-level=warning");
+    args.push_back("--receive-timeout-seconds=60");
+    args.push_back(
+        fmt::format("--driver-id=equivalence-{}-{}", this->name, runName));
+    args.push_back("--deterministic");
+    args.push_back("--no-progress-report");
+    auto packageMapPath = this->projectDir / "package-map.json";
+    args.push_back(
+        fmt::format("--package-map-path={}", packageMapPath.string()));
+    return args;
+  }
+
+  StdPath writeCompdb(std::string_view runName,
+                      std::string_view compdbContents) const {
+    auto compdbPath = this->scratchPath(fmt::format("{}-compdb.json", runName));
+    std::ofstream out(compdbPath, std::ios_base::out | std::ios_base::binary);
+    out << compdbContents;
+    return compdbPath;
+  }
+
+  StdPath createOutputDir(std::string_view runName) const {
+    auto outputDir = this->outputDir(runName);
+    std::filesystem::remove_all(outputDir);
+    std::filesystem::create_directories(outputDir);
+    return outputDir;
+  }
+};
+
+/// Map from relative path to printed document.
+absl::flat_hash_map<std::string, std::string>
+printDocuments(const scip::Index &index, const RootPath &testRoot) {
+  absl::flat_hash_map<std::string, std::string> out;
+  for (auto &doc : index.documents()) {
+    std::string buffer;
+    llvm::raw_string_ostream os(buffer);
+    auto docAbsPath = testRoot.makeAbsolute(
+        RootRelativePathRef{doc.relative_path(), RootKind::Project});
+    test::SnapshotPrinter::printDocument(doc, docAbsPath.asRef(), os);
+    os.flush();
+    auto inserted = out.emplace(doc.relative_path(), std::move(buffer)).second;
+    CHECK_MESSAGE(inserted, fmt::format("document for {} is present twice",
+                                        doc.relative_path()));
+  }
+  return out;
+}
+
+/// Checks that both indexes have the same documents and external symbols,
+/// irrespective of their order.
+///
+/// Documents are printed using the current contents of the files, so
+/// both indexes must be for the current contents.
+void checkEquivalent(const EquivalenceTest &test, scip::Index &&expected,
+                     scip::Index &&actual) {
+  auto testRoot = test.projectRoot();
+  auto expectedDocs = ::printDocuments(expected, testRoot);
+  auto actualDocs = ::printDocuments(actual, testRoot);
+  for (auto &[path, expectedDoc] : expectedDocs) {
+    auto it = actualDocs.find(path);
+    if (it == actualDocs.end()) {
+      FAIL_CHECK(fmt::format("missing document for {}", path));
+      continue;
+    }
+    test::compareDiff(expectedDoc, it->second,
+                      fmt::format("document for {} differs", path));
+  }
+  for (auto &[path, _] : actualDocs) {
+    CHECK_MESSAGE(expectedDocs.contains(path),
+                  fmt::format("unexpected document for {}", path));
+  }
+  auto formatExternalSymbols = [](scip::Index &index) -> std::string {
+    std::vector<scip::SymbolInformation> externalSymbols{};
+    absl::c_move(std::move(*index.mutable_external_symbols()),
+                 std::back_inserter(externalSymbols));
+    absl::c_sort(externalSymbols, [](const auto &s1, const auto &s2) {
+      return s1.symbol() < s2.symbol();
+    });
+    return test::SnapshotPrinter::formatExternalSymbols(
+        std::move(externalSymbols));
+  };
+  test::compareDiff(formatExternalSymbols(expected),
+                    formatExternalSymbols(actual),
+                    "external symbols differ");
+}
+
+/// Changes shared.h, which is included by a.cc and c.cc but not b.cc.
+void changeSharedHeader(EquivalenceTest &test) {
+  test.appendToFile("shared.h", "\nnamespace eq {\n\n"
+                                "inline int added() {\n"
+                                "  return 0;\n"
+                                "}\n\n"
+                                "} // namespace eq\n");
+}
+
+/// Compares a run with \p extraArgs against a run with the default
+/// options, indexing all TUs.
+void checkSameAsDefault(std::string_view testName,
+                        std::vector<std::string> &&extraArgs) {
+  EquivalenceTest test{testName};
+  auto compdb = test.compdb({"a.cc", "b.cc", "c.cc"});
+  auto expected = test.index("default", compdb, {});
+  auto actual = test.index("actual", compdb, std::move(extraArgs));
+  ::checkEquivalent(test, std::move(expected), std::move(actual));
+}
+
+} // namespace
+
+// Equivalence tests check that options which only change how indexing is
+// carried out don't change the final index, by comparing against a run
+// with the default options. Unlike index tests, there are no snapshots.
+TEST_CASE("EQUIVALENCE") {
+  if (test::globalCliOptions.testKind != test::Kind::EquivalenceTests) {
+    return;
+  }
+  auto &testName = test::globalCliOptions.testName;
+  ENFORCE(testName != "", "--test-name should be passed for equivalence tests");
+
+  if (testName == "shard-log") {
+    // See NOTE(ref: shard-log)
+    ::checkSameAsDefault(testName, {"--shard-log"});
+  } else if (testName == "parallel-merge") {
+    // Merged documents are finished and serialized on a pool sized by
+    // --jobs, so the number of workers shouldn't change the index.
+    ::checkSameAsDefault(testName, {"--jobs=4"});
+  } else if (testName == "two-pass-merge") {
+    // See NOTE(ref: two-pass-merge). Any non-zero budget enables the second
+    // pass, which needs to replay the forward declaration information
+    // for b.cc from the first pass.
+    ::checkSameAsDefault(testName, {"--merge-memory-budget=1"});
+  } else if (testName == "merge-order") {
+    // variant.h is indexed once per variant, and the variants are merged
+    // in the order in which shards arrive. With --deterministic, that
+    // order shouldn't affect the deduplicated occurrences.
+    EquivalenceTest test{testName};
+    auto expected =
+        test.index("default", test.compdb({"a.cc", "b.cc", "c.cc"}), {});
+    auto actual = test.index(
+        "reversed", test.compdb({"c.cc", "b.cc", "a.cc"}), {"--jobs=1"});
+    ::checkEquivalent(test, std::move(expected), std::move(actual));
+  } else if (testName == "external-symbol-dedup") {
+    // See NOTE(ref: external-symbol-dedup). With a worker per TU, a.cc and
+    // c.cc are indexed by different workers, and only one of them should
+    // emit ext::triple, which is outside the project root.
+    EquivalenceTest test{testName};
+    auto compdb = test.compdb({"a.cc", "b.cc", "c.cc"});
+    auto expected = test.index("default", compdb, {"--jobs=1"});
+    auto actual = test.index("actual", compdb, {"--jobs=3"});
+    ::checkEquivalent(test, std::move(expected), std::move(actual));
+  } else if (testName == "missing-shard") {
+    // See NOTE(ref: external-symbol-dedup). The shard for a.cc, which has
+    // the only copy of ext::triple, is deleted before merging; the loss
+    // should be reported without affecting the output for c.cc.
+    EquivalenceTest test{testName};
+    auto compdb = test.compdb({"a.cc", "c.cc"});
+    auto output = test.run("actual", compdb,
+                           {"--jobs=1", "--force-worker-fault=lose-shard"});
+    CHECK_MESSAGE(
+        absl::StrContains(output, "external symbols may be missing"),
+        output);
+    std::vector<std::string> paths{};
+    for (auto &doc : test.readIndex("actual").documents()) {
+      paths.push_back(doc.relative_path());
+    }
+    CHECK_MESSAGE(absl::c_find(paths, "c.cc") != paths.end(),
+                  fmt::format("documents: {}", fmt::join(paths, ", ")));
+    CHECK_MESSAGE(absl::c_find(paths, "a.cc") == paths.end(),
+                  fmt::format("documents: {}", fmt::join(paths, ", ")));
+  } else if (testName == "documentation-table") {
+    // See NOTE(ref: documentation-table). The documentation for
+    // ext::triple is long enough to be moved into the table, and needs
+    // to be resolved for the second pass too.
+    ::checkSameAsDefault(testName, {"--jobs=3", "--merge-memory-budget=1"});
+  } else if (testName == "split-output") {
+    // See NOTE(ref: split-index-output). dep/dep.h and ext.h are in
+    // separate packages as per package-map.json, so their documents and
+    // symbols go into separate files. The size limit is too large to
+    // split the files further, but checks that the limit doesn't drop
+    // anything.
+    ::checkSameAsDefault(testName, {"--split-index-by-package",
+                                    "--index-output-max-size=1"});
+  } else if (testName == "stdout") {
+    // See NOTE(ref: index-output-stream). stdout is a pipe here, and should
+    // only have the index, as the summary is printed to stderr.
+    EquivalenceTest test{testName};
+    auto compdb = test.compdb({"a.cc", "b.cc", "c.cc"});
+    auto expected = test.index("default", compdb, {});
+    auto output = test.run("stdout", compdb, {"--index-output-path=-"});
+    scip::Index actual{};
+    REQUIRE_MESSAGE(actual.ParseFromString(output),
+                    "failed to parse SCIP index written to stdout");
+    ::checkEquivalent(test, std::move(expected), std::move(actual));
+  } else if (testName == "compressed-output") {
+    // Decompressing the concatenated gzip members should give back the
+    // same index.
+    EquivalenceTest test{testName};
+    auto compdb = test.compdb({"a.cc", "b.cc", "c.cc"});
+    auto expected = test.index("default", compdb, {});
+    auto outputPath = test.outputDir("compressed") / "index.scip.gz";
+    auto actual = test.index(
+        "compressed", compdb,
+        {"--compress-index-output",
+         fmt::format("--index-output-path={}", outputPath.string())});
+    ::checkEquivalent(test, std::move(expected), std::move(actual));
+  } else if (testName == "incremental") {
+    // See NOTE(ref: incremental-indexing). The second run reuses the
+    // shards for all TUs. After shared.h changes, only b.cc is reused.
+    EquivalenceTest test{testName};
+    auto compdb = test.compdb({"a.cc", "b.cc", "c.cc"});
+    auto cacheArg = fmt::format("--incremental-cache-dir={}",
+                                test.scratchPath("cache").string());
+    test.run("first", compdb, {cacheArg});
+    auto output = test.run("second", compdb, {cacheArg});
+    CHECK_MESSAGE(absl::StrContains(output, "Reused partial indexes for 3 "),
+                  output);
+    ::checkEquivalent(test, test.index("default", compdb, {}),
+                      test.readIndex("second"));
+
+    ::changeSharedHeader(test);
+    output = test.run("third", compdb, {cacheArg});
+    CHECK_MESSAGE(absl::StrContains(output, "Reused partial indexes for 1 "),
+                  output);
+    ::checkEquivalent(test, test.index("default-changed", compdb, {}),
+                      test.readIndex("third"));
+  } else if (testName == "shard-cache") {
+    // See NOTE(ref: shard-cache). With a single worker, each TU is
+    // assigned the same files in every run, so the keys don't change
+    // unless the files do.
+    EquivalenceTest test{testName};
+    auto compdb = test.compdb({"a.cc", "b.cc", "c.cc"});
+    auto cacheArg = fmt::format("--shard-cache={}",
+                                test.scratchPath("cache").string());
+    test.run("first", compdb, {"--jobs=1", cacheArg});
+    auto output = test.run("second", compdb, {"--jobs=1", cacheArg});
+    CHECK_MESSAGE(absl::StrContains(output, "Shard cache: 3 hits, 0 misses."),
+                  output);
+    ::checkEquivalent(test, test.index("default", compdb, {}),
+                      test.readIndex("second"));
+
+    ::changeSharedHeader(test);
+    output = test.run("third", compdb, {"--jobs=1", cacheArg});
+    CHECK_MESSAGE(absl::StrContains(output, "Shard cache: 1 hits, 2 misses."),
+                  output);
+    ::checkEquivalent(test, test.index("default-changed", compdb, {}),
+                      test.readIndex("third"));
+  } else if (testName == "header-cache") {
+    // See NOTE(ref: header-document-cache). Once shared.h changes, its
+    // cached document must not be reused.
+    EquivalenceTest test{testName};
+    auto compdb = test.compdb({"a.cc", "b.cc", "c.cc"});
+    auto cacheArg = fmt::format("--header-cache-dir={}",
+                                test.scratchPath("cache").string());
+    test.run("first", compdb, {cacheArg});
+    ::checkEquivalent(test, test.index("default", compdb, {}),
+                      test.index("second", compdb, {cacheArg}));
+
+    ::changeSharedHeader(test);
+    ::checkEquivalent(test, test.index("default-changed", compdb, {}),
+                      test.index("third", compdb, {cacheArg}));
+  } else if (testName == "changed-files") {
+    // See NOTE(ref: changed-files). Only a.cc and c.cc include shared.h,
+    // so the partial index should be the same as a fresh index for just
+    // those TUs.
+    EquivalenceTest test{testName};
+    auto graphArg = fmt::format("--include-graph-path={}",
+                                test.scratchPath("include-graph").string());
+    test.run("first", test.compdb({"a.cc", "b.cc", "c.cc"}), {graphArg});
+
+    ::changeSharedHeader(test);
+    auto changedFilesPath = test.scratchPath("changed-files.txt");
+    {
+      std::ofstream out(changedFilesPath, std::ios_base::out);
+      out << "shared.h\n";
+    }
+    auto actual = test.index(
+        "second", test.compdb({"a.cc", "b.cc", "c.cc"}),
+        {graphArg,
+         fmt::format("--changed-files={}", changedFilesPath.string())});
+    auto expected = test.index("default", test.compdb({"a.cc", "c.cc"}), {});
+    ::checkEquivalent(test, std::move(expected), std::move(actual));
+  } else if (testName == "speculative-emission") {
+    // See NOTE(ref: speculative-emission). Documents traversed for files
+    // assigned to other TUs must be dropped.
+    ::checkSameAsDefault(testName, {"--speculative-emission"});
+  } else if (testName == "serve") {
+    // See NOTE(ref: serve-mode). The second request reuses the workers
+    // which were started for the first one. Failed requests in between
+    // are reported to the client without stopping the server.
+    EquivalenceTest test{testName};
+    auto compdb = test.compdb({"a.cc", "b.cc", "c.cc"});
+    auto expected = test.index("default", compdb, {});
+    auto socketPath =
+        fmt::format("/tmp/scip-clang-equivalence-{}.sock", ::getpid());
+    auto server = test.serve(socketPath);
+    auto checkRequest = [&](std::string_view runName) {
+      auto response = test.request(socketPath, runName, compdb);
+      REQUIRE_MESSAGE(response.success, response.message);
+      ::checkEquivalent(test, scip::Index(expected), test.readIndex(runName));
+    };
+    checkRequest("first");
+    auto response = test.request(socketPath, "empty", "[]");
+    REQUIRE_MESSAGE(!response.success, "expected empty compdb to fail");
+    response = test.request(socketPath, "missing", test.compdb({"d.cc"}));
+    REQUIRE_MESSAGE(!response.success, "expected compdb without TUs to fail");
+    REQUIRE_MESSAGE(server.running(), "server exited after a failed request");
+    checkRequest("second");
+    server.terminate();
+    std::filesystem::remove(socketPath);
+  } else if (testName == "toolchain-cache") {
+    // See NOTE(ref: toolchain-cache). The second run restores the
+    // toolchain for clang from the cache instead of probing it.
+    EquivalenceTest test{testName};
+    auto compdb = test.compdb({"a.cc", "b.cc", "c.cc"});
+    auto cachePath = test.scratchPath("toolchains.json");
+    auto cacheArg =
+        fmt::format("--toolchain-cache-path={}", cachePath.string());
+    test.run("first", compdb, {cacheArg});
+    REQUIRE_MESSAGE(std::filesystem::exists(cachePath),
+                    "toolchain cache was not written");
+    ::checkEquivalent(test, test.index("default", compdb, {}),
+                      test.index("second", compdb, {cacheArg}));
+  } else if (testName == "compdb-scan") {
+    // The compilation database is scanned for command objects before
+    // being parsed, so neither formatting nor brackets and braces inside
+    // strings should change the commands which are found.
+    EquivalenceTest test{testName};
+    auto compdb = test.compdb({"a.cc", "b.cc", "c.cc"});
+    auto expected = test.index("default", compdb, {});
+    auto parsed = llvm::json::parse(compdb);
+    if (!parsed) {
+      FAIL(llvm::toString(parsed.takeError()));
+    }
+    for (auto &command : *parsed->getAsArray()) {
+      command.getAsObject()->try_emplace("output", "}]\\\"[{ \"{\"");
+    }
+    auto prettyCompdb = llvm::formatv("{0:2}", *parsed).str();
+    auto actual = test.index("pretty", prettyCompdb, {});
+    ::checkEquivalent(test, std::move(expected), std::move(actual));
+  } else if (testName == "incremental-reindex") {
+    // With a single worker, c.cc emits shared.h in the first run. In the
+    // second run, only a.cc is re-indexed, and its semantic analysis
+    // result may be planned before the compilation database entry for
+    // c.cc is parsed, so it must not be assigned shared.h again.
+    EquivalenceTest test{testName};
+    auto cachePath = test.scratchPath("cache");
+    auto cacheArg =
+        fmt::format("--incremental-cache-dir={}", cachePath.string());
+    test.run("first", test.compdb({"c.cc", "b.cc", "a.cc"}),
+             {"--jobs=1", cacheArg});
+    test.appendToFile("a.cc", "\n// Changed.\n");
+    auto compdb = test.compdb({"a.cc", "b.cc", "c.cc"});
+    auto actual = test.index("second", compdb, {"--jobs=1", cacheArg});
+    // Merging hides documents emitted by multiple TUs, so check the
+    // assignments recorded for the next run too.
+    scip::IncrementalManifest manifest{};
+    {
+      std::ifstream manifestStream(cachePath / "manifest.pb",
+                                   std::ios_base::in | std::ios_base::binary);
+      REQUIRE(manifest.ParseFromIstream(&manifestStream));
+    }
+    absl::flat_hash_set<std::pair<uint32_t, uint64_t>> assignedFiles{};
+    for (auto &tu : manifest.tus()) {
+      for (int i = 0; i < tu.assigned_files_size(); ++i) {
+        auto inserted =
+            assignedFiles.emplace(tu.assigned_files(i), tu.assigned_hashes(i))
+                .second;
+        CHECK_MESSAGE(inserted,
+                      fmt::format("{} was assigned to multiple TUs",
+                                  manifest.files(tu.assigned_files(i)).path()));
+      }
+    }
+    ::checkEquivalent(test, test.index("default", compdb, {"--jobs=1"}),
+                      std::move(actual));
+  } else if (testName == "worker-premerge") {
+    // See NOTE(ref: worker-premerge). With a single worker, the output for
+    // a.cc and b.cc is merged when b.cc is done, and the output for c.cc
+    // is merged when the worker is shut down. With more workers, the
+    // grouping depends on scheduling, but the index should be the same.
+    ::checkSameAsDefault(testName, {"--jobs=1", "--worker-premerge-count=2"});
+    ::checkSameAsDefault(testName, {"--jobs=2", "--worker-premerge-count=2"});
+  } else if (testName == "stale-plan") {
+    // See NOTE(ref: previous-plan). a.cc no longer includes shared.h, so
+    // the plan assigning shared.h to a.cc is stale. Whether c.cc finishes
+    // semantic analysis before or after a.cc, the released header must
+    // still be emitted by c.cc.
+    EquivalenceTest test{testName};
+    auto compdb = test.compdb({"a.cc", "b.cc", "c.cc"});
+    auto graphArg = fmt::format("--include-graph-path={}",
+                                test.scratchPath("include-graph").string());
+    test.run("first", compdb, {"--jobs=1", graphArg});
+    test.writeFile("a.cc", "#include \"ext.h\"\n\n"
+                           "#define EQ_VARIANT_A\n"
+                           "#include \"variant.h\"\n\n"
+                           "int fromA(int x) {\n"
+                           "  return ext::triple(x) + eq::variant();\n"
+                           "}\n");
+    auto actual =
+        test.index("second", compdb,
+                   {"--jobs=3", graphArg, "--reuse-previous-plan"});
+    ::checkEquivalent(test, test.index("default", compdb, {}),
+                      std::move(actual));
+  } else {
+    FAIL(fmt::format("unknown equivalence test '{}'", testName));
+  }
+}
+
 int main(int argc, char *argv[]) {
   scip_clang::initializeSymbolizer(argv[0], /*printStacktrace*/ true);
   cxxopts::Options options("test_main", "Test runner for scip-clang");
   std::string testKind;
   options.add_options()("test-kind",
-                        "One of 'unit', 'compdb' or 'preprocessor'",
+                        "One of 'unit', 'compdb', 'preprocessor', "
+                        "'robustness', 'index' or 'equivalence'",
                         cxxopts::value<std::string>(testKind));
   options.add_options()(
       "test-name", "(Optional) Separate identifier for a specific test",
@@ -562,6 +1446,8 @@ int main(int argc, char *argv[]) {
     test::globalCliOptions.testKind = test::Kind::RobustnessTests;
   } else if (testKind == "index") {
     test::globalCliOptions.testKind = test::Kind::IndexTests;
+  } else if (testKind == "equivalence") {
+    test::globalCliOptions.testKind = test::Kind::EquivalenceTests;
   } else {
     fmt::print(stderr, "Unknown value for --test-kind");
     std::exit(EXIT_FAILURE);
@@ -95,7 +95,42 @@ def _index_tests(data):
         updates.append(u)
     return (tests, updates)
 
-def scip_clang_test_suite(compdb_data, preprocessor_data, robustness_data, index_data):
+def _equivalence_tests(data):
+    tests = []
+    for name in [
+        "shard-log",
+        "parallel-merge",
+        "two-pass-merge",
+        "merge-order",
+        "external-symbol-dedup",
+        "missing-shard",
+        "documentation-table",
+        "split-output",
+        "stdout",
+        "compressed-output",
+        "incremental",
+        "shard-cache",
+        "header-cache",
+        "changed-files",
+        "speculative-emission",
+        "serve",
+        "toolchain-cache",
+        "compdb-scan",
+        "incremental-reindex",
+        "worker-premerge",
+        "stale-plan",
+    ]:
+        test_name = "test_equivalence_" + name
+        _test_main(
+            name = test_name,
+            args = ["--test-kind=equivalence", "--test-name=" + name],
+            data = data + ["//indexer:scip-clang"],
+            tags = [],
+        )
+        tests.append(test_name)
+    return tests
+
+def scip_clang_test_suite(compdb_data, preprocessor_data, robustness_data, index_data, equivalence_data):
     _test_main(name = "test_unit", args = ["--test-kind=unit"], data = [], tags = [])
     tests = ["test_unit"]
     updates = []
@@ -120,6 +155,13 @@ def scip_clang_test_suite(compdb_data, preprocessor_data, robustness_data, index
     tests += ts
     updates += us
 
+    ts = _equivalence_tests(equivalence_data)
+    native.test_suite(
+        name = "test_equivalence",
+        tests = ts,
+    )
+    tests += ts
+
     native.test_suite(
         name = "test",
         tests = tests,